@@ -6,6 +6,37 @@
 std::mutex current_stream_tags_lok;
 std::set<std::string> current_stream_tags;
 
+std::mutex open_databases_lok;
+std::map<std::string, std::weak_ptr<nanots_database>> open_databases;
+
+// Memory databases, by the name they were created under. Guarded by
+// open_databases_lok and consulted first, so a memory database shadows any
+// file of the same name.
+std::map<std::string, std::weak_ptr<nanots_database>> memory_databases;
+
+// open_databases is keyed by resolved path, so "a.nts", "./a.nts" and symlinks
+// to it all share one handle.
+static std::string _open_databases_key(const std::string& file_name) {
+  return canonical_path(file_name);
+}
+
+// Drops registry entries for databases nobody holds anymore.
+static void _prune_databases(std::map<std::string, std::weak_ptr<nanots_database>>& databases) {
+  for (auto it = databases.begin(); it != databases.end();) {
+    if (it->second.expired())
+      it = databases.erase(it);
+    else
+      ++it;
+  }
+}
+
+// Idle catalog connections kept per database (per access mode).
+static const size_t MAX_POOLED_CATALOG_CONNS = 8;
+
+// Ranges bound into one read_ranges() catalog query, two parameters each, well
+// under SQLITE_MAX_VARIABLE_NUMBER.
+static const size_t MAX_RANGES_PER_QUERY = 1024;
+
 static uint32_t _round_to_64k_boundary(uint32_t requested_size) {
   const uint32_t BOUNDARY = 65536;  // 64KB
 
@@ -36,7 +67,7 @@ static std::string _database_name(const std::string& file_name) {
   return file_name.substr(0, file_name.find(".nts")) + ".db";
 }
 
-static void _free_block(nts_sqlite_conn& conn, int sb_id, int block_id) {
+static void _free_block(const nts_sqlite_conn& conn, int sb_id, int block_id) {
   nts_sqlite_transaction(conn, [&](const nts_sqlite_conn& conn) {
     auto stmt = conn.prepare("DELETE FROM segment_blocks WHERE id = ?");
     stmt.bind(1, sb_id).exec_no_result();
@@ -77,25 +108,129 @@ static bool _is_valid_frame_at_index(uint8_t* block_p, uint32_t block_size,
   return true;
 }
 
-static void _validate_blocks(const std::string& file_name) {
-  auto f = nts_file::open(file_name, "r+");
+// True when index entry index points at a frame header carrying uuid, i.e. the
+// block still holds the frames its catalog row describes. The caller checks
+// that index is below the block's valid index count.
+static bool _frame_has_uuid(const uint8_t* block_p, uint32_t block_size, uint32_t index, const uint8_t* uuid) {
+  uint64_t offset = *(const uint64_t*)(block_p + BLOCK_HEADER_SIZE + ((uint64_t)index * INDEX_ENTRY_SIZE) + 8);
 
-  if (!f)
-    throw nanots_exception(NANOTS_EC_CANT_OPEN, "Unable to open file.", __FILE__, __LINE__);
+  if (offset < BLOCK_HEADER_SIZE + INDEX_ENTRY_SIZE || offset > block_size - FRAME_HEADER_SIZE)
+    return false;
 
-  uint32_t block_size = 0;
+  return _validate_frame_header(block_p + offset, uuid, nullptr, nullptr);
+}
 
-  {
-    nts_memory_map mm(
-        filenum(f), 0, FILE_HEADER_BLOCK_SIZE,
-        nts_memory_map::NMM_PROT_READ | nts_memory_map::NMM_PROT_WRITE,
-        nts_memory_map::NMM_TYPE_FILE | nts_memory_map::NMM_SHARED);
+static int64_t _index_max_gap(const uint8_t* block_p, uint32_t n_indexes) {
+  int64_t max_gap = 0;
+  for (uint32_t i = 1; i < n_indexes; i++) {
+    const uint8_t* index_p = block_p + BLOCK_HEADER_SIZE + (i * INDEX_ENTRY_SIZE);
+    int64_t gap = *(int64_t*)index_p - *(int64_t*)(index_p - INDEX_ENTRY_SIZE);
+    if (gap > max_gap)
+      max_gap = gap;
+  }
+  return max_gap;
+}
+
+static uint32_t _block_key_size(const uint8_t* block_p) {
+  uint32_t flags = *(uint32_t*)(block_p + BLOCK_FLAGS_OFFSET);
+  return (flags & BLOCK_FLAG_SECONDARY_KEYS) ? SECONDARY_KEY_SIZE : 0;
+}
+
+// Frames are packed downward from the end of the block, so everything from the
+// last frame's offset (less its key slot) to the end of the block is frame data.
+static uint64_t _index_n_bytes(const uint8_t* block_p, uint32_t block_size, uint32_t n_indexes) {
+  if (n_indexes == 0)
+    return 0;
+  const uint8_t* last_index_p = block_p + BLOCK_HEADER_SIZE + ((n_indexes - 1) * INDEX_ENTRY_SIZE);
+  return block_size - (*(uint64_t*)(last_index_p + 8) - _block_key_size(block_p));
+}
 
-    block_size = *(uint32_t*)mm.map();
+static void _index_secondary_range(const uint8_t* block_p,
+                                   uint32_t n_indexes,
+                                   std::optional<int64_t>& secondary_min,
+                                   std::optional<int64_t>& secondary_max) {
+  if (_block_key_size(block_p) == 0)
+    return;
+  for (uint32_t i = 0; i < n_indexes; i++) {
+    const uint8_t* index_p = block_p + BLOCK_HEADER_SIZE + (i * INDEX_ENTRY_SIZE);
+    int64_t key = *(int64_t*)(block_p + *(uint64_t*)(index_p + 8) - SECONDARY_KEY_SIZE);
+    if (!secondary_min || key < *secondary_min)
+      secondary_min = key;
+    if (!secondary_max || key > *secondary_max)
+      secondary_max = key;
   }
+}
 
-  auto db_name = _database_name(file_name);
-  nts_sqlite_conn conn(db_name, true, true);
+static uint64_t _key_hash(const std::string& key) {
+  // FNV-1a followed by a 64 bit finalizer so both halves are well mixed.
+  uint64_t h = 14695981039346656037ULL;
+  for (unsigned char c : key) {
+    h ^= c;
+    h *= 1099511628211ULL;
+  }
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdULL;
+  h ^= h >> 33;
+  return h;
+}
+
+static size_t _key_bloom_bit(uint64_t hash, int probe, size_t n_bits) {
+  uint64_t h2 = (hash >> 32) | 1;
+  return (size_t)((hash + (uint64_t)probe * h2) % n_bits);
+}
+
+static int _hex_value(char c) {
+  return (c >= 'a') ? (c - 'a' + 10) : (c - '0');
+}
+
+// Filters are stored in the catalog as lower case hex.
+static std::string _key_bloom_build(const std::unordered_set<uint64_t>& hashes) {
+  size_t n_bits = std::max<size_t>(64, hashes.size() * KEY_BLOOM_BITS_PER_KEY);
+  n_bits = (n_bits + 7) & ~(size_t)7;
+
+  std::vector<uint8_t> bits(n_bits / 8);
+  for (auto hash : hashes) {
+    for (int i = 0; i < KEY_BLOOM_N_HASHES; i++) {
+      auto bit = _key_bloom_bit(hash, i, n_bits);
+      bits[bit / 8] |= (uint8_t)(1 << (bit % 8));
+    }
+  }
+
+  static const char digits[] = "0123456789abcdef";
+  std::string hex;
+  hex.reserve(bits.size() * 2);
+  for (auto byte : bits) {
+    hex.push_back(digits[byte >> 4]);
+    hex.push_back(digits[byte & 0x0f]);
+  }
+  return hex;
+}
+
+static bool _key_bloom_may_contain(const std::string& bloom, uint64_t hash) {
+  size_t n_bits = (bloom.size() / 2) * 8;
+  if (n_bits == 0)
+    return false;
+
+  for (int i = 0; i < KEY_BLOOM_N_HASHES; i++) {
+    auto bit = _key_bloom_bit(hash, i, n_bits);
+    int byte = (_hex_value(bloom[(bit / 8) * 2]) << 4) | _hex_value(bloom[((bit / 8) * 2) + 1]);
+    if (!(byte & (1 << (bit % 8))))
+      return false;
+  }
+  return true;
+}
+
+static void _validate_blocks(nanots_database& db) {
+  if (db.sealed())
+    throw nanots_exception(NANOTS_EC_CANT_OPEN, "Database is sealed.", __FILE__, __LINE__);
+
+  if (!db.writable())
+    throw nanots_exception(NANOTS_EC_CANT_OPEN, "Unable to open file.", __FILE__, __LINE__);
+
+  uint32_t block_size = db.block_size();
+
+  auto lease = db.catalog(true);
+  const nts_sqlite_conn& conn = *lease;
   
   std::vector<std::map<std::string, std::optional<std::string>>> rowsToProcess;
   
@@ -125,7 +260,7 @@ static void _validate_blocks(const std::string& file_name) {
       s_to_entropy_id(uuid_hex, uuid);
 
       nts_memory_map mm(
-          filenum(f), FILE_HEADER_BLOCK_SIZE + (block_idx * block_size),
+          db.fd(), FILE_HEADER_BLOCK_SIZE + ((int64_t)block_idx * block_size),
           block_size,
           nts_memory_map::NMM_PROT_READ | nts_memory_map::NMM_PROT_WRITE,
           nts_memory_map::NMM_TYPE_FILE | nts_memory_map::NMM_SHARED);
@@ -165,12 +300,22 @@ static void _validate_blocks(const std::string& file_name) {
           uint8_t* last_index_p =
               block_p + BLOCK_HEADER_SIZE + (last_valid * INDEX_ENTRY_SIZE);
           int64_t actual_last_timestamp = *(int64_t*)last_index_p;
+          std::optional<int64_t> secondary_min, secondary_max;
+          _index_secondary_range(block_p, last_valid + 1, secondary_min, secondary_max);
           auto stmt = conn.prepare(
-              "UPDATE segment_blocks SET end_timestamp = ? WHERE block_idx = ? AND uuid "
-              "= ?");
+              "UPDATE segment_blocks SET end_timestamp = ?, n_frames = ?, max_gap = ?, "
+              "n_bytes = ?, secondary_min = ?, secondary_max = ? "
+              "WHERE block_idx = ? AND uuid = ?");
           stmt.bind(1, actual_last_timestamp)
-              .bind(2, block_idx)
-              .bind(3, uuid_hex)
+              .bind(2, (int64_t)(last_valid + 1))
+              .bind(3, _index_max_gap(block_p, last_valid + 1))
+              .bind(4, _index_n_bytes(block_p, block_size, last_valid + 1));
+          if (secondary_min)
+            stmt.bind(5, *secondary_min).bind(6, *secondary_max);
+          else
+            stmt.bind_null(5).bind_null(6);
+          stmt.bind(7, block_idx)
+              .bind(8, uuid_hex)
               .exec_no_result();
         });
 
@@ -205,6 +350,119 @@ static void _upgrade_db(const nts_sqlite_conn& conn) {
           conn, [&](const nts_sqlite_conn& conn) { _set_db_version(conn, 1); });
     }
       [[fallthrough]];
+    case 1: {
+      // Per block frame ordinals. Blocks written before this version have no
+      // ordinal (NULL) and are skipped by ordinal seeks.
+      nts_sqlite_transaction(conn, [&](const nts_sqlite_conn& conn) {
+        conn.exec("ALTER TABLE segment_blocks ADD COLUMN start_ordinal INTEGER;");
+        conn.exec("ALTER TABLE segment_blocks ADD COLUMN n_frames INTEGER;");
+        conn.exec(
+            "CREATE INDEX idx_segment_blocks_start_ordinal ON "
+            "segment_blocks(segment_id, start_ordinal);");
+        _set_db_version(conn, 2);
+      });
+    }
+      [[fallthrough]];
+    case 2: {
+      // Largest timestamp delta between consecutive frames of a finalized block.
+      nts_sqlite_transaction(conn, [&](const nts_sqlite_conn& conn) {
+        conn.exec("ALTER TABLE segment_blocks ADD COLUMN max_gap INTEGER;");
+        _set_db_version(conn, 3);
+      });
+    }
+      [[fallthrough]];
+    case 3: {
+      // Bytes occupied by the frames of a finalized block (headers and padding
+      // included), derived from its index.
+      nts_sqlite_transaction(conn, [&](const nts_sqlite_conn& conn) {
+        conn.exec("ALTER TABLE segment_blocks ADD COLUMN n_bytes INTEGER;");
+        _set_db_version(conn, 4);
+      });
+    }
+      [[fallthrough]];
+    case 4: {
+      // Secondary key range of a finalized block. NULL for blocks written
+      // without secondary keys.
+      nts_sqlite_transaction(conn, [&](const nts_sqlite_conn& conn) {
+        conn.exec("ALTER TABLE segment_blocks ADD COLUMN secondary_min INTEGER;");
+        conn.exec("ALTER TABLE segment_blocks ADD COLUMN secondary_max INTEGER;");
+        _set_db_version(conn, 5);
+      });
+    }
+      [[fallthrough]];
+    case 5: {
+      // Bloom filter (hex) of the frame keys of a finalized block. NULL when the
+      // block was written without a key extractor or recovered after a crash.
+      nts_sqlite_transaction(conn, [&](const nts_sqlite_conn& conn) {
+        conn.exec("ALTER TABLE segment_blocks ADD COLUMN key_bloom TEXT;");
+        _set_db_version(conn, 6);
+      });
+    }
+      [[fallthrough]];
+    case 6: {
+      // Value summary of a finalized block. n_values is NULL when the block
+      // was written without a value extractor (or recovered after a crash) and
+      // 0 when none of its frames had a value.
+      nts_sqlite_transaction(conn, [&](const nts_sqlite_conn& conn) {
+        conn.exec("ALTER TABLE segment_blocks ADD COLUMN n_values INTEGER;");
+        conn.exec("ALTER TABLE segment_blocks ADD COLUMN value_min REAL;");
+        conn.exec("ALTER TABLE segment_blocks ADD COLUMN value_max REAL;");
+        _set_db_version(conn, 7);
+      });
+    }
+      [[fallthrough]];
+    case 7: {
+      // First ordinal of each segment, kept by a trigger as blocks are added.
+      // Ordinals are stream wide, so an ordinal seek is an index lookup of the
+      // segment followed by one of the block within it. Freeing a segment's
+      // oldest blocks leaves the value low, which only costs a failed seek
+      // into ordinals that are gone anyway.
+      nts_sqlite_transaction(conn, [&](const nts_sqlite_conn& conn) {
+        conn.exec("ALTER TABLE segments ADD COLUMN start_ordinal INTEGER;");
+        conn.exec(
+            "UPDATE segments SET start_ordinal = "
+            "(SELECT MIN(sb.start_ordinal) FROM segment_blocks sb WHERE sb.segment_id = segments.id);");
+        conn.exec(
+            "CREATE TRIGGER set_segment_start_ordinal "
+            "AFTER INSERT ON segment_blocks "
+            "WHEN NEW.start_ordinal IS NOT NULL "
+            "BEGIN "
+            "UPDATE segments SET start_ordinal = NEW.start_ordinal "
+            "WHERE id = NEW.segment_id "
+            "AND (start_ordinal IS NULL OR start_ordinal > NEW.start_ordinal); "
+            "END;");
+        conn.exec(
+            "CREATE INDEX idx_segments_start_ordinal ON "
+            "segments(stream_tag, start_ordinal);");
+        _set_db_version(conn, 8);
+      });
+    }
+      [[fallthrough]];
+    case 8: {
+      // Next ordinal of each stream as of the last block to leave the catalog,
+      // so ordinals don't restart once all of a stream's blocks are freed.
+      nts_sqlite_transaction(conn, [&](const nts_sqlite_conn& conn) {
+        conn.exec(
+            "CREATE TABLE stream_ordinals ("
+            "stream_tag STRING PRIMARY KEY, "
+            "next_ordinal INTEGER"
+            ");");
+        // BEFORE, so the segment (and its stream tag) is still there.
+        conn.exec(
+            "CREATE TRIGGER save_stream_ordinal "
+            "BEFORE DELETE ON segment_blocks "
+            "WHEN OLD.start_ordinal IS NOT NULL "
+            "BEGIN "
+            "INSERT INTO stream_ordinals (stream_tag, next_ordinal) "
+            "SELECT stream_tag, OLD.start_ordinal + COALESCE(OLD.n_frames, 0) "
+            "FROM segments WHERE id = OLD.segment_id "
+            "ON CONFLICT(stream_tag) DO UPDATE SET "
+            "next_ordinal = MAX(next_ordinal, excluded.next_ordinal); "
+            "END;");
+        _set_db_version(conn, 9);
+      });
+    }
+      [[fallthrough]];
     default:
       break;
   };
@@ -281,7 +539,8 @@ static std::optional<segment_block> _db_create_segment_block(
     int64_t block_idx,
     int64_t start_timestamp,
     int64_t end_timestamp,
-    const uint8_t* uuid) {
+    const uint8_t* uuid,
+    int64_t start_ordinal) {
   auto stmt = conn.prepare(
       "INSERT INTO segment_blocks ("
       "segment_id, "
@@ -290,8 +549,9 @@ static std::optional<segment_block> _db_create_segment_block(
       "block_idx, "
       "start_timestamp, "
       "end_timestamp, "
-      "uuid"
-      ") VALUES (?, ?, ?, ?, ?, ?, ?)");
+      "uuid, "
+      "start_ordinal"
+      ") VALUES (?, ?, ?, ?, ?, ?, ?, ?)");
 
   auto hex_uuid = entropy_id_to_s(uuid);
 
@@ -302,6 +562,7 @@ static std::optional<segment_block> _db_create_segment_block(
       .bind(5, start_timestamp)
       .bind(6, end_timestamp)
       .bind(7, hex_uuid)
+      .bind(8, start_ordinal)
       .exec_no_result();
 
   struct segment_block sb;
@@ -312,16 +573,60 @@ static std::optional<segment_block> _db_create_segment_block(
   sb.block_idx = block_idx;
   sb.start_timestamp = start_timestamp;
   sb.end_timestamp = end_timestamp;
+  sb.start_ordinal = start_ordinal;
   memcpy(sb.uuid, uuid, 16);
 
   return sb;
 }
 
 static void _db_finalize_block(const nts_sqlite_conn& conn,
-                               int64_t segment_block_id,
-                               int64_t timestamp) {
-  auto stmt = conn.prepare("UPDATE segment_blocks SET end_timestamp = ? WHERE id = ?");
-  stmt.bind(1, timestamp).bind(2, segment_block_id).exec_no_result();
+                               const segment_block& sb,
+                               int64_t timestamp,
+                               const uint8_t* block_p,
+                               uint32_t block_size) {
+  uint32_t n_frames = *(uint32_t*)(block_p + 8);
+  auto stmt = conn.prepare(
+      "UPDATE segment_blocks SET end_timestamp = ?, n_frames = ?, max_gap = ?, n_bytes = ?, "
+      "secondary_min = ?, secondary_max = ?, key_bloom = ?, n_values = ?, value_min = ?, "
+      "value_max = ? WHERE id = ?");
+  stmt.bind(1, timestamp)
+      .bind(2, (int64_t)n_frames)
+      .bind(3, sb.max_gap)
+      .bind(4, _index_n_bytes(block_p, block_size, n_frames));
+  if (sb.secondary_min)
+    stmt.bind(5, *sb.secondary_min).bind(6, *sb.secondary_max);
+  else
+    stmt.bind_null(5).bind_null(6);
+  if (sb.key_hashes)
+    stmt.bind(7, _key_bloom_build(*sb.key_hashes));
+  else
+    stmt.bind_null(7);
+  if (sb.n_values && *sb.n_values > 0)
+    stmt.bind(8, *sb.n_values).bind(9, sb.value_min).bind(10, sb.value_max);
+  else if (sb.n_values)
+    stmt.bind(8, (int64_t)0).bind_null(9).bind_null(10);
+  else
+    stmt.bind_null(8).bind_null(9).bind_null(10);
+  stmt.bind(11, sb.id).exec_no_result();
+}
+
+static int64_t _db_next_ordinal(const nts_sqlite_conn& conn, const std::string& stream_tag) {
+  // Ordinals continue from the newest block still in the catalog or, once
+  // those are all gone, from the last one freed, so they stay stable when
+  // older blocks are freed or reclaimed.
+  auto stmt = conn.prepare(
+      "SELECT MAX("
+      "COALESCE((SELECT MAX(sb.start_ordinal + COALESCE(sb.n_frames, 0)) "
+      "          FROM segment_blocks sb "
+      "          JOIN segments s ON sb.segment_id = s.id "
+      "          WHERE s.stream_tag = ?), 0), "
+      "COALESCE((SELECT next_ordinal FROM stream_ordinals WHERE stream_tag = ?), 0)) AS next_ordinal");
+  auto results = stmt.bind(1, stream_tag).bind(2, stream_tag).exec();
+
+  if (results.empty() || !results.front()["next_ordinal"])
+    return 0;
+
+  return std::stoll(results.front()["next_ordinal"].value());
 }
 
 static void _db_trans_finalize_reserved_blocks(const nts_sqlite_conn& conn) {
@@ -333,6 +638,65 @@ static void _db_trans_finalize_reserved_blocks(const nts_sqlite_conn& conn) {
   conn.exec(query);
 }
 
+// Reserves a block for wctx's next frame and adds it to the segment. The
+// caller stores the result and bumps the segment's sequence once committed.
+static segment_block _db_acquire_block(const nts_sqlite_conn& conn,
+                                       const write_context& wctx,
+                                       int64_t timestamp,
+                                       bool auto_reclaim) {
+  auto block = _db_get_block(conn, auto_reclaim);
+  if (!block)
+    throw nanots_exception(NANOTS_EC_NO_FREE_BLOCKS, "Unable to get free block.", __FILE__, __LINE__);
+
+  uint8_t uuid[16];
+  generate_entropy_id(uuid);
+
+  auto sb = _db_create_segment_block(
+      conn, wctx.current_segment->id, wctx.current_segment->sequence,
+      block->id, block->idx, timestamp, 0, uuid, wctx.next_ordinal);
+
+  if (!sb)
+    throw nanots_exception(NANOTS_EC_UNABLE_TO_CREATE_SEGMENT_BLOCK, "Unable to create segment block.", __FILE__, __LINE__);
+
+  return *sb;
+}
+
+// Where the record (secondary key slot and padded frame) for a frame of size
+// bytes would start in block_p. The block is full when the result is not past
+// index_end, the end of the index with the frame's entry added.
+static uint64_t _next_record_offset(const uint8_t* block_p,
+                                    uint32_t block_size,
+                                    size_t size,
+                                    uint32_t key_size,
+                                    uint64_t& index_end) {
+  uint32_t n_valid_indexes = *(const uint32_t*)(block_p + 8);
+
+  index_end = BLOCK_HEADER_SIZE + ((n_valid_indexes + 1) * INDEX_ENTRY_SIZE);
+
+  // Calculate padded frame size for 8-byte alignment (required for ARM compatibility)
+  uint32_t total_frame_size = (uint32_t)(FRAME_HEADER_SIZE + size);
+  uint32_t padded_frame_size = (total_frame_size + 7) & ~7;  // Round up to multiple of 8
+
+  // A frame record is its optional secondary key slot followed by the frame.
+  uint32_t record_size = padded_frame_size + key_size;
+
+  uint64_t new_block_ofs = (uint64_t)(block_size - record_size);
+
+  if (n_valid_indexes > 0) {
+    const uint8_t* last_index_p = block_p + BLOCK_HEADER_SIZE +
+                                  ((n_valid_indexes - 1) * INDEX_ENTRY_SIZE);
+    uint64_t last_record_offset = *(const uint64_t*)(last_index_p + 8) - key_size;
+    if (last_record_offset >= record_size) {
+      uint64_t candidate_ofs = last_record_offset - record_size;
+      new_block_ofs = (candidate_ofs >= index_end) ? candidate_ofs : index_end;
+    } else {
+      new_block_ofs = index_end;  // Force rollover to new block
+    }
+  }
+
+  return new_block_ofs;
+}
+
 static void _recycle_block(write_context& wctx, int64_t timestamp) {
   uint8_t* p = (uint8_t*)wctx.mm.map();
 
@@ -354,7 +718,7 @@ static void _recycle_block(write_context& wctx, int64_t timestamp) {
 
   p += sizeof(uint32_t);
 
-  // zero out the reserved field
+  // zero out the flags
   *(uint32_t*)p = 0;
   p += sizeof(uint32_t);
 
@@ -367,1152 +731,5330 @@ static void _recycle_block(write_context& wctx, int64_t timestamp) {
                 true);
 }
 
-write_context::~write_context() {
-  std::lock_guard<std::mutex> g(current_stream_tags_lok);
-  std::string key = file_name + ":" + stream_tag;
-  current_stream_tags.erase(key);
-
-  if (last_timestamp && current_block) {
-    auto db_name = _database_name(file_name);
-    nts_sqlite_conn conn(db_name, true, true);
-
-    nts_sqlite_transaction(conn, [&](const nts_sqlite_conn& conn) {
-      _db_finalize_block(conn, current_block->id, last_timestamp.value());
-      // This is a maintenance task that needs to be done periodically.
-      _db_trans_finalize_reserved_blocks(conn);
-    });
-  }
+template <typename T>
+static void _dir_put(std::vector<uint8_t>& dir, T v) {
+  auto p = (const uint8_t*)&v;
+  dir.insert(dir.end(), p, p + sizeof(T));
 }
 
-nanots_writer::nanots_writer(const std::string& file_name, bool auto_reclaim)
-    : _file_name(file_name),
-      _file_size(file_size(file_name)),
-      _file(nts_file::open(file_name, "r+")),
-      _file_header_mm(
-          filenum(_file),
-          0,
-          FILE_HEADER_BLOCK_SIZE,
-          nts_memory_map::NMM_PROT_READ | nts_memory_map::NMM_PROT_WRITE,
-          nts_memory_map::NMM_TYPE_FILE | nts_memory_map::NMM_SHARED),
-      _file_header_p((uint8_t*)_file_header_mm.map()),
-      _block_size(*(uint32_t*)_file_header_p),
-      _n_blocks(*(uint32_t*)(_file_header_p + sizeof(uint32_t))),
-      _auto_reclaim(auto_reclaim) {
-  if (_block_size < 4096 || _block_size > 1024 * 1024 * 1024)
-    throw nanots_exception(NANOTS_EC_INVALID_BLOCK_SIZE, "Invalid block size in file header.", __FILE__, __LINE__);
+static void _dir_put_string(std::vector<uint8_t>& dir, const std::string& s) {
+  _dir_put(dir, (uint32_t)s.size());
+  dir.insert(dir.end(), s.begin(), s.end());
+}
 
-  auto db_name = _database_name(_file_name);
-  nts_sqlite_conn db(db_name, true, true);
-  _upgrade_db(db);
-  _validate_blocks(_file_name);
+template <typename T>
+static void _dir_put_optional(std::vector<uint8_t>& dir, const std::optional<T>& v) {
+  _dir_put(dir, (uint8_t)v.has_value());
+  _dir_put(dir, v.value_or(T()));
 }
 
-write_context nanots_writer::create_write_context(const std::string& stream_tag,
-                                                  const std::string& metadata) {
+template <typename T>
+static T _dir_get(const uint8_t*& p, const uint8_t* end) {
+  if ((size_t)(end - p) < sizeof(T))
+    throw nanots_exception(NANOTS_EC_SCHEMA, "Corrupt sealed directory.", __FILE__, __LINE__);
+  T v;
+  memcpy(&v, p, sizeof(T));
+  p += sizeof(T);
+  return v;
+}
 
-  std::string key = _file_name + ":" + stream_tag;
-  
-  std::lock_guard<std::mutex> g(current_stream_tags_lok);
-  if(current_stream_tags.find(key) != current_stream_tags.end())
-    throw nanots_exception(NANOTS_EC_DUPLICATE_STREAM_TAG, "Only one current writer per active stream tag.", __FILE__, __LINE__);
+static std::string _dir_get_string(const uint8_t*& p, const uint8_t* end) {
+  auto len = _dir_get<uint32_t>(p, end);
+  if ((size_t)(end - p) < len)
+    throw nanots_exception(NANOTS_EC_SCHEMA, "Corrupt sealed directory.", __FILE__, __LINE__);
+  std::string s((const char*)p, len);
+  p += len;
+  return s;
+}
 
-  write_context wctx;
-  wctx.metadata = metadata;
-  wctx.stream_tag = stream_tag;
-  wctx.file_name = _file_name;
+template <typename T>
+static std::optional<T> _dir_get_optional(const uint8_t*& p, const uint8_t* end) {
+  auto present = _dir_get<uint8_t>(p, end);
+  auto v = _dir_get<T>(p, end);
+  if (!present)
+    return std::nullopt;
+  return v;
+}
 
-  auto db_name = _database_name(_file_name);
+// Directory layout: magic and segment count, then each segment (id, stream
+// tag, metadata, block count) followed by its blocks. Optional columns are a
+// presence byte and a value.
+static std::vector<uint8_t> _build_directory(const std::vector<sealed_segment>& segments) {
+  std::vector<uint8_t> dir;
+  _dir_put(dir, (uint32_t)SEALED_DIRECTORY_MAGIC);
+  _dir_put(dir, (uint32_t)segments.size());
+
+  for (auto& seg : segments) {
+    _dir_put(dir, seg.id);
+    _dir_put_string(dir, seg.stream_tag);
+    _dir_put_string(dir, seg.metadata);
+    _dir_put(dir, (uint32_t)seg.blocks.size());
+
+    for (auto& b : seg.blocks) {
+      _dir_put(dir, b.sequence);
+      _dir_put(dir, b.block_idx);
+      _dir_put(dir, b.start_timestamp);
+      _dir_put(dir, b.end_timestamp);
+      dir.insert(dir.end(), b.uuid, b.uuid + 16);
+      _dir_put_optional(dir, b.start_ordinal);
+      _dir_put_optional(dir, b.n_frames);
+      _dir_put_optional(dir, b.max_gap);
+      _dir_put_optional(dir, b.n_bytes);
+      _dir_put_optional(dir, b.secondary_min);
+      _dir_put_optional(dir, b.secondary_max);
+      _dir_put_optional(dir, b.n_values);
+      _dir_put_optional(dir, b.value_min);
+      _dir_put_optional(dir, b.value_max);
+      _dir_put(dir, (uint8_t)b.key_bloom.has_value());
+      _dir_put_string(dir, b.key_bloom.value_or(std::string()));
+    }
+  }
 
-  nts_sqlite_conn conn(db_name.c_str(), true, true);
+  return dir;
+}
 
-  nts_sqlite_transaction(conn, [&](const nts_sqlite_conn& conn) {
-    wctx.current_segment = _db_create_segment(conn, stream_tag, metadata);
-    if (!wctx.current_segment)
-      throw nanots_exception(NANOTS_EC_UNABLE_TO_CREATE_SEGMENT, "Unable to create segment.", __FILE__, __LINE__);
-  });
+static std::vector<sealed_segment> _parse_directory(const uint8_t* p, uint64_t size) {
+  auto end = p + size;
+
+  if (_dir_get<uint32_t>(p, end) != SEALED_DIRECTORY_MAGIC)
+    throw nanots_exception(NANOTS_EC_SCHEMA, "Corrupt sealed directory.", __FILE__, __LINE__);
+
+  std::vector<sealed_segment> segments(_dir_get<uint32_t>(p, end));
+
+  for (auto& seg : segments) {
+    seg.id = _dir_get<int64_t>(p, end);
+    seg.stream_tag = _dir_get_string(p, end);
+    seg.metadata = _dir_get_string(p, end);
+    seg.blocks.resize(_dir_get<uint32_t>(p, end));
+
+    for (auto& b : seg.blocks) {
+      b.sequence = _dir_get<int64_t>(p, end);
+      b.block_idx = _dir_get<int64_t>(p, end);
+      b.start_timestamp = _dir_get<int64_t>(p, end);
+      b.end_timestamp = _dir_get<int64_t>(p, end);
+      for (auto& u : b.uuid)
+        u = _dir_get<uint8_t>(p, end);
+      b.start_ordinal = _dir_get_optional<int64_t>(p, end);
+      b.n_frames = _dir_get_optional<int64_t>(p, end);
+      b.max_gap = _dir_get_optional<int64_t>(p, end);
+      b.n_bytes = _dir_get_optional<int64_t>(p, end);
+      b.secondary_min = _dir_get_optional<int64_t>(p, end);
+      b.secondary_max = _dir_get_optional<int64_t>(p, end);
+      b.n_values = _dir_get_optional<int64_t>(p, end);
+      b.value_min = _dir_get_optional<double>(p, end);
+      b.value_max = _dir_get_optional<double>(p, end);
+      auto has_bloom = _dir_get<uint8_t>(p, end);
+      auto bloom = _dir_get_string(p, end);
+      if (has_bloom)
+        b.key_bloom = std::move(bloom);
+    }
+  }
 
-  current_stream_tags.insert(key);
+  return segments;
+}
 
-  return wctx;
+// The segments of a sealed directory that belong to stream_tag.
+static std::pair<std::vector<sealed_segment>::const_iterator, std::vector<sealed_segment>::const_iterator>
+_sealed_stream(const std::vector<sealed_segment>& directory, const std::string& stream_tag) {
+  struct by_tag {
+    bool operator()(const sealed_segment& seg, const std::string& tag) const { return seg.stream_tag < tag; }
+    bool operator()(const std::string& tag, const sealed_segment& seg) const { return tag < seg.stream_tag; }
+  };
+  return std::equal_range(directory.begin(), directory.end(), stream_tag, by_tag());
 }
 
-void nanots_writer::write(write_context& wctx,
-                          const uint8_t* data,
-                          size_t size,
-                          int64_t timestamp,
-                          uint8_t flags) {
-  if (wctx.last_timestamp && timestamp <= wctx.last_timestamp.value())
-    throw nanots_exception(NANOTS_EC_NON_MONOTONIC_TIMESTAMP, "Timestamp is not monotonic.", __FILE__, __LINE__);
+nanots_database::catalog_conn::~catalog_conn() {
+  if (_conn)
+    _db->_release(std::move(_conn), _rw);
+}
 
-  if (size >
-      _block_size - (FRAME_HEADER_SIZE + INDEX_ENTRY_SIZE + BLOCK_HEADER_SIZE))
-    throw nanots_exception(NANOTS_EC_ROW_SIZE_TOO_BIG, "Frame size is too large. Use a much larger block size.", __FILE__, __LINE__);
+nanots_database::nanots_database(const std::string& file_name)
+    : _file_name(file_name),
+      _db_name(_database_name(file_name)),
+      _file(),
+      _writable(true),
+      _header_mm(),
+      _block_size(0),
+      _n_blocks(0),
+      _sealed(false) {
+  // Writers need the file opened for update, but a reader only process may not
+  // have write permission on it.
+  try {
+    _file = nts_file::open(file_name, "r+");
+  } catch (const std::exception&) {
+    _file = nts_file::open(file_name, "r");
+    _writable = false;
+  }
 
-  if (!wctx.current_block) {
-    nts_sqlite_conn conn(_database_name(_file_name), true, true);
+  _map_header();
 
-    nts_sqlite_transaction(conn, [&](const nts_sqlite_conn& conn) {
-      auto block = _db_get_block(conn, _auto_reclaim);
-      if (!block)
-        throw nanots_exception(NANOTS_EC_NO_FREE_BLOCKS, "Unable to get free block.", __FILE__, __LINE__);
+  auto header_p = (const uint8_t*)_header_mm.map();
+  auto directory_offset = *(const uint64_t*)(header_p + FILE_HEADER_DIRECTORY_OFFSET);
+  auto directory_size = *(const uint64_t*)(header_p + FILE_HEADER_DIRECTORY_SIZE);
 
-      uint8_t uuid[16];
-      generate_entropy_id(uuid);
+  if (directory_offset != 0) {
+    // Sealed files never change, so never hold them open for update.
+    if (_writable) {
+      _file = nts_file::open(file_name, "r");
+      _writable = false;
+      _map_header();
+    }
 
-      wctx.current_block = _db_create_segment_block(
-          conn, wctx.current_segment->id, wctx.current_segment->sequence,
-          block->id, block->idx, timestamp, 0, uuid);
+    _sealed = true;
+    _db_name = "file:/nanots-" + generate_entropy_id() + "?vfs=memdb";
+    _load_directory(directory_offset, directory_size);
+  }
+}
 
-      if (!wctx.current_block)
-        throw nanots_exception(NANOTS_EC_UNABLE_TO_CREATE_SEGMENT_BLOCK, "Unable to create segment block.", __FILE__, __LINE__);
+nanots_database::nanots_database(const std::string& name, nts_file file, const std::string& db_name)
+    : _file_name(name),
+      _db_name(db_name),
+      _file(std::move(file)),
+      _writable(true),
+      _header_mm(),
+      _block_size(0),
+      _n_blocks(0),
+      _sealed(false) {
+  _map_header();
+}
 
-      wctx.current_segment->sequence++;
-    });
+void nanots_database::_map_header() {
+  _header_mm = nts_memory_map(
+      filenum(_file), 0, FILE_HEADER_BLOCK_SIZE, nts_memory_map::NMM_PROT_READ,
+      nts_memory_map::NMM_TYPE_FILE | nts_memory_map::NMM_SHARED);
 
-    wctx.file = nts_file::open(_file_name, "r+");
+  auto header_p = (uint8_t*)_header_mm.map();
 
-    wctx.mm = nts_memory_map(
-        filenum(wctx.file),
-        FILE_HEADER_BLOCK_SIZE + (wctx.current_block->block_idx * _block_size),
-        _block_size,
-        nts_memory_map::NMM_PROT_READ | nts_memory_map::NMM_PROT_WRITE,
-        nts_memory_map::NMM_TYPE_FILE | nts_memory_map::NMM_SHARED);
+  _block_size = *(uint32_t*)header_p;
+  _n_blocks = *(uint32_t*)(header_p + sizeof(uint32_t));
+}
 
-    _recycle_block(wctx, timestamp);
-  }
+void nanots_database::_load_directory(uint64_t offset, uint64_t size) {
+  if (size > UINT32_MAX || offset + size > file_size(_file_name))
+    throw nanots_exception(NANOTS_EC_SCHEMA, "Corrupt sealed directory.", __FILE__, __LINE__);
 
-  uint8_t* block_p = (uint8_t*)wctx.mm.map();
+  nts_memory_map mm(filenum(_file), offset, (uint32_t)size, nts_memory_map::NMM_PROT_READ,
+                    nts_memory_map::NMM_TYPE_FILE | nts_memory_map::NMM_SHARED);
 
-  uint32_t n_valid_indexes = *(uint32_t*)(block_p + 8);
+  _directory = _parse_directory((const uint8_t*)mm.map(), size);
+}
 
-  uint64_t index_end =
-      BLOCK_HEADER_SIZE + ((n_valid_indexes + 1) * INDEX_ENTRY_SIZE);
+std::shared_ptr<nanots_database> nanots_database::open(const std::string& file_name) {
+  auto key = _open_databases_key(file_name);
 
-  // Calculate padded frame size for 8-byte alignment (required for ARM compatibility)
-  uint32_t total_frame_size = (uint32_t)(FRAME_HEADER_SIZE + size);
-  uint32_t padded_frame_size = (total_frame_size + 7) & ~7;  // Round up to multiple of 8
+  std::lock_guard<std::mutex> g(open_databases_lok);
 
-  uint64_t new_block_ofs = (uint64_t)(_block_size - padded_frame_size);
+  auto memory = memory_databases.find(file_name);
+  if (memory != memory_databases.end()) {
+    auto db = memory->second.lock();
+    if (db)
+      return db;
+  }
 
-  if (n_valid_indexes > 0) {
-    uint8_t* last_index_p = block_p + BLOCK_HEADER_SIZE +
-                            ((n_valid_indexes - 1) * INDEX_ENTRY_SIZE);
-    uint64_t last_frame_offset = *(uint64_t*)(last_index_p + 8);
-    if (last_frame_offset >= padded_frame_size) {
-      uint64_t candidate_ofs = last_frame_offset - padded_frame_size;
-      new_block_ofs = (candidate_ofs >= index_end) ? candidate_ofs : index_end;
-    } else {
-      new_block_ofs = index_end;  // Force rollover to new block
-    }
+  auto found = open_databases.find(key);
+  if (found != open_databases.end()) {
+    auto db = found->second.lock();
+    if (db)
+      return db;
   }
 
-  if (index_end >= new_block_ofs) {
-    nts_sqlite_conn conn(_database_name(_file_name), true, true);
+  std::shared_ptr<nanots_database> db(new nanots_database(file_name));
+  open_databases[key] = db;
 
-    wctx.mm.flush(wctx.mm.map(), _block_size, true);
+  _prune_databases(open_databases);
 
-    nts_sqlite_transaction(conn, [&](const nts_sqlite_conn& conn) {
-      _db_finalize_block(conn, wctx.current_block->id, wctx.last_timestamp.value());
-    });
+  return db;
+}
 
-    wctx.current_block = std::nullopt;
-    wctx.mm = nts_memory_map();
+nanots_database::catalog_conn nanots_database::catalog(bool rw) {
+  if (rw && _sealed)
+    throw nanots_exception(NANOTS_EC_CANT_OPEN, "Database is sealed.", __FILE__, __LINE__);
 
-    return write(wctx, data, size, timestamp, flags);
+  {
+    std::lock_guard<std::mutex> g(_catalog_lok);
+    if (_sealed && !_memory_catalog)
+      _load_sealed_catalog();
+    auto& conns = (rw) ? _rw_conns : _ro_conns;
+    if (!conns.empty()) {
+      auto conn = std::move(conns.back());
+      conns.pop_back();
+      return catalog_conn(this, std::move(conn), rw);
+    }
   }
 
-  uint8_t* frame_p = block_p + new_block_ofs;
-  memcpy(frame_p, wctx.current_block->uuid, 16);
-  *(uint32_t*)(frame_p + 16) = (uint32_t)size;
-  *(frame_p + 20) = flags;
-  memcpy(frame_p + FRAME_HEADER_SIZE, data, size);
-
-  uint8_t* index_p =
-      block_p + BLOCK_HEADER_SIZE + (n_valid_indexes * INDEX_ENTRY_SIZE);
-  *(int64_t*)index_p = timestamp;
-  *(uint64_t*)(index_p + 8) = new_block_ofs;
-
-  auto valid_counter = (uint32_t*)(block_p + 8);
-
-#ifdef _WIN32
-  _InterlockedIncrement(reinterpret_cast<volatile long*>(valid_counter));
-#else
-  __atomic_fetch_add(valid_counter, 1, std::memory_order_release);
-#endif
+  return catalog_conn(this, std::make_unique<nts_sqlite_conn>(_db_name, rw, true), rw);
+}
 
-  wctx.last_timestamp = timestamp;
+void nanots_database::_release(std::unique_ptr<nts_sqlite_conn> conn, bool rw) {
+  std::lock_guard<std::mutex> g(_catalog_lok);
+  auto& conns = (rw) ? _rw_conns : _ro_conns;
+  if (conns.size() < MAX_POOLED_CATALOG_CONNS)
+    conns.push_back(std::move(conn));
 }
 
-void nanots_writer::free_blocks(const std::string& file_name,
-                                const std::string& stream_tag,
-                                int64_t start_timestamp,
-                                int64_t end_timestamp) {
-  auto db_name = _database_name(file_name);
-  nts_sqlite_conn conn(db_name, true, true);
+std::shared_ptr<nts_memory_map> nanots_database::map_block(int64_t block_idx) {
+  std::lock_guard<std::mutex> g(_block_maps_lok);
 
-  nts_sqlite_transaction(conn, [&](const nts_sqlite_conn& conn) {
-    // Find blocks that fall entirely within the deletion time range
-    auto stmt = conn.prepare(
-        "SELECT sb.id as segment_block_id, sb.block_id "
-        "FROM segment_blocks sb "
-        "JOIN segments s ON sb.segment_id = s.id "
-        "WHERE s.stream_tag = ? "
-        "AND sb.start_timestamp >= ? "
-        "AND sb.end_timestamp <= ? "
-        "AND sb.end_timestamp != 0");
-    auto blocks_to_delete =
-        stmt.bind(1, stream_tag).bind(2, start_timestamp).bind(3, end_timestamp).exec();
+  auto found = _block_maps.find(block_idx);
+  if (found != _block_maps.end()) {
+    auto mm = found->second.lock();
+    if (mm)
+      return mm;
+  }
 
-    for (auto& block_row : blocks_to_delete) {
-      int64_t segment_block_id = std::stoll(block_row["segment_block_id"].value());
-      int64_t block_id = std::stoll(block_row["block_id"].value());
+  auto mm = std::make_shared<nts_memory_map>(
+      fd(), FILE_HEADER_BLOCK_SIZE + (block_idx * _block_size), _block_size,
+      nts_memory_map::NMM_PROT_READ,
+      nts_memory_map::NMM_TYPE_FILE | nts_memory_map::NMM_SHARED);
 
-      // Remove segment_block entry (trigger will clean up empty segments)
-      stmt = conn.prepare("DELETE FROM segment_blocks WHERE id = ?");
-      stmt.bind(1, segment_block_id).exec_no_result();
+  _block_maps[block_idx] = mm;
 
-      // Mark block as free
-      stmt = conn.prepare("UPDATE blocks SET status = 'free' WHERE id = ?");
-      stmt.bind(1, block_id).exec_no_result();
-    }
-  });
+  return mm;
 }
 
-void nanots_writer::allocate(const std::string& file_name,
-                             uint32_t block_size,
-                             uint32_t n_blocks) {
-  // Windows MapViewOfFile() requires mapped regions to start and end on 64k
-  // boundaires. Our file header size is 65536, SO if the block size is a
-  // multiple of 65536 then block start and end on 64k boundaries.
-  block_size = _round_to_64k_boundary(block_size);
-
-  uint64_t file_size = FILE_HEADER_BLOCK_SIZE + static_cast<uint64_t>(n_blocks) * block_size;
-
-  {
-    auto f = nts_file::open(file_name, "w+");
+// Frames a context may have queued before write_async() waits. A power of 2.
+static const size_t ASYNC_QUEUE_SIZE = 1024;
+
+struct async_frame {
+  write_context* wctx{nullptr};
+  std::vector<uint8_t> data;
+  int64_t timestamp{0};
+  uint8_t flags{0};
+  std::optional<int64_t> secondary_key;
+  bool durable{false};
+  std::function<void(std::exception_ptr)> on_complete;
+};
 
-    if (fallocate(f, file_size) < 0)
-      throw nanots_exception(NANOTS_EC_UNABLE_TO_ALLOCATE_FILE, "Unable to allocate file.", __FILE__, __LINE__);
+// A write context's frames on their way to the writer's async threads. Any
+// number of threads may push (a bounded ring where each slot carries a
+// sequence number, so producers only contend on one atomic counter); one
+// async thread at a time, the one holding claim(), pops. The mutex is only
+// taken to sleep when the ring is full or to wait for it to drain.
+class nanots_async_queue final {
+ public:
+  nanots_async_queue() : _slots(ASYNC_QUEUE_SIZE) {
+    for (size_t i = 0; i < _slots.size(); i++)
+      _slots[i].sequence.store(i, std::memory_order_relaxed);
   }
 
-  {
-    auto f = nts_file::open(file_name, "r+");
+  nanots_async_queue(const nanots_async_queue&) = delete;
+  nanots_async_queue& operator=(const nanots_async_queue&) = delete;
 
-    nts_memory_map mm(
-        filenum(f), 0, 4096,
-        nts_memory_map::NMM_PROT_READ | nts_memory_map::NMM_PROT_WRITE,
-        nts_memory_map::NMM_TYPE_FILE | nts_memory_map::NMM_SHARED);
+  void push(async_frame&& frame) {
+    size_t pos = _enqueue_pos.load(std::memory_order_relaxed);
+    slot* s;
 
-    uint8_t* p = (uint8_t*)mm.map();
+    while (true) {
+      s = &_slots[pos & (_slots.size() - 1)];
+      size_t sequence = s->sequence.load(std::memory_order_acquire);
+      intptr_t dif = (intptr_t)sequence - (intptr_t)pos;
+      if (dif == 0) {
+        if (_enqueue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+          break;
+      } else if (dif < 0) {
+        // Full: sleep until the async threads make room.
+        _wait([&] {
+          return _slots[pos & (_slots.size() - 1)].sequence.load() == pos ||
+                 _enqueue_pos.load() != pos;
+        });
+        pos = _enqueue_pos.load(std::memory_order_relaxed);
+      } else
+        pos = _enqueue_pos.load(std::memory_order_relaxed);
+    }
 
-    // write a file header
-    *(uint32_t*)p = block_size;
-    p += sizeof(uint32_t);
-    *(uint32_t*)p = n_blocks;
-    p += sizeof(uint32_t);
+    s->frame = std::move(frame);
+    // Sequentially consistent, so a sleeping async thread either sees the
+    // frame or is seen by the pusher's wake().
+    s->sequence.store(pos + 1);
+  }
 
-    mm.flush(mm.map(), 8);
+  // Only while claimed.
+  async_frame* front() {
+    size_t pos = _dequeue_pos.load(std::memory_order_relaxed);
+    slot& s = _slots[pos & (_slots.size() - 1)];
+    return (s.sequence.load(std::memory_order_acquire) == pos + 1) ? &s.frame : nullptr;
   }
 
-  auto db_name = _database_name(file_name);
+  // Only while claimed.
+  bool pop(async_frame& frame) {
+    size_t pos = _dequeue_pos.load(std::memory_order_relaxed);
+    slot& s = _slots[pos & (_slots.size() - 1)];
+    if (s.sequence.load(std::memory_order_acquire) != pos + 1)
+      return false;
 
-  if (file_exists(db_name))
-    remove_file(db_name);
+    frame = std::move(s.frame);
+    s.sequence.store(pos + _slots.size());
+    _dequeue_pos.store(pos + 1, std::memory_order_relaxed);
+    _notify();
+    return true;
+  }
 
-  nts_sqlite_conn db(db_name.c_str(), true, true);
+  bool empty() const {
+    size_t pos = _dequeue_pos.load();
+    return _slots[pos & (_slots.size() - 1)].sequence.load() != pos + 1;
+  }
 
-  std::string query =
-      "CREATE TABLE blocks ("
-      "id INTEGER PRIMARY KEY AUTOINCREMENT, "
-      "idx INTEGER, "
-      "status STRING, "
-      "reserved_at DATETIME DEFAULT CURRENT_TIMESTAMP"
-      ");";
-  db.exec(query);
+  // One async thread drains a queue at a time, which keeps frames in order.
+  bool claim() {
+    bool expected = false;
+    return _claimed.compare_exchange_strong(expected, true, std::memory_order_acquire);
+  }
 
-  query =
-      "CREATE TABLE segments ("
-      "id INTEGER PRIMARY KEY AUTOINCREMENT, "
-      "stream_tag STRING, "
-      "metadata STRING "
-      ");";
-  db.exec(query);
+  void release() { _claimed.store(false, std::memory_order_release); }
 
-  query =
-      "CREATE TABLE segment_blocks ("
-      "id INTEGER PRIMARY KEY AUTOINCREMENT, "
-      "segment_id INTEGER, "
-      "sequence INTEGER, "
-      "block_id INTEGER, "
-      "block_idx INTEGER, "
-      "start_timestamp INTEGER, "
-      "end_timestamp INTEGER, "
-      "uuid STRING, "
-      "FOREIGN KEY (segment_id) REFERENCES segments(id)"
-      ");";
-  db.exec(query);
+  bool claimable() const { return !_claimed.load() && !empty(); }
 
-  query =
-      "CREATE TRIGGER delete_empty_segments "
-      "AFTER DELETE ON segment_blocks "
-      "BEGIN "
-      "DELETE FROM segments "
-      "WHERE id = OLD.segment_id "
-      "AND NOT EXISTS ( "
-      "SELECT 1 FROM segment_blocks "
-      "WHERE segment_id = OLD.segment_id "
-      "); "
-      "END;";
-  db.exec(query);
+  void completed(size_t n) {
+    _completed += n;
+    _notify();
+  }
 
-  query =
-      "CREATE INDEX idx_segment_blocks_segment_id ON "
-      "segment_blocks(segment_id);";
-  db.exec(query);
+  // Waits until every frame pushed so far has completed.
+  void drain() {
+    size_t pushed = _enqueue_pos.load();
+    if (_completed.load() < pushed)
+      _wait([&] { return _completed.load() >= pushed; });
+  }
 
-  query =
-      "CREATE INDEX idx_segment_blocks_time_range ON segment_blocks(start_timestamp);";
-  db.exec(query);
+  // Drains the queue; the async threads forget it once it's empty.
+  void close() {
+    drain();
+    _closed = true;
+  }
 
-  query = "CREATE INDEX idx_segments_stream_tag ON segments(stream_tag);";
-  db.exec(query);
+  bool closed() const { return _closed.load(); }
 
-  query = "CREATE INDEX idx_blocks_status ON blocks(status);";
-  db.exec(query);
+  // The async thread that looks at this queue first.
+  size_t home{0};
 
-  nts_sqlite_transaction(db, [n_blocks](const nts_sqlite_conn& conn) {
-    auto stmt =
-        conn.prepare("INSERT INTO blocks (idx, status) VALUES (?, 'free')");
-    for (uint32_t i = 0; i < n_blocks; i++) {
-      stmt.bind(1, static_cast<int>(i)).exec_no_result();
-      stmt.reset();
+ private:
+  struct slot {
+    std::atomic<size_t> sequence{0};
+    async_frame frame;
+  };
+
+  template <typename P>
+  void _wait(P pred) {
+    std::unique_lock<std::mutex> l(_lok);
+    _n_waiters++;
+    _cond.wait(l, pred);
+    _n_waiters--;
+  }
+
+  void _notify() {
+    if (_n_waiters.load() > 0) {
+      std::lock_guard<std::mutex> g(_lok);
+      _cond.notify_all();
     }
-  });
+  }
 
-  _upgrade_db(db);
+  std::vector<slot> _slots;
+  std::atomic<size_t> _enqueue_pos{0};
+  std::atomic<size_t> _dequeue_pos{0};
+  std::atomic<size_t> _completed{0};
+  std::atomic<bool> _claimed{false};
+  std::atomic<int> _n_waiters{0};
+  std::atomic<bool> _closed{false};
+  std::mutex _lok;
+  std::condition_variable _cond;
+};
+
+write_context::~write_context() {
+  // The async thread may still be writing through this context.
+  if (async_queue)
+    async_queue->close();
+
+  if (!db)
+    return;
+
+  // The stream tag stays taken until the block is finalized, so a new context
+  // for it sees this block's frames when it picks its first ordinal.
+  if (last_timestamp && current_block) {
+    auto conn = db->catalog(true);
+
+    nts_sqlite_transaction(*conn, [&](const nts_sqlite_conn& conn) {
+      _db_finalize_block(conn, *current_block, last_timestamp.value(),
+                         (uint8_t*)mm.map(), db->block_size());
+      // This is a maintenance task that needs to be done periodically.
+      _db_trans_finalize_reserved_blocks(conn);
+    });
+  }
+
+  std::lock_guard<std::mutex> g(current_stream_tags_lok);
+  current_stream_tags.erase(db->file_name() + ":" + stream_tag);
 }
 
-nanots_reader::nanots_reader(const std::string& file_name)
-    : _file_name(file_name),
-      _file(nts_file::open(file_name, "r")),
-      _block_size(),
-      _n_blocks() {
-  auto mm = nts_memory_map(
-      filenum(_file), 0, FILE_HEADER_BLOCK_SIZE, nts_memory_map::NMM_PROT_READ,
-      nts_memory_map::NMM_TYPE_FILE | nts_memory_map::NMM_SHARED);
+struct live_ring_header {
+  uint32_t magic;
+  uint32_t n_entries;
+  uint64_t head;       // number of frames published
+  uint32_t wake_word;  // bumped by every publish, waited on by subscribers
+  uint32_t n_waiters;
+  uint32_t n_writers;  // the last writer to close removes the ring
+};
 
-  auto header_p = (uint8_t*)mm.map();
+// seq is n + 1 for entry n once complete and 0 while it is being rewritten.
+struct live_ring_entry {
+  uint64_t seq;
+  int64_t block_idx;
+  uint64_t offset;
+  int64_t timestamp;
+  int64_t block_sequence;
+  uint8_t uuid[16];
+};
 
-  _block_size = *(uint32_t*)header_p;
+template <typename T>
+static T _ring_load(const T* p) {
+#ifdef _WIN32
+  T v = *reinterpret_cast<const volatile T*>(p);
+  _ReadWriteBarrier(); // compiler barrier (not mem)
+  return v;
+#else
+  return __atomic_load_n(p, std::memory_order_acquire);
+#endif
+}
 
-  _n_blocks = (*(uint32_t*)(header_p + sizeof(uint32_t)));
+template <typename T>
+static void _ring_store(T* p, T v) {
+#ifdef _WIN32
+  std::atomic_thread_fence(std::memory_order_release);
+  *reinterpret_cast<volatile T*>(p) = v;
+#else
+  __atomic_store_n(p, v, std::memory_order_release);
+#endif
 }
 
-static int _compare_index_entry_timestamp(uint8_t* index_entry_p,
-                                          uint8_t* target_timestamp_p) {
-  int64_t entry_timestamp = *(int64_t*)index_entry_p;
-  int64_t target_timestamp = *(int64_t*)target_timestamp_p;
+// Returns the new value.
+static uint32_t _ring_add(uint32_t* p, int32_t v) {
+#ifdef _WIN32
+  uint32_t result = (uint32_t)_InterlockedExchangeAdd(reinterpret_cast<volatile long*>(p), v) + v;
+#else
+  uint32_t result = __atomic_add_fetch(p, v, std::memory_order_seq_cst);
+#endif
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  return result;
+}
 
-  if (entry_timestamp < target_timestamp)
-    return -1;
-  if (entry_timestamp > target_timestamp)
-    return 1;
-  return 0;
+// Shared memory names are one flat namespace (of at most 31 characters on
+// macOS), so the database's resolved path and the stream tag are hashed.
+static std::string _live_ring_name(const std::string& file_name, const std::string& stream_tag) {
+  return format_s("/nanots-%016llx",
+                  (unsigned long long)_key_hash(canonical_path(file_name) + ":" + stream_tag));
 }
 
-void nanots_reader::read(
-    const std::string& stream_tag,
-    int64_t start_timestamp,
-    int64_t end_timestamp,
-    const std::function<
-        void(const uint8_t*, size_t, uint8_t, int64_t, int64_t, const std::string&)>& callback) {
-  nts_sqlite_conn db(_database_name(_file_name), false, true);
+class nanots_live_ring final {
+ public:
+  // Writers create the ring; subscribers only open it.
+  nanots_live_ring(const std::string& file_name, const std::string& stream_tag, bool writer)
+      : _name(_live_ring_name(file_name, stream_tag)), _writer(writer) {
+    uint32_t ring_size = LIVE_RING_HEADER_SIZE + (LIVE_RING_ENTRIES * LIVE_RING_ENTRY_SIZE);
+
+    bool created = false;
+    try {
+      _file = nts_file::open_shared(_name, ring_size, writer, &created);
+    } catch (const std::exception&) {
+      if (!writer)
+        throw nanots_exception(NANOTS_EC_NOT_FOUND, "Stream has no live ring.", __FILE__, __LINE__);
+      throw nanots_exception(NANOTS_EC_UNABLE_TO_ALLOCATE_FILE, "Unable to allocate live ring.", __FILE__, __LINE__);
+    }
 
-  auto stmt = db.prepare(
-      "SELECT "
-      "s.metadata as metadata, "
-      "sb.sequence as block_sequence, "
-      "sb.block_idx as block_idx, "
-      "sb.start_timestamp as block_start_timestamp, "
-      "sb.end_timestamp as block_end_timestamp, "
-      "sb.uuid as uuid "
-      "FROM segments s "
-      "JOIN segment_blocks sb ON sb.segment_id = s.id "
-      "WHERE s.stream_tag = ? "
-      "AND sb.start_timestamp <= ? "
-      "AND (sb.end_timestamp >= ? OR sb.end_timestamp = 0) "
-      "ORDER BY sb.sequence ASC;");
-  auto results =
-      stmt.bind(1, stream_tag).bind(2, end_timestamp).bind(3, start_timestamp).exec();
+    _mm = nts_memory_map(
+        filenum(_file), 0, ring_size,
+        nts_memory_map::NMM_PROT_READ | nts_memory_map::NMM_PROT_WRITE,
+        nts_memory_map::NMM_TYPE_FILE | nts_memory_map::NMM_SHARED);
 
-  bool need_binary_search = true;
+    _header = (live_ring_header*)_mm.map();
 
-  for (auto& row : results) {
-    std::string metadata = (row["metadata"])?row["metadata"].value():std::string();
-    int64_t block_sequence = std::stoll(row["block_sequence"].value());
-    int64_t block_idx = std::stoll(row["block_idx"].value());
-    std::string uuid_hex = row["uuid"].value();
+    // An existing ring is reused so a restarted writer continues its sequence.
+    if (created) {
+      _header->n_entries = LIVE_RING_ENTRIES;
+      _ring_store(&_header->magic, (uint32_t)LIVE_RING_MAGIC);
+    } else if (_ring_load(&_header->magic) != LIVE_RING_MAGIC ||
+               _header->n_entries != LIVE_RING_ENTRIES)
+      throw nanots_exception(NANOTS_EC_CANT_OPEN, "Invalid live ring.", __FILE__, __LINE__);
 
-    uint8_t uuid[16];
-    s_to_entropy_id(uuid_hex, uuid);
+    if (_writer)
+      _ring_add(&_header->n_writers, 1);
+  }
 
-    auto mm = nts_memory_map(
-        filenum(_file), FILE_HEADER_BLOCK_SIZE + (block_idx * _block_size),
-        _block_size, nts_memory_map::NMM_PROT_READ,
-        nts_memory_map::NMM_TYPE_FILE | nts_memory_map::NMM_SHARED);
+  // Removing the name doesn't disturb subscribers; they keep their mapping
+  // but see no new frames.
+  ~nanots_live_ring() noexcept {
+    if (_writer && _ring_add(&_header->n_writers, -1) == 0) {
+      try {
+        remove_shared(_name);
+      } catch (...) {
+      }
+    }
+  }
 
-    auto block_p = (uint8_t*)mm.map();
+  nanots_live_ring(const nanots_live_ring&) = delete;
+  nanots_live_ring& operator=(const nanots_live_ring&) = delete;
 
-    auto valid_counter = (uint32_t*)(block_p + 8);
+  live_ring_header* header() const { return _header; }
 
-#ifdef _WIN32
-    uint32_t n_valid_indexes = *reinterpret_cast<volatile uint32_t*>(valid_counter);
-    _ReadWriteBarrier(); // compiler barrier (not mem)
-#else
-    uint32_t n_valid_indexes = __atomic_load_n(valid_counter, std::memory_order_acquire);
-#endif
+  live_ring_entry* entry(uint64_t n) const {
+    return (live_ring_entry*)((uint8_t*)_header + LIVE_RING_HEADER_SIZE +
+                              ((n % LIVE_RING_ENTRIES) * LIVE_RING_ENTRY_SIZE));
+  }
 
-    uint8_t* index_start = block_p + BLOCK_HEADER_SIZE;
-    uint8_t* index_end = index_start + (n_valid_indexes * INDEX_ENTRY_SIZE);
+  // Only the stream's writer publishes, so head needs no read-modify-write.
+  void publish(const segment_block& sb, uint64_t frame_offset, int64_t timestamp) {
+    uint64_t n = _header->head;
+    auto e = entry(n);
+
+    _ring_store(&e->seq, (uint64_t)0);
+    std::atomic_thread_fence(std::memory_order_release);
+    e->block_idx = sb.block_idx;
+    e->offset = frame_offset;
+    e->timestamp = timestamp;
+    e->block_sequence = sb.sequence;
+    memcpy(e->uuid, sb.uuid, 16);
+    _ring_store(&e->seq, n + 1);
+
+    _ring_store(&_header->head, n + 1);
+    _ring_add(&_header->wake_word, 1);
+
+    // Skip the syscall when nobody is waiting.
+    if (_ring_load(&_header->n_waiters) > 0)
+      nts_futex_wake_all(&_header->wake_word);
+  }
 
-    int64_t start_index = 0;
+ private:
+  std::string _name;
+  bool _writer;
+  nts_file _file;
+  nts_memory_map _mm;
+  live_ring_header* _header;
+};
 
-    if (need_binary_search) {
-      uint8_t* first_entry =
-          lower_bound_bytes(index_start, index_end, (uint8_t*)&start_timestamp,
-                            INDEX_ENTRY_SIZE, _compare_index_entry_timestamp);
+class nanots_writer::cq_engine final {
+ public:
+  cq_engine(std::shared_ptr<nanots_database> db, bool auto_reclaim)
+      : _db(db),
+        _derived_writer(db, auto_reclaim, false),
+        _worker(&cq_engine::_run, this) {}
 
-      start_index = (first_entry - index_start) / INDEX_ENTRY_SIZE;
-      need_binary_search = false;
+  cq_engine(const cq_engine&) = delete;
+  cq_engine& operator=(const cq_engine&) = delete;
+
+  ~cq_engine() {
+    {
+      std::lock_guard<std::mutex> g(_lok);
+      _stop = true;
     }
+    _cond.notify_all();
+    _worker.join();
+  }
 
-    // Iterate through frames in this block
-    for (size_t i = start_index; i < n_valid_indexes; i++) {
-      uint8_t* index_p = block_p + BLOCK_HEADER_SIZE + (i * INDEX_ENTRY_SIZE);
-      int64_t timestamp = *(int64_t*)index_p;
-      uint64_t offset = *(uint64_t*)(index_p + 8);
+  int64_t add(continuous_query query) {
+    if (!query.callback && query.derived_stream_tag.empty())
+      throw nanots_exception(NANOTS_EC_INVALID_ARGUMENT, "Continuous query needs a callback or derived stream.", __FILE__, __LINE__);
+    if (query.aggregate != cq_aggregate::COUNT && !query.value_extractor)
+      throw nanots_exception(NANOTS_EC_INVALID_ARGUMENT, "Continuous query aggregate needs a value extractor.", __FILE__, __LINE__);
+    if (query.window < 0)
+      throw nanots_exception(NANOTS_EC_INVALID_ARGUMENT, "Continuous query window can't be negative.", __FILE__, __LINE__);
+
+    auto state = std::make_shared<query_state>();
+    if (!query.derived_stream_tag.empty())
+      state->derived = _derived_writer.create_write_context(query.derived_stream_tag,
+                                                            "continuous query of " + query.stream_tag);
+    state->query = std::move(query);
+
+    std::lock_guard<std::mutex> g(_lok);
+    state->id = _next_id++;
+    _queries[state->id] = state;
+    return state->id;
+  }
 
-      // Check if we've passed the end time
-      if (timestamp > end_timestamp)
-        return;  // All done!
+  void remove(int64_t query_id) {
+    {
+      std::lock_guard<std::mutex> g(_lok);
+      _queries.erase(query_id);
+    }
+    // The worker may still hold the query for the batch it is evaluating.
+    drain();
+  }
 
-      // Validate frame header
-      uint8_t flags;
-      uint32_t frame_size;
-      if (!_validate_frame_header(block_p + offset, uuid, &flags,
-                                  &frame_size)) {
-        // Log warning? Skip corrupted frame
-        continue;
+  // Called by the writer once a frame is published. Only a reference to the
+  // frame is queued; the worker reads it from the block.
+  void post(const write_context& wctx, uint64_t frame_offset, int64_t timestamp) {
+    {
+      std::lock_guard<std::mutex> g(_lok);
+
+      auto watched = std::any_of(_queries.begin(), _queries.end(), [&](const auto& q) {
+        return q.second->query.stream_tag == wctx.stream_tag;
+      });
+      if (!watched)
+        return;
+
+      committed_frame frame;
+      frame.stream_tag = wctx.stream_tag;
+      frame.block_idx = wctx.current_block->block_idx;
+      memcpy(frame.uuid, wctx.current_block->uuid, 16);
+      frame.offset = frame_offset;
+      frame.timestamp = timestamp;
+      _queue.push_back(std::move(frame));
+    }
+    _cond.notify_one();
+  }
+
+  void drain() {
+    std::unique_lock<std::mutex> l(_lok);
+    _idle_cond.wait(l, [&] { return _queue.empty() && !_busy; });
+  }
+
+ private:
+  struct query_state {
+    int64_t id{0};
+    continuous_query query;
+    write_context derived;
+    int64_t window_start{0};
+    uint64_t n_frames{0};
+    double accumulator{0};
+  };
+
+  struct committed_frame {
+    std::string stream_tag;
+    int64_t block_idx{0};
+    uint8_t uuid[16];
+    uint64_t offset{0};
+    int64_t timestamp{0};
+  };
+
+  void _run() {
+    std::shared_ptr<nts_memory_map> mm;
+    int64_t mm_block_idx = -1;
+
+    while (true) {
+      std::deque<committed_frame> batch;
+      std::vector<std::shared_ptr<query_state>> queries;
+      {
+        std::unique_lock<std::mutex> l(_lok);
+        _busy = false;
+        _idle_cond.notify_all();
+        _cond.wait(l, [&] { return _stop || !_queue.empty(); });
+        if (_queue.empty())
+          return;
+        batch.swap(_queue);
+        _busy = true;
+        for (auto& q : _queries)
+          queries.push_back(q.second);
       }
 
-      // Callback with frame data
-      callback(block_p + offset + FRAME_HEADER_SIZE, (size_t)frame_size, flags,
-               timestamp, block_sequence, metadata);
+      for (auto& frame : batch) {
+        if (frame.block_idx != mm_block_idx) {
+          mm = _db->map_block(frame.block_idx);
+          mm_block_idx = frame.block_idx;
+        }
+
+        auto block_p = (uint8_t*)mm->map();
+
+        // The block may have been recycled since the frame was written.
+        uint8_t flags;
+        uint32_t frame_size;
+        if (!_validate_frame_header(block_p + frame.offset, frame.uuid, &flags, &frame_size))
+          continue;
+
+        const uint8_t* data = block_p + frame.offset + FRAME_HEADER_SIZE;
+
+        for (auto& state : queries) {
+          if (state->query.stream_tag != frame.stream_tag)
+            continue;
+          // There is no caller to report to, so a failing query only logs.
+          try {
+            _evaluate(*state, data, (size_t)frame_size, frame.timestamp);
+          } catch (const std::exception& e) {
+            fprintf(stderr, "Exception in continuous query %lld: %s\n", (long long)state->id, e.what());
+          } catch (...) {
+            fprintf(stderr, "Exception in continuous query %lld\n", (long long)state->id);
+          }
+        }
+      }
     }
   }
-}
 
-std::vector<std::string> nanots_reader::query_stream_tags(int64_t start_timestamp, int64_t end_timestamp) {
-  nts_sqlite_conn db(_database_name(_file_name), false, true);
+  void _evaluate(query_state& state, const uint8_t* data, size_t size, int64_t timestamp) {
+    auto& q = state.query;
 
-  auto stmt = db.prepare(
-      "SELECT DISTINCT s.stream_tag "
-      "FROM segments s "
-      "JOIN segment_blocks sb ON s.id = sb.segment_id "
-      "WHERE sb.start_timestamp <= ? AND (sb.end_timestamp >= ? OR sb.end_timestamp = 0);");
-  auto results =
-      stmt.bind(1, end_timestamp).bind(2, start_timestamp).exec();
+    // Any frame past the open window closes it, even one the filter rejects.
+    if (q.window > 0 && state.n_frames > 0 && timestamp >= state.window_start + q.window)
+      _emit(state, state.window_start + q.window - 1);
 
-  std::vector<std::string> stream_tags;
+    if (q.filter && !q.filter(data, size))
+      return;
 
-  for (auto& row : results) {
-      stream_tags.push_back(row["stream_tag"].value());
+    double value = 0;
+    if (q.aggregate != cq_aggregate::COUNT) {
+      auto extracted = q.value_extractor(data, size);
+      if (!extracted || std::isnan(*extracted))
+        return;
+      value = *extracted;
+    }
+
+    if (state.n_frames == 0) {
+      // Windows are aligned to multiples of their width (floor division).
+      state.window_start = timestamp;
+      if (q.window > 0) {
+        state.window_start = (timestamp / q.window) * q.window;
+        if (state.window_start > timestamp)
+          state.window_start -= q.window;
+      }
+      state.accumulator = value;
+    } else if (q.aggregate == cq_aggregate::SUM || q.aggregate == cq_aggregate::AVG)
+      state.accumulator += value;
+    else if (q.aggregate == cq_aggregate::MIN)
+      state.accumulator = std::min(state.accumulator, value);
+    else if (q.aggregate == cq_aggregate::MAX)
+      state.accumulator = std::max(state.accumulator, value);
+
+    state.n_frames++;
+
+    if (q.window == 0)
+      _emit(state, timestamp);
   }
 
-  return stream_tags;
-}
+  void _emit(query_state& state, int64_t window_end) {
+    continuous_query_result result;
+    result.query_id = state.id;
+    result.window_start = state.window_start;
+    result.window_end = window_end;
+    result.n_frames = state.n_frames;
+    if (state.query.aggregate == cq_aggregate::COUNT)
+      result.value = (double)state.n_frames;
+    else if (state.query.aggregate == cq_aggregate::AVG)
+      result.value = state.accumulator / (double)state.n_frames;
+    else
+      result.value = state.accumulator;
+
+    state.n_frames = 0;
+
+    if (state.query.threshold && result.value < state.query.threshold.value())
+      return;
+
+    if (state.query.callback)
+      state.query.callback(result);
+
+    if (!state.query.derived_stream_tag.empty())
+      _derived_writer.write(state.derived, (const uint8_t*)&result, sizeof(result), window_end, 0);
+  }
 
-std::vector<contiguous_segment> nanots_reader::query_contiguous_segments(
-    const std::string& stream_tag,
-    int64_t start_timestamp,
-    int64_t end_timestamp) {
-  nts_sqlite_conn db(_database_name(_file_name), false, true);
+  std::shared_ptr<nanots_database> _db;
+  nanots_writer _derived_writer;
+  std::mutex _lok;
+  std::condition_variable _cond;
+  std::condition_variable _idle_cond;
+  std::deque<committed_frame> _queue;
+  std::map<int64_t, std::shared_ptr<query_state>> _queries;
+  int64_t _next_id{1};
+  bool _busy{false};
+  bool _stop{false};
+  std::thread _worker;
+};
 
-  // Create a grouping key by subtracting sequence from row number
-  // Contiguous sequences will have the same group_key
+class nanots_writer::mirror_shipper final {
+ public:
+  mirror_shipper(std::shared_ptr<nanots_database> db,
+                 const std::string& mirror_file_name,
+                 bool auto_reclaim,
+                 size_t max_lag)
+      : _db(db),
+        _mirror_file_name(mirror_file_name),
+        _mirror_writer(mirror_file_name, auto_reclaim),
+        _max_lag(std::max<size_t>(max_lag, 1)),
+        _worker(&mirror_shipper::_run, this) {
+    std::lock_guard<std::mutex> g(_shippers_lok);
+    _shippers.emplace(_db.get(), this);
+  }
 
-  auto stmt = db.prepare(
-    "WITH contiguous_groups AS ( "
-    "  SELECT "
-    "    sb.segment_id, "
-    "    sb.sequence, "
-    "    sb.start_timestamp, "
-    "    sb.end_timestamp, "
-    "    ROW_NUMBER() OVER (PARTITION BY sb.segment_id ORDER BY sb.sequence) "
-    "      - sb.sequence AS group_key "
-    "  FROM segment_blocks sb "
-    "  JOIN segments s ON sb.segment_id = s.id "
-    "  WHERE sb.start_timestamp <= ? "                    /* bind(1) = window_end    */
-    "    AND (sb.end_timestamp >= ? OR sb.end_timestamp = 0) " /* bind(2) = window_start */
-    "    AND s.stream_tag = ? "                           /* bind(3) = stream_tag    */
-    "), "
-    "region_boundaries AS ( "
-    "  SELECT "
-    "    segment_id, "
-    "    group_key, "
-    "    MIN(start_timestamp) AS region_start, "
-    "    CASE "
-    "      WHEN MIN(end_timestamp) = 0 THEN 0 "
-    "      ELSE MAX(end_timestamp) "
-    "    END AS region_end, "
-    "    COUNT(*) AS block_count "
-    "  FROM contiguous_groups "
-    "  GROUP BY segment_id, group_key "
-    ") "
-    "SELECT "
-    "  segment_id, "
-    "  region_start, "
-    "  region_end, "
-    "  block_count "
-    "FROM region_boundaries "
-    "ORDER BY segment_id, region_start;"
-  );
-  auto results =
-      stmt.bind(1, end_timestamp).bind(2, start_timestamp).bind(3, stream_tag).exec();
+  mirror_shipper(const mirror_shipper&) = delete;
+  mirror_shipper& operator=(const mirror_shipper&) = delete;
 
-  std::vector<contiguous_segment> segments;
+  ~mirror_shipper() {
+    {
+      std::lock_guard<std::mutex> g(_shippers_lok);
+      auto range = _shippers.equal_range(_db.get());
+      for (auto it = range.first; it != range.second; ++it) {
+        if (it->second == this) {
+          _shippers.erase(it);
+          break;
+        }
+      }
+    }
+    {
+      std::lock_guard<std::mutex> g(_lok);
+      _stop = true;
+    }
+    _cond.notify_all();
+    _worker.join();
+  }
 
-  for (auto& row : results) {
-    contiguous_segment segment;
-    segment.segment_id = std::stoll(row["segment_id"].value());
-    segment.start_timestamp = std::stoll(row["region_start"].value());
-    segment.end_timestamp = std::stoll(row["region_end"].value());
-    segments.push_back(segment);
+  // Called by free_blocks() on a primary once its transaction committed. The
+  // range is replayed on each of its mirrors after the frames queued before
+  // it, and frees the mirror's blocks that lie entirely within it.
+  static void post_free(const nanots_database* db,
+                        const std::string& stream_tag,
+                        int64_t start_timestamp,
+                        int64_t end_timestamp) {
+    std::lock_guard<std::mutex> g(_shippers_lok);
+    auto range = _shippers.equal_range(db);
+    for (auto it = range.first; it != range.second; ++it)
+      it->second->_post_free(stream_tag, start_timestamp, end_timestamp);
   }
 
-  return segments;
-}
+  // Called by the writer once a frame is published. Only a reference to the
+  // frame is queued; the shipper reads it from the block.
+  void post(const write_context& wctx, uint64_t frame_offset, int64_t timestamp) {
+    committed_frame frame;
+    frame.stream_tag = wctx.stream_tag;
+    frame.metadata = wctx.metadata;
+    frame.segment_id = wctx.current_segment->id;
+    frame.block_idx = wctx.current_block->block_idx;
+    memcpy(frame.uuid, wctx.current_block->uuid, 16);
+    frame.offset = frame_offset;
+    frame.timestamp = timestamp;
+    frame.posted_at = std::chrono::steady_clock::now();
+
+    {
+      std::unique_lock<std::mutex> l(_lok);
+      _space_cond.wait(l, [&] { return _queue.size() < _max_lag; });
+      _queue.push_back(std::move(frame));
+    }
+    _cond.notify_one();
+  }
 
-nanots_iterator::nanots_iterator(const std::string& file_name,
-                                 const std::string& stream_tag)
-    : _file_name(file_name),
-      _stream_tag(stream_tag),
-      _file(nts_file::open(file_name, "r")),
-      _current_block_sequence(0),
-      _current_segment_id(0),
-      _current_frame_idx(0),
-      _valid(false),
-      _initialized(false) {
-  // Read block size from file header
-  auto header_mm = nts_memory_map(
-      filenum(_file), 0, FILE_HEADER_BLOCK_SIZE, nts_memory_map::NMM_PROT_READ,
-      nts_memory_map::NMM_TYPE_FILE | nts_memory_map::NMM_SHARED);
+  void drain() {
+    std::unique_lock<std::mutex> l(_lok);
+    _space_cond.wait(l, [&] { return _queue.empty(); });
+  }
 
-  auto header_p = (uint8_t*)header_mm.map();
-  _block_size = *(uint32_t*)header_p;
+  mirror_stats stats() const {
+    std::lock_guard<std::mutex> g(_lok);
+    mirror_stats stats = _stats;
+    stats.lag_frames = _queue.size();
+    if (!_queue.empty())
+      stats.lag_ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+                         std::chrono::steady_clock::now() - _queue.front().posted_at)
+                         .count();
+    return stats;
+  }
 
-  // Initialize to first frame if stream exists
-  reset();
-}
+ private:
+  struct committed_frame {
+    std::string stream_tag;
+    std::string metadata;
+    int64_t segment_id{0};
+    int64_t block_idx{0};
+    uint8_t uuid[16];
+    uint64_t offset{0};
+    int64_t timestamp{0};
+    std::chrono::steady_clock::time_point posted_at;
+    // Set for a free_blocks() range to replay rather than a frame.
+    std::optional<std::pair<int64_t, int64_t>> freed;
+  };
 
-block_info* nanots_iterator::_get_block_by_segment_and_sequence(int64_t segment_id, int64_t sequence) {
-  std::string cache_key = std::to_string(segment_id) + ":" + std::to_string(sequence);
-  auto it = _block_cache.find(cache_key);
-  if (it != _block_cache.end()) {
-    return &it->second;
-  }
+  // The mirror context of a stream and the primary segment it mirrors.
+  struct mirror_stream {
+    int64_t segment_id{0};
+    std::optional<write_context> wctx;
+  };
 
-  // Query database for this specific block
-  auto db_name = _database_name(_file_name);
-  nts_sqlite_conn db(db_name, false, true);
+  void _run() {
+    std::shared_ptr<nts_memory_map> mm;
+    int64_t mm_block_idx = -1;
+
+    while (true) {
+      committed_frame frame;
+      {
+        // Frames stay queued until shipped so the lag covers them.
+        std::unique_lock<std::mutex> l(_lok);
+        _cond.wait(l, [&] { return _stop || !_queue.empty(); });
+        if (_queue.empty())
+          return;
+        frame = _queue.front();
+      }
 
-  auto stmt = db.prepare(
-      "SELECT "
-      "s.metadata as metadata, "
-      "sb.segment_id as segment_id, "
-      "sb.sequence as block_sequence, "
-      "sb.block_idx as block_idx, "
-      "sb.start_timestamp as start_timestamp, "
-      "sb.end_timestamp as end_timestamp, "
-      "sb.uuid as uuid "
-      "FROM segments s "
-      "JOIN segment_blocks sb ON sb.segment_id = s.id "
-      "WHERE sb.segment_id = ? AND sb.sequence = ?");
+      if (frame.freed) {
+        _free(frame);
+        {
+          std::lock_guard<std::mutex> g(_lok);
+          _queue.pop_front();
+        }
+        _space_cond.notify_all();
+        continue;
+      }
 
-  auto results = stmt.bind(1, segment_id).bind(2, sequence).exec();
+      if (frame.block_idx != mm_block_idx) {
+        mm = _db->map_block(frame.block_idx);
+        mm_block_idx = frame.block_idx;
+      }
 
-  if (results.empty()) {
-    return nullptr;
-  }
+      bool shipped = _ship(frame, (const uint8_t*)mm->map());
 
-  auto& row = results[0];
-  block_info block;
-  block.block_idx = std::stoll(row["block_idx"].value());
-  block.block_sequence = std::stoll(row["block_sequence"].value());
-  block.segment_id = std::stoll(row["segment_id"].value());
-  block.metadata = row["metadata"].value();
-  block.uuid_hex = row["uuid"].value();
-  block.start_timestamp = std::stoll(row["start_timestamp"].value());
-  block.end_timestamp = std::stoll(row["end_timestamp"].value());
-  
-  auto result = _block_cache.emplace(cache_key, std::move(block));
-  return &result.first->second;
-}
+      {
+        std::lock_guard<std::mutex> g(_lok);
+        _queue.pop_front();
+        if (shipped)
+          _stats.n_frames_shipped++;
+        else
+          _stats.n_frames_dropped++;
+      }
+      _space_cond.notify_all();
+    }
+  }
 
-block_info* nanots_iterator::_get_first_block() {
-  auto db_name = _database_name(_file_name);
-  nts_sqlite_conn db(db_name, false, true);
+  bool _ship(const committed_frame& frame, const uint8_t* block_p) {
+    // The block may have been recycled since the frame was written.
+    uint8_t flags;
+    uint32_t frame_size;
+    if (!_validate_frame_header(block_p + frame.offset, frame.uuid, &flags, &frame_size))
+      return false;
 
-  auto stmt = db.prepare(
-      "SELECT sb.segment_id, sb.sequence "
-      "FROM segments s "
-      "JOIN segment_blocks sb ON sb.segment_id = s.id "
-      "WHERE s.stream_tag = ? "
-      "ORDER BY s.id ASC, sb.sequence ASC "
-      "LIMIT 1");
+    const uint8_t* data = block_p + frame.offset + FRAME_HEADER_SIZE;
 
-  auto results = stmt.bind(1, _stream_tag).exec();
+    // There is no caller to report to, so a failing write only logs.
+    try {
+      auto& stream = _streams[frame.stream_tag];
 
-  if (results.empty())
-    return nullptr;
+      // A new primary segment (a new write context) starts a new one here too.
+      if (stream.segment_id != frame.segment_id) {
+        // Finalize the previous one first; it holds the stream tag.
+        stream.wctx.reset();
+        stream.wctx.emplace(_mirror_writer.create_write_context(frame.stream_tag, frame.metadata));
+        stream.segment_id = frame.segment_id;
+      }
 
-  int64_t segment_id = std::stoll(results[0]["segment_id"].value());
-  int64_t sequence = std::stoll(results[0]["sequence"].value());
-  return _get_block_by_segment_and_sequence(segment_id, sequence);
-}
+      if (*(const uint32_t*)(block_p + BLOCK_FLAGS_OFFSET) & BLOCK_FLAG_SECONDARY_KEYS)
+        _mirror_writer.write(*stream.wctx, data, frame_size, frame.timestamp, flags,
+                             *(const int64_t*)(block_p + frame.offset - SECONDARY_KEY_SIZE));
+      else
+        _mirror_writer.write(*stream.wctx, data, frame_size, frame.timestamp, flags);
+    } catch (const std::exception& e) {
+      fprintf(stderr, "Exception in mirror of %s: %s\n", frame.stream_tag.c_str(), e.what());
+      return false;
+    } catch (...) {
+      fprintf(stderr, "Exception in mirror of %s\n", frame.stream_tag.c_str());
+      return false;
+    }
 
-block_info* nanots_iterator::_get_next_block() {
-  auto db_name = _database_name(_file_name);
-  nts_sqlite_conn db(db_name, false, true);
+    return true;
+  }
 
-  // First try to find next block within the same segment
-  auto stmt = db.prepare(
-      "SELECT sb.id, sb.sequence "
-      "FROM segment_blocks sb "
-      "WHERE sb.segment_id = ? AND sb.sequence > ? "
-      "ORDER BY sb.sequence ASC "
-      "LIMIT 1");
+  void _post_free(const std::string& stream_tag, int64_t start_timestamp, int64_t end_timestamp) {
+    committed_frame frame;
+    frame.stream_tag = stream_tag;
+    frame.freed = std::make_pair(start_timestamp, end_timestamp);
+    frame.posted_at = std::chrono::steady_clock::now();
 
-  auto results = stmt.bind(1, _current_segment_id).bind(2, _current_block_sequence).exec();
+    {
+      std::lock_guard<std::mutex> g(_lok);
+      _queue.push_back(std::move(frame));
+    }
+    _cond.notify_one();
+  }
 
-  if (!results.empty()) {
-    // Found next block in same segment
-    int64_t next_sequence = std::stoll(results[0]["sequence"].value());
-    return _get_block_by_segment_and_sequence(_current_segment_id, next_sequence);
+  void _free(const committed_frame& frame) {
+    try {
+      nanots_writer::free_blocks(_mirror_file_name, frame.stream_tag, frame.freed->first, frame.freed->second);
+    } catch (const std::exception& e) {
+      fprintf(stderr, "Exception in mirror of %s: %s\n", frame.stream_tag.c_str(), e.what());
+    } catch (...) {
+      fprintf(stderr, "Exception in mirror of %s\n", frame.stream_tag.c_str());
+    }
   }
 
-  // No more blocks in current segment, look for first block in next segment
-  stmt = db.prepare(
-      "SELECT sb.segment_id, sb.sequence "
-      "FROM segments s "
-      "JOIN segment_blocks sb ON sb.segment_id = s.id "
-      "WHERE s.stream_tag = ? "
-      "AND s.id > ? "
-      "ORDER BY s.id ASC, sb.sequence ASC "
-      "LIMIT 1");
+  // Running shippers by the primary they replicate, so free_blocks() (a
+  // static, writerless call) reaches them.
+  static inline std::mutex _shippers_lok;
+  static inline std::multimap<const nanots_database*, mirror_shipper*> _shippers;
+
+  std::shared_ptr<nanots_database> _db;
+  std::string _mirror_file_name;
+  nanots_writer _mirror_writer;
+  std::map<std::string, mirror_stream> _streams;
+  size_t _max_lag;
+  mutable std::mutex _lok;
+  std::condition_variable _cond;
+  std::condition_variable _space_cond;
+  std::deque<committed_frame> _queue;
+  mirror_stats _stats;
+  bool _stop{false};
+  std::thread _worker;
+};
 
-  results = stmt.bind(1, _stream_tag).bind(2, _current_segment_id).exec();
+// Writes queued frames through the writer that owns it on a fixed pool of
+// threads. Each queue has a home thread; a thread with nothing of its own to
+// do takes over other threads' waiting queues. Rollovers due in one round of
+// a thread are done in a single catalog transaction.
+class nanots_writer::async_engine final {
+ public:
+  async_engine(nanots_writer* writer, size_t n_threads)
+      : _writer(writer) {
+    for (size_t i = 0; i < std::max<size_t>(n_threads, 1); i++)
+      _workers.emplace_back(&async_engine::_run, this, i);
+  }
 
-  if (results.empty())
-    return nullptr;
+  async_engine(const async_engine&) = delete;
+  async_engine& operator=(const async_engine&) = delete;
 
-  int64_t next_segment_id = std::stoll(results[0]["segment_id"].value());
-  int64_t next_sequence = std::stoll(results[0]["sequence"].value());
-  return _get_block_by_segment_and_sequence(next_segment_id, next_sequence);
-}
+  // Frames still queued are written before the threads exit.
+  ~async_engine() {
+    {
+      std::lock_guard<std::mutex> g(_lok);
+      _stop = true;
+    }
+    _cond.notify_all();
+    for (auto& worker : _workers)
+      worker.join();
+  }
 
-block_info* nanots_iterator::_get_prev_block() {
-  auto db_name = _database_name(_file_name);
-  nts_sqlite_conn db(db_name, false, true);
+  size_t n_threads() const { return _workers.size(); }
 
-  // First try to find previous block within the same segment
-  auto stmt = db.prepare(
-      "SELECT sb.id, sb.sequence "
-      "FROM segment_blocks sb "
-      "WHERE sb.segment_id = ? AND sb.sequence < ? "
-      "ORDER BY sb.sequence DESC "
-      "LIMIT 1");
+  void add(std::shared_ptr<nanots_async_queue> queue) {
+    std::lock_guard<std::mutex> g(_queues_lok);
+    queue->home = _next_home++ % _workers.size();
+    _queues.push_back(std::move(queue));
+    _version++;
+  }
 
-  auto results = stmt.bind(1, _current_segment_id).bind(2, _current_block_sequence).exec();
+  std::vector<std::shared_ptr<nanots_async_queue>> queues() {
+    std::lock_guard<std::mutex> g(_queues_lok);
+    return _queues;
+  }
 
-  if (!results.empty()) {
-    // Found previous block in same segment
-    int64_t prev_sequence = std::stoll(results[0]["sequence"].value());
-    return _get_block_by_segment_and_sequence(_current_segment_id, prev_sequence);
+  // Called after every push. Only takes the lock if a thread is asleep.
+  void wake() {
+    if (_n_sleeping.load() > 0) {
+      std::lock_guard<std::mutex> g(_lok);
+      _signalled = true;
+      _cond.notify_one();
+    }
   }
 
-  // No previous blocks in current segment, look for last block in previous segment
-  stmt = db.prepare(
-      "SELECT sb.segment_id, sb.sequence "
-      "FROM segments s "
-      "JOIN segment_blocks sb ON sb.segment_id = s.id "
-      "WHERE s.stream_tag = ? "
-      "AND s.id < ? "
-      "ORDER BY s.id DESC, sb.sequence DESC "
-      "LIMIT 1");
+  void drain() {
+    for (auto& queue : queues())
+      queue->drain();
+  }
 
-  results = stmt.bind(1, _stream_tag).bind(2, _current_segment_id).exec();
+  // Only called while drained, when the owning writer moves.
+  void rebind(nanots_writer* writer) { _writer = writer; }
 
-  if (results.empty())
-    return nullptr;
+ private:
+  bool _claimable() {
+    std::lock_guard<std::mutex> g(_queues_lok);
+    for (auto& queue : _queues) {
+      if (queue->claimable())
+        return true;
+    }
+    return false;
+  }
 
-  int64_t prev_segment_id = std::stoll(results[0]["segment_id"].value());
-  int64_t prev_sequence = std::stoll(results[0]["sequence"].value());
-  return _get_block_by_segment_and_sequence(prev_segment_id, prev_sequence);
-}
+  static void _complete(async_frame& frame, std::exception_ptr e) {
+    try {
+      frame.on_complete(e);
+    } catch (...) {
+    }
+  }
 
-block_info* nanots_iterator::_find_block_for_timestamp(int64_t timestamp) {
-  auto db_name = _database_name(_file_name);
-  nts_sqlite_conn db(db_name, false, true);
+  // Prepares blocks for the next frame of every claimed queue at once.
+  // Failures are left for the frame's own write to run into and report.
+  void _batch_rollovers(nanots_writer* writer, std::vector<nanots_async_queue*>& claimed) {
+    std::vector<pending_write> writes;
 
-  // First try to find block that contains the timestamp
-  auto stmt = db.prepare(
-      "SELECT sb.segment_id, sb.sequence "
-      "FROM segments s "
-      "JOIN segment_blocks sb ON sb.segment_id = s.id "
-      "WHERE s.stream_tag = ? "
-      "AND sb.start_timestamp <= ? "
-      "AND (sb.end_timestamp >= ? OR sb.end_timestamp = 0) "
-      "ORDER BY s.id ASC, sb.sequence ASC "
-      "LIMIT 1");
+    for (auto queue : claimed) {
+      auto frame = queue->front();
+      if (!frame)
+        continue;
+      auto& wctx = *frame->wctx;
+      if (wctx.last_timestamp && frame->timestamp <= wctx.last_timestamp.value())
+        continue;
+      if (!wctx.current_segment)
+        continue;
 
-  auto results =
-      stmt.bind(1, _stream_tag).bind(2, timestamp).bind(3, timestamp).exec();
+      uint32_t key_size = (frame->secondary_key) ? SECONDARY_KEY_SIZE : 0;
+      if (frame->data.size() >
+          writer->_block_size - (FRAME_HEADER_SIZE + INDEX_ENTRY_SIZE + BLOCK_HEADER_SIZE + key_size))
+        continue;
 
-  if(!results.empty())
-  {
-    int64_t segment_id = std::stoll(results[0]["segment_id"].value());
-    int64_t sequence = std::stoll(results[0]["sequence"].value());
-    return _get_block_by_segment_and_sequence(segment_id, sequence);
+      writes.push_back(pending_write{&wctx, frame->data.size(), key_size, frame->timestamp});
+    }
+
+    try {
+      writer->_prepare_blocks(writes);
+    } catch (...) {
+      // Dropped: _write() retries any rollover left undone and reports the error per frame.
+    }
   }
 
-  // If no block contains the timestamp, find the first block with start_timestamp >=
-  // timestamp. This explicitly allows a find() before the first timsestamp to still find the first block.
-  stmt = db.prepare(
-      "SELECT sb.segment_id, sb.sequence "
-      "FROM segments s "
-      "JOIN segment_blocks sb ON sb.segment_id = s.id "
-      "WHERE s.stream_tag = ? "
-      "AND sb.start_timestamp >= ? "
-      "ORDER BY s.id ASC, sb.sequence ASC "
-      "LIMIT 1");
+  // Writes one batch from a claimed queue. Durable frames complete together
+  // after a single flush of the blocks they went to.
+  void _write_batch(nanots_writer* writer, nanots_async_queue& queue, std::vector<async_frame>& batch) {
+    batch.clear();
+    async_frame frame;
+    while (batch.size() < 256 && queue.pop(frame))
+      batch.push_back(std::move(frame));
+
+    if (batch.empty())
+      return;
+
+    std::vector<async_frame*> durable;
+
+    for (auto& f : batch) {
+      try {
+        writer->_write(*f.wctx, f.data.data(), f.data.size(), f.timestamp, f.flags,
+                       (f.secondary_key) ? &*f.secondary_key : nullptr);
+      } catch (...) {
+        _complete(f, std::current_exception());
+        continue;
+      }
 
-  results = stmt.bind(1, _stream_tag).bind(2, timestamp).exec();
+      if (f.durable)
+        durable.push_back(&f);
+      else
+        _complete(f, nullptr);
+    }
 
-  if (results.empty())
-    return nullptr;  // No blocks at all, or timestamp is after everything
+    if (!durable.empty()) {
+      // Frames in blocks that rolled over were flushed with the block.
+      std::exception_ptr error;
+      try {
+        std::set<write_context*> flushed;
+        for (auto f : durable) {
+          if (flushed.insert(f->wctx).second && f->wctx->current_block)
+            f->wctx->mm.flush(f->wctx->mm.map(), writer->_block_size, true);
+        }
+      } catch (...) {
+        error = std::current_exception();
+      }
 
-  int64_t segment_id = std::stoll(results[0]["segment_id"].value());
-  int64_t sequence = std::stoll(results[0]["sequence"].value());
-  return _get_block_by_segment_and_sequence(segment_id, sequence);
-}
+      for (auto f : durable)
+        _complete(*f, error);
+    }
 
-bool nanots_iterator::_load_block_data(block_info& block) {
-  if (block.is_loaded)
-    return true;
+    queue.completed(batch.size());
+  }
 
-  // Memory map the block
-  block.mm = nts_memory_map(
-      filenum(_file), FILE_HEADER_BLOCK_SIZE + (block.block_idx * _block_size),
-      _block_size, nts_memory_map::NMM_PROT_READ,
-      nts_memory_map::NMM_TYPE_FILE | nts_memory_map::NMM_SHARED);
+  void _run(size_t id) {
+    std::vector<async_frame> batch;
+    std::vector<std::shared_ptr<nanots_async_queue>> queues;
+    std::vector<nanots_async_queue*> claimed;
+    uint64_t version = UINT64_MAX;
+
+    while (true) {
+      {
+        std::lock_guard<std::mutex> g(_queues_lok);
+        auto n_queues = _queues.size();
+        _queues.erase(std::remove_if(_queues.begin(), _queues.end(),
+                                     [](const std::shared_ptr<nanots_async_queue>& queue) {
+                                       return queue->closed() && queue->empty();
+                                     }),
+                      _queues.end());
+        if (_queues.size() != n_queues)
+          _version++;
+        if (version != _version) {
+          queues = _queues;
+          version = _version;
+        }
+      }
 
-  block.block_p = (uint8_t*)block.mm.map();
+      // Own queues first, then anyone else's that are waiting.
+      claimed.clear();
+      for (auto& queue : queues) {
+        if (queue->home == id && !queue->empty() && queue->claim())
+          claimed.push_back(queue.get());
+      }
+      if (claimed.empty()) {
+        for (auto& queue : queues) {
+          if (queue->claimable() && queue->claim())
+            claimed.push_back(queue.get());
+        }
+      }
 
-  auto valid_counter = (uint32_t*)(block.block_p + 8);
+      if (!claimed.empty()) {
+        auto writer = _writer.load();
+        _batch_rollovers(writer, claimed);
+        for (auto queue : claimed) {
+          _write_batch(writer, *queue, batch);
+          queue->release();
+        }
+        continue;
+      }
 
-#ifdef _WIN32
-    block.n_valid_indexes = *reinterpret_cast<volatile uint32_t*>(valid_counter);
-    _ReadWriteBarrier(); // compiler barrier (not mem)
-#else
-    block.n_valid_indexes = __atomic_load_n(valid_counter, std::memory_order_acquire);
-#endif
+      // A producer that pushes after _n_sleeping is raised sees it and
+      // signals; one that pushed before is caught by _claimable().
+      std::unique_lock<std::mutex> l(_lok);
+      _n_sleeping++;
+      _cond.wait(l, [&] { return _signalled || _stop || _claimable(); });
+      _n_sleeping--;
+      _signalled = false;
+      if (_stop && !_claimable()) {
+        bool idle = true;
+        std::lock_guard<std::mutex> g(_queues_lok);
+        for (auto& queue : _queues)
+          idle = idle && queue->empty();
+        if (idle)
+          return;
+      }
+    }
+  }
 
-  // Convert UUID std::string to bytes
-  s_to_entropy_id(block.uuid_hex, block.uuid);
+  std::atomic<nanots_writer*> _writer;
+  std::mutex _queues_lok;
+  std::vector<std::shared_ptr<nanots_async_queue>> _queues;
+  uint64_t _version{0};
+  size_t _next_home{0};
+  std::mutex _lok;
+  std::condition_variable _cond;
+  std::atomic<int> _n_sleeping{0};
+  bool _signalled{false};
+  bool _stop{false};
+  std::vector<std::thread> _workers;
+};
 
-  block.is_loaded = true;
-  return true;
+nanots_writer::nanots_writer(const std::string& file_name, bool auto_reclaim)
+    : nanots_writer(nanots_database::open(file_name), auto_reclaim) {
 }
 
-bool nanots_iterator::_load_current_frame() {
-  auto* block = _get_block_by_segment_and_sequence(_current_segment_id, _current_block_sequence);
-  if (!block) {
-    _valid = false;
-    return false;
-  }
+nanots_writer::nanots_writer(std::shared_ptr<nanots_database> db, bool auto_reclaim)
+    : nanots_writer(std::move(db), auto_reclaim, true) {
+}
 
-  if (!_load_block_data(*block)) {
-    _valid = false;
-    return false;
+nanots_writer::nanots_writer(nanots_writer&& other) {
+  *this = std::move(other);
+}
+
+nanots_writer& nanots_writer::operator=(nanots_writer&& other) {
+  if (this == &other)
+    return *this;
+
+  // The async thread writes through the writer that owns it, so it must be
+  // idle while the state moves.
+  _async.reset();
+  if (other._async)
+    other._async->drain();
+
+  _db = std::move(other._db);
+  _block_size = other._block_size;
+  _n_blocks = other._n_blocks;
+  _auto_reclaim = other._auto_reclaim;
+  _async_threads = other._async_threads;
+  _active_stream_tags = std::move(other._active_stream_tags);
+  _cq = std::move(other._cq);
+  _mirror = std::move(other._mirror);
+  _async = std::move(other._async);
+  if (_async)
+    _async->rebind(this);
+
+  return *this;
+}
+
+// Defined here, where cq_engine, mirror_shipper and async_engine are complete.
+// _async is declared last, so queued frames are written before the rest goes.
+nanots_writer::~nanots_writer() = default;
+
+nanots_writer::nanots_writer(std::shared_ptr<nanots_database> db, bool auto_reclaim, bool validate)
+    : _db(std::move(db)),
+      _block_size(_db->block_size()),
+      _n_blocks(_db->n_blocks()),
+      _auto_reclaim(auto_reclaim) {
+  if (_block_size < 4096 || _block_size > 1024 * 1024 * 1024)
+    throw nanots_exception(NANOTS_EC_INVALID_BLOCK_SIZE, "Invalid block size in file header.", __FILE__, __LINE__);
+
+  if (!_db->writable())
+    throw nanots_exception(NANOTS_EC_CANT_OPEN, "Unable to open file for writing.", __FILE__, __LINE__);
+
+  {
+    auto conn = _db->catalog(true);
+    _upgrade_db(*conn);
   }
+  if (validate)
+    _validate_blocks(*_db);
+}
 
-  if (_current_frame_idx >= block->n_valid_indexes) {
-    _valid = false;
-    return false;
+write_context nanots_writer::create_write_context(const std::string& stream_tag,
+                                                  const std::string& metadata) {
+  auto contexts = create_write_contexts({{stream_tag, metadata}});
+  return std::move(contexts.front());
+}
+
+std::vector<write_context> nanots_writer::create_write_contexts(
+    const std::vector<std::pair<std::string, std::string>>& streams) {
+  std::vector<std::string> keys;
+  for (auto& stream : streams)
+    keys.push_back(_db->file_name() + ":" + stream.first);
+
+  // Only claiming the stream tags is done under the lock; the catalog work
+  // below runs concurrently with other writers.
+  {
+    std::lock_guard<std::mutex> g(current_stream_tags_lok);
+    std::set<std::string> claimed;
+    for (auto& key : keys) {
+      if (current_stream_tags.count(key) || !claimed.insert(key).second)
+        throw nanots_exception(NANOTS_EC_DUPLICATE_STREAM_TAG, "Only one current writer per active stream tag.", __FILE__, __LINE__);
+    }
+    current_stream_tags.insert(claimed.begin(), claimed.end());
   }
 
-  // Get frame info from index
-  uint8_t* index_p = block->block_p + BLOCK_HEADER_SIZE +
-                     (_current_frame_idx * INDEX_ENTRY_SIZE);
-  int64_t timestamp = *(int64_t*)index_p;
-  uint64_t offset = *(uint64_t*)(index_p + 8);
+  std::vector<write_context> contexts(streams.size());
 
-  // Validate frame header
-  uint8_t flags;
-  uint32_t frame_size;
-  if (!_validate_frame_header(block->block_p + offset, block->uuid, &flags,
-                              &frame_size)) {
-    _valid = false;
-    return false;
+  try {
+    auto conn = _db->catalog(true);
+
+    nts_sqlite_transaction(*conn, [&](const nts_sqlite_conn& conn) {
+      for (size_t i = 0; i < streams.size(); i++) {
+        auto& wctx = contexts[i];
+        wctx.stream_tag = streams[i].first;
+        wctx.metadata = streams[i].second;
+        wctx.current_segment = _db_create_segment(conn, wctx.stream_tag, wctx.metadata);
+        if (!wctx.current_segment)
+          throw nanots_exception(NANOTS_EC_UNABLE_TO_CREATE_SEGMENT, "Unable to create segment.", __FILE__, __LINE__);
+        wctx.next_ordinal = _db_next_ordinal(conn, wctx.stream_tag);
+      }
+    });
+  } catch (...) {
+    std::lock_guard<std::mutex> g(current_stream_tags_lok);
+    for (auto& key : keys)
+      current_stream_tags.erase(key);
+    throw;
   }
 
-  // Set up current frame
-  _current_frame.data = block->block_p + offset + FRAME_HEADER_SIZE;
-  _current_frame.size = frame_size;
-  _current_frame.flags = flags;
-  _current_frame.timestamp = timestamp;
-  _current_frame.block_sequence = block->block_sequence;
+  for (auto& wctx : contexts)
+    wctx.db = _db;
 
-  _valid = true;
-  return true;
+  return contexts;
 }
 
-nanots_iterator& nanots_iterator::operator++() {
-  if (!_valid)
-    return *this;
+void nanots_writer::close_write_contexts(std::vector<write_context>& contexts) {
+  for (auto& wctx : contexts) {
+    if (wctx.db && wctx.db != _db)
+      throw nanots_exception(NANOTS_EC_INVALID_ARGUMENT, "Write context belongs to another writer.", __FILE__, __LINE__);
+  }
 
-  auto* current_block = _get_block_by_segment_and_sequence(_current_segment_id, _current_block_sequence);
-  if (!current_block || !_load_block_data(*current_block)) {
-    _valid = false;
-    return *this;
+  for (auto& wctx : contexts) {
+    if (wctx.async_queue)
+      wctx.async_queue->close();
   }
 
-  _current_frame_idx++;
+  bool any_open = std::any_of(contexts.begin(), contexts.end(), [](const write_context& wctx) {
+    return wctx.db && wctx.last_timestamp && wctx.current_block;
+  });
 
-  // If we've gone past the end of current block, move to next block
-  if (_current_frame_idx >= current_block->n_valid_indexes) {
-    auto* next_block = _get_next_block();
-    if (!next_block) {
-      _valid = false;
-      return *this;
+  // On failure the contexts are left as they are, for their destructors.
+  if (any_open) {
+    auto conn = _db->catalog(true);
+
+    nts_sqlite_transaction(*conn, [&](const nts_sqlite_conn& conn) {
+      for (auto& wctx : contexts) {
+        if (wctx.db && wctx.last_timestamp && wctx.current_block)
+          _db_finalize_block(conn, *wctx.current_block, wctx.last_timestamp.value(),
+                             (uint8_t*)wctx.mm.map(), _block_size);
+      }
+      _db_trans_finalize_reserved_blocks(conn);
+    });
+  }
+
+  {
+    std::lock_guard<std::mutex> g(current_stream_tags_lok);
+    for (auto& wctx : contexts) {
+      if (wctx.db) {
+        current_stream_tags.erase(_db->file_name() + ":" + wctx.stream_tag);
+        wctx.db.reset();
+      }
     }
+  }
 
-    _current_segment_id = next_block->segment_id;
-    _current_block_sequence = next_block->block_sequence;
-    _current_frame_idx = 0;
+  contexts.clear();
+}
+
+void nanots_writer::write(write_context& wctx,
+                          const uint8_t* data,
+                          size_t size,
+                          int64_t timestamp,
+                          uint8_t flags) {
+  _write(wctx, data, size, timestamp, flags, nullptr);
+}
+
+void nanots_writer::write(write_context& wctx,
+                          const uint8_t* data,
+                          size_t size,
+                          int64_t timestamp,
+                          uint8_t flags,
+                          int64_t secondary_key) {
+  _write(wctx, data, size, timestamp, flags, &secondary_key);
+}
+
+std::future<void> nanots_writer::write_async(write_context& wctx,
+                                             const uint8_t* data,
+                                             size_t size,
+                                             int64_t timestamp,
+                                             uint8_t flags,
+                                             std::optional<int64_t> secondary_key,
+                                             bool durable) {
+  auto promise = std::make_shared<std::promise<void>>();
+  auto future = promise->get_future();
+
+  _write_async(wctx, data, size, timestamp, flags, secondary_key, durable, [promise](std::exception_ptr e) {
+    if (e)
+      promise->set_exception(e);
+    else
+      promise->set_value();
+  });
+
+  return future;
+}
+
+void nanots_writer::write_async(write_context& wctx,
+                                const uint8_t* data,
+                                size_t size,
+                                int64_t timestamp,
+                                uint8_t flags,
+                                std::optional<int64_t> secondary_key,
+                                bool durable,
+                                std::function<void(nanots_ec_t)> on_complete) {
+  _write_async(wctx, data, size, timestamp, flags, secondary_key, durable,
+               [on_complete = std::move(on_complete)](std::exception_ptr e) {
+                 nanots_ec_t ec = NANOTS_EC_OK;
+                 if (e) {
+                   try {
+                     std::rethrow_exception(e);
+                   } catch (const nanots_exception& ex) {
+                     ec = ex.get_ec();
+                   } catch (...) {
+                     ec = NANOTS_EC_UNKNOWN;
+                   }
+                 }
+                 if (on_complete)
+                   on_complete(ec);
+               });
+}
+
+void nanots_writer::drain_async(write_context& wctx) {
+  if (wctx.async_queue)
+    wctx.async_queue->drain();
+}
+
+void nanots_writer::set_async_threads(size_t n_threads) {
+  if (n_threads == 0)
+    throw nanots_exception(NANOTS_EC_INVALID_ARGUMENT, "At least one async thread is needed.", __FILE__, __LINE__);
+
+  std::lock_guard<std::mutex> g(_async_lok);
+  _async_threads = n_threads;
+  if (!_async || _async->n_threads() == n_threads)
+    return;
+
+  _async->drain();
+  auto queues = _async->queues();
+  _async = std::make_unique<async_engine>(this, n_threads);
+  for (auto& queue : queues)
+    _async->add(queue);
+}
+
+void nanots_writer::_write_async(write_context& wctx,
+                                 const uint8_t* data,
+                                 size_t size,
+                                 int64_t timestamp,
+                                 uint8_t flags,
+                                 std::optional<int64_t> secondary_key,
+                                 bool durable,
+                                 std::function<void(std::exception_ptr)> on_complete) {
+  if (!wctx.db)
+    throw nanots_exception(NANOTS_EC_INVALID_ARGUMENT, "Invalid write context.", __FILE__, __LINE__);
+
+  // set_async_threads() may replace the engine at any time, so it is only
+  // touched under _async_lok. A queue added here is either in the snapshot
+  // the replacement is built from or added to the replacement.
+  {
+    std::lock_guard<std::mutex> g(_async_lok);
+    if (!_async)
+      _async = std::make_unique<async_engine>(this, _async_threads);
+
+    if (!wctx.async_queue) {
+      wctx.async_queue = std::make_shared<nanots_async_queue>();
+      _async->add(wctx.async_queue);
+    }
   }
 
-  _load_current_frame();
-  return *this;
+  async_frame frame;
+  frame.wctx = &wctx;
+  frame.data.assign(data, data + size);
+  frame.timestamp = timestamp;
+  frame.flags = flags;
+  frame.secondary_key = secondary_key;
+  frame.durable = durable;
+  frame.on_complete = std::move(on_complete);
+
+  // Not under the lock: push() waits while the queue is full.
+  wctx.async_queue->push(std::move(frame));
+
+  std::lock_guard<std::mutex> g(_async_lok);
+  _async->wake();
 }
 
-nanots_iterator& nanots_iterator::operator--() {
-  if (!_valid)
-    return *this;
+void nanots_writer::_map_block(write_context& wctx, int64_t timestamp) {
+  wctx.mm = nts_memory_map(
+      _db->fd(),
+      FILE_HEADER_BLOCK_SIZE + (wctx.current_block->block_idx * _block_size),
+      _block_size,
+      nts_memory_map::NMM_PROT_READ | nts_memory_map::NMM_PROT_WRITE,
+      nts_memory_map::NMM_TYPE_FILE | nts_memory_map::NMM_SHARED);
 
-  if (_current_frame_idx == 0) {
-    // Need to go to previous block
-    auto* prev_block = _get_prev_block();
-    if (!prev_block) {
-      _valid = false;
-      return *this;
+  _recycle_block(wctx, timestamp);
+}
+
+void nanots_writer::_prepare_blocks(const std::vector<pending_write>& writes) {
+  std::vector<write_context*> finalize;
+  std::vector<const pending_write*> acquire;
+
+  for (auto& w : writes) {
+    auto& wctx = *w.wctx;
+
+    if (!wctx.current_block) {
+      acquire.push_back(&w);
+      continue;
     }
 
-    if (!_load_block_data(*prev_block)) {
-      _valid = false;
-      return *this;
+    uint64_t index_end;
+    uint64_t offset = _next_record_offset((const uint8_t*)wctx.mm.map(), _block_size, w.size,
+                                          w.key_size, index_end);
+    if (index_end >= offset && wctx.last_timestamp) {
+      finalize.push_back(&wctx);
+      acquire.push_back(&w);
     }
+  }
 
-    _current_segment_id = prev_block->segment_id;
-    _current_block_sequence = prev_block->block_sequence;
-    _current_frame_idx =
-        (prev_block->n_valid_indexes > 0) ? prev_block->n_valid_indexes - 1 : 0;
-  } else
-    _current_frame_idx--;
+  if (acquire.empty())
+    return;
 
-  _load_current_frame();
-  return *this;
+  for (auto wctx : finalize)
+    wctx->mm.flush(wctx->mm.map(), _block_size, true);
+
+  std::vector<segment_block> acquired;
+
+  auto conn = _db->catalog(true);
+
+  nts_sqlite_transaction(*conn, [&](const nts_sqlite_conn& conn) {
+    for (auto wctx : finalize)
+      _db_finalize_block(conn, *wctx->current_block, wctx->last_timestamp.value(),
+                         (const uint8_t*)wctx->mm.map(), _block_size);
+    for (auto w : acquire)
+      acquired.push_back(_db_acquire_block(conn, *w->wctx, w->timestamp, _auto_reclaim));
+  });
+
+  for (auto wctx : finalize) {
+    wctx->current_block = std::nullopt;
+    wctx->mm = nts_memory_map();
+  }
+
+  for (size_t i = 0; i < acquire.size(); i++) {
+    auto& wctx = *acquire[i]->wctx;
+    wctx.current_block = acquired[i];
+    wctx.current_segment->sequence++;
+    _map_block(wctx, acquire[i]->timestamp);
+  }
+}
+
+void nanots_writer::write_group(const std::vector<group_frame>& frames, int64_t timestamp) {
+  if (frames.empty())
+    throw nanots_exception(NANOTS_EC_INVALID_ARGUMENT, "Empty frame group.", __FILE__, __LINE__);
+
+  // Everything that can reject a frame is checked before any is written.
+  std::set<write_context*> contexts;
+  std::vector<pending_write> writes;
+
+  for (auto& frame : frames) {
+    auto wctx = frame.wctx;
+    if (!wctx || wctx->db != _db || !contexts.insert(wctx).second)
+      throw nanots_exception(NANOTS_EC_INVALID_ARGUMENT, "Each frame of a group needs its own write context of this writer.", __FILE__, __LINE__);
+
+    if (wctx->last_timestamp && timestamp <= wctx->last_timestamp.value())
+      throw nanots_exception(NANOTS_EC_NON_MONOTONIC_TIMESTAMP, "Timestamp is not monotonic.", __FILE__, __LINE__);
+
+    if (wctx->secondary_keys && wctx->secondary_keys.value())
+      throw nanots_exception(NANOTS_EC_INVALID_ARGUMENT, "Write context mixes frames with and without secondary keys.", __FILE__, __LINE__);
+
+    if (frame.size > _block_size - (FRAME_HEADER_SIZE + INDEX_ENTRY_SIZE + BLOCK_HEADER_SIZE))
+      throw nanots_exception(NANOTS_EC_ROW_SIZE_TOO_BIG, "Frame size is too large. Use a much larger block size.", __FILE__, __LINE__);
+
+    writes.push_back(pending_write{wctx, frame.size, 0, timestamp});
+  }
+
+  _prepare_blocks(writes);
+
+  // Every frame is in place before the first one becomes visible.
+  std::vector<uint64_t> offsets;
+  for (auto& frame : frames)
+    offsets.push_back(_stage(*frame.wctx, frame.data, frame.size, timestamp, frame.flags, nullptr));
+
+  for (size_t i = 0; i < frames.size(); i++)
+    _publish(*frames[i].wctx, offsets[i], timestamp, false);
+}
+
+void nanots_writer::_write(write_context& wctx,
+                           const uint8_t* data,
+                           size_t size,
+                           int64_t timestamp,
+                           uint8_t flags,
+                           const int64_t* secondary_key) {
+  if (wctx.last_timestamp && timestamp <= wctx.last_timestamp.value())
+    throw nanots_exception(NANOTS_EC_NON_MONOTONIC_TIMESTAMP, "Timestamp is not monotonic.", __FILE__, __LINE__);
+
+  bool has_key = secondary_key != nullptr;
+  if (wctx.secondary_keys && wctx.secondary_keys.value() != has_key)
+    throw nanots_exception(NANOTS_EC_INVALID_ARGUMENT, "Write context mixes frames with and without secondary keys.", __FILE__, __LINE__);
+
+  uint32_t key_size = (has_key) ? SECONDARY_KEY_SIZE : 0;
+
+  if (size >
+      _block_size - (FRAME_HEADER_SIZE + INDEX_ENTRY_SIZE + BLOCK_HEADER_SIZE + key_size))
+    throw nanots_exception(NANOTS_EC_ROW_SIZE_TOO_BIG, "Frame size is too large. Use a much larger block size.", __FILE__, __LINE__);
+
+  if (!wctx.current_block) {
+    auto conn = _db->catalog(true);
+
+    nts_sqlite_transaction(*conn, [&](const nts_sqlite_conn& conn) {
+      wctx.current_block = _db_acquire_block(conn, wctx, timestamp, _auto_reclaim);
+      wctx.current_segment->sequence++;
+    });
+
+    _map_block(wctx, timestamp);
+  }
+
+  uint8_t* block_p = (uint8_t*)wctx.mm.map();
+
+  uint64_t index_end;
+  uint64_t new_block_ofs = _next_record_offset(block_p, _block_size, size, key_size, index_end);
+
+  if (index_end >= new_block_ofs) {
+    wctx.mm.flush(wctx.mm.map(), _block_size, true);
+
+    auto conn = _db->catalog(true);
+
+    nts_sqlite_transaction(*conn, [&](const nts_sqlite_conn& conn) {
+      _db_finalize_block(conn, *wctx.current_block, wctx.last_timestamp.value(),
+                         block_p, _block_size);
+    });
+
+    wctx.current_block = std::nullopt;
+    wctx.mm = nts_memory_map();
+
+    return _write(wctx, data, size, timestamp, flags, secondary_key);
+  }
+
+  _publish(wctx, _stage(wctx, data, size, timestamp, flags, secondary_key), timestamp, has_key);
+}
+
+uint64_t nanots_writer::_stage(write_context& wctx,
+                               const uint8_t* data,
+                               size_t size,
+                               int64_t timestamp,
+                               uint8_t flags,
+                               const int64_t* secondary_key) {
+  uint8_t* block_p = (uint8_t*)wctx.mm.map();
+
+  uint32_t n_valid_indexes = *(uint32_t*)(block_p + 8);
+
+  bool has_key = secondary_key != nullptr;
+  uint32_t key_size = (has_key) ? SECONDARY_KEY_SIZE : 0;
+
+  uint64_t index_end;
+  uint64_t new_block_ofs = _next_record_offset(block_p, _block_size, size, key_size, index_end);
+
+  auto& sb = *wctx.current_block;
+
+  if (n_valid_indexes > 0)
+    sb.max_gap = std::max(sb.max_gap, timestamp - wctx.last_timestamp.value());
+
+  // A filter is only kept if it covers every frame of the block.
+  if (n_valid_indexes == 0 && wctx.key_extractor)
+    sb.key_hashes.emplace();
+  if (sb.key_hashes) {
+    if (wctx.key_extractor) {
+      auto key = wctx.key_extractor(data, size);
+      if (!key.empty())
+        sb.key_hashes->insert(_key_hash(key));
+    } else
+      sb.key_hashes.reset();
+  }
+
+  // Likewise a value summary must cover every frame of the block.
+  if (n_valid_indexes == 0 && wctx.value_extractor)
+    sb.n_values = 0;
+  if (sb.n_values) {
+    if (wctx.value_extractor) {
+      auto value = wctx.value_extractor(data, size);
+      if (value && !std::isnan(*value)) {
+        if (*sb.n_values == 0 || *value < sb.value_min)
+          sb.value_min = *value;
+        if (*sb.n_values == 0 || *value > sb.value_max)
+          sb.value_max = *value;
+        (*sb.n_values)++;
+      }
+    } else
+      sb.n_values.reset();
+  }
+
+  if (has_key) {
+    // The flag is published with the block's first index entry.
+    if (n_valid_indexes == 0)
+      *(uint32_t*)(block_p + BLOCK_FLAGS_OFFSET) |= BLOCK_FLAG_SECONDARY_KEYS;
+
+    *(int64_t*)(block_p + new_block_ofs) = *secondary_key;
+
+    if (!sb.secondary_min || *secondary_key < *sb.secondary_min)
+      sb.secondary_min = *secondary_key;
+    if (!sb.secondary_max || *secondary_key > *sb.secondary_max)
+      sb.secondary_max = *secondary_key;
+
+    new_block_ofs += key_size;
+  }
+
+  uint8_t* frame_p = block_p + new_block_ofs;
+  memcpy(frame_p, wctx.current_block->uuid, 16);
+  *(uint32_t*)(frame_p + 16) = (uint32_t)size;
+  *(frame_p + 20) = flags;
+  memcpy(frame_p + FRAME_HEADER_SIZE, data, size);
+
+  uint8_t* index_p =
+      block_p + BLOCK_HEADER_SIZE + (n_valid_indexes * INDEX_ENTRY_SIZE);
+  *(int64_t*)index_p = timestamp;
+  *(uint64_t*)(index_p + 8) = new_block_ofs;
+
+  return new_block_ofs;
+}
+
+void nanots_writer::_publish(write_context& wctx, uint64_t frame_offset, int64_t timestamp, bool has_key) {
+  uint8_t* block_p = (uint8_t*)wctx.mm.map();
+
+  auto valid_counter = (uint32_t*)(block_p + 8);
+
+#ifdef _WIN32
+  _InterlockedIncrement(reinterpret_cast<volatile long*>(valid_counter));
+#else
+  __atomic_fetch_add(valid_counter, 1, std::memory_order_release);
+#endif
+
+  wctx.last_timestamp = timestamp;
+  wctx.secondary_keys = has_key;
+  wctx.next_ordinal++;
+
+  if (_cq)
+    _cq->post(wctx, frame_offset, timestamp);
+
+  if (_mirror)
+    _mirror->post(wctx, frame_offset, timestamp);
+
+  if (wctx.live_ring)
+    wctx.live_ring->publish(*wctx.current_block, frame_offset, timestamp);
+}
+
+void nanots_writer::enable_live_fanout(write_context& wctx) {
+  if (!wctx.live_ring)
+    wctx.live_ring = std::make_shared<nanots_live_ring>(_db->file_name(), wctx.stream_tag, true);
+}
+
+void nanots_writer::remove_live_ring(const std::string& file_name, const std::string& stream_tag) {
+  remove_shared(_live_ring_name(file_name, stream_tag));
+}
+
+int64_t nanots_writer::register_continuous_query(continuous_query query) {
+  if (!_cq)
+    _cq = std::make_unique<cq_engine>(_db, _auto_reclaim);
+  return _cq->add(std::move(query));
+}
+
+void nanots_writer::unregister_continuous_query(int64_t query_id) {
+  if (_cq)
+    _cq->remove(query_id);
+}
+
+void nanots_writer::drain_continuous_queries() {
+  if (_cq)
+    _cq->drain();
+}
+
+void nanots_writer::enable_mirror(const std::string& mirror_file_name, size_t max_lag) {
+  if (_mirror)
+    throw nanots_exception(NANOTS_EC_INVALID_ARGUMENT, "Writer already has a mirror.", __FILE__, __LINE__);
+  if (nanots_database::open(mirror_file_name) == _db)
+    throw nanots_exception(NANOTS_EC_INVALID_ARGUMENT, "A database can't mirror itself.", __FILE__, __LINE__);
+  _mirror = std::make_unique<mirror_shipper>(_db, mirror_file_name, _auto_reclaim, max_lag);
+}
+
+void nanots_writer::drain_mirror() {
+  if (_mirror)
+    _mirror->drain();
+}
+
+mirror_stats nanots_writer::get_mirror_stats() const {
+  if (!_mirror)
+    return mirror_stats();
+  return _mirror->stats();
+}
+
+void nanots_writer::promote_mirror(const std::string& mirror_file_name, const std::string& file_name) {
+  {
+    auto db = nanots_database::open(mirror_file_name);
+    // Close out the blocks the shipper still had open.
+    _validate_blocks(*db);
+    auto conn = db->catalog(true);
+    conn->exec("PRAGMA wal_checkpoint(TRUNCATE);");
+  }
+
+  {
+    std::lock_guard<std::mutex> g(open_databases_lok);
+    open_databases.erase(_open_databases_key(mirror_file_name));
+    open_databases.erase(_open_databases_key(file_name));
+  }
+
+  auto mirror_db_name = _database_name(mirror_file_name);
+  auto db_name = _database_name(file_name);
+
+  for (auto& name : {db_name + "-wal", db_name + "-shm", mirror_db_name + "-shm"}) {
+    if (file_exists(name))
+      remove_file(name);
+  }
+
+  rename_file(mirror_file_name, file_name);
+  rename_file(mirror_db_name, db_name);
+  if (file_exists(mirror_db_name + "-wal"))
+    rename_file(mirror_db_name + "-wal", db_name + "-wal");
+}
+
+// A block built by bulk_load() and the catalog row describing it.
+struct bulk_block {
+  size_t stream{0};
+  std::vector<uint8_t> data;
+  segment_block sb;
+  uint32_t n_frames{0};
+  uint64_t n_bytes{0};
+};
+
+// Lays a stream's frames out in blocks exactly as write() would, handing each
+// block to emit once it is full.
+static void _bulk_build_stream(const bulk_stream& stream,
+                               uint32_t block_size,
+                               const std::function<void(bulk_block&&)>& emit) {
+  std::optional<bulk_block> current;
+  std::optional<bool> secondary_keys;
+  std::optional<int64_t> last_timestamp;
+  uint64_t last_record_offset = 0;
+  int64_t ordinal = 0;
+  int64_t sequence = 0;
+
+  auto finish = [&]() {
+    auto& b = *current;
+    *(uint32_t*)(b.data.data() + 8) = b.n_frames;
+    b.sb.end_timestamp = last_timestamp.value();
+    b.n_bytes = _index_n_bytes(b.data.data(), block_size, b.n_frames);
+    emit(std::move(b));
+    current.reset();
+  };
+
+  bulk_frame frame;
+  while (stream.next(frame)) {
+    if (last_timestamp && frame.timestamp <= last_timestamp.value())
+      throw nanots_exception(NANOTS_EC_NON_MONOTONIC_TIMESTAMP, "Timestamp is not monotonic.", __FILE__, __LINE__);
+
+    bool has_key = frame.secondary_key.has_value();
+    if (secondary_keys && secondary_keys.value() != has_key)
+      throw nanots_exception(NANOTS_EC_INVALID_ARGUMENT, "Stream mixes frames with and without secondary keys.", __FILE__, __LINE__);
+    secondary_keys = has_key;
+
+    uint32_t key_size = (has_key) ? SECONDARY_KEY_SIZE : 0;
+
+    if (frame.size >
+        block_size - (FRAME_HEADER_SIZE + INDEX_ENTRY_SIZE + BLOCK_HEADER_SIZE + key_size))
+      throw nanots_exception(NANOTS_EC_ROW_SIZE_TOO_BIG, "Frame size is too large. Use a much larger block size.", __FILE__, __LINE__);
+
+    uint32_t padded_frame_size = ((uint32_t)(FRAME_HEADER_SIZE + frame.size) + 7) & ~7;
+    uint32_t record_size = padded_frame_size + key_size;
+
+    uint64_t record_ofs = 0;
+
+    if (current) {
+      uint64_t index_end = BLOCK_HEADER_SIZE + ((current->n_frames + 1) * INDEX_ENTRY_SIZE);
+      record_ofs = index_end;
+      if (last_record_offset >= record_size)
+        record_ofs = std::max<uint64_t>(last_record_offset - record_size, index_end);
+      if (index_end >= record_ofs)
+        finish();
+    }
+
+    if (!current) {
+      current.emplace();
+      auto& b = *current;
+      b.data.assign(block_size, 0);
+      *(int64_t*)b.data.data() = frame.timestamp;
+      if (has_key)
+        *(uint32_t*)(b.data.data() + BLOCK_FLAGS_OFFSET) = BLOCK_FLAG_SECONDARY_KEYS;
+      b.sb.sequence = sequence++;
+      b.sb.start_timestamp = frame.timestamp;
+      b.sb.start_ordinal = ordinal;
+      generate_entropy_id(b.sb.uuid);
+      if (stream.key_extractor)
+        b.sb.key_hashes.emplace();
+      if (stream.value_extractor)
+        b.sb.n_values = 0;
+      record_ofs = block_size - record_size;
+    } else
+      current->sb.max_gap = std::max(current->sb.max_gap, frame.timestamp - last_timestamp.value());
+
+    auto& b = *current;
+    auto& sb = b.sb;
+    uint8_t* block_p = b.data.data();
+
+    if (sb.key_hashes) {
+      auto key = stream.key_extractor(frame.data, frame.size);
+      if (!key.empty())
+        sb.key_hashes->insert(_key_hash(key));
+    }
+
+    if (sb.n_values) {
+      auto value = stream.value_extractor(frame.data, frame.size);
+      if (value && !std::isnan(*value)) {
+        if (*sb.n_values == 0 || *value < sb.value_min)
+          sb.value_min = *value;
+        if (*sb.n_values == 0 || *value > sb.value_max)
+          sb.value_max = *value;
+        (*sb.n_values)++;
+      }
+    }
+
+    last_record_offset = record_ofs;
+
+    if (has_key) {
+      int64_t key = frame.secondary_key.value();
+      *(int64_t*)(block_p + record_ofs) = key;
+      if (!sb.secondary_min || key < *sb.secondary_min)
+        sb.secondary_min = key;
+      if (!sb.secondary_max || key > *sb.secondary_max)
+        sb.secondary_max = key;
+      record_ofs += key_size;
+    }
+
+    uint8_t* frame_p = block_p + record_ofs;
+    memcpy(frame_p, sb.uuid, 16);
+    *(uint32_t*)(frame_p + 16) = (uint32_t)frame.size;
+    *(frame_p + 20) = frame.flags;
+    if (frame.size > 0)
+      memcpy(frame_p + FRAME_HEADER_SIZE, frame.data, frame.size);
+
+    uint8_t* index_p = block_p + BLOCK_HEADER_SIZE + (b.n_frames * INDEX_ENTRY_SIZE);
+    *(int64_t*)index_p = frame.timestamp;
+    *(uint64_t*)(index_p + 8) = record_ofs;
+
+    b.n_frames++;
+    ordinal++;
+    last_timestamp = frame.timestamp;
+  }
+
+  if (current)
+    finish();
+}
+
+bulk_load_stats nanots_writer::bulk_load(const std::string& file_name,
+                                         std::vector<bulk_stream> streams,
+                                         size_t n_threads) {
+  auto db = nanots_database::open(file_name);
+
+  if (db->sealed() || !db->writable() || db->in_memory())
+    throw nanots_exception(NANOTS_EC_CANT_OPEN, "Unable to open file for bulk loading.", __FILE__, __LINE__);
+
+  {
+    std::lock_guard<std::mutex> g(current_stream_tags_lok);
+    for (auto& stream : streams) {
+      if (!stream.next)
+        throw nanots_exception(NANOTS_EC_INVALID_ARGUMENT, "Bulk stream has no frame source.", __FILE__, __LINE__);
+      if (current_stream_tags.count(db->file_name() + ":" + stream.stream_tag))
+        throw nanots_exception(NANOTS_EC_DUPLICATE_STREAM_TAG, "Only one current writer per active stream tag.", __FILE__, __LINE__);
+    }
+  }
+
+  uint32_t block_size = db->block_size();
+
+  // Free blocks in file order, so the built blocks go out as sequential writes.
+  std::deque<block> free_blocks;
+  {
+    auto conn = db->catalog();
+    for (auto& row : conn->exec("SELECT id, idx FROM blocks WHERE status = 'free' ORDER BY idx;"))
+      free_blocks.push_back(block{std::stoll(row["id"].value()), std::stoll(row["idx"].value())});
+  }
+
+  if (n_threads == 0)
+    n_threads = std::max<size_t>(std::thread::hardware_concurrency(), 1);
+  n_threads = std::max<size_t>(std::min(n_threads, streams.size()), 1);
+
+  // Builders hand finished blocks to this thread, which writes them. At most
+  // two blocks per builder are held in memory.
+  std::mutex lok;
+  std::condition_variable ready_cond;
+  std::condition_variable space_cond;
+  std::deque<bulk_block> ready;
+  size_t n_builders_done = 0;
+  std::exception_ptr error;
+  std::atomic<size_t> next_stream{0};
+
+  auto fail = [&](std::exception_ptr e) {
+    std::lock_guard<std::mutex> g(lok);
+    if (!error)
+      error = e;
+    ready_cond.notify_all();
+    space_cond.notify_all();
+  };
+
+  std::vector<std::thread> builders;
+  for (size_t i = 0; i < n_threads; i++) {
+    builders.emplace_back([&]() {
+      try {
+        for (size_t s; (s = next_stream++) < streams.size();) {
+          _bulk_build_stream(streams[s], block_size, [&](bulk_block&& b) {
+            b.stream = s;
+            std::unique_lock<std::mutex> l(lok);
+            space_cond.wait(l, [&] { return error || ready.size() < 2 * n_threads; });
+            if (error)
+              throw nanots_exception(NANOTS_EC_UNKNOWN, "Bulk load aborted.", __FILE__, __LINE__);
+            ready.push_back(std::move(b));
+            ready_cond.notify_one();
+          });
+        }
+      } catch (...) {
+        fail(std::current_exception());
+      }
+
+      std::lock_guard<std::mutex> g(lok);
+      n_builders_done++;
+      ready_cond.notify_all();
+    });
+  }
+
+  // Catalog rows of the blocks written so far, with the block each went to.
+  std::vector<std::pair<block, bulk_block>> loaded;
+
+  try {
+    auto f = nts_file::open(file_name, "r+");
+
+    while (true) {
+      bulk_block b;
+      {
+        std::unique_lock<std::mutex> l(lok);
+        ready_cond.wait(l, [&] { return error || !ready.empty() || n_builders_done == n_threads; });
+        if (error || ready.empty())
+          break;
+        b = std::move(ready.front());
+        ready.pop_front();
+        space_cond.notify_one();
+      }
+
+      if (free_blocks.empty())
+        throw nanots_exception(NANOTS_EC_NO_FREE_BLOCKS, "Unable to get free block.", __FILE__, __LINE__);
+
+      auto target = free_blocks.front();
+      free_blocks.pop_front();
+
+      if (write_file_at(f, FILE_HEADER_BLOCK_SIZE + (uint64_t)target.idx * block_size,
+                        b.data.data(), b.data.size()) < 0)
+        throw nanots_exception(NANOTS_EC_UNKNOWN, "Unable to write block.", __FILE__, __LINE__);
+
+      b.data = std::vector<uint8_t>();
+      loaded.emplace_back(target, std::move(b));
+    }
+
+    if (!error && sync_file(f) < 0)
+      throw nanots_exception(NANOTS_EC_UNKNOWN, "Unable to sync file.", __FILE__, __LINE__);
+  } catch (...) {
+    fail(std::current_exception());
+  }
+
+  for (auto& builder : builders)
+    builder.join();
+
+  if (error)
+    std::rethrow_exception(error);
+
+  bulk_load_stats stats;
+
+  auto conn = db->catalog(true);
+
+  nts_sqlite_transaction(*conn, [&](const nts_sqlite_conn& conn) {
+    std::vector<std::optional<segment>> segments(streams.size());
+    std::vector<int64_t> base_ordinals(streams.size());
+
+    auto stmt = conn.prepare(
+        "INSERT INTO segment_blocks (segment_id, sequence, block_id, block_idx, "
+        "start_timestamp, end_timestamp, uuid, start_ordinal, n_frames, max_gap, n_bytes, "
+        "secondary_min, secondary_max, key_bloom, n_values, value_min, value_max) "
+        "VALUES (?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?)");
+    auto used_stmt = conn.prepare("UPDATE blocks SET status = 'used' WHERE id = ?");
+
+    for (auto& l : loaded) {
+      auto& target = l.first;
+      auto& b = l.second;
+      auto& sb = b.sb;
+      auto& stream = streams[b.stream];
+
+      if (!segments[b.stream]) {
+        base_ordinals[b.stream] = _db_next_ordinal(conn, stream.stream_tag);
+        segments[b.stream] = _db_create_segment(conn, stream.stream_tag, stream.metadata);
+      }
+
+      stmt.bind(1, segments[b.stream]->id)
+          .bind(2, sb.sequence)
+          .bind(3, target.id)
+          .bind(4, target.idx)
+          .bind(5, sb.start_timestamp)
+          .bind(6, sb.end_timestamp)
+          .bind(7, entropy_id_to_s(sb.uuid))
+          .bind(8, base_ordinals[b.stream] + sb.start_ordinal)
+          .bind(9, (int64_t)b.n_frames)
+          .bind(10, sb.max_gap)
+          .bind(11, b.n_bytes);
+      if (sb.secondary_min)
+        stmt.bind(12, *sb.secondary_min).bind(13, *sb.secondary_max);
+      else
+        stmt.bind_null(12).bind_null(13);
+      if (sb.key_hashes)
+        stmt.bind(14, _key_bloom_build(*sb.key_hashes));
+      else
+        stmt.bind_null(14);
+      if (sb.n_values && *sb.n_values > 0)
+        stmt.bind(15, *sb.n_values).bind(16, sb.value_min).bind(17, sb.value_max);
+      else if (sb.n_values)
+        stmt.bind(15, (int64_t)0).bind_null(16).bind_null(17);
+      else
+        stmt.bind_null(15).bind_null(16).bind_null(17);
+      stmt.exec_no_result();
+      stmt.reset();
+
+      used_stmt.bind(1, target.id).exec_no_result();
+      used_stmt.reset();
+
+      stats.n_frames += b.n_frames;
+      stats.n_blocks++;
+    }
+  });
+
+  return stats;
+}
+
+void nanots_writer::free_blocks(const std::string& file_name,
+                                const std::string& stream_tag,
+                                int64_t start_timestamp,
+                                int64_t end_timestamp) {
+  auto db = nanots_database::open(file_name);
+  auto conn = db->catalog(true);
+
+  nts_sqlite_transaction(*conn, [&](const nts_sqlite_conn& conn) {
+    // Find blocks that fall entirely within the deletion time range
+    auto stmt = conn.prepare(
+        "SELECT sb.id as segment_block_id, sb.block_id "
+        "FROM segment_blocks sb "
+        "JOIN segments s ON sb.segment_id = s.id "
+        "WHERE s.stream_tag = ? "
+        "AND sb.start_timestamp >= ? "
+        "AND sb.end_timestamp <= ? "
+        "AND sb.end_timestamp != 0");
+    auto blocks_to_delete =
+        stmt.bind(1, stream_tag).bind(2, start_timestamp).bind(3, end_timestamp).exec();
+
+    for (auto& block_row : blocks_to_delete) {
+      int64_t segment_block_id = std::stoll(block_row["segment_block_id"].value());
+      int64_t block_id = std::stoll(block_row["block_id"].value());
+
+      // Remove segment_block entry (trigger will clean up empty segments)
+      stmt = conn.prepare("DELETE FROM segment_blocks WHERE id = ?");
+      stmt.bind(1, segment_block_id).exec_no_result();
+
+      // Mark block as free
+      stmt = conn.prepare("UPDATE blocks SET status = 'free' WHERE id = ?");
+      stmt.bind(1, block_id).exec_no_result();
+    }
+  });
+
+  mirror_shipper::post_free(db.get(), stream_tag, start_timestamp, end_timestamp);
+}
+
+static void _write_file_header(FILE* f, uint32_t block_size, uint32_t n_blocks) {
+  nts_memory_map mm(
+      filenum(f), 0, 4096,
+      nts_memory_map::NMM_PROT_READ | nts_memory_map::NMM_PROT_WRITE,
+      nts_memory_map::NMM_TYPE_FILE | nts_memory_map::NMM_SHARED);
+
+  uint8_t* p = (uint8_t*)mm.map();
+
+  // write a file header
+  *(uint32_t*)p = block_size;
+  p += sizeof(uint32_t);
+  *(uint32_t*)p = n_blocks;
+  p += sizeof(uint32_t);
+
+  mm.flush(mm.map(), 8);
+}
+
+static void _create_catalog(const nts_sqlite_conn& db, uint32_t n_blocks) {
+  std::string query =
+      "CREATE TABLE blocks ("
+      "id INTEGER PRIMARY KEY AUTOINCREMENT, "
+      "idx INTEGER, "
+      "status STRING, "
+      "reserved_at DATETIME DEFAULT CURRENT_TIMESTAMP"
+      ");";
+  db.exec(query);
+
+  query =
+      "CREATE TABLE segments ("
+      "id INTEGER PRIMARY KEY AUTOINCREMENT, "
+      "stream_tag STRING, "
+      "metadata STRING "
+      ");";
+  db.exec(query);
+
+  query =
+      "CREATE TABLE segment_blocks ("
+      "id INTEGER PRIMARY KEY AUTOINCREMENT, "
+      "segment_id INTEGER, "
+      "sequence INTEGER, "
+      "block_id INTEGER, "
+      "block_idx INTEGER, "
+      "start_timestamp INTEGER, "
+      "end_timestamp INTEGER, "
+      "uuid STRING, "
+      "FOREIGN KEY (segment_id) REFERENCES segments(id)"
+      ");";
+  db.exec(query);
+
+  query =
+      "CREATE TRIGGER delete_empty_segments "
+      "AFTER DELETE ON segment_blocks "
+      "BEGIN "
+      "DELETE FROM segments "
+      "WHERE id = OLD.segment_id "
+      "AND NOT EXISTS ( "
+      "SELECT 1 FROM segment_blocks "
+      "WHERE segment_id = OLD.segment_id "
+      "); "
+      "END;";
+  db.exec(query);
+
+  query =
+      "CREATE INDEX idx_segment_blocks_segment_id ON "
+      "segment_blocks(segment_id);";
+  db.exec(query);
+
+  query =
+      "CREATE INDEX idx_segment_blocks_time_range ON segment_blocks(start_timestamp);";
+  db.exec(query);
+
+  query = "CREATE INDEX idx_segments_stream_tag ON segments(stream_tag);";
+  db.exec(query);
+
+  query = "CREATE INDEX idx_blocks_status ON blocks(status);";
+  db.exec(query);
+
+  nts_sqlite_transaction(db, [n_blocks](const nts_sqlite_conn& conn) {
+    auto stmt =
+        conn.prepare("INSERT INTO blocks (idx, status) VALUES (?, 'free')");
+    for (uint32_t i = 0; i < n_blocks; i++) {
+      stmt.bind(1, static_cast<int>(i)).exec_no_result();
+      stmt.reset();
+    }
+  });
+
+  _upgrade_db(db);
+}
+
+void nanots_writer::allocate(const std::string& file_name,
+                             uint32_t block_size,
+                             uint32_t n_blocks) {
+  // Windows MapViewOfFile() requires mapped regions to start and end on 64k
+  // boundaires. Our file header size is 65536, SO if the block size is a
+  // multiple of 65536 then block start and end on 64k boundaries.
+  block_size = _round_to_64k_boundary(block_size);
+
+  uint64_t file_size = FILE_HEADER_BLOCK_SIZE + static_cast<uint64_t>(n_blocks) * block_size;
+
+  {
+    auto f = nts_file::open(file_name, "w+");
+
+    if (fallocate(f, file_size) < 0)
+      throw nanots_exception(NANOTS_EC_UNABLE_TO_ALLOCATE_FILE, "Unable to allocate file.", __FILE__, __LINE__);
+  }
+
+  {
+    auto f = nts_file::open(file_name, "r+");
+    _write_file_header(f, block_size, n_blocks);
+  }
+
+  auto db_name = _database_name(file_name);
+
+  if (file_exists(db_name))
+    remove_file(db_name);
+
+  nts_sqlite_conn db(db_name.c_str(), true, true);
+  _create_catalog(db, n_blocks);
+}
+
+std::shared_ptr<nanots_database> nanots_database::create_in_memory(const std::string& name,
+                                                                   uint32_t block_size,
+                                                                   uint32_t n_blocks) {
+  block_size = _round_to_64k_boundary(block_size);
+
+  uint64_t file_size = FILE_HEADER_BLOCK_SIZE + static_cast<uint64_t>(n_blocks) * block_size;
+
+  // Held throughout so two creators of one name can't both succeed.
+  std::lock_guard<std::mutex> g(open_databases_lok);
+
+  auto found = memory_databases.find(name);
+  if (found != memory_databases.end() && !found->second.expired())
+    throw nanots_exception(NANOTS_EC_INVALID_ARGUMENT, "Memory database already exists.", __FILE__, __LINE__);
+
+  nts_file file;
+  try {
+    file = nts_file::open_anonymous("nanots:" + name, file_size);
+  } catch (const std::exception&) {
+    throw nanots_exception(NANOTS_EC_UNABLE_TO_ALLOCATE_FILE, "Unable to allocate memory database.", __FILE__, __LINE__);
+  }
+
+  _write_file_header(file, block_size, n_blocks);
+
+  // The catalog lives in SQLite's memdb VFS; names starting with '/' are shared
+  // by every connection in the process for as long as one of them is open.
+  auto db_name = "file:/nanots-" + generate_entropy_id() + "?vfs=memdb";
+  auto catalog = std::make_unique<nts_sqlite_conn>(db_name, true, false);
+  _create_catalog(*catalog, n_blocks);
+
+  std::shared_ptr<nanots_database> db(new nanots_database(name, std::move(file), db_name));
+  db->_memory_catalog = std::move(catalog);
+
+  memory_databases[name] = db;
+
+  _prune_databases(memory_databases);
+
+  return db;
+}
+
+void nanots_database::_load_sealed_catalog() {
+  auto catalog = std::make_unique<nts_sqlite_conn>(_db_name, true, false);
+  _create_catalog(*catalog, 0);
+
+  nts_sqlite_transaction(*catalog, [this](const nts_sqlite_conn& conn) {
+    auto segment_stmt =
+        conn.prepare("INSERT INTO segments (id, stream_tag, metadata) VALUES (?, ?, ?)");
+    auto block_stmt = conn.prepare(
+        "INSERT INTO segment_blocks (segment_id, sequence, block_idx, start_timestamp, "
+        "end_timestamp, uuid, start_ordinal, n_frames, max_gap, n_bytes, secondary_min, "
+        "secondary_max, key_bloom, n_values, value_min, value_max) "
+        "VALUES (?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?)");
+
+    auto bind_optional = [&](int index, const auto& v) {
+      if (v)
+        block_stmt.bind(index, *v);
+      else
+        block_stmt.bind_null(index);
+    };
+
+    for (auto& seg : _directory) {
+      segment_stmt.bind(1, seg.id).bind(2, seg.stream_tag).bind(3, seg.metadata).exec_no_result();
+      segment_stmt.reset();
+
+      for (auto& b : seg.blocks) {
+        block_stmt.bind(1, seg.id)
+            .bind(2, b.sequence)
+            .bind(3, b.block_idx)
+            .bind(4, b.start_timestamp)
+            .bind(5, b.end_timestamp)
+            .bind(6, entropy_id_to_s(b.uuid));
+        bind_optional(7, b.start_ordinal);
+        bind_optional(8, b.n_frames);
+        bind_optional(9, b.max_gap);
+        bind_optional(10, b.n_bytes);
+        bind_optional(11, b.secondary_min);
+        bind_optional(12, b.secondary_max);
+        bind_optional(13, b.key_bloom);
+        bind_optional(14, b.n_values);
+        bind_optional(15, b.value_min);
+        bind_optional(16, b.value_max);
+        block_stmt.exec_no_result();
+        block_stmt.reset();
+      }
+    }
+  });
+
+  _memory_catalog = std::move(catalog);
+}
+
+static std::optional<int64_t> _optional_int64(const std::optional<std::string>& v) {
+  if (!v)
+    return std::nullopt;
+  return std::stoll(*v);
+}
+
+static std::optional<double> _optional_double(const std::optional<std::string>& v) {
+  if (!v)
+    return std::nullopt;
+  return std::stod(*v);
+}
+
+void nanots_writer::seal(const std::string& file_name) {
+  auto db = nanots_database::open(file_name);
+
+  if (db->sealed())
+    throw nanots_exception(NANOTS_EC_INVALID_ARGUMENT, "Database is already sealed.", __FILE__, __LINE__);
+  if (db->in_memory())
+    throw nanots_exception(NANOTS_EC_INVALID_ARGUMENT, "In-memory databases can't be sealed.", __FILE__, __LINE__);
+
+  // Blocks a live writer has open would be closed out from under it.
+  {
+    std::lock_guard<std::mutex> g(current_stream_tags_lok);
+    auto prefix = db->file_name() + ":";
+    auto found = current_stream_tags.lower_bound(prefix);
+    if (found != current_stream_tags.end() && found->compare(0, prefix.size(), prefix) == 0)
+      throw nanots_exception(NANOTS_EC_INVALID_ARGUMENT, "Unable to seal a database with open writers.", __FILE__, __LINE__);
+  }
+
+  // Close out blocks a crashed writer left open so every block in the
+  // directory has its end timestamp and summaries.
+  _validate_blocks(*db);
+
+  std::vector<sealed_segment> segments;
+
+  {
+    auto conn = db->catalog();
+
+    auto results = conn->exec(
+        "SELECT s.id AS segment_id, s.stream_tag AS stream_tag, s.metadata AS metadata, "
+        "sb.sequence AS sequence, sb.block_idx AS block_idx, "
+        "sb.start_timestamp AS start_timestamp, sb.end_timestamp AS end_timestamp, "
+        "sb.uuid AS uuid, sb.start_ordinal AS start_ordinal, sb.n_frames AS n_frames, "
+        "sb.max_gap AS max_gap, sb.n_bytes AS n_bytes, sb.secondary_min AS secondary_min, "
+        "sb.secondary_max AS secondary_max, sb.key_bloom AS key_bloom, "
+        "sb.n_values AS n_values, sb.value_min AS value_min, sb.value_max AS value_max "
+        "FROM segments s "
+        "JOIN segment_blocks sb ON sb.segment_id = s.id "
+        "ORDER BY s.stream_tag ASC, s.id ASC, sb.sequence ASC;");
+
+    for (auto& row : results) {
+      int64_t segment_id = std::stoll(row["segment_id"].value());
+
+      if (segments.empty() || segments.back().id != segment_id) {
+        sealed_segment seg;
+        seg.id = segment_id;
+        seg.stream_tag = row["stream_tag"].value_or(std::string());
+        seg.metadata = row["metadata"].value_or(std::string());
+        segments.push_back(std::move(seg));
+      }
+
+      sealed_block b;
+      b.sequence = std::stoll(row["sequence"].value());
+      b.block_idx = std::stoll(row["block_idx"].value());
+      b.start_timestamp = std::stoll(row["start_timestamp"].value());
+      b.end_timestamp = std::stoll(row["end_timestamp"].value());
+      s_to_entropy_id(row["uuid"].value(), b.uuid);
+      b.start_ordinal = _optional_int64(row["start_ordinal"]);
+      b.n_frames = _optional_int64(row["n_frames"]);
+      b.max_gap = _optional_int64(row["max_gap"]);
+      b.n_bytes = _optional_int64(row["n_bytes"]);
+      b.secondary_min = _optional_int64(row["secondary_min"]);
+      b.secondary_max = _optional_int64(row["secondary_max"]);
+      b.key_bloom = row["key_bloom"];
+      b.n_values = _optional_int64(row["n_values"]);
+      b.value_min = _optional_double(row["value_min"]);
+      b.value_max = _optional_double(row["value_max"]);
+      segments.back().blocks.push_back(std::move(b));
+    }
+  }
+
+  auto directory = _build_directory(segments);
+
+  if (directory.size() > UINT32_MAX)
+    throw nanots_exception(NANOTS_EC_INVALID_ARGUMENT, "Catalog too large to seal.", __FILE__, __LINE__);
+
+  // The directory follows the last block, so it starts on a 64k boundary, and
+  // is padded so its mapping ends on one too.
+  uint64_t directory_offset = FILE_HEADER_BLOCK_SIZE + (uint64_t)db->n_blocks() * db->block_size();
+  uint64_t directory_size = directory.size();
+  uint32_t mapped_size = (uint32_t)(((directory_size + 65535) / 65536) * 65536);
+
+  {
+    auto f = nts_file::open(file_name, "r+");
+
+    if (fallocate(f, directory_offset + mapped_size) < 0)
+      throw nanots_exception(NANOTS_EC_UNABLE_TO_ALLOCATE_FILE, "Unable to allocate file.", __FILE__, __LINE__);
+
+    {
+      nts_memory_map mm(filenum(f), directory_offset, mapped_size,
+                        nts_memory_map::NMM_PROT_READ | nts_memory_map::NMM_PROT_WRITE,
+                        nts_memory_map::NMM_TYPE_FILE | nts_memory_map::NMM_SHARED);
+      memcpy(mm.map(), directory.data(), directory.size());
+      mm.flush(mm.map(), mapped_size, true);
+    }
+
+    // Only point the header at the directory once the directory is durable.
+    nts_memory_map mm(filenum(f), 0, 4096,
+                      nts_memory_map::NMM_PROT_READ | nts_memory_map::NMM_PROT_WRITE,
+                      nts_memory_map::NMM_TYPE_FILE | nts_memory_map::NMM_SHARED);
+    auto p = (uint8_t*)mm.map();
+    *(uint64_t*)(p + FILE_HEADER_DIRECTORY_OFFSET) = directory_offset;
+    *(uint64_t*)(p + FILE_HEADER_DIRECTORY_SIZE) = directory_size;
+    mm.flush(mm.map(), FILE_HEADER_DIRECTORY_SIZE + sizeof(uint64_t), true);
+  }
+
+  auto db_name = db->database_name();
+
+  // Later opens must see the sealed file rather than this handle.
+  db.reset();
+  {
+    std::lock_guard<std::mutex> g(open_databases_lok);
+    open_databases.erase(_open_databases_key(file_name));
+  }
+
+  for (auto& name : {db_name, db_name + "-wal", db_name + "-shm"}) {
+    if (file_exists(name))
+      remove_file(name);
+  }
+}
+
+backup_info nanots_writer::backup(const std::string& file_name, const std::string& backup_file_name) {
+  auto db = nanots_database::open(file_name);
+
+  if (db->sealed() || db->in_memory())
+    throw nanots_exception(NANOTS_EC_INVALID_ARGUMENT, "Only live on disk databases can be backed up.", __FILE__, __LINE__);
+
+  uint32_t block_size = db->block_size();
+  uint32_t n_blocks = db->n_blocks();
+  auto backup_db_name = _database_name(backup_file_name);
+  auto snapshot_name = backup_db_name + ".snapshot";
+
+  if (file_exists(snapshot_name))
+    remove_file(snapshot_name);
+
+  // VACUUM INTO copies the catalog as of a single read transaction, so the
+  // snapshot is consistent however busy the writers are.
+  {
+    auto conn = db->catalog();
+    conn->prepare("VACUUM INTO ?").bind(1, snapshot_name).exec_no_result();
+  }
+
+  // block_idx -> uuid of every block the previous backup has a complete copy of.
+  std::unordered_map<int64_t, std::string> previous;
+
+  bool incremental = file_exists(backup_file_name) && file_exists(backup_db_name) &&
+                     file_size(backup_file_name) >= FILE_HEADER_BLOCK_SIZE + (uint64_t)n_blocks * block_size;
+
+  if (incremental) {
+    auto f = nts_file::open(backup_file_name, "r");
+    nts_memory_map mm(filenum(f), 0, 4096, nts_memory_map::NMM_PROT_READ,
+                      nts_memory_map::NMM_TYPE_FILE | nts_memory_map::NMM_SHARED);
+    auto p = (const uint8_t*)mm.map();
+    incremental = (*(const uint32_t*)p == block_size) &&
+                  (*(const uint32_t*)(p + sizeof(uint32_t)) == n_blocks);
+  }
+
+  if (incremental) {
+    nts_sqlite_conn conn(backup_db_name, false, true);
+    auto results = conn.exec(
+        "SELECT block_idx, uuid FROM segment_blocks WHERE end_timestamp != 0;");
+    for (auto& row : results)
+      previous[std::stoll(row["block_idx"].value())] = row["uuid"].value();
+  } else {
+    auto f = nts_file::open(backup_file_name, "w+");
+
+    if (truncate_file(f, FILE_HEADER_BLOCK_SIZE + (uint64_t)n_blocks * block_size) < 0)
+      throw nanots_exception(NANOTS_EC_UNABLE_TO_ALLOCATE_FILE, "Unable to allocate file.", __FILE__, __LINE__);
+
+    _write_file_header(f, block_size, n_blocks);
+  }
+
+  backup_info info;
+
+  {
+    // VACUUM INTO leaves the copy in rollback journal mode; readers expect WAL.
+    nts_sqlite_conn snapshot(snapshot_name, true, true);
+
+    auto results = snapshot.exec("SELECT block_idx, uuid FROM segment_blocks;");
+
+    auto from = nts_file::open(file_name, "r");
+    auto to = nts_file::open(backup_file_name, "r+");
+
+    // Blocks reclaimed by a writer after the snapshot was taken.
+    std::vector<std::pair<int64_t, std::string>> stale;
+
+    for (auto& row : results) {
+      int64_t block_idx = std::stoll(row["block_idx"].value());
+      std::string uuid_hex = row["uuid"].value();
+
+      info.n_blocks++;
+
+      auto found = previous.find(block_idx);
+      if (found != previous.end() && found->second == uuid_hex)
+        continue;
+
+      uint64_t offset = FILE_HEADER_BLOCK_SIZE + (uint64_t)block_idx * block_size;
+
+      if (copy_file_bytes(from, offset, to, offset, block_size) < 0)
+        throw nanots_exception(NANOTS_EC_UNKNOWN, "Unable to copy block.", __FILE__, __LINE__);
+
+      info.n_blocks_copied++;
+
+      // A block that was recycled between the snapshot and the copy no longer
+      // holds the snapshot's frames.
+      uint8_t uuid[16];
+      s_to_entropy_id(uuid_hex, uuid);
+
+      nts_memory_map mm(filenum(to), offset, block_size, nts_memory_map::NMM_PROT_READ,
+                        nts_memory_map::NMM_TYPE_FILE | nts_memory_map::NMM_SHARED);
+      auto block_p = (const uint8_t*)mm.map();
+      uint32_t n_valid_indexes = *(const uint32_t*)(block_p + 8);
+
+      if (n_valid_indexes == 0 || !_frame_has_uuid(block_p, block_size, 0, uuid))
+        stale.emplace_back(block_idx, uuid_hex);
+    }
+
+    if (sync_file(to) < 0)
+      throw nanots_exception(NANOTS_EC_UNKNOWN, "Unable to sync backup.", __FILE__, __LINE__);
+
+    nts_sqlite_transaction(snapshot, [&](const nts_sqlite_conn& conn) {
+      for (auto& s : stale) {
+        auto stmt = conn.prepare("DELETE FROM segment_blocks WHERE block_idx = ? AND uuid = ?");
+        stmt.bind(1, s.first).bind(2, s.second).exec_no_result();
+        stmt = conn.prepare("UPDATE blocks SET status = 'free' WHERE idx = ?");
+        stmt.bind(1, s.first).exec_no_result();
+      }
+    });
+  }
+
+  // The blocks are durable; now swap in the catalog that describes them.
+  for (auto& name : {backup_db_name + "-wal", backup_db_name + "-shm"}) {
+    if (file_exists(name))
+      remove_file(name);
+  }
+  rename_file(snapshot_name, backup_db_name);
+
+  return info;
+}
+
+merge_stats nanots_writer::merge(const std::string& source_file_name, const std::string& file_name) {
+  auto source = nanots_database::open(source_file_name);
+  auto db = nanots_database::open(file_name);
+
+  if (source == db)
+    throw nanots_exception(NANOTS_EC_INVALID_ARGUMENT, "Unable to merge a database into itself.", __FILE__, __LINE__);
+
+  if (source->in_memory() || db->in_memory() || db->sealed() || !db->writable())
+    throw nanots_exception(NANOTS_EC_CANT_OPEN, "Unable to open file for merging.", __FILE__, __LINE__);
+
+  uint32_t block_size = db->block_size();
+
+  if (source->block_size() != block_size)
+    throw nanots_exception(NANOTS_EC_INVALID_ARGUMENT, "Databases have different block sizes.", __FILE__, __LINE__);
+
+  // Only finalized blocks are merged; in file order so the copy reads sequentially.
+  std::vector<std::map<std::string, std::optional<std::string>>> rows;
+  {
+    auto conn = source->catalog();
+    rows = conn->exec(
+        "SELECT s.stream_tag, s.metadata, sb.* "
+        "FROM segment_blocks sb "
+        "JOIN segments s ON sb.segment_id = s.id "
+        "WHERE sb.end_timestamp != 0 "
+        "ORDER BY sb.block_idx;");
+  }
+
+  {
+    std::lock_guard<std::mutex> g(current_stream_tags_lok);
+    for (auto& row : rows) {
+      if (current_stream_tags.count(db->file_name() + ":" + row["stream_tag"].value()))
+        throw nanots_exception(NANOTS_EC_DUPLICATE_STREAM_TAG, "Only one current writer per active stream tag.", __FILE__, __LINE__);
+    }
+  }
+
+  merge_stats stats;
+
+  if (rows.empty())
+    return stats;
+
+  // Reserve the destination blocks up front so writers can keep running.
+  std::vector<block> targets;
+  {
+    auto conn = db->catalog(true);
+    nts_sqlite_transaction(*conn, [&](const nts_sqlite_conn& conn) {
+      auto results = conn.prepare("SELECT id, idx FROM blocks WHERE status = 'free' ORDER BY idx LIMIT ?")
+                         .bind(1, (int64_t)rows.size())
+                         .exec();
+      if (results.size() < rows.size())
+        throw nanots_exception(NANOTS_EC_NO_FREE_BLOCKS, "Not enough free blocks to merge.", __FILE__, __LINE__);
+
+      auto stmt = conn.prepare("UPDATE blocks SET status = 'reserved', reserved_at = CURRENT_TIMESTAMP WHERE id = ?");
+      for (auto& row : results) {
+        targets.push_back(block{std::stoll(row["id"].value()), std::stoll(row["idx"].value())});
+        stmt.bind(1, targets.back().id).exec_no_result();
+        stmt.reset();
+      }
+    });
+  }
+
+  auto release = [&](const nts_sqlite_conn& conn, const block& target) {
+    auto stmt = conn.prepare("UPDATE blocks SET status = 'free' WHERE id = ?");
+    stmt.bind(1, target.id).exec_no_result();
+  };
+
+  try {
+    // Which source rows made it across intact.
+    std::vector<bool> verified(rows.size(), false);
+
+    {
+      auto from = nts_file::open(source_file_name, "r");
+      auto to = nts_file::open(file_name, "r+");
+
+      for (size_t i = 0; i < rows.size(); i++) {
+        uint64_t from_offset = FILE_HEADER_BLOCK_SIZE + (uint64_t)std::stoll(rows[i]["block_idx"].value()) * block_size;
+        uint64_t to_offset = FILE_HEADER_BLOCK_SIZE + (uint64_t)targets[i].idx * block_size;
+
+        if (copy_file_bytes(from, from_offset, to, to_offset, block_size) < 0)
+          throw nanots_exception(NANOTS_EC_UNKNOWN, "Unable to copy block.", __FILE__, __LINE__);
+      }
+
+      if (sync_file(to) < 0)
+        throw nanots_exception(NANOTS_EC_UNKNOWN, "Unable to sync file.", __FILE__, __LINE__);
+
+      // A source block recycled by a writer during the copy no longer holds
+      // the frames its row describes; it is left out.
+      for (size_t i = 0; i < rows.size(); i++) {
+        uint8_t uuid[16];
+        s_to_entropy_id(rows[i]["uuid"].value(), uuid);
+
+        nts_memory_map mm(filenum(to), FILE_HEADER_BLOCK_SIZE + (uint64_t)targets[i].idx * block_size, block_size,
+                          nts_memory_map::NMM_PROT_READ,
+                          nts_memory_map::NMM_TYPE_FILE | nts_memory_map::NMM_SHARED);
+        auto block_p = (const uint8_t*)mm.map();
+        uint32_t n_valid_indexes = *(const uint32_t*)(block_p + 8);
+        auto n_frames = _optional_int64(rows[i]["n_frames"]);
+
+        verified[i] = n_valid_indexes > 0 && ((uint64_t)n_valid_indexes * INDEX_ENTRY_SIZE) < block_size &&
+                      (!n_frames || *n_frames == n_valid_indexes) &&
+                      _frame_has_uuid(block_p, block_size, 0, uuid) &&
+                      _frame_has_uuid(block_p, block_size, n_valid_indexes - 1, uuid);
+      }
+    }
+
+    auto conn = db->catalog(true);
+
+    nts_sqlite_transaction(*conn, [&](const nts_sqlite_conn& conn) {
+      // Source segment id -> destination segment id.
+      std::map<int64_t, int64_t> segments;
+      // Ordinals are rebased per stream so they continue the destination's.
+      std::map<std::string, std::pair<int64_t, int64_t>> ordinal_bases;
+
+      for (size_t i = 0; i < rows.size(); i++) {
+        if (!verified[i])
+          continue;
+        auto& row = rows[i];
+        auto start_ordinal = _optional_int64(row["start_ordinal"]);
+        if (!start_ordinal)
+          continue;
+        auto& stream_tag = row["stream_tag"].value();
+        auto found = ordinal_bases.find(stream_tag);
+        if (found == ordinal_bases.end())
+          ordinal_bases[stream_tag] = {*start_ordinal, _db_next_ordinal(conn, stream_tag)};
+        else
+          found->second.first = std::min(found->second.first, *start_ordinal);
+      }
+
+      // Blocks come in file order, which says nothing about age once blocks
+      // have been recycled. Segments are created first, per stream in source
+      // segment order, so their ids stay chronological.
+      std::map<std::pair<std::string, int64_t>, std::string> source_segments;
+      for (size_t i = 0; i < rows.size(); i++) {
+        if (verified[i])
+          source_segments.emplace(
+              std::make_pair(rows[i]["stream_tag"].value(), (int64_t)std::stoll(rows[i]["segment_id"].value())),
+              rows[i]["metadata"].value_or(""));
+      }
+
+      for (auto& source_segment : source_segments) {
+        auto segment = _db_create_segment(conn, source_segment.first.first, source_segment.second);
+        segments[source_segment.first.second] = segment->id;
+        stats.n_segments++;
+      }
+
+      auto stmt = conn.prepare(
+          "INSERT INTO segment_blocks (segment_id, sequence, block_id, block_idx, "
+          "start_timestamp, end_timestamp, uuid, start_ordinal, n_frames, max_gap, n_bytes, "
+          "secondary_min, secondary_max, key_bloom, n_values, value_min, value_max) "
+          "VALUES (?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?)");
+      auto used_stmt = conn.prepare("UPDATE blocks SET status = 'used' WHERE id = ?");
+
+      auto bind_int64 = [&](int index, const std::optional<int64_t>& v) {
+        if (v)
+          stmt.bind(index, *v);
+        else
+          stmt.bind_null(index);
+      };
+      auto bind_double = [&](int index, const std::optional<double>& v) {
+        if (v)
+          stmt.bind(index, *v);
+        else
+          stmt.bind_null(index);
+      };
+
+      for (size_t i = 0; i < rows.size(); i++) {
+        auto& row = rows[i];
+        auto& target = targets[i];
+
+        if (!verified[i]) {
+          release(conn, target);
+          stats.n_blocks_skipped++;
+          continue;
+        }
+
+        auto& stream_tag = row["stream_tag"].value();
+        int64_t segment_id = segments.at(std::stoll(row["segment_id"].value()));
+
+        std::optional<int64_t> start_ordinal = _optional_int64(row["start_ordinal"]);
+        if (start_ordinal) {
+          auto& bases = ordinal_bases[stream_tag];
+          start_ordinal = bases.second + (*start_ordinal - bases.first);
+        }
+
+        auto n_frames = _optional_int64(row["n_frames"]);
+
+        stmt.bind(1, segment_id)
+            .bind(2, (int64_t)std::stoll(row["sequence"].value()))
+            .bind(3, target.id)
+            .bind(4, target.idx)
+            .bind(5, (int64_t)std::stoll(row["start_timestamp"].value()))
+            .bind(6, (int64_t)std::stoll(row["end_timestamp"].value()))
+            .bind(7, row["uuid"].value());
+        bind_int64(8, start_ordinal);
+        bind_int64(9, n_frames);
+        bind_int64(10, _optional_int64(row["max_gap"]));
+        bind_int64(11, _optional_int64(row["n_bytes"]));
+        bind_int64(12, _optional_int64(row["secondary_min"]));
+        bind_int64(13, _optional_int64(row["secondary_max"]));
+        if (row["key_bloom"])
+          stmt.bind(14, row["key_bloom"].value());
+        else
+          stmt.bind_null(14);
+        bind_int64(15, _optional_int64(row["n_values"]));
+        bind_double(16, _optional_double(row["value_min"]));
+        bind_double(17, _optional_double(row["value_max"]));
+        stmt.exec_no_result();
+        stmt.reset();
+
+        used_stmt.bind(1, target.id).exec_no_result();
+        used_stmt.reset();
+
+        stats.n_blocks++;
+        stats.n_frames += (n_frames) ? *n_frames : 0;
+      }
+    });
+  } catch (...) {
+    auto conn = db->catalog(true);
+    nts_sqlite_transaction(*conn, [&](const nts_sqlite_conn& conn) {
+      for (auto& target : targets)
+        release(conn, target);
+    });
+    throw;
+  }
+
+  return stats;
+}
+
+nanots_reader::nanots_reader(const std::string& file_name)
+    : nanots_reader(nanots_database::open(file_name)) {
+}
+
+nanots_reader::nanots_reader(std::shared_ptr<nanots_database> db)
+    : _db(std::move(db)),
+      _block_size(_db->block_size()) {
+}
+
+static int _compare_index_entry_timestamp(uint8_t* index_entry_p,
+                                          uint8_t* target_timestamp_p) {
+  int64_t entry_timestamp = *(int64_t*)index_entry_p;
+  int64_t target_timestamp = *(int64_t*)target_timestamp_p;
+
+  if (entry_timestamp < target_timestamp)
+    return -1;
+  if (entry_timestamp > target_timestamp)
+    return 1;
+  return 0;
+}
+
+void nanots_reader::read(
+    const std::string& stream_tag,
+    int64_t start_timestamp,
+    int64_t end_timestamp,
+    const std::function<
+        void(const uint8_t*, size_t, uint8_t, int64_t, int64_t, const std::string&)>& callback) {
+  bool need_binary_search = true;
+
+  // Returns false once a frame past end_timestamp is reached.
+  auto read_block = [&](const std::string& metadata, int64_t block_sequence,
+                        int64_t block_idx, const uint8_t* uuid) {
+    auto mm = _db->map_block(block_idx);
+
+    auto block_p = (uint8_t*)mm->map();
+
+    auto valid_counter = (uint32_t*)(block_p + 8);
+
+#ifdef _WIN32
+    uint32_t n_valid_indexes = *reinterpret_cast<volatile uint32_t*>(valid_counter);
+    _ReadWriteBarrier(); // compiler barrier (not mem)
+#else
+    uint32_t n_valid_indexes = __atomic_load_n(valid_counter, std::memory_order_acquire);
+#endif
+
+    uint8_t* index_start = block_p + BLOCK_HEADER_SIZE;
+    uint8_t* index_end = index_start + (n_valid_indexes * INDEX_ENTRY_SIZE);
+
+    int64_t start_index = 0;
+
+    if (need_binary_search) {
+      uint8_t* first_entry =
+          lower_bound_bytes(index_start, index_end, (uint8_t*)&start_timestamp,
+                            INDEX_ENTRY_SIZE, _compare_index_entry_timestamp);
+
+      start_index = (first_entry - index_start) / INDEX_ENTRY_SIZE;
+      need_binary_search = false;
+    }
+
+    // Iterate through frames in this block
+    for (size_t i = start_index; i < n_valid_indexes; i++) {
+      uint8_t* index_p = block_p + BLOCK_HEADER_SIZE + (i * INDEX_ENTRY_SIZE);
+      int64_t timestamp = *(int64_t*)index_p;
+      uint64_t offset = *(uint64_t*)(index_p + 8);
+
+      // Check if we've passed the end time
+      if (timestamp > end_timestamp)
+        return false;  // All done!
+
+      // Validate frame header
+      uint8_t flags;
+      uint32_t frame_size;
+      if (!_validate_frame_header(block_p + offset, uuid, &flags,
+                                  &frame_size)) {
+        // Log warning? Skip corrupted frame
+        continue;
+      }
+
+      // Callback with frame data
+      callback(block_p + offset + FRAME_HEADER_SIZE, (size_t)frame_size, flags,
+               timestamp, block_sequence, metadata);
+    }
+
+    return true;
+  };
+
+  // Sealed files answer from their directory without touching SQLite.
+  if (_db->sealed()) {
+    std::vector<std::pair<const sealed_segment*, const sealed_block*>> blocks;
+
+    auto range = _sealed_stream(_db->directory(), stream_tag);
+    for (auto seg = range.first; seg != range.second; ++seg) {
+      for (auto& b : seg->blocks) {
+        if (b.start_timestamp <= end_timestamp &&
+            (b.end_timestamp >= start_timestamp || b.end_timestamp == 0))
+          blocks.emplace_back(&*seg, &b);
+      }
+    }
+
+    // Directory order is already stream order: segments by id, then blocks by
+    // sequence (which restarts in every segment).
+    for (auto& found : blocks) {
+      if (!read_block(found.first->metadata, found.second->sequence, found.second->block_idx,
+                      found.second->uuid))
+        return;
+    }
+
+    return;
+  }
+
+  auto db = _db->catalog();
+
+  auto stmt = db->prepare(
+      "SELECT "
+      "s.metadata as metadata, "
+      "sb.sequence as block_sequence, "
+      "sb.block_idx as block_idx, "
+      "sb.start_timestamp as block_start_timestamp, "
+      "sb.end_timestamp as block_end_timestamp, "
+      "sb.uuid as uuid "
+      "FROM segments s "
+      "JOIN segment_blocks sb ON sb.segment_id = s.id "
+      "WHERE s.stream_tag = ? "
+      "AND sb.start_timestamp <= ? "
+      "AND (sb.end_timestamp >= ? OR sb.end_timestamp = 0) "
+      "ORDER BY s.id ASC, sb.sequence ASC;");
+  auto results =
+      stmt.bind(1, stream_tag).bind(2, end_timestamp).bind(3, start_timestamp).exec();
+
+  for (auto& row : results) {
+    std::string metadata = (row["metadata"])?row["metadata"].value():std::string();
+    int64_t block_sequence = std::stoll(row["block_sequence"].value());
+    int64_t block_idx = std::stoll(row["block_idx"].value());
+    std::string uuid_hex = row["uuid"].value();
+
+    uint8_t uuid[16];
+    s_to_entropy_id(uuid_hex, uuid);
+
+    if (!read_block(metadata, block_sequence, block_idx, uuid))
+      return;
+  }
+}
+
+void nanots_reader::read_key(
+    const std::string& stream_tag,
+    const std::string& key,
+    const frame_key_extractor& key_extractor,
+    int64_t start_timestamp,
+    int64_t end_timestamp,
+    const std::function<
+        void(const uint8_t*, size_t, uint8_t, int64_t, int64_t, const std::string&)>& callback) {
+  if (key.empty() || !key_extractor)
+    throw nanots_exception(NANOTS_EC_INVALID_ARGUMENT, "A key and key extractor are required.", __FILE__, __LINE__);
+
+  uint64_t key_hash = _key_hash(key);
+
+  auto db = _db->catalog();
+
+  auto stmt = db->prepare(
+      "SELECT "
+      "s.metadata as metadata, "
+      "sb.sequence as block_sequence, "
+      "sb.block_idx as block_idx, "
+      "sb.uuid as uuid, "
+      "sb.key_bloom as key_bloom "
+      "FROM segments s "
+      "JOIN segment_blocks sb ON sb.segment_id = s.id "
+      "WHERE s.stream_tag = ? "
+      "AND sb.start_timestamp <= ? "
+      "AND (sb.end_timestamp >= ? OR sb.end_timestamp = 0) "
+      "ORDER BY s.id ASC, sb.sequence ASC;");
+  auto results =
+      stmt.bind(1, stream_tag).bind(2, end_timestamp).bind(3, start_timestamp).exec();
+
+  for (auto& row : results) {
+    if (row["key_bloom"] && !_key_bloom_may_contain(row["key_bloom"].value(), key_hash))
+      continue;
+
+    std::string metadata = (row["metadata"])?row["metadata"].value():std::string();
+    int64_t block_sequence = std::stoll(row["block_sequence"].value());
+    int64_t block_idx = std::stoll(row["block_idx"].value());
+    std::string uuid_hex = row["uuid"].value();
+
+    uint8_t uuid[16];
+    s_to_entropy_id(uuid_hex, uuid);
+
+    auto mm = _db->map_block(block_idx);
+
+    auto block_p = (uint8_t*)mm->map();
+
+    auto valid_counter = (uint32_t*)(block_p + 8);
+
+#ifdef _WIN32
+    uint32_t n_valid_indexes = *reinterpret_cast<volatile uint32_t*>(valid_counter);
+    _ReadWriteBarrier(); // compiler barrier (not mem)
+#else
+    uint32_t n_valid_indexes = __atomic_load_n(valid_counter, std::memory_order_acquire);
+#endif
+
+    uint8_t* index_start = block_p + BLOCK_HEADER_SIZE;
+    uint8_t* index_end = index_start + (n_valid_indexes * INDEX_ENTRY_SIZE);
+
+    uint8_t* first_entry =
+        lower_bound_bytes(index_start, index_end, (uint8_t*)&start_timestamp,
+                          INDEX_ENTRY_SIZE, _compare_index_entry_timestamp);
+
+    for (uint8_t* index_p = first_entry; index_p < index_end; index_p += INDEX_ENTRY_SIZE) {
+      int64_t timestamp = *(int64_t*)index_p;
+      uint64_t offset = *(uint64_t*)(index_p + 8);
+
+      if (timestamp > end_timestamp)
+        return;
+
+      uint8_t flags;
+      uint32_t frame_size;
+      if (!_validate_frame_header(block_p + offset, uuid, &flags, &frame_size))
+        continue;
+
+      // The filter only says the key may be present, so every frame is checked.
+      const uint8_t* data = block_p + offset + FRAME_HEADER_SIZE;
+      if (key_extractor(data, (size_t)frame_size) != key)
+        continue;
+
+      callback(data, (size_t)frame_size, flags, timestamp, block_sequence, metadata);
+    }
+  }
+}
+
+void nanots_reader::read_where(
+    const std::string& stream_tag,
+    const frame_value_extractor& value_extractor,
+    double min_value,
+    double max_value,
+    int64_t start_timestamp,
+    int64_t end_timestamp,
+    const std::function<
+        void(const uint8_t*, size_t, uint8_t, int64_t, int64_t, const std::string&)>& callback) {
+  if (!value_extractor || std::isnan(min_value) || std::isnan(max_value))
+    throw nanots_exception(NANOTS_EC_INVALID_ARGUMENT, "A value extractor and value range are required.", __FILE__, __LINE__);
+
+  auto db = _db->catalog();
+
+  // Blocks with a summary are pruned here; only blocks that may hold a
+  // matching value are returned.
+  auto stmt = db->prepare(
+      "SELECT "
+      "s.metadata as metadata, "
+      "sb.sequence as block_sequence, "
+      "sb.block_idx as block_idx, "
+      "sb.uuid as uuid "
+      "FROM segments s "
+      "JOIN segment_blocks sb ON sb.segment_id = s.id "
+      "WHERE s.stream_tag = ? "
+      "AND sb.start_timestamp <= ? "
+      "AND (sb.end_timestamp >= ? OR sb.end_timestamp = 0) "
+      "AND (sb.n_values IS NULL OR (sb.n_values > 0 AND sb.value_max >= ? AND sb.value_min <= ?)) "
+      "ORDER BY s.id ASC, sb.sequence ASC;");
+  auto results = stmt.bind(1, stream_tag)
+                     .bind(2, end_timestamp)
+                     .bind(3, start_timestamp)
+                     .bind(4, min_value)
+                     .bind(5, max_value)
+                     .exec();
+
+  for (auto& row : results) {
+    std::string metadata = (row["metadata"])?row["metadata"].value():std::string();
+    int64_t block_sequence = std::stoll(row["block_sequence"].value());
+    int64_t block_idx = std::stoll(row["block_idx"].value());
+    std::string uuid_hex = row["uuid"].value();
+
+    uint8_t uuid[16];
+    s_to_entropy_id(uuid_hex, uuid);
+
+    auto mm = _db->map_block(block_idx);
+
+    auto block_p = (uint8_t*)mm->map();
+
+    auto valid_counter = (uint32_t*)(block_p + 8);
+
+#ifdef _WIN32
+    uint32_t n_valid_indexes = *reinterpret_cast<volatile uint32_t*>(valid_counter);
+    _ReadWriteBarrier(); // compiler barrier (not mem)
+#else
+    uint32_t n_valid_indexes = __atomic_load_n(valid_counter, std::memory_order_acquire);
+#endif
+
+    uint8_t* index_start = block_p + BLOCK_HEADER_SIZE;
+    uint8_t* index_end = index_start + (n_valid_indexes * INDEX_ENTRY_SIZE);
+
+    uint8_t* first_entry =
+        lower_bound_bytes(index_start, index_end, (uint8_t*)&start_timestamp,
+                          INDEX_ENTRY_SIZE, _compare_index_entry_timestamp);
+
+    for (uint8_t* index_p = first_entry; index_p < index_end; index_p += INDEX_ENTRY_SIZE) {
+      int64_t timestamp = *(int64_t*)index_p;
+      uint64_t offset = *(uint64_t*)(index_p + 8);
+
+      if (timestamp > end_timestamp)
+        return;
+
+      uint8_t flags;
+      uint32_t frame_size;
+      if (!_validate_frame_header(block_p + offset, uuid, &flags, &frame_size))
+        continue;
+
+      const uint8_t* data = block_p + offset + FRAME_HEADER_SIZE;
+      auto value = value_extractor(data, (size_t)frame_size);
+      if (!value || !(*value >= min_value && *value <= max_value))
+        continue;
+
+      callback(data, (size_t)frame_size, flags, timestamp, block_sequence, metadata);
+    }
+  }
+}
+
+void nanots_reader::read_ranges(
+    const std::string& stream_tag,
+    std::vector<std::pair<int64_t, int64_t>> ranges,
+    const std::function<
+        void(const uint8_t*, size_t, uint8_t, int64_t, int64_t, const std::string&)>& callback) {
+  ranges.erase(std::remove_if(ranges.begin(), ranges.end(),
+                              [](const std::pair<int64_t, int64_t>& r) { return r.first > r.second; }),
+               ranges.end());
+
+  if (ranges.empty())
+    return;
+
+  std::sort(ranges.begin(), ranges.end());
+
+  // Coalesce overlapping and touching ranges so no frame is delivered twice.
+  std::vector<std::pair<int64_t, int64_t>> merged;
+  for (auto& r : ranges) {
+    if (!merged.empty() &&
+        (merged.back().second == INT64_MAX || r.first <= merged.back().second + 1))
+      merged.back().second = std::max(merged.back().second, r.second);
+    else
+      merged.push_back(r);
+  }
+
+  // Each query returns every block that overlaps at least one range of its
+  // batch. Batches keep the bound parameters under SQLite's limit; a block hit
+  // by several of them is only kept once, in stream order.
+  std::map<std::pair<int64_t, int64_t>, std::map<std::string, std::optional<std::string>>> blocks;
+
+  auto db = _db->catalog();
+
+  for (size_t first = 0; first < merged.size(); first += MAX_RANGES_PER_QUERY) {
+    size_t n = std::min(MAX_RANGES_PER_QUERY, merged.size() - first);
+
+    std::string values;
+    for (size_t i = 0; i < n; i++)
+      values += (i == 0) ? "(?, ?)" : ", (?, ?)";
+
+    auto stmt = db->prepare(
+        "WITH ranges(range_start, range_end) AS (VALUES " + values + ") "
+        "SELECT DISTINCT "
+        "s.id as segment_id, "
+        "s.metadata as metadata, "
+        "sb.sequence as block_sequence, "
+        "sb.block_idx as block_idx, "
+        "sb.start_timestamp as block_start_timestamp, "
+        "sb.end_timestamp as block_end_timestamp, "
+        "sb.uuid as uuid "
+        "FROM segments s "
+        "JOIN segment_blocks sb ON sb.segment_id = s.id "
+        "JOIN ranges r ON sb.start_timestamp <= r.range_end "
+        "AND (sb.end_timestamp >= r.range_start OR sb.end_timestamp = 0) "
+        "WHERE s.stream_tag = ?;");
+
+    int param = 1;
+    for (size_t i = first; i < first + n; i++) {
+      stmt.bind(param++, merged[i].first);
+      stmt.bind(param++, merged[i].second);
+    }
+    stmt.bind(param, stream_tag);
+
+    for (auto& row : stmt.exec()) {
+      auto key = std::make_pair((int64_t)std::stoll(row["segment_id"].value()),
+                                (int64_t)std::stoll(row["block_sequence"].value()));
+      blocks.emplace(key, std::move(row));
+    }
+  }
+
+  for (auto& entry : blocks) {
+    auto& row = entry.second;
+    std::string metadata = (row["metadata"])?row["metadata"].value():std::string();
+    int64_t block_sequence = std::stoll(row["block_sequence"].value());
+    int64_t block_idx = std::stoll(row["block_idx"].value());
+    int64_t block_start_timestamp = std::stoll(row["block_start_timestamp"].value());
+    int64_t block_end_timestamp = std::stoll(row["block_end_timestamp"].value());
+    std::string uuid_hex = row["uuid"].value();
+
+    uint8_t uuid[16];
+    s_to_entropy_id(uuid_hex, uuid);
+
+    auto mm = _db->map_block(block_idx);
+
+    auto block_p = (uint8_t*)mm->map();
+
+    auto valid_counter = (uint32_t*)(block_p + 8);
+
+#ifdef _WIN32
+    uint32_t n_valid_indexes = *reinterpret_cast<volatile uint32_t*>(valid_counter);
+    _ReadWriteBarrier(); // compiler barrier (not mem)
+#else
+    uint32_t n_valid_indexes = __atomic_load_n(valid_counter, std::memory_order_acquire);
+#endif
+
+    uint8_t* index_start = block_p + BLOCK_HEADER_SIZE;
+    uint8_t* index_end = index_start + (n_valid_indexes * INDEX_ENTRY_SIZE);
+
+    // The first range that doesn't end before the block.
+    auto first_range = std::lower_bound(
+        merged.begin(), merged.end(), block_start_timestamp,
+        [](const std::pair<int64_t, int64_t>& r, int64_t timestamp) { return r.second < timestamp; });
+
+    for (auto it = first_range; it != merged.end(); ++it) {
+      auto& r = *it;
+      if (block_end_timestamp != 0 && r.first > block_end_timestamp)
+        break;
+
+      int64_t range_start = r.first;
+      uint8_t* first_entry =
+          lower_bound_bytes(index_start, index_end, (uint8_t*)&range_start,
+                            INDEX_ENTRY_SIZE, _compare_index_entry_timestamp);
+
+      for (uint8_t* index_p = first_entry; index_p < index_end; index_p += INDEX_ENTRY_SIZE) {
+        int64_t timestamp = *(int64_t*)index_p;
+        uint64_t offset = *(uint64_t*)(index_p + 8);
+
+        if (timestamp > r.second)
+          break;
+
+        uint8_t flags;
+        uint32_t frame_size;
+        if (!_validate_frame_header(block_p + offset, uuid, &flags, &frame_size))
+          continue;
+
+        callback(block_p + offset + FRAME_HEADER_SIZE, (size_t)frame_size, flags,
+                 timestamp, block_sequence, metadata);
+      }
+    }
+  }
+}
+
+// One stream's frames, in order, for nanots_reader::read_group().
+class group_cursor final {
+ public:
+  struct block_ref {
+    int64_t block_sequence;
+    int64_t block_idx;
+    uint8_t uuid[16];
+  };
+
+  std::vector<block_ref> blocks;
+  frame_info frame;
+
+  // Moves to the first frame at or after timestamp. Returns false at the end.
+  bool seek(nanots_database& db, int64_t timestamp) {
+    while (true) {
+      if (!_block_p || _i >= _n_valid_indexes) {
+        if (_next_block == blocks.size())
+          return false;
+        _block = &blocks[_next_block++];
+        _mm = db.map_block(_block->block_idx);
+        _block_p = (uint8_t*)_mm->map();
+        auto valid_counter = (uint32_t*)(_block_p + 8);
+#ifdef _WIN32
+        _n_valid_indexes = *reinterpret_cast<volatile uint32_t*>(valid_counter);
+        _ReadWriteBarrier(); // compiler barrier (not mem)
+#else
+        _n_valid_indexes = __atomic_load_n(valid_counter, std::memory_order_acquire);
+#endif
+        _i = 0;
+        continue;
+      }
+
+      uint8_t* index_start = _block_p + BLOCK_HEADER_SIZE;
+      uint8_t* first_entry = lower_bound_bytes(index_start + (_i * INDEX_ENTRY_SIZE),
+                                               index_start + (_n_valid_indexes * INDEX_ENTRY_SIZE),
+                                               (uint8_t*)&timestamp, INDEX_ENTRY_SIZE,
+                                               _compare_index_entry_timestamp);
+      _i = (uint32_t)((first_entry - index_start) / INDEX_ENTRY_SIZE);
+      if (_i >= _n_valid_indexes)
+        continue;
+
+      uint64_t offset = *(uint64_t*)(first_entry + 8);
+      uint8_t flags;
+      uint32_t frame_size;
+      if (!_validate_frame_header(_block_p + offset, _block->uuid, &flags, &frame_size)) {
+        _i++;
+        continue;
+      }
+
+      frame.data = _block_p + offset + FRAME_HEADER_SIZE;
+      frame.size = frame_size;
+      frame.flags = flags;
+      frame.timestamp = *(int64_t*)first_entry;
+      frame.block_sequence = _block->block_sequence;
+      return true;
+    }
+  }
+
+ private:
+  size_t _next_block{0};
+  const block_ref* _block{nullptr};
+  std::shared_ptr<nts_memory_map> _mm;
+  uint8_t* _block_p{nullptr};
+  uint32_t _n_valid_indexes{0};
+  uint32_t _i{0};
+};
+
+void nanots_reader::read_group(
+    const std::vector<std::string>& stream_tags,
+    int64_t start_timestamp,
+    int64_t end_timestamp,
+    const std::function<void(int64_t, const std::vector<frame_info>&)>& callback) {
+  if (stream_tags.empty())
+    return;
+
+  if (std::set<std::string>(stream_tags.begin(), stream_tags.end()).size() != stream_tags.size())
+    throw nanots_exception(NANOTS_EC_INVALID_ARGUMENT, "A group lists a stream tag twice.", __FILE__, __LINE__);
+
+  std::vector<group_cursor> cursors(stream_tags.size());
+
+  auto add_block = [&](size_t stream, int64_t block_sequence, int64_t block_idx, const uint8_t* uuid) {
+    group_cursor::block_ref ref;
+    ref.block_sequence = block_sequence;
+    ref.block_idx = block_idx;
+    memcpy(ref.uuid, uuid, 16);
+    cursors[stream].blocks.push_back(ref);
+  };
+
+  if (_db->sealed()) {
+    for (size_t s = 0; s < stream_tags.size(); s++) {
+      // The directory lists a stream's segments and blocks in stream order;
+      // sequences restart in every segment.
+      auto range = _sealed_stream(_db->directory(), stream_tags[s]);
+      for (auto seg = range.first; seg != range.second; ++seg) {
+        for (auto& b : seg->blocks) {
+          if (b.start_timestamp <= end_timestamp &&
+              (b.end_timestamp >= start_timestamp || b.end_timestamp == 0))
+            add_block(s, b.sequence, b.block_idx, b.uuid);
+        }
+      }
+    }
+  } else {
+    // The blocks of every stream in the group come from one query.
+    std::string placeholders;
+    for (size_t s = 0; s < stream_tags.size(); s++)
+      placeholders += (s == 0) ? "?" : ", ?";
+
+    auto db = _db->catalog();
+    auto stmt = db->prepare(
+        "SELECT "
+        "s.stream_tag as stream_tag, "
+        "sb.sequence as block_sequence, "
+        "sb.block_idx as block_idx, "
+        "sb.uuid as uuid "
+        "FROM segments s "
+        "JOIN segment_blocks sb ON sb.segment_id = s.id "
+        "WHERE s.stream_tag IN (" + placeholders + ") "
+        "AND sb.start_timestamp <= ? "
+        "AND (sb.end_timestamp >= ? OR sb.end_timestamp = 0) "
+        "ORDER BY s.id ASC, sb.sequence ASC;");
+
+    int param = 1;
+    for (auto& stream_tag : stream_tags)
+      stmt.bind(param++, stream_tag);
+    stmt.bind(param, end_timestamp).bind(param + 1, start_timestamp);
+
+    std::map<std::string, size_t> streams;
+    for (size_t s = 0; s < stream_tags.size(); s++)
+      streams.emplace(stream_tags[s], s);
+
+    for (auto& row : stmt.exec()) {
+      uint8_t uuid[16];
+      s_to_entropy_id(row["uuid"].value(), uuid);
+      add_block(streams[row["stream_tag"].value()], std::stoll(row["block_sequence"].value()),
+                std::stoll(row["block_idx"].value()), uuid);
+    }
+  }
+
+  // Merge join on timestamp: a group is complete when every stream has a frame
+  // at the same timestamp. Incomplete groups are skipped.
+  std::vector<frame_info> frames(stream_tags.size());
+  int64_t timestamp = start_timestamp;
+
+  while (true) {
+    bool aligned = true;
+    for (auto& cursor : cursors) {
+      if (!cursor.seek(*_db, timestamp) || cursor.frame.timestamp > end_timestamp)
+        return;
+      if (cursor.frame.timestamp != timestamp) {
+        timestamp = cursor.frame.timestamp;
+        aligned = false;
+        break;
+      }
+    }
+
+    if (!aligned)
+      continue;
+
+    for (size_t s = 0; s < cursors.size(); s++)
+      frames[s] = cursors[s].frame;
+    callback(timestamp, frames);
+
+    if (timestamp == end_timestamp)
+      return;
+    timestamp++;
+  }
+}
+
+std::vector<gap> nanots_reader::find_gaps(const std::string& stream_tag,
+                                          int64_t start_timestamp,
+                                          int64_t end_timestamp,
+                                          int64_t min_gap) {
+  std::vector<gap> gaps;
+
+  auto db = _db->catalog();
+
+  // The blocks overlapping the window, plus the blocks on either side of it so
+  // gaps that straddle the window edges are seen too.
+  auto stmt = db->prepare(
+      "SELECT * FROM ( "
+      "  SELECT sb.block_idx, sb.start_timestamp, sb.end_timestamp, sb.max_gap "
+      "  FROM segment_blocks sb JOIN segments s ON sb.segment_id = s.id "
+      "  WHERE s.stream_tag = ? AND sb.end_timestamp != 0 AND sb.end_timestamp < ? "
+      "  ORDER BY sb.end_timestamp DESC LIMIT 1 "
+      ") UNION SELECT * FROM ( "
+      "  SELECT sb.block_idx, sb.start_timestamp, sb.end_timestamp, sb.max_gap "
+      "  FROM segment_blocks sb JOIN segments s ON sb.segment_id = s.id "
+      "  WHERE s.stream_tag = ? AND sb.start_timestamp <= ? "
+      "  AND (sb.end_timestamp >= ? OR sb.end_timestamp = 0) "
+      ") UNION SELECT * FROM ( "
+      "  SELECT sb.block_idx, sb.start_timestamp, sb.end_timestamp, sb.max_gap "
+      "  FROM segment_blocks sb JOIN segments s ON sb.segment_id = s.id "
+      "  WHERE s.stream_tag = ? AND sb.start_timestamp > ? "
+      "  ORDER BY sb.start_timestamp ASC LIMIT 1 "
+      ") ORDER BY start_timestamp ASC;");
+
+  auto results = stmt.bind(1, stream_tag)
+                     .bind(2, start_timestamp)
+                     .bind(3, stream_tag)
+                     .bind(4, end_timestamp)
+                     .bind(5, start_timestamp)
+                     .bind(6, stream_tag)
+                     .bind(7, end_timestamp)
+                     .exec();
+
+  auto report = [&](int64_t before, int64_t after) {
+    if (after - before > min_gap && after > start_timestamp && before < end_timestamp)
+      gaps.push_back({before, after});
+  };
+
+  std::optional<int64_t> last_timestamp;
+
+  for (auto& row : results) {
+    int64_t block_idx = std::stoll(row["block_idx"].value());
+    int64_t block_start = std::stoll(row["start_timestamp"].value());
+    int64_t block_end = std::stoll(row["end_timestamp"].value());
+
+    if (last_timestamp)
+      report(last_timestamp.value(), block_start);
+
+    // A finalized block can only hide a gap if its recorded max gap (or, for
+    // blocks written before max_gap existed, its whole span) is big enough.
+    bool finalized = block_end != 0;
+    bool may_have_gap = true;
+    if (finalized) {
+      int64_t bound = (row["max_gap"]) ? std::stoll(row["max_gap"].value()) : block_end - block_start;
+      may_have_gap = bound > min_gap && block_start < end_timestamp && block_end > start_timestamp;
+    }
+
+    if (!may_have_gap) {
+      last_timestamp = block_end;
+      continue;
+    }
+
+    // Only the index region is read, never the frames.
+    auto mm = _db->map_block(block_idx);
+    auto block_p = (uint8_t*)mm->map();
+
+    auto valid_counter = (uint32_t*)(block_p + 8);
+
+#ifdef _WIN32
+    uint32_t n_valid_indexes = *reinterpret_cast<volatile uint32_t*>(valid_counter);
+    _ReadWriteBarrier(); // compiler barrier (not mem)
+#else
+    uint32_t n_valid_indexes = __atomic_load_n(valid_counter, std::memory_order_acquire);
+#endif
+
+    if (n_valid_indexes == 0)
+      continue;
+
+    uint8_t* index_start = block_p + BLOCK_HEADER_SIZE;
+    uint8_t* index_end = index_start + (n_valid_indexes * INDEX_ENTRY_SIZE);
+
+    // Start at the last entry before the window so a gap crossing its start is seen.
+    int64_t window_start = start_timestamp;
+    uint8_t* index_p =
+        lower_bound_bytes(index_start, index_end, (uint8_t*)&window_start,
+                          INDEX_ENTRY_SIZE, _compare_index_entry_timestamp);
+    if (index_p > index_start)
+      index_p -= INDEX_ENTRY_SIZE;
+
+    int64_t previous = *(int64_t*)index_p;
+    for (index_p += INDEX_ENTRY_SIZE; index_p < index_end; index_p += INDEX_ENTRY_SIZE) {
+      int64_t timestamp = *(int64_t*)index_p;
+      report(previous, timestamp);
+      previous = timestamp;
+      if (timestamp > end_timestamp)
+        break;
+    }
+
+    last_timestamp = *(int64_t*)(index_end - INDEX_ENTRY_SIZE);
+  }
+
+  return gaps;
+}
+
+std::vector<size_bucket> nanots_reader::size_histogram(const std::string& stream_tag,
+                                                      int64_t start_timestamp,
+                                                      int64_t end_timestamp,
+                                                      int64_t bucket_size) {
+  if (bucket_size <= 0 || end_timestamp < start_timestamp)
+    throw nanots_exception(NANOTS_EC_INVALID_ARGUMENT, "Invalid histogram range or bucket size.", __FILE__, __LINE__);
+
+  // The span of the range can exceed INT64_MAX, so offsets from
+  // start_timestamp are computed unsigned.
+  auto offset_of = [&](int64_t timestamp) { return (uint64_t)timestamp - (uint64_t)start_timestamp; };
+
+  uint64_t last_bucket = offset_of(end_timestamp) / (uint64_t)bucket_size;
+  if (last_bucket >= MAX_HISTOGRAM_BUCKETS)
+    throw nanots_exception(NANOTS_EC_INVALID_ARGUMENT, "Too many histogram buckets.", __FILE__, __LINE__);
+
+  std::vector<size_bucket> buckets((size_t)last_bucket + 1);
+  for (size_t i = 0; i < buckets.size(); i++)
+    buckets[i].start_timestamp = (int64_t)((uint64_t)start_timestamp + ((uint64_t)i * (uint64_t)bucket_size));
+
+  auto bucket_of = [&](int64_t timestamp) {
+    return (size_t)(offset_of(timestamp) / (uint64_t)bucket_size);
+  };
+
+  auto db = _db->catalog();
+
+  auto stmt = db->prepare(
+      "SELECT "
+      "sb.block_idx as block_idx, "
+      "sb.start_timestamp as block_start_timestamp, "
+      "sb.end_timestamp as block_end_timestamp, "
+      "sb.n_frames as n_frames, "
+      "sb.n_bytes as n_bytes "
+      "FROM segments s "
+      "JOIN segment_blocks sb ON sb.segment_id = s.id "
+      "WHERE s.stream_tag = ? "
+      "AND sb.start_timestamp <= ? "
+      "AND (sb.end_timestamp >= ? OR sb.end_timestamp = 0);");
+  auto results =
+      stmt.bind(1, stream_tag).bind(2, end_timestamp).bind(3, start_timestamp).exec();
+
+  for (auto& row : results) {
+    int64_t block_idx = std::stoll(row["block_idx"].value());
+    int64_t block_start = std::stoll(row["block_start_timestamp"].value());
+    int64_t block_end = std::stoll(row["block_end_timestamp"].value());
+
+    // A finalized block that lies entirely within one bucket is counted from its
+    // catalog totals without being mapped.
+    if (block_end != 0 && row["n_frames"] && row["n_bytes"] && block_start >= start_timestamp &&
+        block_end <= end_timestamp && bucket_of(block_start) == bucket_of(block_end)) {
+      auto& bucket = buckets[bucket_of(block_start)];
+      bucket.n_frames += std::stoull(row["n_frames"].value());
+      bucket.n_bytes += std::stoull(row["n_bytes"].value());
+      continue;
+    }
+
+    // Otherwise walk the index; a frame's size is the distance to the previous
+    // frame's offset since frames are packed downward from the end of the block.
+    auto mm = _db->map_block(block_idx);
+    auto block_p = (uint8_t*)mm->map();
+
+    auto valid_counter = (uint32_t*)(block_p + 8);
+
+#ifdef _WIN32
+    uint32_t n_valid_indexes = *reinterpret_cast<volatile uint32_t*>(valid_counter);
+    _ReadWriteBarrier(); // compiler barrier (not mem)
+#else
+    uint32_t n_valid_indexes = __atomic_load_n(valid_counter, std::memory_order_acquire);
+#endif
+
+    // Offsets point past each frame's key slot, if any.
+    uint64_t previous_offset = _block_size + (n_valid_indexes ? _block_key_size(block_p) : 0);
+    for (uint32_t i = 0; i < n_valid_indexes; i++) {
+      uint8_t* index_p = block_p + BLOCK_HEADER_SIZE + (i * INDEX_ENTRY_SIZE);
+      int64_t timestamp = *(int64_t*)index_p;
+      uint64_t offset = *(uint64_t*)(index_p + 8);
+
+      if (timestamp > end_timestamp)
+        break;
+
+      if (timestamp >= start_timestamp) {
+        auto& bucket = buckets[bucket_of(timestamp)];
+        bucket.n_frames++;
+        bucket.n_bytes += previous_offset - offset;
+      }
+
+      previous_offset = offset;
+    }
+  }
+
+  return buckets;
+}
+
+std::vector<std::string> nanots_reader::query_stream_tags(int64_t start_timestamp, int64_t end_timestamp) {
+  auto db = _db->catalog();
+
+  auto stmt = db->prepare(
+      "SELECT DISTINCT s.stream_tag "
+      "FROM segments s "
+      "JOIN segment_blocks sb ON s.id = sb.segment_id "
+      "WHERE sb.start_timestamp <= ? AND (sb.end_timestamp >= ? OR sb.end_timestamp = 0);");
+  auto results =
+      stmt.bind(1, end_timestamp).bind(2, start_timestamp).exec();
+
+  std::vector<std::string> stream_tags;
+
+  for (auto& row : results) {
+      stream_tags.push_back(row["stream_tag"].value());
+  }
+
+  return stream_tags;
+}
+
+std::vector<contiguous_segment> nanots_reader::query_contiguous_segments(
+    const std::string& stream_tag,
+    int64_t start_timestamp,
+    int64_t end_timestamp) {
+  auto db = _db->catalog();
+
+  // Create a grouping key by subtracting sequence from row number
+  // Contiguous sequences will have the same group_key
+
+  auto stmt = db->prepare(
+    "WITH contiguous_groups AS ( "
+    "  SELECT "
+    "    sb.segment_id, "
+    "    sb.sequence, "
+    "    sb.start_timestamp, "
+    "    sb.end_timestamp, "
+    "    ROW_NUMBER() OVER (PARTITION BY sb.segment_id ORDER BY sb.sequence) "
+    "      - sb.sequence AS group_key "
+    "  FROM segment_blocks sb "
+    "  JOIN segments s ON sb.segment_id = s.id "
+    "  WHERE sb.start_timestamp <= ? "                    /* bind(1) = window_end    */
+    "    AND (sb.end_timestamp >= ? OR sb.end_timestamp = 0) " /* bind(2) = window_start */
+    "    AND s.stream_tag = ? "                           /* bind(3) = stream_tag    */
+    "), "
+    "region_boundaries AS ( "
+    "  SELECT "
+    "    segment_id, "
+    "    group_key, "
+    "    MIN(start_timestamp) AS region_start, "
+    "    CASE "
+    "      WHEN MIN(end_timestamp) = 0 THEN 0 "
+    "      ELSE MAX(end_timestamp) "
+    "    END AS region_end, "
+    "    COUNT(*) AS block_count "
+    "  FROM contiguous_groups "
+    "  GROUP BY segment_id, group_key "
+    ") "
+    "SELECT "
+    "  segment_id, "
+    "  region_start, "
+    "  region_end, "
+    "  block_count "
+    "FROM region_boundaries "
+    "ORDER BY segment_id, region_start;"
+  );
+  auto results =
+      stmt.bind(1, end_timestamp).bind(2, start_timestamp).bind(3, stream_tag).exec();
+
+  std::vector<contiguous_segment> segments;
+
+  for (auto& row : results) {
+    contiguous_segment segment;
+    segment.segment_id = std::stoll(row["segment_id"].value());
+    segment.start_timestamp = std::stoll(row["region_start"].value());
+    segment.end_timestamp = std::stoll(row["region_end"].value());
+    segments.push_back(segment);
+  }
+
+  return segments;
+}
+
+nanots_iterator::nanots_iterator(const std::string& file_name,
+                                 const std::string& stream_tag)
+    : nanots_iterator(nanots_database::open(file_name), stream_tag) {
+}
+
+nanots_iterator::nanots_iterator(std::shared_ptr<nanots_database> db,
+                                 const std::string& stream_tag)
+    : _db(std::move(db)),
+      _stream_tag(stream_tag),
+      _block_size(_db->block_size()),
+      _current_block_sequence(0),
+      _current_segment_id(0),
+      _current_frame_idx(0),
+      _block_cache(std::make_shared<block_cache>()),
+      _valid(false),
+      _initialized(false) {
+  // Initialize to first frame if stream exists
+  reset();
+}
+
+block_info* nanots_iterator::_get_block_by_segment_and_sequence(int64_t segment_id, int64_t sequence) {
+  std::string cache_key = std::to_string(segment_id) + ":" + std::to_string(sequence);
+  auto it = _block_cache->find(cache_key);
+  if (it != _block_cache->end()) {
+    return it->second.get();
+  }
+
+  // Query database for this specific block
+  auto db = _db->catalog();
+
+  auto stmt = db->prepare(
+      "SELECT "
+      "s.metadata as metadata, "
+      "sb.segment_id as segment_id, "
+      "sb.sequence as block_sequence, "
+      "sb.block_idx as block_idx, "
+      "sb.start_timestamp as start_timestamp, "
+      "sb.end_timestamp as end_timestamp, "
+      "sb.uuid as uuid, "
+      "sb.start_ordinal as start_ordinal "
+      "FROM segments s "
+      "JOIN segment_blocks sb ON sb.segment_id = s.id "
+      "WHERE sb.segment_id = ? AND sb.sequence = ?");
+
+  auto results = stmt.bind(1, segment_id).bind(2, sequence).exec();
+
+  if (results.empty()) {
+    return nullptr;
+  }
+
+  auto& row = results[0];
+  auto block = std::make_shared<block_info>();
+  block->block_idx = std::stoll(row["block_idx"].value());
+  block->block_sequence = std::stoll(row["block_sequence"].value());
+  block->segment_id = std::stoll(row["segment_id"].value());
+  block->metadata = row["metadata"].value();
+  block->uuid_hex = row["uuid"].value();
+  block->start_timestamp = std::stoll(row["start_timestamp"].value());
+  block->end_timestamp = std::stoll(row["end_timestamp"].value());
+  if (row["start_ordinal"])
+    block->start_ordinal = std::stoll(row["start_ordinal"].value());
+
+  // Cached blocks are loaded up front and never modified afterwards, so they
+  // can be shared between clones of this iterator.
+  if (!_load_block_data(*block))
+    return nullptr;
+
+  // Copy on write: a cloned iterator shares its cache with the original until
+  // one of them needs to add a block.
+  if (_block_cache.use_count() > 1)
+    _block_cache = std::make_shared<block_cache>(*_block_cache);
+
+  auto result = _block_cache->emplace(cache_key, std::move(block));
+  return result.first->second.get();
+}
+
+block_info* nanots_iterator::_get_first_block() {
+  auto db = _db->catalog();
+
+  auto stmt = db->prepare(
+      "SELECT sb.segment_id, sb.sequence "
+      "FROM segments s "
+      "JOIN segment_blocks sb ON sb.segment_id = s.id "
+      "WHERE s.stream_tag = ? "
+      "ORDER BY s.id ASC, sb.sequence ASC "
+      "LIMIT 1");
+
+  auto results = stmt.bind(1, _stream_tag).exec();
+
+  if (results.empty())
+    return nullptr;
+
+  int64_t segment_id = std::stoll(results[0]["segment_id"].value());
+  int64_t sequence = std::stoll(results[0]["sequence"].value());
+  return _get_block_by_segment_and_sequence(segment_id, sequence);
+}
+
+block_info* nanots_iterator::_get_next_block() {
+  auto db = _db->catalog();
+
+  // First try to find next block within the same segment
+  auto stmt = db->prepare(
+      "SELECT sb.id, sb.sequence "
+      "FROM segment_blocks sb "
+      "WHERE sb.segment_id = ? AND sb.sequence > ? "
+      "ORDER BY sb.sequence ASC "
+      "LIMIT 1");
+
+  auto results = stmt.bind(1, _current_segment_id).bind(2, _current_block_sequence).exec();
+
+  if (!results.empty()) {
+    // Found next block in same segment
+    int64_t next_sequence = std::stoll(results[0]["sequence"].value());
+    return _get_block_by_segment_and_sequence(_current_segment_id, next_sequence);
+  }
+
+  // No more blocks in current segment, look for first block in next segment
+  stmt = db->prepare(
+      "SELECT sb.segment_id, sb.sequence "
+      "FROM segments s "
+      "JOIN segment_blocks sb ON sb.segment_id = s.id "
+      "WHERE s.stream_tag = ? "
+      "AND s.id > ? "
+      "ORDER BY s.id ASC, sb.sequence ASC "
+      "LIMIT 1");
+
+  results = stmt.bind(1, _stream_tag).bind(2, _current_segment_id).exec();
+
+  if (results.empty())
+    return nullptr;
+
+  int64_t next_segment_id = std::stoll(results[0]["segment_id"].value());
+  int64_t next_sequence = std::stoll(results[0]["sequence"].value());
+  return _get_block_by_segment_and_sequence(next_segment_id, next_sequence);
+}
+
+block_info* nanots_iterator::_get_prev_block() {
+  auto db = _db->catalog();
+
+  // First try to find previous block within the same segment
+  auto stmt = db->prepare(
+      "SELECT sb.id, sb.sequence "
+      "FROM segment_blocks sb "
+      "WHERE sb.segment_id = ? AND sb.sequence < ? "
+      "ORDER BY sb.sequence DESC "
+      "LIMIT 1");
+
+  auto results = stmt.bind(1, _current_segment_id).bind(2, _current_block_sequence).exec();
+
+  if (!results.empty()) {
+    // Found previous block in same segment
+    int64_t prev_sequence = std::stoll(results[0]["sequence"].value());
+    return _get_block_by_segment_and_sequence(_current_segment_id, prev_sequence);
+  }
+
+  // No previous blocks in current segment, look for last block in previous segment
+  stmt = db->prepare(
+      "SELECT sb.segment_id, sb.sequence "
+      "FROM segments s "
+      "JOIN segment_blocks sb ON sb.segment_id = s.id "
+      "WHERE s.stream_tag = ? "
+      "AND s.id < ? "
+      "ORDER BY s.id DESC, sb.sequence DESC "
+      "LIMIT 1");
+
+  results = stmt.bind(1, _stream_tag).bind(2, _current_segment_id).exec();
+
+  if (results.empty())
+    return nullptr;
+
+  int64_t prev_segment_id = std::stoll(results[0]["segment_id"].value());
+  int64_t prev_sequence = std::stoll(results[0]["sequence"].value());
+  return _get_block_by_segment_and_sequence(prev_segment_id, prev_sequence);
+}
+
+block_info* nanots_iterator::_find_block_for_timestamp(int64_t timestamp) {
+  auto db = _db->catalog();
+
+  // First try to find block that contains the timestamp
+  auto stmt = db->prepare(
+      "SELECT sb.segment_id, sb.sequence "
+      "FROM segments s "
+      "JOIN segment_blocks sb ON sb.segment_id = s.id "
+      "WHERE s.stream_tag = ? "
+      "AND sb.start_timestamp <= ? "
+      "AND (sb.end_timestamp >= ? OR sb.end_timestamp = 0) "
+      "ORDER BY s.id ASC, sb.sequence ASC "
+      "LIMIT 1");
+
+  auto results =
+      stmt.bind(1, _stream_tag).bind(2, timestamp).bind(3, timestamp).exec();
+
+  if(!results.empty())
+  {
+    int64_t segment_id = std::stoll(results[0]["segment_id"].value());
+    int64_t sequence = std::stoll(results[0]["sequence"].value());
+    return _get_block_by_segment_and_sequence(segment_id, sequence);
+  }
+
+  // If no block contains the timestamp, find the first block with start_timestamp >=
+  // timestamp. This explicitly allows a find() before the first timsestamp to still find the first block.
+  stmt = db->prepare(
+      "SELECT sb.segment_id, sb.sequence "
+      "FROM segments s "
+      "JOIN segment_blocks sb ON sb.segment_id = s.id "
+      "WHERE s.stream_tag = ? "
+      "AND sb.start_timestamp >= ? "
+      "ORDER BY s.id ASC, sb.sequence ASC "
+      "LIMIT 1");
+
+  results = stmt.bind(1, _stream_tag).bind(2, timestamp).exec();
+
+  if (results.empty())
+    return nullptr;  // No blocks at all, or timestamp is after everything
+
+  int64_t segment_id = std::stoll(results[0]["segment_id"].value());
+  int64_t sequence = std::stoll(results[0]["sequence"].value());
+  return _get_block_by_segment_and_sequence(segment_id, sequence);
+}
+
+bool nanots_iterator::_load_block_data(block_info& block) {
+  if (block.is_loaded)
+    return true;
+
+  // Memory map the block (shared with any other reader of the same block)
+  block.mm = _db->map_block(block.block_idx);
+
+  block.block_p = (uint8_t*)block.mm->map();
+
+  auto valid_counter = (uint32_t*)(block.block_p + 8);
+
+#ifdef _WIN32
+    block.n_valid_indexes = *reinterpret_cast<volatile uint32_t*>(valid_counter);
+    _ReadWriteBarrier(); // compiler barrier (not mem)
+#else
+    block.n_valid_indexes = __atomic_load_n(valid_counter, std::memory_order_acquire);
+#endif
+
+  // The flags are set before the first index entry is published.
+  block.key_size = _block_key_size(block.block_p);
+
+  // Convert UUID std::string to bytes
+  s_to_entropy_id(block.uuid_hex, block.uuid);
+
+  block.is_loaded = true;
+  return true;
+}
+
+bool nanots_iterator::_load_current_frame() {
+  auto* block = _get_block_by_segment_and_sequence(_current_segment_id, _current_block_sequence);
+  if (!block) {
+    _valid = false;
+    return false;
+  }
+
+  if (!_load_block_data(*block)) {
+    _valid = false;
+    return false;
+  }
+
+  if (_current_frame_idx >= block->n_valid_indexes) {
+    _valid = false;
+    return false;
+  }
+
+  // Get frame info from index
+  uint8_t* index_p = block->block_p + BLOCK_HEADER_SIZE +
+                     (_current_frame_idx * INDEX_ENTRY_SIZE);
+  int64_t timestamp = *(int64_t*)index_p;
+  uint64_t offset = *(uint64_t*)(index_p + 8);
+
+  // Validate frame header
+  uint8_t flags;
+  uint32_t frame_size;
+  if (!_validate_frame_header(block->block_p + offset, block->uuid, &flags,
+                              &frame_size)) {
+    _valid = false;
+    return false;
+  }
+
+  // Set up current frame
+  _current_frame.data = block->block_p + offset + FRAME_HEADER_SIZE;
+  _current_frame.size = frame_size;
+  _current_frame.flags = flags;
+  _current_frame.timestamp = timestamp;
+  _current_frame.block_sequence = block->block_sequence;
+
+  _valid = true;
+  return true;
+}
+
+nanots_iterator& nanots_iterator::operator++() {
+  if (!_valid)
+    return *this;
+
+  auto* current_block = _get_block_by_segment_and_sequence(_current_segment_id, _current_block_sequence);
+  if (!current_block || !_load_block_data(*current_block)) {
+    _valid = false;
+    return *this;
+  }
+
+  _current_frame_idx++;
+
+  // If we've gone past the end of current block, move to next block
+  if (_current_frame_idx >= current_block->n_valid_indexes) {
+    auto* next_block = _get_next_block();
+    if (!next_block) {
+      _valid = false;
+      return *this;
+    }
+
+    _current_segment_id = next_block->segment_id;
+    _current_block_sequence = next_block->block_sequence;
+    _current_frame_idx = 0;
+  }
+
+  _load_current_frame();
+  return *this;
+}
+
+nanots_iterator& nanots_iterator::operator--() {
+  if (!_valid)
+    return *this;
+
+  if (_current_frame_idx == 0) {
+    // Need to go to previous block
+    auto* prev_block = _get_prev_block();
+    if (!prev_block) {
+      _valid = false;
+      return *this;
+    }
+
+    if (!_load_block_data(*prev_block)) {
+      _valid = false;
+      return *this;
+    }
+
+    _current_segment_id = prev_block->segment_id;
+    _current_block_sequence = prev_block->block_sequence;
+    _current_frame_idx =
+        (prev_block->n_valid_indexes > 0) ? prev_block->n_valid_indexes - 1 : 0;
+  } else
+    _current_frame_idx--;
+
+  _load_current_frame();
+  return *this;
+}
+
+bool nanots_iterator::find(int64_t timestamp) {
+  auto* block = _find_block_for_timestamp(timestamp);
+  if (!block) {
+    _valid = false;
+    return false;
+  }
+
+  if (!_load_block_data(*block)) {
+    _valid = false;
+    return false;
+  }
+
+  _current_segment_id = block->segment_id;
+  _current_block_sequence = block->block_sequence;
+
+  // Binary search within the block
+  uint8_t* index_start = block->block_p + BLOCK_HEADER_SIZE;
+  uint8_t* index_end =
+      index_start + (block->n_valid_indexes * INDEX_ENTRY_SIZE);
+
+  uint8_t* found_entry =
+      lower_bound_bytes(index_start, index_end, (uint8_t*)&timestamp,
+                        INDEX_ENTRY_SIZE, _compare_index_entry_timestamp);
+
+  _current_frame_idx = (found_entry - index_start) / INDEX_ENTRY_SIZE;
+
+  // If we didn't find it in this block, try next block
+  if (_current_frame_idx >= block->n_valid_indexes) {
+    auto* next_block = _get_next_block();
+    if (!next_block) {
+      _valid = false;
+      return false;
+    }
+
+    _current_segment_id = next_block->segment_id;
+    _current_block_sequence = next_block->block_sequence;
+    _current_frame_idx = 0;
+  }
+
+  // Get frame info from index
+  uint8_t* index_p = block->block_p + BLOCK_HEADER_SIZE +
+                     (_current_frame_idx * INDEX_ENTRY_SIZE);
+  int64_t found_timestamp = *(int64_t*)index_p;
+  uint64_t offset = *(uint64_t*)(index_p + 8);
+
+  // Validate frame header
+  uint8_t flags;
+  uint32_t frame_size;
+  if (!_validate_frame_header(block->block_p + offset, block->uuid, &flags,
+                              &frame_size)) {
+    _valid = false;
+    return false;
+  }
+
+  // Set up current frame
+  _current_frame.data = block->block_p + offset + FRAME_HEADER_SIZE;
+  _current_frame.size = frame_size;
+  _current_frame.flags = flags;
+  _current_frame.timestamp = found_timestamp;
+  _current_frame.block_sequence = block->block_sequence;
+
+  _valid = true;
+  return true;
+}
+
+void nanots_iterator::reset() {
+  auto* first_block = _get_first_block();
+  if (!first_block) {
+    _valid = false;
+    return;
+  }
+
+  _current_segment_id = first_block->segment_id;
+  _current_block_sequence = first_block->block_sequence;
+  _current_frame_idx = 0;
+  _load_current_frame();
+}
+
+bool nanots_iterator::seek_token(const cursor_token& token) {
+  auto* block = _get_block_by_segment_and_sequence(token.segment_id, token.block_sequence);
+
+  // The block must still be the one the token was taken from; if it was freed or
+  // recycled its segment_block row (and uuid) is gone.
+  if (block && memcmp(block->uuid, token.block_uuid, 16) == 0 && token.frame_idx >= 0 &&
+      (uint64_t)token.frame_idx < block->n_valid_indexes) {
+    uint8_t* index_p =
+        block->block_p + BLOCK_HEADER_SIZE + (token.frame_idx * INDEX_ENTRY_SIZE);
+
+    if (*(int64_t*)index_p == token.timestamp) {
+      _current_segment_id = block->segment_id;
+      _current_block_sequence = block->block_sequence;
+      _current_frame_idx = (size_t)token.frame_idx;
+      if (_load_current_frame())
+        return true;
+    }
+  }
+
+  find(token.timestamp);
+  return false;
+}
+
+bool nanots_iterator::seek_ordinal(int64_t ordinal) {
+  _valid = false;
+
+  if (ordinal < 0)
+    return false;
+
+  int64_t segment_id = 0;
+  int64_t sequence = 0;
+
+  {
+    auto db = _db->catalog();
+
+    // Ordinals are contiguous across a stream's segments, so the segment
+    // holding the ordinal is the last one starting at or before it, and the
+    // block is the last one of that segment starting at or before it.
+    auto stmt = db->prepare(
+        "SELECT id FROM segments "
+        "WHERE stream_tag = ? AND start_ordinal <= ? "
+        "ORDER BY start_ordinal DESC "
+        "LIMIT 1");
+
+    auto results = stmt.bind(1, _stream_tag).bind(2, ordinal).exec();
+
+    if (results.empty())
+      return false;
+
+    segment_id = std::stoll(results[0]["id"].value());
+
+    stmt = db->prepare(
+        "SELECT sequence FROM segment_blocks "
+        "WHERE segment_id = ? AND start_ordinal <= ? "
+        "ORDER BY start_ordinal DESC "
+        "LIMIT 1");
+    results = stmt.bind(1, segment_id).bind(2, ordinal).exec();
+
+    if (results.empty())
+      return false;
+
+    sequence = std::stoll(results[0]["sequence"].value());
+  }
+
+  auto* block = _get_block_by_segment_and_sequence(segment_id, sequence);
+  if (!block)
+    return false;
+
+  // The ordinal may fall in a block that has since been freed.
+  int64_t frame_idx = ordinal - block->start_ordinal;
+  if (frame_idx >= (int64_t)block->n_valid_indexes)
+    return false;
+
+  _current_segment_id = block->segment_id;
+  _current_block_sequence = block->block_sequence;
+  _current_frame_idx = (size_t)frame_idx;
+
+  return _load_current_frame();
+}
+
+bool nanots_iterator::find_secondary(int64_t key) {
+  _valid = false;
+
+  int64_t segment_id = -1;
+  int64_t sequence = -1;
+
+  while (true) {
+    {
+      auto db = _db->catalog();
+
+      // Next block in stream order that may hold a key >= key. Open blocks have
+      // no key range yet so they are always candidates.
+      auto stmt = db->prepare(
+          "SELECT sb.segment_id, sb.sequence "
+          "FROM segments s "
+          "JOIN segment_blocks sb ON sb.segment_id = s.id "
+          "WHERE s.stream_tag = ? "
+          "AND (sb.segment_id > ? OR (sb.segment_id = ? AND sb.sequence > ?)) "
+          "AND (sb.secondary_max >= ? OR sb.end_timestamp = 0) "
+          "ORDER BY sb.segment_id ASC, sb.sequence ASC "
+          "LIMIT 1");
+
+      auto results = stmt.bind(1, _stream_tag)
+                         .bind(2, segment_id)
+                         .bind(3, segment_id)
+                         .bind(4, sequence)
+                         .bind(5, key)
+                         .exec();
+
+      if (results.empty())
+        return false;
+
+      segment_id = std::stoll(results[0]["segment_id"].value());
+      sequence = std::stoll(results[0]["sequence"].value());
+    }
+
+    auto* block = _get_block_by_segment_and_sequence(segment_id, sequence);
+    if (!block || block->key_size == 0)
+      continue;
+
+    for (uint32_t i = 0; i < block->n_valid_indexes; i++) {
+      uint8_t* index_p = block->block_p + BLOCK_HEADER_SIZE + (i * INDEX_ENTRY_SIZE);
+      uint64_t offset = *(uint64_t*)(index_p + 8);
+      if (*(int64_t*)(block->block_p + offset - SECONDARY_KEY_SIZE) >= key) {
+        _current_segment_id = block->segment_id;
+        _current_block_sequence = block->block_sequence;
+        _current_frame_idx = i;
+        return _load_current_frame();
+      }
+    }
+  }
+}
+
+const block_info* nanots_iterator::_current_block() const {
+  std::string cache_key = std::to_string(_current_segment_id) + ":" + std::to_string(_current_block_sequence);
+  auto it = _block_cache->find(cache_key);
+  return (it != _block_cache->end()) ? it->second.get() : nullptr;
+}
+
+int64_t nanots_iterator::ordinal() const {
+  if (!_valid)
+    return -1;
+
+  auto block = _current_block();
+  if (!block || block->start_ordinal < 0)
+    return -1;
+
+  return block->start_ordinal + (int64_t)_current_frame_idx;
+}
+
+std::optional<int64_t> nanots_iterator::current_secondary_key() const {
+  if (!_valid)
+    return std::nullopt;
+
+  auto block = _current_block();
+  if (!block || block->key_size == 0)
+    return std::nullopt;
+
+  uint8_t* index_p = block->block_p + BLOCK_HEADER_SIZE + (_current_frame_idx * INDEX_ENTRY_SIZE);
+  return *(int64_t*)(block->block_p + *(uint64_t*)(index_p + 8) - SECONDARY_KEY_SIZE);
+}
+
+cursor_token nanots_iterator::current_token() const {
+  cursor_token token;
+
+  if (!_valid)
+    return token;
+
+  token.segment_id = _current_segment_id;
+  token.block_sequence = _current_block_sequence;
+  token.frame_idx = (int64_t)_current_frame_idx;
+  token.timestamp = _current_frame.timestamp;
+
+  auto block = _current_block();
+  if (block)
+    memcpy(token.block_uuid, block->uuid, 16);
+
+  return token;
+}
+
+const std::string& nanots_iterator::current_metadata() const {
+  auto block = _current_block();
+  if (block)
+    return block->metadata;
+  
+  static std::string empty_string;
+  return empty_string;
+}
+
+nanots_live_subscriber::nanots_live_subscriber(const std::string& file_name,
+                                               const std::string& stream_tag)
+    : nanots_live_subscriber(nanots_database::open(file_name), stream_tag) {
+}
+
+nanots_live_subscriber::nanots_live_subscriber(std::shared_ptr<nanots_database> db,
+                                               const std::string& stream_tag)
+    : _db(std::move(db)),
+      _ring(std::make_shared<nanots_live_ring>(_db->file_name(), stream_tag, false)),
+      _mm(),
+      _mm_block_idx(-1),
+      _next_seq(_ring_load(&_ring->header()->head)),
+      _n_dropped(0) {
+}
+
+bool nanots_live_subscriber::next(frame_info& frame, uint32_t timeout_ms) {
+  auto header = _ring->header();
+  auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout_ms);
+
+  while (true) {
+    uint64_t head = _ring_load(&header->head);
+
+    if (_next_seq < head) {
+      // Entries older than a ring's worth have been overwritten.
+      if (head - _next_seq > LIVE_RING_ENTRIES) {
+        _n_dropped += (head - LIVE_RING_ENTRIES) - _next_seq;
+        _next_seq = head - LIVE_RING_ENTRIES;
+      }
+
+      // Seqlock read: the copy is only used if seq was intact on both sides.
+      auto e = _ring->entry(_next_seq);
+      uint64_t seq = _ring_load(&e->seq);
+      live_ring_entry copy;
+      memcpy(&copy, e, sizeof(copy));
+      std::atomic_thread_fence(std::memory_order_acquire);
+      bool intact = (seq == _next_seq + 1) && (_ring_load(&e->seq) == seq);
+
+      _next_seq++;
+
+      if (!intact) {
+        _n_dropped++;
+        continue;
+      }
+
+      if (!_mm || _mm_block_idx != copy.block_idx) {
+        _mm = _db->map_block(copy.block_idx);
+        _mm_block_idx = copy.block_idx;
+      }
+
+      auto block_p = (uint8_t*)_mm->map();
+
+      // The block may have been recycled since the frame was published.
+      uint8_t flags;
+      uint32_t frame_size;
+      if (!_validate_frame_header(block_p + copy.offset, copy.uuid, &flags, &frame_size)) {
+        _n_dropped++;
+        continue;
+      }
+
+      frame.data = block_p + copy.offset + FRAME_HEADER_SIZE;
+      frame.size = frame_size;
+      frame.flags = flags;
+      frame.timestamp = copy.timestamp;
+      frame.block_sequence = copy.block_sequence;
+      return true;
+    }
+
+    auto now = std::chrono::steady_clock::now();
+    if (now >= deadline)
+      return false;
+
+    auto remaining = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - now).count();
+
+    // Announce the wait before sampling wake_word so the writer either sees
+    // the waiter or bumps wake_word after the sample, failing the wait.
+    _ring_add(&header->n_waiters, 1);
+    uint32_t word = _ring_load(&header->wake_word);
+    if (_ring_load(&header->head) == head)
+      nts_futex_wait(&header->wake_word, word, (uint32_t)std::max<int64_t>(remaining, 1));
+    _ring_add(&header->n_waiters, -1);
+  }
+}
+
+extern "C" {
+
+struct nanots_writer_handle {
+  nanots_writer* writer;
+  nanots_writer_handle(nanots_writer* w) : writer(w) {}
+  ~nanots_writer_handle() { delete writer; }
+};
+
+struct nanots_write_context_handle {
+  write_context context;
+  nanots_write_context_handle(write_context&& c) : context(std::move(c)) {}
+};
+
+struct nanots_reader_handle {
+  nanots_reader* reader;
+  std::vector<std::string> cached_stream_tags;
+  size_t stream_tags_iterator;
+  nanots_reader_handle(nanots_reader* r) : reader(r), stream_tags_iterator(0) {}
+  ~nanots_reader_handle() { delete reader; }
+};
+
+struct nanots_iterator_handle {
+  nanots_iterator* iterator;
+  nanots_iterator_handle(nanots_iterator* i) : iterator(i) {}
+  ~nanots_iterator_handle() { delete iterator; }
+};
+
+struct nanots_live_subscriber_handle {
+  nanots_live_subscriber* subscriber;
+  nanots_live_subscriber_handle(nanots_live_subscriber* s) : subscriber(s) {}
+  ~nanots_live_subscriber_handle() { delete subscriber; }
+};
+
+nanots_ec_t nanots_writer_allocate_file(const char* file_name, uint32_t block_size, uint32_t n_blocks) {
+  nanots_ec_t ec = nanots_ec_t::NANOTS_EC_OK;
+  try {
+    nanots_writer::allocate(std::string(file_name), block_size, n_blocks);
+  } catch (const nanots_exception& e) {
+    ec = e.get_ec();
+  } catch (const std::exception& e) {
+    fprintf(stderr,"Exception in nanots_writer_allocate_file: %s\n", e.what());
+    ec = NANOTS_EC_UNKNOWN;
+  } catch (...) {
+    ec = NANOTS_EC_UNKNOWN;
+  }
+  if(ec != NANOTS_EC_OK) {
+    fprintf(stderr,"Error in nanots_writer_allocate_file: %d\n", ec);
+  }
+  return ec;
+}
+
+nanots_writer_t nanots_writer_create(const char* file_name, int auto_reclaim) {
+  try {
+    auto* writer = new nanots_writer(std::string(file_name), auto_reclaim != 0);
+    return new nanots_writer_handle(writer);
+  } catch (const std::exception& e) {
+    fprintf(stderr,"Exception in nanots_writer_create: %s\n", e.what());
+    return nullptr;
+  } catch (...) {
+    return nullptr;
+  }
+}
+
+void nanots_writer_destroy(nanots_writer_t writer) {
+  delete writer;
+}
+
+nanots_write_context_t nanots_writer_create_context(nanots_writer_t writer,
+                                                    const char* stream_tag,
+                                                    const char* metadata) {
+  if (!writer || !writer->writer) {
+    return nullptr;
+  }
+
+  try {
+    auto context = writer->writer->create_write_context(std::string(stream_tag),
+                                                        std::string(metadata));
+    return new nanots_write_context_handle(std::move(context));
+  } catch (const nanots_exception& e) {
+    fprintf(stderr,"Error in nanots_writer_create_context: %d", e.get_ec());
+    return nullptr;
+  } catch (const std::exception& e) {
+    fprintf(stderr,"Exception in nanots_writer_create_context: %s\n", e.what());
+    return nullptr;
+  } catch (...) {
+    return nullptr;
+  }
+}
+
+void nanots_write_context_destroy(nanots_write_context_t context) {
+  delete context;
+}
+
+nanots_ec_t nanots_writer_create_contexts(nanots_writer_t writer,
+                                          const char* const* stream_tags,
+                                          const char* const* metadata,
+                                          size_t n,
+                                          nanots_write_context_t* contexts) {
+  if (!writer || !writer->writer || !stream_tags || !metadata || !contexts) {
+    return NANOTS_EC_INVALID_ARGUMENT;
+  }
+
+  try {
+    std::vector<std::pair<std::string, std::string>> streams;
+    for (size_t i = 0; i < n; i++)
+      streams.emplace_back(std::string(stream_tags[i]), std::string(metadata[i]));
+
+    auto created = writer->writer->create_write_contexts(streams);
+    for (size_t i = 0; i < n; i++)
+      contexts[i] = new nanots_write_context_handle(std::move(created[i]));
+    return NANOTS_EC_OK;
+  } catch (const nanots_exception& e) {
+    return e.get_ec();
+  } catch (const std::exception& e) {
+    fprintf(stderr,"Exception in nanots_writer_create_contexts: %s\n", e.what());
+    return NANOTS_EC_UNKNOWN;
+  } catch (...) {
+    fprintf(stderr,"Exception in nanots_writer_create_contexts\n");
+    return NANOTS_EC_UNKNOWN;
+  }
+}
+
+nanots_ec_t nanots_writer_close_contexts(nanots_writer_t writer,
+                                         nanots_write_context_t* contexts,
+                                         size_t n) {
+  if (!writer || !writer->writer || !contexts) {
+    return NANOTS_EC_INVALID_ARGUMENT;
+  }
+
+  nanots_ec_t ec = NANOTS_EC_OK;
+
+  try {
+    // Queued frames point at the context, so they must be written before it
+    // moves.
+    std::vector<write_context> closing;
+    for (size_t i = 0; i < n; i++) {
+      if (contexts[i]) {
+        writer->writer->drain_async(contexts[i]->context);
+        closing.push_back(std::move(contexts[i]->context));
+      }
+    }
+    writer->writer->close_write_contexts(closing);
+  } catch (const nanots_exception& e) {
+    ec = e.get_ec();
+  } catch (const std::exception& e) {
+    fprintf(stderr,"Exception in nanots_writer_close_contexts: %s\n", e.what());
+    ec = NANOTS_EC_UNKNOWN;
+  } catch (...) {
+    fprintf(stderr,"Exception in nanots_writer_close_contexts\n");
+    ec = NANOTS_EC_UNKNOWN;
+  }
+
+  for (size_t i = 0; i < n; i++)
+    delete contexts[i];
+
+  return ec;
+}
+
+nanots_ec_t nanots_write_context_set_key_extractor(nanots_write_context_t context,
+                                                   nanots_key_extractor_t extractor,
+                                                   void* user_data) {
+  if (!context) {
+    return NANOTS_EC_INVALID_ARGUMENT;
+  }
+
+  if (!extractor) {
+    context->context.key_extractor = nullptr;
+    return NANOTS_EC_OK;
+  }
+
+  context->context.key_extractor = [extractor, user_data](const uint8_t* data, size_t size) {
+    const uint8_t* key = nullptr;
+    size_t key_size = extractor(data, size, &key, user_data);
+    return (key && key_size) ? std::string((const char*)key, key_size) : std::string();
+  };
+  return NANOTS_EC_OK;
+}
+
+nanots_ec_t nanots_write_context_set_value_extractor(nanots_write_context_t context,
+                                                     nanots_value_extractor_t extractor,
+                                                     void* user_data) {
+  if (!context) {
+    return NANOTS_EC_INVALID_ARGUMENT;
+  }
+
+  if (!extractor) {
+    context->context.value_extractor = nullptr;
+    return NANOTS_EC_OK;
+  }
+
+  context->context.value_extractor = [extractor, user_data](const uint8_t* data,
+                                                            size_t size) -> std::optional<double> {
+    double value = 0;
+    if (!extractor(data, size, &value, user_data))
+      return std::nullopt;
+    return value;
+  };
+  return NANOTS_EC_OK;
+}
+
+nanots_ec_t nanots_writer_write(nanots_writer_t writer,
+                                nanots_write_context_t context,
+                                const uint8_t* data,
+                                size_t size,
+                                int64_t timestamp,
+                                uint8_t flags) {
+  if (!writer || !writer->writer) {
+    return NANOTS_EC_INVALID_ARGUMENT;
+  }
+  if (!context) {
+    return NANOTS_EC_INVALID_ARGUMENT;
+  }
+
+  try {
+    writer->writer->write(context->context, data, size, timestamp, flags);
+    return NANOTS_EC_OK;
+  } catch (const nanots_exception& e) {
+    return e.get_ec();
+  } catch (const std::exception& e) {
+    fprintf(stderr,"Exception in nanots_writer_write: %s\n", e.what());
+    return NANOTS_EC_UNKNOWN;
+  } catch (...) {
+    fprintf(stderr,"Exception in nanots_writer_write\n");
+    return NANOTS_EC_UNKNOWN;
+  }
+}
+
+nanots_ec_t nanots_writer_write_secondary(nanots_writer_t writer,
+                                          nanots_write_context_t context,
+                                          const uint8_t* data,
+                                          size_t size,
+                                          int64_t timestamp,
+                                          uint8_t flags,
+                                          int64_t secondary_key) {
+  if (!writer || !writer->writer) {
+    return NANOTS_EC_INVALID_ARGUMENT;
+  }
+  if (!context) {
+    return NANOTS_EC_INVALID_ARGUMENT;
+  }
+
+  try {
+    writer->writer->write(context->context, data, size, timestamp, flags, secondary_key);
+    return NANOTS_EC_OK;
+  } catch (const nanots_exception& e) {
+    return e.get_ec();
+  } catch (const std::exception& e) {
+    fprintf(stderr,"Exception in nanots_writer_write_secondary: %s\n", e.what());
+    return NANOTS_EC_UNKNOWN;
+  } catch (...) {
+    fprintf(stderr,"Exception in nanots_writer_write_secondary\n");
+    return NANOTS_EC_UNKNOWN;
+  }
+}
+
+nanots_ec_t nanots_writer_write_async(nanots_writer_t writer,
+                                      nanots_write_context_t context,
+                                      const uint8_t* data,
+                                      size_t size,
+                                      int64_t timestamp,
+                                      uint8_t flags,
+                                      const int64_t* secondary_key,
+                                      int durable,
+                                      nanots_write_callback_t callback,
+                                      void* user_data) {
+  if (!writer || !writer->writer) {
+    return NANOTS_EC_INVALID_ARGUMENT;
+  }
+  if (!context || (!data && size > 0)) {
+    return NANOTS_EC_INVALID_ARGUMENT;
+  }
+
+  try {
+    std::optional<int64_t> key;
+    if (secondary_key)
+      key = *secondary_key;
+    writer->writer->write_async(context->context, data, size, timestamp, flags, key, durable != 0,
+                                [callback, user_data](nanots_ec_t ec) {
+                                  if (callback)
+                                    callback(ec, user_data);
+                                });
+    return NANOTS_EC_OK;
+  } catch (const nanots_exception& e) {
+    return e.get_ec();
+  } catch (const std::exception& e) {
+    fprintf(stderr,"Exception in nanots_writer_write_async: %s\n", e.what());
+    return NANOTS_EC_UNKNOWN;
+  } catch (...) {
+    fprintf(stderr,"Exception in nanots_writer_write_async\n");
+    return NANOTS_EC_UNKNOWN;
+  }
+}
+
+nanots_ec_t nanots_writer_drain_async(nanots_writer_t writer, nanots_write_context_t context) {
+  if (!writer || !writer->writer || !context) {
+    return NANOTS_EC_INVALID_ARGUMENT;
+  }
+
+  try {
+    writer->writer->drain_async(context->context);
+    return NANOTS_EC_OK;
+  } catch (const nanots_exception& e) {
+    return e.get_ec();
+  } catch (const std::exception& e) {
+    fprintf(stderr,"Exception in nanots_writer_drain_async: %s\n", e.what());
+    return NANOTS_EC_UNKNOWN;
+  } catch (...) {
+    fprintf(stderr,"Exception in nanots_writer_drain_async\n");
+    return NANOTS_EC_UNKNOWN;
+  }
+}
+
+nanots_ec_t nanots_writer_set_async_threads(nanots_writer_t writer, size_t n_threads) {
+  if (!writer || !writer->writer) {
+    return NANOTS_EC_INVALID_ARGUMENT;
+  }
+
+  try {
+    writer->writer->set_async_threads(n_threads);
+    return NANOTS_EC_OK;
+  } catch (const nanots_exception& e) {
+    return e.get_ec();
+  } catch (const std::exception& e) {
+    fprintf(stderr,"Exception in nanots_writer_set_async_threads: %s\n", e.what());
+    return NANOTS_EC_UNKNOWN;
+  } catch (...) {
+    fprintf(stderr,"Exception in nanots_writer_set_async_threads\n");
+    return NANOTS_EC_UNKNOWN;
+  }
+}
+
+nanots_ec_t nanots_writer_write_group(nanots_writer_t writer,
+                                      const nanots_write_context_t* contexts,
+                                      const uint8_t* const* data,
+                                      const size_t* sizes,
+                                      const uint8_t* flags,
+                                      size_t n,
+                                      int64_t timestamp) {
+  if (!writer || !writer->writer || !contexts || !data || !sizes) {
+    return NANOTS_EC_INVALID_ARGUMENT;
+  }
+
+  try {
+    std::vector<group_frame> frames(n);
+    for (size_t i = 0; i < n; i++) {
+      if (!contexts[i])
+        return NANOTS_EC_INVALID_ARGUMENT;
+      frames[i].wctx = &contexts[i]->context;
+      frames[i].data = data[i];
+      frames[i].size = sizes[i];
+      frames[i].flags = (flags) ? flags[i] : 0;
+    }
+    writer->writer->write_group(frames, timestamp);
+    return NANOTS_EC_OK;
+  } catch (const nanots_exception& e) {
+    return e.get_ec();
+  } catch (const std::exception& e) {
+    fprintf(stderr,"Exception in nanots_writer_write_group: %s\n", e.what());
+    return NANOTS_EC_UNKNOWN;
+  } catch (...) {
+    fprintf(stderr,"Exception in nanots_writer_write_group\n");
+    return NANOTS_EC_UNKNOWN;
+  }
 }
 
-bool nanots_iterator::find(int64_t timestamp) {
-  auto* block = _find_block_for_timestamp(timestamp);
-  if (!block) {
-    _valid = false;
-    return false;
+nanots_ec_t nanots_writer_register_continuous_query(nanots_writer_t writer,
+                                                    const nanots_continuous_query_t* query,
+                                                    int64_t* query_id) {
+  if (!writer || !writer->writer) {
+    return NANOTS_EC_INVALID_ARGUMENT;
   }
-
-  if (!_load_block_data(*block)) {
-    _valid = false;
-    return false;
+  if (!query || !query->stream_tag || !query_id) {
+    return NANOTS_EC_INVALID_ARGUMENT;
   }
 
-  _current_segment_id = block->segment_id;
-  _current_block_sequence = block->block_sequence;
-
-  // Binary search within the block
-  uint8_t* index_start = block->block_p + BLOCK_HEADER_SIZE;
-  uint8_t* index_end =
-      index_start + (block->n_valid_indexes * INDEX_ENTRY_SIZE);
+  try {
+    auto user_data = query->user_data;
+
+    continuous_query cpp_query;
+    cpp_query.stream_tag = query->stream_tag;
+    if (query->filter) {
+      auto filter = query->filter;
+      cpp_query.filter = [filter, user_data](const uint8_t* data, size_t size) {
+        return filter(data, size, user_data) != 0;
+      };
+    }
+    if (query->value_extractor) {
+      auto extractor = query->value_extractor;
+      cpp_query.value_extractor = [extractor, user_data](const uint8_t* data,
+                                                         size_t size) -> std::optional<double> {
+        double value = 0;
+        if (!extractor(data, size, &value, user_data))
+          return std::nullopt;
+        return value;
+      };
+    }
+    cpp_query.aggregate = (cq_aggregate)query->aggregate;
+    cpp_query.window = query->window;
+    if (query->has_threshold)
+      cpp_query.threshold = query->threshold;
+    if (query->callback) {
+      auto callback = query->callback;
+      cpp_query.callback = [callback, user_data](const continuous_query_result& result) {
+        nanots_cq_result_t c_result;
+        c_result.query_id = result.query_id;
+        c_result.window_start = result.window_start;
+        c_result.window_end = result.window_end;
+        c_result.n_frames = result.n_frames;
+        c_result.value = result.value;
+        callback(&c_result, user_data);
+      };
+    }
+    if (query->derived_stream_tag)
+      cpp_query.derived_stream_tag = query->derived_stream_tag;
 
-  uint8_t* found_entry =
-      lower_bound_bytes(index_start, index_end, (uint8_t*)&timestamp,
-                        INDEX_ENTRY_SIZE, _compare_index_entry_timestamp);
+    *query_id = writer->writer->register_continuous_query(std::move(cpp_query));
+    return NANOTS_EC_OK;
+  } catch (const nanots_exception& e) {
+    return e.get_ec();
+  } catch (const std::exception& e) {
+    fprintf(stderr,"Exception in nanots_writer_register_continuous_query: %s\n", e.what());
+    return NANOTS_EC_UNKNOWN;
+  } catch (...) {
+    fprintf(stderr,"Exception in nanots_writer_register_continuous_query\n");
+    return NANOTS_EC_UNKNOWN;
+  }
+}
 
-  _current_frame_idx = (found_entry - index_start) / INDEX_ENTRY_SIZE;
+nanots_ec_t nanots_writer_unregister_continuous_query(nanots_writer_t writer,
+                                                      int64_t query_id) {
+  if (!writer || !writer->writer) {
+    return NANOTS_EC_INVALID_ARGUMENT;
+  }
 
-  // If we didn't find it in this block, try next block
-  if (_current_frame_idx >= block->n_valid_indexes) {
-    auto* next_block = _get_next_block();
-    if (!next_block) {
-      _valid = false;
-      return false;
-    }
+  writer->writer->unregister_continuous_query(query_id);
+  return NANOTS_EC_OK;
+}
 
-    _current_segment_id = next_block->segment_id;
-    _current_block_sequence = next_block->block_sequence;
-    _current_frame_idx = 0;
+nanots_ec_t nanots_writer_drain_continuous_queries(nanots_writer_t writer) {
+  if (!writer || !writer->writer) {
+    return NANOTS_EC_INVALID_ARGUMENT;
   }
 
-  // Get frame info from index
-  uint8_t* index_p = block->block_p + BLOCK_HEADER_SIZE +
-                     (_current_frame_idx * INDEX_ENTRY_SIZE);
-  int64_t found_timestamp = *(int64_t*)index_p;
-  uint64_t offset = *(uint64_t*)(index_p + 8);
+  writer->writer->drain_continuous_queries();
+  return NANOTS_EC_OK;
+}
 
-  // Validate frame header
-  uint8_t flags;
-  uint32_t frame_size;
-  if (!_validate_frame_header(block->block_p + offset, block->uuid, &flags,
-                              &frame_size)) {
-    _valid = false;
-    return false;
+nanots_ec_t nanots_writer_enable_mirror(nanots_writer_t writer,
+                                        const char* mirror_file_name,
+                                        size_t max_lag) {
+  if (!writer || !writer->writer || !mirror_file_name) {
+    return NANOTS_EC_INVALID_ARGUMENT;
   }
 
-  // Set up current frame
-  _current_frame.data = block->block_p + offset + FRAME_HEADER_SIZE;
-  _current_frame.size = frame_size;
-  _current_frame.flags = flags;
-  _current_frame.timestamp = found_timestamp;
-  _current_frame.block_sequence = block->block_sequence;
-
-  _valid = true;
-  return true;
+  try {
+    writer->writer->enable_mirror(std::string(mirror_file_name), max_lag);
+    return NANOTS_EC_OK;
+  } catch (const nanots_exception& e) {
+    return e.get_ec();
+  } catch (const std::exception& e) {
+    fprintf(stderr,"Exception in nanots_writer_enable_mirror: %s\n", e.what());
+    return NANOTS_EC_UNKNOWN;
+  } catch (...) {
+    fprintf(stderr,"Exception in nanots_writer_enable_mirror\n");
+    return NANOTS_EC_UNKNOWN;
+  }
 }
 
-void nanots_iterator::reset() {
-  auto* first_block = _get_first_block();
-  if (!first_block) {
-    _valid = false;
-    return;
+nanots_ec_t nanots_writer_drain_mirror(nanots_writer_t writer) {
+  if (!writer || !writer->writer) {
+    return NANOTS_EC_INVALID_ARGUMENT;
   }
 
-  _current_segment_id = first_block->segment_id;
-  _current_block_sequence = first_block->block_sequence;
-  _current_frame_idx = 0;
-  _load_current_frame();
+  writer->writer->drain_mirror();
+  return NANOTS_EC_OK;
 }
 
-const std::string& nanots_iterator::current_metadata() const {
-  std::string cache_key = std::to_string(_current_segment_id) + ":" + std::to_string(_current_block_sequence);
-  auto it = _block_cache.find(cache_key);
-  if (it != _block_cache.end()) {
-    return it->second.metadata;
+nanots_ec_t nanots_writer_mirror_stats(nanots_writer_t writer, nanots_mirror_stats_t* stats) {
+  if (!writer || !writer->writer || !stats) {
+    return NANOTS_EC_INVALID_ARGUMENT;
   }
-  
-  static std::string empty_string;
-  return empty_string;
+
+  auto cpp_stats = writer->writer->get_mirror_stats();
+  stats->n_frames_shipped = cpp_stats.n_frames_shipped;
+  stats->n_frames_dropped = cpp_stats.n_frames_dropped;
+  stats->lag_frames = cpp_stats.lag_frames;
+  stats->lag_ms = cpp_stats.lag_ms;
+  return NANOTS_EC_OK;
 }
 
-extern "C" {
+nanots_ec_t nanots_writer_promote_mirror(const char* mirror_file_name, const char* file_name) {
+  if (!mirror_file_name || !file_name) {
+    return NANOTS_EC_INVALID_ARGUMENT;
+  }
 
-struct nanots_writer_handle {
-  nanots_writer* writer;
-  nanots_writer_handle(nanots_writer* w) : writer(w) {}
-  ~nanots_writer_handle() { delete writer; }
-};
+  try {
+    nanots_writer::promote_mirror(std::string(mirror_file_name), std::string(file_name));
+    return NANOTS_EC_OK;
+  } catch (const nanots_exception& e) {
+    return e.get_ec();
+  } catch (const std::exception& e) {
+    fprintf(stderr,"Exception in nanots_writer_promote_mirror: %s\n", e.what());
+    return NANOTS_EC_UNKNOWN;
+  } catch (...) {
+    fprintf(stderr,"Exception in nanots_writer_promote_mirror\n");
+    return NANOTS_EC_UNKNOWN;
+  }
+}
 
-struct nanots_write_context_handle {
-  write_context context;
-  nanots_write_context_handle(write_context&& c) : context(std::move(c)) {}
-};
+nanots_ec_t nanots_writer_free_blocks(const char* file_name,
+                                          const char* stream_tag,
+                                          int64_t start_timestamp,
+                                          int64_t end_timestamp) {
+  if (!file_name || !stream_tag) {
+    return NANOTS_EC_INVALID_ARGUMENT;
+  }
 
-struct nanots_reader_handle {
-  nanots_reader* reader;
-  std::vector<std::string> cached_stream_tags;
-  size_t stream_tags_iterator;
-  nanots_reader_handle(nanots_reader* r) : reader(r), stream_tags_iterator(0) {}
-  ~nanots_reader_handle() { delete reader; }
-};
+  try {
+    nanots_writer::free_blocks(std::string(file_name), std::string(stream_tag), start_timestamp, end_timestamp);
+    return NANOTS_EC_OK;
+  } catch (const nanots_exception& e) {
+    return e.get_ec();
+  } catch (const std::exception& e) {
+    fprintf(stderr,"Exception in nanots_writer_free_blocks: %s\n", e.what());
+    return NANOTS_EC_UNKNOWN;
+  } catch (...) {
+    fprintf(stderr,"Exception in nanots_writer_free_blocks\n");
+    return NANOTS_EC_UNKNOWN;
+  }
+}
 
-struct nanots_iterator_handle {
-  nanots_iterator* iterator;
-  nanots_iterator_handle(nanots_iterator* i) : iterator(i) {}
-  ~nanots_iterator_handle() { delete iterator; }
-};
+nanots_ec_t nanots_writer_seal(const char* file_name) {
+  if (!file_name)
+    return NANOTS_EC_INVALID_ARGUMENT;
 
-nanots_ec_t nanots_writer_allocate_file(const char* file_name, uint32_t block_size, uint32_t n_blocks) {
-  nanots_ec_t ec = nanots_ec_t::NANOTS_EC_OK;
   try {
-    nanots_writer::allocate(std::string(file_name), block_size, n_blocks);
+    nanots_writer::seal(std::string(file_name));
+    return NANOTS_EC_OK;
   } catch (const nanots_exception& e) {
-    ec = e.get_ec();
+    return e.get_ec();
   } catch (const std::exception& e) {
-    fprintf(stderr,"Exception in nanots_writer_allocate_file: %s\n", e.what());
-    ec = NANOTS_EC_UNKNOWN;
+    fprintf(stderr,"Exception in nanots_writer_seal: %s\n", e.what());
+    return NANOTS_EC_UNKNOWN;
   } catch (...) {
-    ec = NANOTS_EC_UNKNOWN;
-  }
-  if(ec != NANOTS_EC_OK) {
-    fprintf(stderr,"Error in nanots_writer_allocate_file: %d\n", ec);
+    fprintf(stderr,"Exception in nanots_writer_seal\n");
+    return NANOTS_EC_UNKNOWN;
   }
-  return ec;
 }
 
-nanots_writer_t nanots_writer_create(const char* file_name, int auto_reclaim) {
+nanots_ec_t nanots_writer_backup(const char* file_name, const char* backup_file_name) {
+  if (!file_name || !backup_file_name)
+    return NANOTS_EC_INVALID_ARGUMENT;
+
   try {
-    auto* writer = new nanots_writer(std::string(file_name), auto_reclaim != 0);
-    return new nanots_writer_handle(writer);
+    nanots_writer::backup(std::string(file_name), std::string(backup_file_name));
+    return NANOTS_EC_OK;
+  } catch (const nanots_exception& e) {
+    return e.get_ec();
   } catch (const std::exception& e) {
-    fprintf(stderr,"Exception in nanots_writer_create: %s\n", e.what());
-    return nullptr;
+    fprintf(stderr,"Exception in nanots_writer_backup: %s\n", e.what());
+    return NANOTS_EC_UNKNOWN;
   } catch (...) {
-    return nullptr;
+    fprintf(stderr,"Exception in nanots_writer_backup\n");
+    return NANOTS_EC_UNKNOWN;
   }
 }
 
-void nanots_writer_destroy(nanots_writer_t writer) {
-  delete writer;
-}
+nanots_ec_t nanots_writer_merge(const char* source_file_name, const char* file_name) {
+  if (!source_file_name || !file_name)
+    return NANOTS_EC_INVALID_ARGUMENT;
 
-nanots_write_context_t nanots_writer_create_context(nanots_writer_t writer,
-                                                    const char* stream_tag,
-                                                    const char* metadata) {
-  if (!writer || !writer->writer) {
-    return nullptr;
+  try {
+    nanots_writer::merge(std::string(source_file_name), std::string(file_name));
+    return NANOTS_EC_OK;
+  } catch (const nanots_exception& e) {
+    return e.get_ec();
+  } catch (const std::exception& e) {
+    fprintf(stderr,"Exception in nanots_writer_merge: %s\n", e.what());
+    return NANOTS_EC_UNKNOWN;
+  } catch (...) {
+    fprintf(stderr,"Exception in nanots_writer_merge\n");
+    return NANOTS_EC_UNKNOWN;
   }
+}
 
+nanots_reader_t nanots_reader_create(const char* file_name) {
   try {
-    auto context = writer->writer->create_write_context(std::string(stream_tag),
-                                                        std::string(metadata));
-    return new nanots_write_context_handle(std::move(context));
+    auto* reader = new nanots_reader(std::string(file_name));
+    return new nanots_reader_handle(reader);
   } catch (const nanots_exception& e) {
-    fprintf(stderr,"Error in nanots_writer_create_context: %d", e.get_ec());
+    fprintf(stderr,"Exception in nanots_reader_create: %d", e.get_ec());
     return nullptr;
   } catch (const std::exception& e) {
-    fprintf(stderr,"Exception in nanots_writer_create_context: %s\n", e.what());
+    fprintf(stderr,"Exception in nanots_reader_create: %s\n", e.what());
     return nullptr;
   } catch (...) {
     return nullptr;
   }
 }
 
-void nanots_write_context_destroy(nanots_write_context_t context) {
-  delete context;
+void nanots_reader_destroy(nanots_reader_t reader) {
+  delete reader;
 }
 
-nanots_ec_t nanots_writer_write(nanots_writer_t writer,
-                                nanots_write_context_t context,
-                                const uint8_t* data,
-                                size_t size,
-                                int64_t timestamp,
-                                uint8_t flags) {
-  if (!writer || !writer->writer) {
+struct nanots_callback_context {
+  nanots_read_callback_t callback;
+  void* user_data;
+};
+
+nanots_ec_t nanots_reader_read(nanots_reader_t reader,
+                               const char* stream_tag,
+                               int64_t start_timestamp,
+                               int64_t end_timestamp,
+                               nanots_read_callback_t callback,
+                               void* user_data) {
+  if (!reader || !reader->reader) {
+    return NANOTS_EC_INVALID_ARGUMENT;
+  }
+  if (!callback) {
+    return NANOTS_EC_INVALID_ARGUMENT;
+  }
+
+  try {
+    nanots_callback_context ctx{callback, user_data};
+    reader->reader->read(std::string(stream_tag), start_timestamp, end_timestamp,
+                         [&ctx](const uint8_t* data, size_t size, uint8_t flags,
+                                int64_t timestamp, int64_t block_sequence, const std::string& metadata) {
+                           ctx.callback(data, size, flags, timestamp,
+                                        block_sequence, metadata.c_str(), ctx.user_data);
+                         });
+    return NANOTS_EC_OK;
+  } catch (const nanots_exception& e) {
+    return e.get_ec();
+  } catch (const std::exception& e) {
+    fprintf(stderr,"Exception in nanots_reader_read: %s\n", e.what());
+    return NANOTS_EC_UNKNOWN;
+  } catch (...) {
+    fprintf(stderr,"Exception in nanots_reader_read\n");
+    return NANOTS_EC_UNKNOWN;
+  }
+}
+
+nanots_ec_t nanots_reader_read_ranges(nanots_reader_t reader,
+                                      const char* stream_tag,
+                                      const nanots_time_range_t* ranges,
+                                      size_t n_ranges,
+                                      nanots_read_callback_t callback,
+                                      void* user_data) {
+  if (!reader || !reader->reader) {
     return NANOTS_EC_INVALID_ARGUMENT;
   }
-  if (!context) {
+  if (!callback || !stream_tag || (!ranges && n_ranges > 0)) {
     return NANOTS_EC_INVALID_ARGUMENT;
   }
 
   try {
-    writer->writer->write(context->context, data, size, timestamp, flags);
+    std::vector<std::pair<int64_t, int64_t>> cpp_ranges;
+    cpp_ranges.reserve(n_ranges);
+    for (size_t i = 0; i < n_ranges; i++)
+      cpp_ranges.emplace_back(ranges[i].start_timestamp, ranges[i].end_timestamp);
+
+    nanots_callback_context ctx{callback, user_data};
+    reader->reader->read_ranges(std::string(stream_tag), std::move(cpp_ranges),
+                                [&ctx](const uint8_t* data, size_t size, uint8_t flags,
+                                       int64_t timestamp, int64_t block_sequence, const std::string& metadata) {
+                                  ctx.callback(data, size, flags, timestamp,
+                                               block_sequence, metadata.c_str(), ctx.user_data);
+                                });
     return NANOTS_EC_OK;
   } catch (const nanots_exception& e) {
     return e.get_ec();
   } catch (const std::exception& e) {
-    fprintf(stderr,"Exception in nanots_writer_write: %s\n", e.what());
+    fprintf(stderr,"Exception in nanots_reader_read_ranges: %s\n", e.what());
     return NANOTS_EC_UNKNOWN;
   } catch (...) {
-    fprintf(stderr,"Exception in nanots_writer_write\n");
+    fprintf(stderr,"Exception in nanots_reader_read_ranges\n");
     return NANOTS_EC_UNKNOWN;
   }
 }
 
-nanots_ec_t nanots_writer_free_blocks(const char* file_name,
-                                          const char* stream_tag,
-                                          int64_t start_timestamp,
-                                          int64_t end_timestamp) {
-  if (!file_name || !stream_tag) {
+nanots_ec_t nanots_reader_read_group(nanots_reader_t reader,
+                                     const char* const* stream_tags,
+                                     size_t n_streams,
+                                     int64_t start_timestamp,
+                                     int64_t end_timestamp,
+                                     nanots_group_callback_t callback,
+                                     void* user_data) {
+  if (!reader || !reader->reader || !stream_tags || !callback) {
     return NANOTS_EC_INVALID_ARGUMENT;
   }
 
   try {
-    nanots_writer::free_blocks(std::string(file_name), std::string(stream_tag), start_timestamp, end_timestamp);
+    std::vector<std::string> tags(stream_tags, stream_tags + n_streams);
+    std::vector<nanots_frame_info_t> infos(n_streams);
+    reader->reader->read_group(tags, start_timestamp, end_timestamp,
+                               [&](int64_t timestamp, const std::vector<frame_info>& frames) {
+                                 for (size_t i = 0; i < frames.size(); i++) {
+                                   infos[i].data = frames[i].data;
+                                   infos[i].size = frames[i].size;
+                                   infos[i].flags = frames[i].flags;
+                                   infos[i].timestamp = frames[i].timestamp;
+                                   infos[i].block_sequence = frames[i].block_sequence;
+                                 }
+                                 callback(timestamp, infos.data(), infos.size(), user_data);
+                               });
     return NANOTS_EC_OK;
   } catch (const nanots_exception& e) {
     return e.get_ec();
   } catch (const std::exception& e) {
-    fprintf(stderr,"Exception in nanots_writer_free_blocks: %s\n", e.what());
+    fprintf(stderr,"Exception in nanots_reader_read_group: %s\n", e.what());
     return NANOTS_EC_UNKNOWN;
   } catch (...) {
-    fprintf(stderr,"Exception in nanots_writer_free_blocks\n");
+    fprintf(stderr,"Exception in nanots_reader_read_group\n");
     return NANOTS_EC_UNKNOWN;
   }
 }
 
-nanots_reader_t nanots_reader_create(const char* file_name) {
+nanots_ec_t nanots_reader_read_key(nanots_reader_t reader,
+                                   const char* stream_tag,
+                                   const uint8_t* key,
+                                   size_t key_size,
+                                   nanots_key_extractor_t extractor,
+                                   void* extractor_user_data,
+                                   int64_t start_timestamp,
+                                   int64_t end_timestamp,
+                                   nanots_read_callback_t callback,
+                                   void* user_data) {
+  if (!reader || !reader->reader) {
+    return NANOTS_EC_INVALID_ARGUMENT;
+  }
+  if (!callback || !stream_tag || !key || !extractor) {
+    return NANOTS_EC_INVALID_ARGUMENT;
+  }
+
   try {
-    auto* reader = new nanots_reader(std::string(file_name));
-    return new nanots_reader_handle(reader);
+    auto key_extractor = [extractor, extractor_user_data](const uint8_t* data, size_t size) {
+      const uint8_t* frame_key = nullptr;
+      size_t frame_key_size = extractor(data, size, &frame_key, extractor_user_data);
+      return (frame_key && frame_key_size) ? std::string((const char*)frame_key, frame_key_size)
+                                           : std::string();
+    };
+
+    nanots_callback_context ctx{callback, user_data};
+    reader->reader->read_key(std::string(stream_tag), std::string((const char*)key, key_size),
+                             key_extractor, start_timestamp, end_timestamp,
+                             [&ctx](const uint8_t* data, size_t size, uint8_t flags,
+                                    int64_t timestamp, int64_t block_sequence, const std::string& metadata) {
+                               ctx.callback(data, size, flags, timestamp,
+                                            block_sequence, metadata.c_str(), ctx.user_data);
+                             });
+    return NANOTS_EC_OK;
   } catch (const nanots_exception& e) {
-    fprintf(stderr,"Exception in nanots_reader_create: %d", e.get_ec());
-    return nullptr;
+    return e.get_ec();
   } catch (const std::exception& e) {
-    fprintf(stderr,"Exception in nanots_reader_create: %s\n", e.what());
-    return nullptr;
+    fprintf(stderr,"Exception in nanots_reader_read_key: %s\n", e.what());
+    return NANOTS_EC_UNKNOWN;
   } catch (...) {
-    return nullptr;
+    fprintf(stderr,"Exception in nanots_reader_read_key\n");
+    return NANOTS_EC_UNKNOWN;
   }
 }
 
-void nanots_reader_destroy(nanots_reader_t reader) {
-  delete reader;
-}
-
-struct nanots_callback_context {
-  nanots_read_callback_t callback;
-  void* user_data;
-};
-
-nanots_ec_t nanots_reader_read(nanots_reader_t reader,
-                               const char* stream_tag,
-                               int64_t start_timestamp,
-                               int64_t end_timestamp,
-                               nanots_read_callback_t callback,
-                               void* user_data) {
+nanots_ec_t nanots_reader_read_where(nanots_reader_t reader,
+                                     const char* stream_tag,
+                                     nanots_value_extractor_t extractor,
+                                     void* extractor_user_data,
+                                     double min_value,
+                                     double max_value,
+                                     int64_t start_timestamp,
+                                     int64_t end_timestamp,
+                                     nanots_read_callback_t callback,
+                                     void* user_data) {
   if (!reader || !reader->reader) {
     return NANOTS_EC_INVALID_ARGUMENT;
   }
-  if (!callback) {
+  if (!callback || !stream_tag || !extractor) {
     return NANOTS_EC_INVALID_ARGUMENT;
   }
 
   try {
+    auto value_extractor = [extractor, extractor_user_data](const uint8_t* data,
+                                                            size_t size) -> std::optional<double> {
+      double value = 0;
+      if (!extractor(data, size, &value, extractor_user_data))
+        return std::nullopt;
+      return value;
+    };
+
     nanots_callback_context ctx{callback, user_data};
-    reader->reader->read(std::string(stream_tag), start_timestamp, end_timestamp,
-                         [&ctx](const uint8_t* data, size_t size, uint8_t flags,
-                                int64_t timestamp, int64_t block_sequence, const std::string& metadata) {
-                           ctx.callback(data, size, flags, timestamp,
-                                        block_sequence, metadata.c_str(), ctx.user_data);
-                         });
+    reader->reader->read_where(std::string(stream_tag), value_extractor, min_value, max_value,
+                               start_timestamp, end_timestamp,
+                               [&ctx](const uint8_t* data, size_t size, uint8_t flags,
+                                      int64_t timestamp, int64_t block_sequence, const std::string& metadata) {
+                                 ctx.callback(data, size, flags, timestamp,
+                                              block_sequence, metadata.c_str(), ctx.user_data);
+                               });
     return NANOTS_EC_OK;
   } catch (const nanots_exception& e) {
     return e.get_ec();
   } catch (const std::exception& e) {
-    fprintf(stderr,"Exception in nanots_reader_read: %s\n", e.what());
+    fprintf(stderr,"Exception in nanots_reader_read_where: %s\n", e.what());
     return NANOTS_EC_UNKNOWN;
   } catch (...) {
-    fprintf(stderr,"Exception in nanots_reader_read\n");
+    fprintf(stderr,"Exception in nanots_reader_read_where\n");
     return NANOTS_EC_UNKNOWN;
   }
 }
@@ -1569,6 +6111,102 @@ void nanots_free_contiguous_segments(nanots_contiguous_segment_t* segments) {
   free(segments);
 }
 
+nanots_ec_t nanots_reader_find_gaps(nanots_reader_t reader,
+                                    const char* stream_tag,
+                                    int64_t start_timestamp,
+                                    int64_t end_timestamp,
+                                    int64_t min_gap,
+                                    nanots_gap_t** gaps,
+                                    size_t* count) {
+  if (!reader || !reader->reader) {
+    return NANOTS_EC_INVALID_ARGUMENT;
+  }
+  if (!stream_tag || !gaps || !count) {
+    return NANOTS_EC_INVALID_ARGUMENT;
+  }
+
+  try {
+    auto cpp_gaps = reader->reader->find_gaps(std::string(stream_tag), start_timestamp,
+                                              end_timestamp, min_gap);
+
+    *count = cpp_gaps.size();
+    if (*count == 0) {
+      *gaps = nullptr;
+      return NANOTS_EC_OK;
+    }
+
+    *gaps = (nanots_gap_t*)malloc(*count * sizeof(nanots_gap_t));
+    if (!*gaps) {
+      return NANOTS_EC_UNKNOWN;
+    }
+
+    for (size_t i = 0; i < *count; i++) {
+      (*gaps)[i].start_timestamp = cpp_gaps[i].start_timestamp;
+      (*gaps)[i].end_timestamp = cpp_gaps[i].end_timestamp;
+    }
+
+    return NANOTS_EC_OK;
+  } catch (const nanots_exception& e) {
+    return e.get_ec();
+  } catch (const std::exception& e) {
+    fprintf(stderr,"Exception in nanots_reader_find_gaps: %s\n", e.what());
+    return NANOTS_EC_UNKNOWN;
+  } catch (...) {
+    fprintf(stderr,"Exception in nanots_reader_find_gaps\n");
+    return NANOTS_EC_UNKNOWN;
+  }
+}
+
+void nanots_free_gaps(nanots_gap_t* gaps) {
+  free(gaps);
+}
+
+nanots_ec_t nanots_reader_size_histogram(nanots_reader_t reader,
+                                         const char* stream_tag,
+                                         int64_t start_timestamp,
+                                         int64_t end_timestamp,
+                                         int64_t bucket_size,
+                                         nanots_size_bucket_t** buckets,
+                                         size_t* count) {
+  if (!reader || !reader->reader) {
+    return NANOTS_EC_INVALID_ARGUMENT;
+  }
+  if (!stream_tag || !buckets || !count) {
+    return NANOTS_EC_INVALID_ARGUMENT;
+  }
+
+  try {
+    auto cpp_buckets = reader->reader->size_histogram(std::string(stream_tag), start_timestamp,
+                                                      end_timestamp, bucket_size);
+
+    *count = cpp_buckets.size();
+    *buckets = (nanots_size_bucket_t*)malloc(*count * sizeof(nanots_size_bucket_t));
+    if (!*buckets) {
+      return NANOTS_EC_UNKNOWN;
+    }
+
+    for (size_t i = 0; i < *count; i++) {
+      (*buckets)[i].start_timestamp = cpp_buckets[i].start_timestamp;
+      (*buckets)[i].n_frames = cpp_buckets[i].n_frames;
+      (*buckets)[i].n_bytes = cpp_buckets[i].n_bytes;
+    }
+
+    return NANOTS_EC_OK;
+  } catch (const nanots_exception& e) {
+    return e.get_ec();
+  } catch (const std::exception& e) {
+    fprintf(stderr,"Exception in nanots_reader_size_histogram: %s\n", e.what());
+    return NANOTS_EC_UNKNOWN;
+  } catch (...) {
+    fprintf(stderr,"Exception in nanots_reader_size_histogram\n");
+    return NANOTS_EC_UNKNOWN;
+  }
+}
+
+void nanots_free_size_buckets(nanots_size_bucket_t* buckets) {
+  free(buckets);
+}
+
 nanots_ec_t nanots_reader_query_stream_tags_start(nanots_reader_t reader,
                                                   int64_t start_timestamp,
                                                   int64_t end_timestamp) {
@@ -1623,6 +6261,23 @@ nanots_iterator_t nanots_iterator_create(const char* file_name,
   }
 }
 
+nanots_iterator_t nanots_iterator_clone(nanots_iterator_t iterator) {
+  if (!iterator || !iterator->iterator) {
+    return nullptr;
+  }
+
+  try {
+    auto* clone = new nanots_iterator(*iterator->iterator);
+    return new nanots_iterator_handle(clone);
+  } catch (const std::exception& e) {
+    fprintf(stderr,"Exception in nanots_iterator_clone: %s\n", e.what());
+    return nullptr;
+  } catch (...) {
+    fprintf(stderr,"Exception in nanots_iterator_clone\n");
+    return nullptr;
+  }
+}
+
 void nanots_iterator_destroy(nanots_iterator_t iterator) {
   delete iterator;
 }
@@ -1780,6 +6435,208 @@ const char* nanots_iterator_current_metadata(nanots_iterator_t iterator) {
   return nullptr;
 }
 
+nanots_ec_t nanots_iterator_seek_ordinal(nanots_iterator_t iterator,
+                                         int64_t ordinal) {
+  if (!iterator || !iterator->iterator) {
+    return NANOTS_EC_INVALID_ARGUMENT;
+  }
+
+  try {
+    bool found = iterator->iterator->seek_ordinal(ordinal);
+    return found ? NANOTS_EC_OK : NANOTS_EC_NOT_FOUND;
+  } catch (const nanots_exception& e) {
+    return e.get_ec();
+  } catch (const std::exception& e) {
+    fprintf(stderr,"Exception in nanots_iterator_seek_ordinal: %s\n", e.what());
+    return NANOTS_EC_UNKNOWN;
+  } catch (...) {
+    fprintf(stderr,"Exception in nanots_iterator_seek_ordinal\n");
+    return NANOTS_EC_UNKNOWN;
+  }
+}
+
+int64_t nanots_iterator_ordinal(nanots_iterator_t iterator) {
+  if (!iterator || !iterator->iterator) {
+    return -1;
+  }
+
+  return iterator->iterator->ordinal();
+}
+
+nanots_ec_t nanots_iterator_find_secondary(nanots_iterator_t iterator,
+                                           int64_t key) {
+  if (!iterator || !iterator->iterator) {
+    return NANOTS_EC_INVALID_ARGUMENT;
+  }
+
+  try {
+    bool found = iterator->iterator->find_secondary(key);
+    return found ? NANOTS_EC_OK : NANOTS_EC_NOT_FOUND;
+  } catch (const nanots_exception& e) {
+    return e.get_ec();
+  } catch (const std::exception& e) {
+    fprintf(stderr,"Exception in nanots_iterator_find_secondary: %s\n", e.what());
+    return NANOTS_EC_UNKNOWN;
+  } catch (...) {
+    fprintf(stderr,"Exception in nanots_iterator_find_secondary\n");
+    return NANOTS_EC_UNKNOWN;
+  }
+}
+
+nanots_ec_t nanots_iterator_current_secondary_key(nanots_iterator_t iterator,
+                                                  int64_t* key) {
+  if (!iterator || !iterator->iterator) {
+    return NANOTS_EC_INVALID_ARGUMENT;
+  }
+  if (!key) {
+    return NANOTS_EC_INVALID_ARGUMENT;
+  }
+
+  auto cpp_key = iterator->iterator->current_secondary_key();
+  if (!cpp_key)
+    return NANOTS_EC_NOT_FOUND;
+
+  *key = cpp_key.value();
+  return NANOTS_EC_OK;
+}
+
+nanots_ec_t nanots_iterator_current_token(nanots_iterator_t iterator,
+                                          nanots_cursor_token_t* token) {
+  if (!iterator || !iterator->iterator) {
+    return NANOTS_EC_INVALID_ARGUMENT;
+  }
+  if (!token) {
+    return NANOTS_EC_INVALID_ARGUMENT;
+  }
+  if (!iterator->iterator->valid()) {
+    return NANOTS_EC_INVALID_ARGUMENT;
+  }
+
+  auto cpp_token = iterator->iterator->current_token();
+  token->segment_id = cpp_token.segment_id;
+  token->block_sequence = cpp_token.block_sequence;
+  token->frame_idx = cpp_token.frame_idx;
+  token->timestamp = cpp_token.timestamp;
+  memcpy(token->block_uuid, cpp_token.block_uuid, 16);
+
+  return NANOTS_EC_OK;
+}
+
+nanots_ec_t nanots_iterator_seek_token(nanots_iterator_t iterator,
+                                       const nanots_cursor_token_t* token) {
+  if (!iterator || !iterator->iterator) {
+    return NANOTS_EC_INVALID_ARGUMENT;
+  }
+  if (!token) {
+    return NANOTS_EC_INVALID_ARGUMENT;
+  }
+
+  try {
+    cursor_token cpp_token;
+    cpp_token.segment_id = token->segment_id;
+    cpp_token.block_sequence = token->block_sequence;
+    cpp_token.frame_idx = token->frame_idx;
+    cpp_token.timestamp = token->timestamp;
+    memcpy(cpp_token.block_uuid, token->block_uuid, 16);
+
+    bool exact = iterator->iterator->seek_token(cpp_token);
+    return exact ? NANOTS_EC_OK : NANOTS_EC_NOT_FOUND;
+  } catch (const nanots_exception& e) {
+    return e.get_ec();
+  } catch (const std::exception& e) {
+    fprintf(stderr,"Exception in nanots_iterator_seek_token: %s\n", e.what());
+    return NANOTS_EC_UNKNOWN;
+  } catch (...) {
+    fprintf(stderr,"Exception in nanots_iterator_seek_token\n");
+    return NANOTS_EC_UNKNOWN;
+  }
+}
+
+nanots_ec_t nanots_write_context_enable_live_fanout(nanots_writer_t writer,
+                                                    nanots_write_context_t context) {
+  if (!writer || !writer->writer) {
+    return NANOTS_EC_INVALID_ARGUMENT;
+  }
+  if (!context) {
+    return NANOTS_EC_INVALID_ARGUMENT;
+  }
+
+  try {
+    writer->writer->enable_live_fanout(context->context);
+    return NANOTS_EC_OK;
+  } catch (const nanots_exception& e) {
+    return e.get_ec();
+  } catch (const std::exception& e) {
+    fprintf(stderr,"Exception in nanots_write_context_enable_live_fanout: %s\n", e.what());
+    return NANOTS_EC_UNKNOWN;
+  } catch (...) {
+    fprintf(stderr,"Exception in nanots_write_context_enable_live_fanout\n");
+    return NANOTS_EC_UNKNOWN;
+  }
+}
+
+nanots_live_subscriber_t nanots_live_subscriber_create(const char* file_name,
+                                                       const char* stream_tag) {
+  try {
+    auto* subscriber =
+        new nanots_live_subscriber(std::string(file_name), std::string(stream_tag));
+    return new nanots_live_subscriber_handle(subscriber);
+  } catch (const nanots_exception& e) {
+    fprintf(stderr,"Error in nanots_live_subscriber_create: %d", e.get_ec());
+    return nullptr;
+  } catch (const std::exception& e) {
+    fprintf(stderr,"Exception in nanots_live_subscriber_create: %s\n", e.what());
+    return nullptr;
+  } catch (...) {
+    fprintf(stderr,"Exception in nanots_live_subscriber_create\n");
+    return nullptr;
+  }
+}
+
+void nanots_live_subscriber_destroy(nanots_live_subscriber_t subscriber) {
+  delete subscriber;
+}
+
+nanots_ec_t nanots_live_subscriber_next(nanots_live_subscriber_t subscriber,
+                                        nanots_frame_info_t* frame,
+                                        uint32_t timeout_ms) {
+  if (!subscriber || !subscriber->subscriber) {
+    return NANOTS_EC_INVALID_ARGUMENT;
+  }
+  if (!frame) {
+    return NANOTS_EC_INVALID_ARGUMENT;
+  }
+
+  try {
+    frame_info cpp_frame;
+    if (!subscriber->subscriber->next(cpp_frame, timeout_ms))
+      return NANOTS_EC_NOT_FOUND;
+
+    frame->data = cpp_frame.data;
+    frame->size = cpp_frame.size;
+    frame->flags = cpp_frame.flags;
+    frame->timestamp = cpp_frame.timestamp;
+    frame->block_sequence = cpp_frame.block_sequence;
+    return NANOTS_EC_OK;
+  } catch (const nanots_exception& e) {
+    return e.get_ec();
+  } catch (const std::exception& e) {
+    fprintf(stderr,"Exception in nanots_live_subscriber_next: %s\n", e.what());
+    return NANOTS_EC_UNKNOWN;
+  } catch (...) {
+    fprintf(stderr,"Exception in nanots_live_subscriber_next\n");
+    return NANOTS_EC_UNKNOWN;
+  }
+}
+
+uint64_t nanots_live_subscriber_dropped(nanots_live_subscriber_t subscriber) {
+  if (!subscriber || !subscriber->subscriber) {
+    return 0;
+  }
+
+  return subscriber->subscriber->n_dropped();
+}
+
 }
 
 /* NANOTS */
@@ -46,6 +46,11 @@ private:
 };
 
 #define FILE_HEADER_BLOCK_SIZE 65536
+// A sealed file carries its catalog as a directory following the last block.
+// The file header records the directory's offset and size (0 when unsealed).
+#define FILE_HEADER_DIRECTORY_OFFSET 8
+#define FILE_HEADER_DIRECTORY_SIZE 16
+#define SEALED_DIRECTORY_MAGIC 0x5244544e
 // 8 + 4 + 4 bytes (with padding)
 #define BLOCK_HEADER_SIZE 16
 // 8 + 8 bytes
@@ -55,11 +60,28 @@ private:
 #define FRAME_UUID_OFFSET 0
 #define FRAME_SIZE_OFFSET 16
 #define FRAME_FLAGS_OFFSET 20
+#define BLOCK_FLAGS_OFFSET 12
+// Every frame in the block has an 8 byte secondary key stored directly ahead
+// of its frame header (i.e. at index offset - SECONDARY_KEY_SIZE).
+#define BLOCK_FLAG_SECONDARY_KEYS 0x01
+#define SECONDARY_KEY_SIZE 8
+// Per block bloom filters on the frame key: bits per distinct key and probes.
+#define KEY_BLOOM_BITS_PER_KEY 10
+#define KEY_BLOOM_N_HASHES 7
+// Live fanout rings hold references to the newest LIVE_RING_ENTRIES frames.
+// A ring is a shared memory object holding a header followed by the entries;
+// entry n of the stream lives in slot n % LIVE_RING_ENTRIES.
+#define LIVE_RING_ENTRIES 1024
+#define LIVE_RING_MAGIC 0x4c52544e
+#define LIVE_RING_HEADER_SIZE 64
+#define LIVE_RING_ENTRY_SIZE 64
+// Largest number of buckets size_histogram() will return.
+#define MAX_HISTOGRAM_BUCKETS (1 << 20)
 
 struct block_header {
   int64_t block_start_timestamp{0};
   uint32_t n_valid_indexes{0};
-  uint32_t reserved{0};
+  uint32_t flags{0};
 };
 
 struct index_entry {
@@ -87,9 +109,157 @@ struct segment_block {
   int64_t block_idx{0};
   int64_t start_timestamp{0};
   int64_t end_timestamp{0};
+  int64_t start_ordinal{0};
+  int64_t max_gap{0};
+  std::optional<int64_t> secondary_min;
+  std::optional<int64_t> secondary_max;
+  // Hashes of the distinct frame keys written to the block. Only engaged when a
+  // key extractor was set for the block's first frame.
+  std::optional<std::unordered_set<uint64_t>> key_hashes;
+  // Number of summarized values and their range. Only engaged when a value
+  // extractor was set for the block's first frame.
+  std::optional<uint64_t> n_values;
+  double value_min{0};
+  double value_max{0};
   uint8_t uuid[16];
 };
 
+// A block of a sealed file's directory (one segment_blocks row).
+struct sealed_block {
+  int64_t sequence{0};
+  int64_t block_idx{0};
+  int64_t start_timestamp{0};
+  int64_t end_timestamp{0};
+  std::optional<int64_t> start_ordinal;
+  std::optional<int64_t> n_frames;
+  std::optional<int64_t> max_gap;
+  std::optional<int64_t> n_bytes;
+  std::optional<int64_t> secondary_min;
+  std::optional<int64_t> secondary_max;
+  std::optional<int64_t> n_values;
+  std::optional<double> value_min;
+  std::optional<double> value_max;
+  std::optional<std::string> key_bloom;
+  uint8_t uuid[16];
+};
+
+// A segment of a sealed file's directory with its blocks in sequence order.
+struct sealed_segment {
+  int64_t id{0};
+  std::string stream_tag;
+  std::string metadata;
+  std::vector<sealed_block> blocks;
+};
+
+// Extracts the entity key (symbol, device id, ...) a frame belongs to. An empty
+// key means the frame has none.
+using frame_key_extractor = std::function<std::string(const uint8_t* data, size_t size)>;
+
+// Extracts a numeric field (temperature, price, ...) from a frame, or nullopt
+// if the frame has none.
+using frame_value_extractor = std::function<std::optional<double>(const uint8_t* data, size_t size)>;
+
+// A refcounted handle to an open .nts file and its catalog. Every writer,
+// reader and iterator in a process that opens the same file shares a single
+// nanots_database, so the file descriptor, header geometry, catalog
+// connections and block mappings are set up once rather than per object.
+class nanots_database final {
+ public:
+  // RAII lease on a pooled catalog connection. The connection goes back to the
+  // pool when the lease is destroyed.
+  class catalog_conn final {
+   public:
+    catalog_conn(nanots_database* db, std::unique_ptr<nts_sqlite_conn> conn, bool rw)
+        : _db(db), _conn(std::move(conn)), _rw(rw) {}
+    catalog_conn(const catalog_conn&) = delete;
+    catalog_conn(catalog_conn&&) = default;
+    catalog_conn& operator=(const catalog_conn&) = delete;
+    catalog_conn& operator=(catalog_conn&&) = delete;
+    ~catalog_conn();
+
+    const nts_sqlite_conn& operator*() const { return *_conn; }
+    const nts_sqlite_conn* operator->() const { return _conn.get(); }
+
+   private:
+    nanots_database* _db;
+    std::unique_ptr<nts_sqlite_conn> _conn;
+    bool _rw;
+  };
+
+  nanots_database(const nanots_database&) = delete;
+  nanots_database(nanots_database&&) = delete;
+  nanots_database& operator=(const nanots_database&) = delete;
+  nanots_database& operator=(nanots_database&&) = delete;
+  ~nanots_database() = default;
+
+  // Returns the process wide handle for file_name, opening it if no other
+  // object currently holds it.
+  static std::shared_ptr<nanots_database> open(const std::string& file_name);
+
+  // Creates a database that never touches disk: the blocks live in anonymous
+  // shared memory (memfd on Linux) and the catalog in an in-memory SQLite
+  // database. While the returned handle (or any object built on it) is alive,
+  // open(name) - and so every constructor taking a file name - resolves to it,
+  // even if a file of that name exists. Throws NANOTS_EC_INVALID_ARGUMENT if a
+  // memory database of that name is still alive.
+  static std::shared_ptr<nanots_database> create_in_memory(const std::string& name,
+                                                           uint32_t block_size,
+                                                           uint32_t n_blocks);
+
+  const std::string& file_name() const { return _file_name; }
+  const std::string& database_name() const { return _db_name; }
+  int fd() const { return filenum(_file); }
+  bool writable() const { return _writable; }
+  bool in_memory() const { return _memory_catalog != nullptr && !_sealed; }
+  bool sealed() const { return _sealed; }
+  uint32_t block_size() const { return _block_size; }
+  uint32_t n_blocks() const { return _n_blocks; }
+
+  // Sealed databases have no catalog on disk; the first call loads their
+  // directory into an in-memory catalog. Throws for rw on sealed databases.
+  catalog_conn catalog(bool rw = false);
+
+  // A sealed file's directory, segments ordered by stream tag then id. Empty
+  // unless sealed().
+  const std::vector<sealed_segment>& directory() const { return _directory; }
+
+  // Returns a read only mapping of the block at block_idx. Mappings are shared
+  // by everyone reading the same block and unmapped when the last user lets go.
+  std::shared_ptr<nts_memory_map> map_block(int64_t block_idx);
+
+ private:
+  explicit nanots_database(const std::string& file_name);
+  nanots_database(const std::string& name, nts_file file, const std::string& db_name);
+
+  void _map_header();
+  void _load_directory(uint64_t offset, uint64_t size);
+  void _load_sealed_catalog();
+
+  void _release(std::unique_ptr<nts_sqlite_conn> conn, bool rw);
+
+  std::string _file_name;
+  std::string _db_name;
+  nts_file _file;
+  bool _writable;
+  nts_memory_map _header_mm;
+  uint32_t _block_size;
+  uint32_t _n_blocks;
+  bool _sealed;
+  std::vector<sealed_segment> _directory;
+
+  std::mutex _catalog_lok;
+  std::vector<std::unique_ptr<nts_sqlite_conn>> _ro_conns;
+  std::vector<std::unique_ptr<nts_sqlite_conn>> _rw_conns;
+  // Keeps an in-memory (or loaded sealed) catalog alive.
+  std::unique_ptr<nts_sqlite_conn> _memory_catalog;
+
+  std::mutex _block_maps_lok;
+  std::unordered_map<int64_t, std::weak_ptr<nts_memory_map>> _block_maps;
+};
+
+class nanots_live_ring;
+class nanots_async_queue;
+
 struct write_context final {
   write_context() = default;
   write_context(const write_context&) = delete;
@@ -104,29 +274,194 @@ struct write_context final {
   std::optional<int64_t> last_timestamp;
   std::optional<segment> current_segment;
   std::optional<segment_block> current_block;
-  nts_file file;
+  int64_t next_ordinal{0};
+  // Set by the first write; a context either gives every frame a secondary key
+  // or none.
+  std::optional<bool> secondary_keys;
+  // When set, each block written records a bloom filter of its frame keys so
+  // nanots_reader::read_key() can skip blocks that can't hold a key.
+  frame_key_extractor key_extractor;
+  // When set, each block written records the min/max of the extracted value so
+  // nanots_reader::read_where() can prune blocks from the catalog alone.
+  frame_value_extractor value_extractor;
+  // Set by nanots_writer::enable_live_fanout().
+  std::shared_ptr<nanots_live_ring> live_ring;
+  // Set by the first nanots_writer::write_async().
+  std::shared_ptr<nanots_async_queue> async_queue;
   nts_memory_map mm;
-  std::string file_name;
+  std::shared_ptr<nanots_database> db;
+};
+
+// One frame of nanots_writer::write_group().
+struct group_frame {
+  write_context* wctx{nullptr};
+  const uint8_t* data{nullptr};
+  size_t size{0};
+  uint8_t flags{0};
+};
+
+struct backup_info {
+  // Blocks in use when the catalog was snapshotted.
+  int64_t n_blocks{0};
+  // Blocks copied; the rest were unchanged since the previous backup.
+  int64_t n_blocks_copied{0};
+};
+
+struct merge_stats {
+  uint64_t n_segments{0};
+  uint64_t n_blocks{0};
+  uint64_t n_frames{0};
+  // Source blocks recycled by a writer while they were being copied.
+  uint64_t n_blocks_skipped{0};
+};
+
+// A frame handed to nanots_writer::bulk_load().
+struct bulk_frame {
+  const uint8_t* data{nullptr};
+  size_t size{0};
+  int64_t timestamp{0};
+  uint8_t flags{0};
+  std::optional<int64_t> secondary_key;
+};
+
+// A stream for nanots_writer::bulk_load(). next() fills in the stream's frames
+// in timestamp order and returns false after the last one; frame data need
+// only stay valid until the following call. The extractors are optional and
+// work as they do on a write_context.
+struct bulk_stream {
+  std::string stream_tag;
+  std::string metadata;
+  std::function<bool(bulk_frame& frame)> next;
+  frame_key_extractor key_extractor;
+  frame_value_extractor value_extractor;
+};
+
+struct bulk_load_stats {
+  uint64_t n_frames{0};
+  uint64_t n_blocks{0};
+};
+
+struct mirror_stats {
+  uint64_t n_frames_shipped{0};
+  // Frames the mirror never got: recycled on the primary before they could be
+  // shipped, or rejected by the mirror (e.g. out of blocks).
+  uint64_t n_frames_dropped{0};
+  // Frames written but not yet shipped, and how long the oldest has waited.
+  uint64_t lag_frames{0};
+  int64_t lag_ms{0};
+};
+
+enum class cq_aggregate { COUNT, SUM, MIN, MAX, AVG };
+
+struct continuous_query_result {
+  int64_t query_id{0};
+  // First and last timestamp covered. For per frame queries both are the
+  // frame's timestamp.
+  int64_t window_start{0};
+  int64_t window_end{0};
+  uint64_t n_frames{0};
+  double value{0};
+};
+
+// A lightweight query evaluated as frames of stream_tag are written through a
+// nanots_writer.
+struct continuous_query {
+  std::string stream_tag;
+  // Frames the filter rejects are ignored. Optional.
+  std::function<bool(const uint8_t* data, size_t size)> filter;
+  // Required by every aggregate but COUNT. Frames without a value are ignored.
+  frame_value_extractor value_extractor;
+  cq_aggregate aggregate{cq_aggregate::COUNT};
+  // Width of the tumbling windows, which are aligned to multiples of window. A
+  // window's result is emitted once a frame past its end is written. 0
+  // evaluates every frame on its own.
+  int64_t window{0};
+  // Only results whose value is >= threshold are emitted. Optional.
+  std::optional<double> threshold;
+  // Results go to callback (called on the query worker thread) and, if set,
+  // are appended to derived_stream_tag as continuous_query_result frames.
+  std::function<void(const continuous_query_result&)> callback;
+  std::string derived_stream_tag;
 };
 
 class nanots_writer {
  public:
   nanots_writer(const std::string& file_name, bool auto_reclaim = false);
+  nanots_writer(std::shared_ptr<nanots_database> db, bool auto_reclaim = false);
   nanots_writer(const nanots_writer&) = delete;
-  nanots_writer(nanots_writer&&) = default;
+  nanots_writer(nanots_writer&&);
   nanots_writer& operator=(const nanots_writer&) = delete;
-  nanots_writer& operator=(nanots_writer&&) = default;
-  ~nanots_writer() = default;
+  nanots_writer& operator=(nanots_writer&&);
+  ~nanots_writer();
 
   write_context create_write_context(const std::string& stream_tag,
                                      const std::string& metadata);
 
+  // Creates a context per (stream_tag, metadata) pair with a single catalog
+  // transaction. Either every context is created or none is.
+  std::vector<write_context> create_write_contexts(
+      const std::vector<std::pair<std::string, std::string>>& streams);
+
+  // Closes the contexts as destroying them would, but finalizes all their open
+  // blocks in a single catalog transaction, then clears contexts.
+  void close_write_contexts(std::vector<write_context>& contexts);
+
   void write(write_context& wctx,
              const uint8_t* data,
              size_t size,
              int64_t timestamp,
              uint8_t flags);
 
+  // Same as write() but also stores a secondary key (e.g. capture time or PTS)
+  // with the frame. Secondary keys need not be monotonic.
+  void write(write_context& wctx,
+             const uint8_t* data,
+             size_t size,
+             int64_t timestamp,
+             uint8_t flags,
+             int64_t secondary_key);
+
+  // Queues a frame and returns without touching storage; a background thread
+  // of this writer writes it, rollovers included. The future becomes ready
+  // once the frame is committed (readable) or, if durable, once it has also
+  // been flushed to disk, and carries any write error. data is copied. Each
+  // context has its own queue of 1024 frames, written in order; write_async()
+  // only waits when that queue is full. While frames are pending the context
+  // must not be moved or written synchronously; destroying it waits for them.
+  std::future<void> write_async(write_context& wctx,
+                                const uint8_t* data,
+                                size_t size,
+                                int64_t timestamp,
+                                uint8_t flags,
+                                std::optional<int64_t> secondary_key = std::nullopt,
+                                bool durable = false);
+
+  // Same, but on_complete is called on one of the writer's async threads with
+  // NANOTS_EC_OK or the error instead of fulfilling a future.
+  void write_async(write_context& wctx,
+                   const uint8_t* data,
+                   size_t size,
+                   int64_t timestamp,
+                   uint8_t flags,
+                   std::optional<int64_t> secondary_key,
+                   bool durable,
+                   std::function<void(nanots_ec_t)> on_complete);
+
+  // Blocks until every frame queued on wctx has completed.
+  void drain_async(write_context& wctx);
+
+  // Writes one frame to each of several contexts (e.g. the audio, video and
+  // metadata of one event) under a single timestamp, which marks the group.
+  // All frames are checked and all rollovers done, in one catalog
+  // transaction, before any frame is written; the frames are then published
+  // together. nanots_reader::read_group() reads the groups back.
+  void write_group(const std::vector<group_frame>& frames, int64_t timestamp);
+
+  // Number of threads writing queued frames (default 1). Streams are spread
+  // over the threads and an idle thread takes over a busy one's streams, so a
+  // few threads can carry thousands of contexts. Waits for queued frames.
+  void set_async_threads(size_t n_threads);
+
   static void free_blocks(const std::string& file_name,
                           const std::string& stream_tag,
                           int64_t start_timestamp,
@@ -136,16 +471,143 @@ class nanots_writer {
                        uint32_t block_size,
                        uint32_t n_blocks);
 
+  // Loads pre-sorted historical data without going through write(). Blocks
+  // are built in memory on up to n_threads threads (0 = one per core), one
+  // stream per thread at a time, and each goes to disk in a single write in
+  // file order. Once the data is synced every catalog row is inserted in one
+  // transaction, so an interrupted load leaves the database as it was. Each
+  // stream becomes a new segment. Meant for offline backfills: no writer may
+  // be using the file.
+  static bulk_load_stats bulk_load(const std::string& file_name,
+                                   std::vector<bulk_stream> streams,
+                                   size_t n_threads = 0);
+
+  // Finalizes file_name into an immutable archive: the catalog is written into
+  // the .nts file as a sorted directory and the SQLite sidecar is deleted.
+  // Sealed files open read only, need no sidecar and can't be written again.
+  // No writer may be using the file; open write contexts in this process
+  // are rejected with NANOTS_EC_INVALID_ARGUMENT.
+  static void seal(const std::string& file_name);
+
+  // Backs up file_name to backup_file_name while writers keep running. The
+  // catalog is snapshotted in one transaction and only the blocks it uses are
+  // copied (free blocks stay sparse holes). If backup_file_name already holds
+  // a backup of a database with the same geometry, only blocks whose segment
+  // block uuid changed, or that were still being written, are copied again.
+  static backup_info backup(const std::string& file_name, const std::string& backup_file_name);
+
+  // Appends every finalized block of source_file_name to file_name. Blocks are
+  // copied whole into free blocks of file_name with file to file copies, then
+  // checked against their catalog rows; only the catalog is rewritten: each
+  // source segment becomes a new segment with the same stream tag, metadata
+  // and block sequence, and ordinals continue the destination's. Both files
+  // must use the same block size. Writers of other streams may keep running.
+  static merge_stats merge(const std::string& source_file_name, const std::string& file_name);
+
+  // Publishes a reference to every frame subsequently written with wctx to the
+  // stream's live ring, a small named shared memory object, so
+  // nanots_live_subscriber objects in any local process can follow the stream.
+  // The ring is removed when the last writer publishing to it closes.
+  void enable_live_fanout(write_context& wctx);
+
+  // Removes a stream's live ring, if any, e.g. one left behind by a writer
+  // that crashed. Subscribers that still have it open keep their mapping but
+  // will see no new frames.
+  static void remove_live_ring(const std::string& file_name, const std::string& stream_tag);
+
+  // Continuous queries are evaluated on a background worker as frames are
+  // written through this writer. Frames are read in place from the block,
+  // never copied. Returns an id for unregister_continuous_query().
+  int64_t register_continuous_query(continuous_query query);
+
+  // No results are delivered for the query once this returns. Must not be
+  // called from a query callback.
+  void unregister_continuous_query(int64_t query_id);
+
+  // Blocks until every frame written so far has been evaluated.
+  void drain_continuous_queries();
+
+  // Replicates every frame subsequently written through this writer to the
+  // database at mirror_file_name (allocated beforehand, e.g. on another disk).
+  // A background shipper copies committed frames from their blocks in write
+  // order, so write() only waits once max_lag frames are unshipped. Ranges
+  // passed to free_blocks() on the primary are replayed on the mirror in the
+  // same order; other catalog changes (e.g. blocks reclaimed when the primary
+  // runs full) are not, as the mirror reclaims on its own.
+  void enable_mirror(const std::string& mirror_file_name, size_t max_lag = 10000);
+
+  // Blocks until every frame written so far has been shipped to the mirror.
+  void drain_mirror();
+
+  mirror_stats get_mirror_stats() const;
+
+  // Makes a mirror the primary after the primary is lost: blocks left open are
+  // closed out as when a writer opens the file, then the mirror's data file
+  // and catalog are moved to file_name. Nothing may have either file open.
+  static void promote_mirror(const std::string& mirror_file_name, const std::string& file_name);
+
  private:
-  std::string _file_name;
-  uint64_t _file_size;
-  nts_file _file;
-  nts_memory_map _file_header_mm;
-  uint8_t* _file_header_p;
+  class cq_engine;
+  class mirror_shipper;
+  class async_engine;
+
+  // Used for derived streams. Skips crash recovery, which would otherwise
+  // finalize the open blocks of live writers.
+  nanots_writer(std::shared_ptr<nanots_database> db, bool auto_reclaim, bool validate);
+
+  void _write(write_context& wctx,
+              const uint8_t* data,
+              size_t size,
+              int64_t timestamp,
+              uint8_t flags,
+              const int64_t* secondary_key);
+
+  // Maps wctx's newly acquired block and resets its header for timestamp.
+  void _map_block(write_context& wctx, int64_t timestamp);
+
+  struct pending_write {
+    write_context* wctx;
+    size_t size;
+    uint32_t key_size;
+    int64_t timestamp;
+  };
+
+  // Gives every context a block with room for its pending frame. Full blocks
+  // are finalized and new ones acquired in a single catalog transaction.
+  void _prepare_blocks(const std::vector<pending_write>& writes);
+
+  // Copies a frame and its index entry into wctx's block without publishing
+  // it; returns the frame's offset.
+  uint64_t _stage(write_context& wctx,
+                  const uint8_t* data,
+                  size_t size,
+                  int64_t timestamp,
+                  uint8_t flags,
+                  const int64_t* secondary_key);
+
+  // Makes a staged frame visible to readers.
+  void _publish(write_context& wctx, uint64_t frame_offset, int64_t timestamp, bool has_key);
+
+  void _write_async(write_context& wctx,
+                    const uint8_t* data,
+                    size_t size,
+                    int64_t timestamp,
+                    uint8_t flags,
+                    std::optional<int64_t> secondary_key,
+                    bool durable,
+                    std::function<void(std::exception_ptr)> on_complete);
+
+  std::shared_ptr<nanots_database> _db;
   uint32_t _block_size;
   uint32_t _n_blocks;
   bool _auto_reclaim;
   std::set<std::string> _active_stream_tags;
+  std::unique_ptr<cq_engine> _cq;
+  std::unique_ptr<mirror_shipper> _mirror;
+  std::mutex _async_lok;
+  size_t _async_threads{1};
+  // Last, so it is destroyed (and its queued frames written) first.
+  std::unique_ptr<async_engine> _async;
 };
 
 struct contiguous_segment {
@@ -154,9 +616,33 @@ struct contiguous_segment {
   int64_t end_timestamp{0};
 };
 
+// Missing data between two consecutive frames of a stream. The timestamps are
+// those of the frames on either side of the gap.
+struct gap {
+  int64_t start_timestamp{0};
+  int64_t end_timestamp{0};
+};
+
+// Frame count and stored bytes (frame headers and alignment padding included)
+// for the bucket [start_timestamp, start_timestamp + bucket_size).
+struct size_bucket {
+  int64_t start_timestamp{0};
+  uint64_t n_frames{0};
+  uint64_t n_bytes{0};
+};
+
+struct frame_info {
+  const uint8_t* data{nullptr};
+  size_t size{0};
+  uint8_t flags{0};
+  int64_t timestamp{0};
+  int64_t block_sequence{0};
+};
+
 class nanots_reader {
  public:
   nanots_reader(const std::string& file_name);
+  nanots_reader(std::shared_ptr<nanots_database> db);
   nanots_reader(const nanots_reader&) = delete;
   nanots_reader(nanots_reader&&) = default;
   nanots_reader& operator=(const nanots_reader&) = delete;
@@ -169,7 +655,72 @@ class nanots_reader {
       int64_t end_timestamp,
       const std::function<
           void(const uint8_t*, size_t, uint8_t, int64_t, int64_t, const std::string&)>& callback);
-  
+
+  // Reads several time ranges (inclusive) of one stream. Ranges are sorted and
+  // coalesced, the blocks for all of them come from a single catalog query and
+  // each block is mapped once no matter how many ranges it serves.
+  void read_ranges(
+      const std::string& stream_tag,
+      std::vector<std::pair<int64_t, int64_t>> ranges,
+      const std::function<
+          void(const uint8_t*, size_t, uint8_t, int64_t, int64_t, const std::string&)>& callback);
+
+  // Reads the frames in [start_timestamp, end_timestamp] whose key, as computed
+  // by key_extractor, equals key. Blocks whose bloom filter rules the key out
+  // are skipped without being mapped. Blocks without a filter (still open,
+  // recovered after a crash, or written without an extractor) are scanned.
+  void read_key(
+      const std::string& stream_tag,
+      const std::string& key,
+      const frame_key_extractor& key_extractor,
+      int64_t start_timestamp,
+      int64_t end_timestamp,
+      const std::function<
+          void(const uint8_t*, size_t, uint8_t, int64_t, int64_t, const std::string&)>& callback);
+
+  // Reads the frames in [start_timestamp, end_timestamp] whose value, as
+  // computed by value_extractor, lies in [min_value, max_value]. Blocks whose
+  // recorded value range can't match are pruned in the catalog query. Blocks
+  // without a summary are scanned.
+  void read_where(
+      const std::string& stream_tag,
+      const frame_value_extractor& value_extractor,
+      double min_value,
+      double max_value,
+      int64_t start_timestamp,
+      int64_t end_timestamp,
+      const std::function<
+          void(const uint8_t*, size_t, uint8_t, int64_t, int64_t, const std::string&)>& callback);
+
+  // Reads the groups written by nanots_writer::write_group(): for every
+  // timestamp in [start_timestamp, end_timestamp] at which each of stream_tags
+  // has a frame, callback gets the frames in stream_tags order. Groups missing
+  // a frame (e.g. cut short by a crash) are skipped. The blocks of all the
+  // streams come from a single catalog query.
+  void read_group(
+      const std::vector<std::string>& stream_tags,
+      int64_t start_timestamp,
+      int64_t end_timestamp,
+      const std::function<void(int64_t, const std::vector<frame_info>&)>& callback);
+
+  // Returns every gap longer than min_gap between consecutive frames that
+  // overlaps [start_timestamp, end_timestamp]. Only the catalog and the block
+  // indexes are consulted, and blocks whose recorded max gap is too small to
+  // matter are skipped without being mapped.
+  std::vector<gap> find_gaps(const std::string& stream_tag,
+                             int64_t start_timestamp,
+                             int64_t end_timestamp,
+                             int64_t min_gap);
+
+  // Buckets [start_timestamp, end_timestamp] into fixed width buckets and
+  // reports frames and bytes per bucket, using only the block indexes. Blocks
+  // that fall in a single bucket are answered from the catalog totals. Throws
+  // NANOTS_EC_INVALID_ARGUMENT for more than MAX_HISTOGRAM_BUCKETS buckets.
+  std::vector<size_bucket> size_histogram(const std::string& stream_tag,
+                                          int64_t start_timestamp,
+                                          int64_t end_timestamp,
+                                          int64_t bucket_size);
+
   std::vector<std::string> query_stream_tags(int64_t start_timestamp, int64_t end_timestamp);
 
   std::vector<contiguous_segment> query_contiguous_segments(
@@ -178,18 +729,18 @@ class nanots_reader {
       int64_t end_timestamp);
 
  private:
-  std::string _file_name;
-  nts_file _file;
+  std::shared_ptr<nanots_database> _db;
   uint32_t _block_size;
-  uint32_t _n_blocks;
 };
 
-struct frame_info {
-  const uint8_t* data{nullptr};
-  size_t size{0};
-  uint8_t flags{0};
-  int64_t timestamp{0};
+// Identifies a single frame so a consumer can persist its position and resume
+// later without searching. Treat the contents as opaque.
+struct cursor_token {
+  int64_t segment_id{0};
   int64_t block_sequence{0};
+  int64_t frame_idx{0};
+  int64_t timestamp{0};
+  uint8_t block_uuid[16]{};
 };
 
 struct block_info {
@@ -200,11 +751,13 @@ struct block_info {
   std::string uuid_hex;
   int64_t start_timestamp{0};
   int64_t end_timestamp{0};
+  int64_t start_ordinal{-1};
 
   // Loaded block data
-  nts_memory_map mm;
+  std::shared_ptr<nts_memory_map> mm;
   uint8_t* block_p{nullptr};
   uint32_t n_valid_indexes{0};
+  uint32_t key_size{0};
   uint8_t uuid[16];
   bool is_loaded{false};
 };
@@ -212,9 +765,12 @@ struct block_info {
 class nanots_iterator {
  public:
   nanots_iterator(const std::string& file_name, const std::string& stream_tag);
-  nanots_iterator(const nanots_iterator&) = delete;
+  nanots_iterator(std::shared_ptr<nanots_database> db, const std::string& stream_tag);
+  // Copies are cheap: the clone starts at the same position and shares the
+  // block cache with the original until either of them has to extend it.
+  nanots_iterator(const nanots_iterator&) = default;
   nanots_iterator(nanots_iterator&&) = default;
-  nanots_iterator& operator=(const nanots_iterator&) = delete;
+  nanots_iterator& operator=(const nanots_iterator&) = default;
   nanots_iterator& operator=(nanots_iterator&&) = default;
   ~nanots_iterator() = default;
 
@@ -229,11 +785,28 @@ class nanots_iterator {
   bool find(int64_t timestamp);  // Find first frame >= timestamp
   void reset();                   // Go to first frame
 
+  // Position on the frame a token was taken from. Returns false if that frame
+  // no longer exists (e.g. its block was reclaimed), in which case this falls
+  // back to find(token.timestamp); check valid() afterwards.
+  bool seek_token(const cursor_token& token);
+
+  // Position on the Nth frame ever written to this stream (0 based). Ordinals
+  // are assigned at write time and survive the freeing of older blocks.
+  bool seek_ordinal(int64_t ordinal);
+
+  // Find the first frame, in stream order, whose secondary key is >= key.
+  // Blocks are pruned with the per block key range kept in the catalog.
+  bool find_secondary(int64_t key);
+
   // Utility
   int64_t current_block_sequence() const { return _current_block_sequence; }
   const std::string& current_metadata() const;
+  cursor_token current_token() const;
+  int64_t ordinal() const;  // -1 if unknown
+  std::optional<int64_t> current_secondary_key() const;
 
  private:
+  const block_info* _current_block() const;
   block_info* _get_block_by_segment_and_sequence(int64_t segment_id, int64_t sequence);
   block_info* _get_first_block();
   block_info* _get_next_block();
@@ -243,9 +816,8 @@ class nanots_iterator {
   bool _load_block_data(block_info& block);
   bool _load_current_frame();
 
-  std::string _file_name;
+  std::shared_ptr<nanots_database> _db;
   std::string _stream_tag;
-  nts_file _file;
   uint32_t _block_size;
 
   // Current position
@@ -255,7 +827,8 @@ class nanots_iterator {
 
   // Cache of visited blocks (segment_id:sequence -> block_info)
   // Using string key for simplicity: "segment_id:sequence"
-  std::unordered_map<std::string, block_info> _block_cache;
+  using block_cache = std::unordered_map<std::string, std::shared_ptr<block_info>>;
+  std::shared_ptr<block_cache> _block_cache;
 
   // Cached current frame
   frame_info _current_frame;
@@ -263,6 +836,36 @@ class nanots_iterator {
   bool _initialized;
 };
 
+// Follows the newest frames of a stream through its live ring (see
+// nanots_writer::enable_live_fanout). Frames are read in place from the data
+// file without touching the catalog. A subscriber that falls more than a ring's
+// worth of frames behind skips ahead; the skipped frames are counted in
+// n_dropped().
+class nanots_live_subscriber {
+ public:
+  nanots_live_subscriber(const std::string& file_name, const std::string& stream_tag);
+  nanots_live_subscriber(std::shared_ptr<nanots_database> db, const std::string& stream_tag);
+  nanots_live_subscriber(const nanots_live_subscriber&) = delete;
+  nanots_live_subscriber(nanots_live_subscriber&&) = default;
+  nanots_live_subscriber& operator=(const nanots_live_subscriber&) = delete;
+  nanots_live_subscriber& operator=(nanots_live_subscriber&&) = default;
+  ~nanots_live_subscriber() = default;
+
+  // Waits up to timeout_ms for the next frame published after the subscriber
+  // was created. frame.data stays valid until the next call.
+  bool next(frame_info& frame, uint32_t timeout_ms);
+
+  uint64_t n_dropped() const { return _n_dropped; }
+
+ private:
+  std::shared_ptr<nanots_database> _db;
+  std::shared_ptr<nanots_live_ring> _ring;
+  std::shared_ptr<nts_memory_map> _mm;
+  int64_t _mm_block_idx;
+  uint64_t _next_seq;
+  uint64_t _n_dropped;
+};
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -271,6 +874,7 @@ typedef struct nanots_writer_handle* nanots_writer_t;
 typedef struct nanots_write_context_handle* nanots_write_context_t;
 typedef struct nanots_reader_handle* nanots_reader_t;
 typedef struct nanots_iterator_handle* nanots_iterator_t;
+typedef struct nanots_live_subscriber_handle* nanots_live_subscriber_t;
 
 typedef struct {
   int64_t segment_id;
@@ -278,6 +882,22 @@ typedef struct {
   int64_t end_timestamp;
 } nanots_contiguous_segment_t;
 
+typedef struct {
+  int64_t start_timestamp;
+  int64_t end_timestamp;
+} nanots_time_range_t;
+
+typedef struct {
+  int64_t start_timestamp;
+  int64_t end_timestamp;
+} nanots_gap_t;
+
+typedef struct {
+  int64_t start_timestamp;
+  uint64_t n_frames;
+  uint64_t n_bytes;
+} nanots_size_bucket_t;
+
 typedef struct {
   const uint8_t* data;
   size_t size;
@@ -286,6 +906,14 @@ typedef struct {
   int64_t block_sequence;
 } nanots_frame_info_t;
 
+typedef struct {
+  int64_t segment_id;
+  int64_t block_sequence;
+  int64_t frame_idx;
+  int64_t timestamp;
+  uint8_t block_uuid[16];
+} nanots_cursor_token_t;
+
 typedef void (*nanots_read_callback_t)(const uint8_t* data,
                                        size_t size,
                                        uint8_t flags,
@@ -294,6 +922,54 @@ typedef void (*nanots_read_callback_t)(const uint8_t* data,
                                        const char* metadata,
                                        void* user_data);
 
+// Returns the length of the frame's key and points *key at it (0 if the frame
+// has no key). The key must stay valid until the next call.
+typedef size_t (*nanots_key_extractor_t)(const uint8_t* data,
+                                         size_t size,
+                                         const uint8_t** key,
+                                         void* user_data);
+
+// Stores the frame's value in *value and returns non zero, or returns 0 if the
+// frame has no value.
+typedef int (*nanots_value_extractor_t)(const uint8_t* data,
+                                        size_t size,
+                                        double* value,
+                                        void* user_data);
+
+typedef enum {
+  NANOTS_CQ_COUNT = 0,
+  NANOTS_CQ_SUM = 1,
+  NANOTS_CQ_MIN = 2,
+  NANOTS_CQ_MAX = 3,
+  NANOTS_CQ_AVG = 4
+} nanots_cq_aggregate_t;
+
+typedef struct {
+  int64_t query_id;
+  int64_t window_start;
+  int64_t window_end;
+  uint64_t n_frames;
+  double value;
+} nanots_cq_result_t;
+
+// Returns non zero to keep the frame.
+typedef int (*nanots_frame_filter_t)(const uint8_t* data, size_t size, void* user_data);
+
+typedef void (*nanots_cq_callback_t)(const nanots_cq_result_t* result, void* user_data);
+
+typedef struct {
+  const char* stream_tag;
+  nanots_frame_filter_t filter;              // optional
+  nanots_value_extractor_t value_extractor;  // optional for NANOTS_CQ_COUNT
+  nanots_cq_aggregate_t aggregate;
+  int64_t window;                            // 0 evaluates every frame
+  int has_threshold;
+  double threshold;
+  nanots_cq_callback_t callback;             // optional with a derived stream
+  const char* derived_stream_tag;            // optional
+  void* user_data;                           // passed to every callback above
+} nanots_continuous_query_t;
+
 nanots_ec_t nanots_writer_allocate_file(const char* file_name, uint32_t block_size, uint32_t n_blocks);
 
 // writer
@@ -307,6 +983,29 @@ nanots_write_context_t nanots_writer_create_context(nanots_writer_t writer,
 
 void nanots_write_context_destroy(nanots_write_context_t context);
 
+// Creates n contexts in one transaction; on success contexts[i] is the context
+// for stream_tags[i] and metadata[i], on failure nothing is created.
+nanots_ec_t nanots_writer_create_contexts(nanots_writer_t writer,
+                                          const char* const* stream_tags,
+                                          const char* const* metadata,
+                                          size_t n,
+                                          nanots_write_context_t* contexts);
+
+// Closes and destroys n contexts, finalizing their blocks in one transaction.
+nanots_ec_t nanots_writer_close_contexts(nanots_writer_t writer,
+                                         nanots_write_context_t* contexts,
+                                         size_t n);
+
+// Pass a NULL extractor to stop recording key filters.
+nanots_ec_t nanots_write_context_set_key_extractor(nanots_write_context_t context,
+                                                   nanots_key_extractor_t extractor,
+                                                   void* user_data);
+
+// Pass a NULL extractor to stop recording value summaries.
+nanots_ec_t nanots_write_context_set_value_extractor(nanots_write_context_t context,
+                                                     nanots_value_extractor_t extractor,
+                                                     void* user_data);
+
 nanots_ec_t nanots_writer_write(nanots_writer_t writer,
                                     nanots_write_context_t context,
                                     const uint8_t* data,
@@ -314,11 +1013,86 @@ nanots_ec_t nanots_writer_write(nanots_writer_t writer,
                                     int64_t timestamp,
                                     uint8_t flags);
 
+nanots_ec_t nanots_writer_write_secondary(nanots_writer_t writer,
+                                         nanots_write_context_t context,
+                                         const uint8_t* data,
+                                         size_t size,
+                                         int64_t timestamp,
+                                         uint8_t flags,
+                                         int64_t secondary_key);
+
+typedef void (*nanots_write_callback_t)(nanots_ec_t ec, void* user_data);
+
+// Queues a frame (see nanots_writer::write_async()); callback, if not NULL, is
+// called from the writer's async thread once the frame is committed, or
+// durable when durable is non zero. secondary_key may be NULL.
+nanots_ec_t nanots_writer_write_async(nanots_writer_t writer,
+                                      nanots_write_context_t context,
+                                      const uint8_t* data,
+                                      size_t size,
+                                      int64_t timestamp,
+                                      uint8_t flags,
+                                      const int64_t* secondary_key,
+                                      int durable,
+                                      nanots_write_callback_t callback,
+                                      void* user_data);
+
+nanots_ec_t nanots_writer_drain_async(nanots_writer_t writer, nanots_write_context_t context);
+
+nanots_ec_t nanots_writer_set_async_threads(nanots_writer_t writer, size_t n_threads);
+
+// Writes data[i] (sizes[i] bytes, flags[i]) to contexts[i] for i < n, all at
+// timestamp (see nanots_writer::write_group()). flags may be NULL.
+nanots_ec_t nanots_writer_write_group(nanots_writer_t writer,
+                                      const nanots_write_context_t* contexts,
+                                      const uint8_t* const* data,
+                                      const size_t* sizes,
+                                      const uint8_t* flags,
+                                      size_t n,
+                                      int64_t timestamp);
+
+nanots_ec_t nanots_writer_register_continuous_query(nanots_writer_t writer,
+                                                    const nanots_continuous_query_t* query,
+                                                    int64_t* query_id);
+
+nanots_ec_t nanots_writer_unregister_continuous_query(nanots_writer_t writer,
+                                                      int64_t query_id);
+
+nanots_ec_t nanots_writer_drain_continuous_queries(nanots_writer_t writer);
+
+typedef struct {
+  uint64_t n_frames_shipped;
+  uint64_t n_frames_dropped;
+  uint64_t lag_frames;
+  int64_t lag_ms;
+} nanots_mirror_stats_t;
+
+nanots_ec_t nanots_writer_enable_mirror(nanots_writer_t writer,
+                                        const char* mirror_file_name,
+                                        size_t max_lag);
+
+nanots_ec_t nanots_writer_drain_mirror(nanots_writer_t writer);
+
+nanots_ec_t nanots_writer_mirror_stats(nanots_writer_t writer, nanots_mirror_stats_t* stats);
+
+nanots_ec_t nanots_writer_promote_mirror(const char* mirror_file_name, const char* file_name);
+
 nanots_ec_t nanots_writer_free_blocks(const char* file_name,
                                       const char* stream_tag,
                                       int64_t start_timestamp,
                                       int64_t end_timestamp);
 
+// Makes file_name an immutable archive (see nanots_writer::seal()).
+nanots_ec_t nanots_writer_seal(const char* file_name);
+
+// Backs up file_name, incrementally if backup_file_name holds an earlier
+// backup (see nanots_writer::backup()).
+nanots_ec_t nanots_writer_backup(const char* file_name, const char* backup_file_name);
+
+// Copies the finalized blocks of source_file_name into file_name (see
+// nanots_writer::merge()).
+nanots_ec_t nanots_writer_merge(const char* source_file_name, const char* file_name);
+
 // reader
 nanots_reader_t nanots_reader_create(const char* file_name);
 
@@ -331,6 +1105,49 @@ nanots_ec_t nanots_reader_read(nanots_reader_t reader,
                                nanots_read_callback_t callback,
                                void* user_data);
 
+nanots_ec_t nanots_reader_read_ranges(nanots_reader_t reader,
+                                      const char* stream_tag,
+                                      const nanots_time_range_t* ranges,
+                                      size_t n_ranges,
+                                      nanots_read_callback_t callback,
+                                      void* user_data);
+
+// frames[i] belongs to stream_tags[i] of nanots_reader_read_group().
+typedef void (*nanots_group_callback_t)(int64_t timestamp,
+                                        const nanots_frame_info_t* frames,
+                                        size_t n_frames,
+                                        void* user_data);
+
+nanots_ec_t nanots_reader_read_group(nanots_reader_t reader,
+                                     const char* const* stream_tags,
+                                     size_t n_streams,
+                                     int64_t start_timestamp,
+                                     int64_t end_timestamp,
+                                     nanots_group_callback_t callback,
+                                     void* user_data);
+
+nanots_ec_t nanots_reader_read_key(nanots_reader_t reader,
+                                   const char* stream_tag,
+                                   const uint8_t* key,
+                                   size_t key_size,
+                                   nanots_key_extractor_t extractor,
+                                   void* extractor_user_data,
+                                   int64_t start_timestamp,
+                                   int64_t end_timestamp,
+                                   nanots_read_callback_t callback,
+                                   void* user_data);
+
+nanots_ec_t nanots_reader_read_where(nanots_reader_t reader,
+                                     const char* stream_tag,
+                                     nanots_value_extractor_t extractor,
+                                     void* extractor_user_data,
+                                     double min_value,
+                                     double max_value,
+                                     int64_t start_timestamp,
+                                     int64_t end_timestamp,
+                                     nanots_read_callback_t callback,
+                                     void* user_data);
+
 nanots_ec_t nanots_reader_query_contiguous_segments(
     nanots_reader_t reader,
     const char* stream_tag,
@@ -341,6 +1158,26 @@ nanots_ec_t nanots_reader_query_contiguous_segments(
 
 void nanots_free_contiguous_segments(nanots_contiguous_segment_t* segments);
 
+nanots_ec_t nanots_reader_find_gaps(nanots_reader_t reader,
+                                    const char* stream_tag,
+                                    int64_t start_timestamp,
+                                    int64_t end_timestamp,
+                                    int64_t min_gap,
+                                    nanots_gap_t** gaps,
+                                    size_t* count);
+
+void nanots_free_gaps(nanots_gap_t* gaps);
+
+nanots_ec_t nanots_reader_size_histogram(nanots_reader_t reader,
+                                         const char* stream_tag,
+                                         int64_t start_timestamp,
+                                         int64_t end_timestamp,
+                                         int64_t bucket_size,
+                                         nanots_size_bucket_t** buckets,
+                                         size_t* count);
+
+void nanots_free_size_buckets(nanots_size_bucket_t* buckets);
+
 nanots_ec_t nanots_reader_query_stream_tags_start(nanots_reader_t reader,
                                                   int64_t start_timestamp,
                                                   int64_t end_timestamp);
@@ -350,6 +1187,8 @@ const char* nanots_reader_query_stream_tags_next(nanots_reader_t reader);
 // iterator
 nanots_iterator_t nanots_iterator_create(const char* file_name,
                                          const char* stream_tag);
+// Returns a new iterator positioned where iterator currently is.
+nanots_iterator_t nanots_iterator_clone(nanots_iterator_t iterator);
 void nanots_iterator_destroy(nanots_iterator_t iterator);
 
 int nanots_iterator_valid(nanots_iterator_t iterator);
@@ -371,6 +1210,42 @@ int64_t nanots_iterator_current_block_sequence(nanots_iterator_t iterator);
 
 const char* nanots_iterator_current_metadata(nanots_iterator_t iterator);
 
+nanots_ec_t nanots_iterator_seek_ordinal(nanots_iterator_t iterator,
+                                         int64_t ordinal);
+
+int64_t nanots_iterator_ordinal(nanots_iterator_t iterator);
+
+nanots_ec_t nanots_iterator_find_secondary(nanots_iterator_t iterator,
+                                           int64_t key);
+
+// Returns NANOTS_EC_NOT_FOUND if the current frame has no secondary key.
+nanots_ec_t nanots_iterator_current_secondary_key(nanots_iterator_t iterator,
+                                                  int64_t* key);
+
+nanots_ec_t nanots_iterator_current_token(nanots_iterator_t iterator,
+                                          nanots_cursor_token_t* token);
+
+// Returns NANOTS_EC_NOT_FOUND if the token's frame is gone, in which case the
+// iterator was positioned with find(token->timestamp) instead.
+nanots_ec_t nanots_iterator_seek_token(nanots_iterator_t iterator,
+                                       const nanots_cursor_token_t* token);
+
+// live fanout
+nanots_ec_t nanots_write_context_enable_live_fanout(nanots_writer_t writer,
+                                                    nanots_write_context_t context);
+
+nanots_live_subscriber_t nanots_live_subscriber_create(const char* file_name,
+                                                       const char* stream_tag);
+
+void nanots_live_subscriber_destroy(nanots_live_subscriber_t subscriber);
+
+// Returns NANOTS_EC_NOT_FOUND if no frame arrived within timeout_ms.
+nanots_ec_t nanots_live_subscriber_next(nanots_live_subscriber_t subscriber,
+                                        nanots_frame_info_t* frame,
+                                        uint32_t timeout_ms);
+
+uint64_t nanots_live_subscriber_dropped(nanots_live_subscriber_t subscriber);
+
 #ifdef __cplusplus
 }
 #endif
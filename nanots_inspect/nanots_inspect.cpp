@@ -0,0 +1,662 @@
+// nanots_inspect - reports on the layout and health of a nanots database.
+//
+//   nanots_inspect info <file.nts>
+//     File geometry, block status counts and, per stream, segments, blocks,
+//     frames, frames per block, fill ratio and the age of the oldest block
+//     (the next to go when blocks are reclaimed).
+//
+//   nanots_inspect fsck <file.nts> [--threads <n>]
+//     Checks every block in the catalog against its row: valid index count,
+//     increasing timestamps within the row's range, frame offsets and sizes
+//     inside the block and frame header uuids. Blocks are checked in parallel
+//     (default: one thread per core). Exits with 1 if anything is wrong.
+//
+//   nanots_inspect advise <file.nts> [--block-sizes <size,...>]
+//                                    [--capacity <size>] [--ticks-per-second <n>]
+//     Profiles each stream from its block indexes (rates, frame size
+//     percentiles, segments, rollovers) and replays the recorded frames into
+//     other block sizes, reporting for each the rollover rate, wasted space,
+//     the most data a crash can cost and how far back data reaches with the
+//     same capacity (default: this file's). Sizes take K, M or G suffixes;
+//     timestamps are taken to be microseconds unless told otherwise.
+//
+// All only read; they are safe to run next to live writers, though blocks
+// being written or reclaimed while fsck runs can show up as errors.
+
+#include "nanots.h"
+
+#include <algorithm>
+#include <cinttypes>
+#include <cmath>
+#include <cstdio>
+
+using namespace std;
+
+static void _usage() {
+  fprintf(stderr,
+          "usage: nanots_inspect info <file.nts>\n"
+          "       nanots_inspect fsck <file.nts> [--threads <n>]\n"
+          "       nanots_inspect advise <file.nts> [--block-sizes <size,...>] [--capacity <size>]\n"
+          "                                        [--ticks-per-second <n>]\n");
+}
+
+static int64_t _column_int64(const map<string, optional<string>>& row, const string& name) {
+  auto found = row.find(name);
+  return (found != row.end() && found->second) ? stoll(*found->second) : 0;
+}
+
+static string _column_string(const map<string, optional<string>>& row, const string& name) {
+  auto found = row.find(name);
+  return (found != row.end() && found->second) ? *found->second : string();
+}
+
+static int _info(const string& file_name) {
+  auto db = nanots_database::open(file_name);
+  auto conn = db->catalog();
+
+  uint64_t block_size = db->block_size();
+
+  printf("file:        %s\n", file_name.c_str());
+  printf("catalog:     %s\n", (db->sealed()) ? "sealed (embedded directory)" : db->database_name().c_str());
+  printf("block size:  %" PRIu64 "\n", block_size);
+  printf("blocks:      %" PRIu32 " (%.1f MB)\n", db->n_blocks(),
+         (double)(db->n_blocks() * block_size) / (1024 * 1024));
+
+  // Sealed catalogs have no blocks table rows; every block they list is used.
+  map<string, int64_t> by_status;
+  for (auto& row : conn->exec("SELECT status, COUNT(*) AS n FROM blocks GROUP BY status;"))
+    by_status[_column_string(row, "status")] = _column_int64(row, "n");
+  if (db->sealed()) {
+    auto rows = conn->exec("SELECT COUNT(*) AS n FROM segment_blocks;");
+    by_status["used"] = _column_int64(rows.front(), "n");
+    by_status["free"] = db->n_blocks() - by_status["used"];
+  }
+
+  printf("status:     ");
+  for (auto& s : by_status)
+    printf(" %s %" PRId64 " (%.1f%%)", s.first.c_str(), s.second,
+           (db->n_blocks() > 0) ? 100.0 * s.second / db->n_blocks() : 0.0);
+  printf("\n\n");
+
+  // n_bytes already covers frame headers and padding; fill adds the block
+  // header and index entries, which is what a block actually runs out of.
+  auto streams = conn->exec(
+      "SELECT s.stream_tag, "
+      "COUNT(DISTINCT s.id) AS n_segments, "
+      "COUNT(*) AS n_blocks, "
+      "SUM(sb.end_timestamp = 0) AS n_open, "
+      "SUM(COALESCE(sb.n_frames, 0)) AS n_frames, "
+      "SUM(COALESCE(sb.n_bytes, 0)) AS n_bytes, "
+      "MIN(sb.start_timestamp) AS first_timestamp, "
+      "MAX(CASE WHEN sb.end_timestamp = 0 THEN sb.start_timestamp ELSE sb.end_timestamp END) AS last_timestamp, "
+      "MAX(CASE WHEN sb.end_timestamp != 0 THEN (julianday('now') - julianday(b.reserved_at)) * 86400 END) "
+      "AS oldest_age "
+      "FROM segment_blocks sb "
+      "JOIN segments s ON sb.segment_id = s.id "
+      "LEFT JOIN blocks b ON sb.block_id = b.id "
+      "GROUP BY s.stream_tag "
+      "ORDER BY s.stream_tag;");
+
+  printf("%-24s %8s %8s %6s %12s %10s %6s %12s %20s %20s\n", "stream", "segments", "blocks", "open",
+         "frames", "frames/blk", "fill", "oldest (s)", "first timestamp", "last timestamp");
+
+  vector<string> notes;
+
+  for (auto& row : streams) {
+    auto stream_tag = _column_string(row, "stream_tag");
+    int64_t n_segments = _column_int64(row, "n_segments");
+    int64_t n_blocks = _column_int64(row, "n_blocks");
+    int64_t n_finalized = n_blocks - _column_int64(row, "n_open");
+    int64_t n_frames = _column_int64(row, "n_frames");
+    int64_t n_bytes = _column_int64(row, "n_bytes");
+
+    double frames_per_block = (n_finalized > 0) ? (double)n_frames / n_finalized : 0.0;
+    double fill = (n_finalized > 0)
+                      ? (double)(n_bytes + n_finalized * BLOCK_HEADER_SIZE + n_frames * INDEX_ENTRY_SIZE) /
+                            ((double)n_finalized * block_size)
+                      : 0.0;
+
+    auto oldest = row.find("oldest_age");
+    string oldest_age = (oldest != row.end() && oldest->second)
+                            ? format_s("%.0f", stod(*oldest->second))
+                            : string("-");
+
+    printf("%-24s %8" PRId64 " %8" PRId64 " %6" PRId64 " %12" PRId64 " %10.1f %5.1f%% %12s %20" PRId64
+           " %20" PRId64 "\n",
+           stream_tag.c_str(), n_segments, n_blocks, n_blocks - n_finalized, n_frames, frames_per_block,
+           fill * 100, oldest_age.c_str(), _column_int64(row, "first_timestamp"),
+           _column_int64(row, "last_timestamp"));
+
+    if (n_finalized > 0 && fill < 0.5)
+      notes.push_back(stream_tag + ": blocks are " + format_s("%.0f", fill * 100) +
+                      "% full on average; a smaller block size would waste less space.");
+    if (n_segments > 1 && n_segments * 2 > n_blocks)
+      notes.push_back(stream_tag + ": " + to_string(n_segments) + " segments in " + to_string(n_blocks) +
+                      " blocks; short lived write contexts make reads visit many segments.");
+  }
+
+  // The block that goes first when a writer with auto reclaim runs out.
+  auto next = conn->exec(
+      "SELECT s.stream_tag, sb.block_idx, sb.end_timestamp, "
+      "(julianday('now') - julianday(b.reserved_at)) * 86400 AS age "
+      "FROM segment_blocks sb "
+      "JOIN segments s ON sb.segment_id = s.id "
+      "JOIN blocks b ON sb.block_id = b.id "
+      "WHERE sb.end_timestamp != 0 "
+      "ORDER BY sb.end_timestamp ASC, b.reserved_at ASC "
+      "LIMIT 1;");
+  if (!next.empty()) {
+    auto& row = next.front();
+    printf("\nnext reclaim: block %" PRId64 " of %s, ending at %" PRId64 ", written %.0fs ago\n",
+           _column_int64(row, "block_idx"), _column_string(row, "stream_tag").c_str(),
+           _column_int64(row, "end_timestamp"), stod(_column_string(row, "age")));
+  }
+
+  if (!notes.empty()) {
+    printf("\n");
+    for (auto& note : notes)
+      printf("note: %s\n", note.c_str());
+  }
+
+  return 0;
+}
+
+struct fsck_block {
+  string stream_tag;
+  int64_t block_idx;
+  int64_t start_timestamp;
+  int64_t end_timestamp;
+  optional<int64_t> n_frames;
+  uint8_t uuid[16];
+};
+
+// Returns a description of the first problem found, or an empty string.
+static string _check_block(const uint8_t* block_p, uint32_t block_size, const fsck_block& b, uint64_t& n_frames) {
+  // Writers of open blocks bump the count after the frame is in place.
+  uint32_t n_valid = *(const volatile uint32_t*)(block_p + 8);
+  uint32_t block_flags = *(const uint32_t*)(block_p + 12);
+  uint32_t key_size = (block_flags & BLOCK_FLAG_SECONDARY_KEYS) ? SECONDARY_KEY_SIZE : 0;
+
+  if (n_valid == 0)
+    return "no valid frames";
+
+  uint64_t index_end = BLOCK_HEADER_SIZE + (uint64_t)n_valid * INDEX_ENTRY_SIZE;
+  if (index_end >= block_size)
+    return format_s("valid index count %u overruns the block", n_valid);
+
+  if (b.end_timestamp != 0 && b.n_frames && *b.n_frames != n_valid)
+    return format_s("catalog has %" PRId64 " frames, block has %u", *b.n_frames, n_valid);
+
+  if (*(const int64_t*)block_p != b.start_timestamp)
+    return format_s("block header timestamp %" PRId64 " != catalog start %" PRId64, *(const int64_t*)block_p,
+                    b.start_timestamp);
+
+  int64_t last_timestamp = 0;
+  uint64_t frames_low = block_size;
+
+  for (uint32_t i = 0; i < n_valid; i++) {
+    auto index_p = block_p + BLOCK_HEADER_SIZE + (uint64_t)i * INDEX_ENTRY_SIZE;
+    int64_t timestamp = *(const int64_t*)index_p;
+    uint64_t offset = *(const uint64_t*)(index_p + 8);
+
+    if (i > 0 && timestamp <= last_timestamp)
+      return format_s("frame %u timestamp %" PRId64 " is not after %" PRId64, i, timestamp, last_timestamp);
+    if (timestamp < b.start_timestamp || (b.end_timestamp != 0 && timestamp > b.end_timestamp))
+      return format_s("frame %u timestamp %" PRId64 " is outside the catalog range", i, timestamp);
+    last_timestamp = timestamp;
+
+    if (offset < index_end + key_size || offset + FRAME_HEADER_SIZE > frames_low)
+      return format_s("frame %u offset %" PRIu64 " overlaps the index or another frame", i, offset);
+
+    auto frame_p = block_p + offset;
+    if (memcmp(frame_p + FRAME_UUID_OFFSET, b.uuid, 16) != 0)
+      return format_s("frame %u header uuid does not match the catalog", i);
+
+    uint32_t frame_size = *(const uint32_t*)(frame_p + FRAME_SIZE_OFFSET);
+    if (offset + FRAME_HEADER_SIZE + frame_size > frames_low)
+      return format_s("frame %u size %u runs past the block or into the next frame", i, frame_size);
+
+    frames_low = offset - key_size;
+  }
+
+  if (b.end_timestamp != 0 && last_timestamp != b.end_timestamp)
+    return format_s("last frame timestamp %" PRId64 " != catalog end %" PRId64, last_timestamp, b.end_timestamp);
+
+  n_frames += n_valid;
+  return string();
+}
+
+static int _fsck(const string& file_name, size_t n_threads) {
+  auto db = nanots_database::open(file_name);
+  uint32_t block_size = db->block_size();
+
+  vector<fsck_block> blocks;
+  uint64_t n_problems = 0;
+
+  {
+    auto conn = db->catalog();
+    for (auto& row : conn->exec(
+             "SELECT s.stream_tag, sb.block_idx, sb.start_timestamp, sb.end_timestamp, sb.n_frames, sb.uuid "
+             "FROM segment_blocks sb "
+             "JOIN segments s ON sb.segment_id = s.id "
+             "ORDER BY sb.block_idx;")) {
+      fsck_block b;
+      b.stream_tag = _column_string(row, "stream_tag");
+      b.block_idx = _column_int64(row, "block_idx");
+      b.start_timestamp = _column_int64(row, "start_timestamp");
+      b.end_timestamp = _column_int64(row, "end_timestamp");
+      if (row["n_frames"])
+        b.n_frames = stoll(*row["n_frames"]);
+      s_to_entropy_id(_column_string(row, "uuid"), b.uuid);
+      blocks.push_back(b);
+    }
+
+    // Catalog consistency: rows on blocks not marked used, used blocks without
+    // rows and blocks listed twice. Sealed catalogs have no blocks table rows.
+    if (!db->sealed()) {
+      auto report = [&](const char* query, const char* what) {
+        for (auto& row : conn->exec(query)) {
+          printf("block %" PRId64 ": %s\n", _column_int64(row, "idx"), what);
+          n_problems++;
+        }
+      };
+      report(
+          "SELECT b.idx FROM blocks b JOIN segment_blocks sb ON sb.block_id = b.id "
+          "WHERE b.status = 'free';",
+          "catalog row on a free block");
+      report(
+          "SELECT b.idx FROM blocks b WHERE b.status = 'used' "
+          "AND NOT EXISTS (SELECT 1 FROM segment_blocks sb WHERE sb.block_id = b.id);",
+          "used block without a catalog row (leaked)");
+      report("SELECT block_idx AS idx FROM segment_blocks GROUP BY block_idx HAVING COUNT(*) > 1;",
+             "listed more than once in the catalog");
+    }
+  }
+
+  if (n_threads == 0)
+    n_threads = max<size_t>(thread::hardware_concurrency(), 1);
+  n_threads = max<size_t>(min(n_threads, blocks.size()), 1);
+
+  atomic<size_t> next_block{0};
+  atomic<uint64_t> n_frames{0};
+  mutex report_lok;
+
+  auto start = chrono::steady_clock::now();
+
+  vector<thread> workers;
+  for (size_t t = 0; t < n_threads; t++) {
+    workers.emplace_back([&]() {
+      uint64_t frames = 0;
+      for (size_t i; (i = next_block++) < blocks.size();) {
+        auto& b = blocks[i];
+        string problem;
+        try {
+          if (b.block_idx < 0 || b.block_idx >= (int64_t)db->n_blocks())
+            problem = "block index outside the file";
+          else {
+            auto mm = db->map_block(b.block_idx);
+            problem = _check_block((const uint8_t*)mm->map(), block_size, b, frames);
+          }
+        } catch (const exception& e) {
+          problem = e.what();
+        }
+
+        if (!problem.empty()) {
+          lock_guard<mutex> g(report_lok);
+          printf("block %" PRId64 " (%s, %s): %s\n", b.block_idx, b.stream_tag.c_str(),
+                 (b.end_timestamp == 0) ? "open" : "finalized", problem.c_str());
+          n_problems++;
+        }
+      }
+      n_frames += frames;
+    });
+  }
+
+  for (auto& worker : workers)
+    worker.join();
+
+  auto secs = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+  double mb = (double)blocks.size() * block_size / (1024 * 1024);
+
+  printf("checked %zu blocks, %" PRIu64 " frames (%.1f MB) in %.3fs on %zu threads, %.1f MB/s\n",
+         blocks.size(), n_frames.load(), mb, secs, n_threads, (secs > 0) ? mb / secs : 0.0);
+  printf("%" PRIu64 " problem%s found\n", n_problems, (n_problems == 1) ? "" : "s");
+
+  return (n_problems > 0) ? 1 : 0;
+}
+
+// One stream's frames, in write order, as read back from its block indexes.
+struct workload_stream {
+  string stream_tag;
+  vector<int64_t> timestamps;
+  vector<uint32_t> sizes;
+  // Index of each segment's first frame; segments always start a new block.
+  vector<size_t> segment_starts;
+  uint32_t key_size{0};
+  int64_t n_segments{0};
+  int64_t n_blocks{0};
+  int64_t n_finalized{0};
+};
+
+struct simulation {
+  // Finalized blocks plus the used fraction of the one still open.
+  double n_blocks{0};
+  uint64_t n_finalized{0};
+  uint64_t wasted_bytes{0};
+  uint64_t finalized_bytes{0};
+  // Longest stretch of time one block held, the open one included.
+  int64_t max_block_span{0};
+  uint64_t n_too_large{0};
+};
+
+static uint64_t _parse_bytes(const string& s) {
+  size_t end = 0;
+  double v = stod(s, &end);
+  auto suffix = s.substr(end);
+  if (suffix == "K" || suffix == "k")
+    v *= 1024;
+  else if (suffix == "M" || suffix == "m")
+    v *= 1024 * 1024;
+  else if (suffix == "G" || suffix == "g")
+    v *= 1024.0 * 1024 * 1024;
+  else if (!suffix.empty())
+    throw runtime_error("Bad size: " + s);
+  return (uint64_t)v;
+}
+
+static string _format_bytes(double bytes) {
+  if (bytes >= 1024.0 * 1024 * 1024)
+    return format_s("%.1fG", bytes / (1024.0 * 1024 * 1024));
+  if (bytes >= 1024 * 1024)
+    return format_s("%.1fM", bytes / (1024 * 1024));
+  if (bytes >= 1024)
+    return format_s("%.1fK", bytes / 1024);
+  return format_s("%.0f", bytes);
+}
+
+static string _format_seconds(double secs) {
+  if (secs < 0 || std::isinf(secs))
+    return "-";
+  if (secs >= 2 * 86400)
+    return format_s("%.1fd", secs / 86400);
+  if (secs >= 2 * 3600)
+    return format_s("%.1fh", secs / 3600);
+  if (secs >= 120)
+    return format_s("%.1fm", secs / 60);
+  return format_s("%.2fs", secs);
+}
+
+// Packs a stream's frames into blocks of block_size exactly as the writer
+// does: index entries grow up, padded frame records grow down and a block is
+// finalized when the next record would run into the index.
+static simulation _simulate(const workload_stream& s, uint64_t block_size) {
+  simulation sim;
+
+  bool open = false;
+  uint64_t n = 0, low = 0;
+  int64_t first_timestamp = 0, last_timestamp = 0;
+  size_t next_segment = 0;
+
+  auto finalize = [&]() {
+    sim.wasted_bytes += low - (BLOCK_HEADER_SIZE + n * INDEX_ENTRY_SIZE);
+    sim.finalized_bytes += block_size;
+    sim.max_block_span = max(sim.max_block_span, last_timestamp - first_timestamp);
+    sim.n_finalized++;
+    open = false;
+  };
+
+  for (size_t i = 0; i < s.sizes.size(); i++) {
+    if (next_segment < s.segment_starts.size() && s.segment_starts[next_segment] == i) {
+      if (open)
+        finalize();
+      next_segment++;
+    }
+
+    uint64_t record_size = ((FRAME_HEADER_SIZE + (uint64_t)s.sizes[i] + 7) & ~(uint64_t)7) + s.key_size;
+
+    for (int attempt = 0; attempt < 2; attempt++) {
+      if (!open) {
+        open = true;
+        n = 0;
+        low = block_size;
+        first_timestamp = s.timestamps[i];
+      }
+      uint64_t index_end = BLOCK_HEADER_SIZE + (n + 1) * INDEX_ENTRY_SIZE;
+      if (low >= record_size && index_end < low - record_size) {
+        low -= record_size;
+        n++;
+        last_timestamp = s.timestamps[i];
+        break;
+      }
+      if (n == 0) {
+        // Doesn't fit even an empty block; the writer would reject it.
+        sim.n_too_large++;
+        break;
+      }
+      finalize();
+    }
+  }
+
+  sim.n_blocks = (double)sim.n_finalized;
+  if (open) {
+    sim.n_blocks += (double)(block_size - low + n * INDEX_ENTRY_SIZE) / block_size;
+    sim.max_block_span = max(sim.max_block_span, last_timestamp - first_timestamp);
+  }
+
+  return sim;
+}
+
+static int _advise(const string& file_name,
+                   double ticks_per_second,
+                   vector<uint64_t> block_sizes,
+                   uint64_t capacity) {
+  auto db = nanots_database::open(file_name);
+  uint32_t block_size = db->block_size();
+
+  // Read every cataloged block's index: timestamps and frame sizes per stream.
+  map<string, workload_stream> streams;
+  {
+    auto conn = db->catalog();
+    int64_t last_segment = -1;
+    for (auto& row : conn->exec(
+             "SELECT s.stream_tag, s.id AS segment_id, sb.block_idx, sb.end_timestamp "
+             "FROM segment_blocks sb "
+             "JOIN segments s ON sb.segment_id = s.id "
+             "ORDER BY s.stream_tag, s.id, sb.sequence;")) {
+      auto stream_tag = _column_string(row, "stream_tag");
+      auto& s = streams[stream_tag];
+      s.stream_tag = stream_tag;
+      s.n_blocks++;
+      if (_column_int64(row, "end_timestamp") != 0)
+        s.n_finalized++;
+
+      int64_t segment_id = _column_int64(row, "segment_id");
+      if (segment_id != last_segment) {
+        s.segment_starts.push_back(s.sizes.size());
+        s.n_segments++;
+        last_segment = segment_id;
+      }
+
+      auto mm = db->map_block(_column_int64(row, "block_idx"));
+      auto block_p = (const uint8_t*)mm->map();
+      uint32_t n_valid = *(const volatile uint32_t*)(block_p + 8);
+      if ((uint64_t)BLOCK_HEADER_SIZE + (uint64_t)n_valid * INDEX_ENTRY_SIZE >= block_size)
+        continue;
+      if (*(const uint32_t*)(block_p + 12) & BLOCK_FLAG_SECONDARY_KEYS)
+        s.key_size = SECONDARY_KEY_SIZE;
+
+      for (uint32_t i = 0; i < n_valid; i++) {
+        auto index_p = block_p + BLOCK_HEADER_SIZE + (uint64_t)i * INDEX_ENTRY_SIZE;
+        uint64_t offset = *(const uint64_t*)(index_p + 8);
+        if (offset + FRAME_HEADER_SIZE > block_size)
+          break;
+        s.timestamps.push_back(*(const int64_t*)index_p);
+        s.sizes.push_back(*(const uint32_t*)(block_p + offset + FRAME_SIZE_OFFSET));
+      }
+    }
+  }
+
+  if (streams.empty()) {
+    printf("no data to profile\n");
+    return 0;
+  }
+
+  printf("workload (timestamps at %.0f per second):\n\n", ticks_per_second);
+  printf("%-24s %10s %10s %10s %10s %8s %8s %8s %8s %8s %10s\n", "stream", "frames", "span", "frames/s",
+         "bytes/s", "p50", "p90", "p99", "max", "segments", "blocks/h");
+
+  double total_bytes = 0;
+
+  for (auto& entry : streams) {
+    auto& s = entry.second;
+    if (s.sizes.empty())
+      continue;
+
+    auto sorted = s.sizes;
+    sort(sorted.begin(), sorted.end());
+    auto percentile = [&](double p) { return (double)sorted[(size_t)(p * (sorted.size() - 1))]; };
+
+    double bytes = 0;
+    for (auto size : s.sizes)
+      bytes += size;
+    total_bytes += bytes;
+
+    double span = (double)(s.timestamps.back() - s.timestamps.front()) / ticks_per_second;
+    auto rate = [&](double v) { return (span > 0) ? v / span : 0.0; };
+
+    printf("%-24s %10zu %10s %10.1f %10s %8s %8s %8s %8s %8" PRId64 " %10.1f\n", s.stream_tag.c_str(),
+           s.sizes.size(), _format_seconds(span).c_str(), rate((double)s.sizes.size()),
+           _format_bytes(rate(bytes)).c_str(), _format_bytes(percentile(0.5)).c_str(),
+           _format_bytes(percentile(0.9)).c_str(), _format_bytes(percentile(0.99)).c_str(),
+           _format_bytes(sorted.back()).c_str(), s.n_segments, rate((double)s.n_finalized) * 3600);
+  }
+
+  if (capacity == 0)
+    capacity = (uint64_t)db->n_blocks() * block_size;
+
+  if (block_sizes.empty())
+    block_sizes = {64 * 1024, 256 * 1024, 1024 * 1024, 4 * 1024 * 1024, 16 * 1024 * 1024, 64 * 1024 * 1024};
+  block_sizes.push_back(block_size);
+
+  // allocate() rounds block sizes up to 64K.
+  for (auto& size : block_sizes)
+    size = ((size + 65535) / 65536) * 65536;
+  sort(block_sizes.begin(), block_sizes.end());
+  block_sizes.erase(unique(block_sizes.begin(), block_sizes.end()), block_sizes.end());
+
+  printf("\nsimulated for %s of blocks (crash loss is per stream, at most one block;\n"
+         "retention is how far back data reaches once auto reclaim kicks in):\n\n",
+         _format_bytes((double)capacity).c_str());
+  printf("%-12s %8s %12s %8s %16s %12s %12s\n", "block size", "blocks", "rollovers/h", "wasted",
+         "max crash loss", "at risk", "retention");
+
+  for (auto size : block_sizes) {
+    uint64_t n_blocks = capacity / size;
+    double blocks_per_second = 0;
+    uint64_t wasted = 0, finalized = 0, too_large = 0;
+    int64_t max_block_span = 0;
+    // A stream that never fills a block could lose everything profiled.
+    bool never_full = false;
+
+    for (auto& entry : streams) {
+      auto& s = entry.second;
+      if (s.sizes.empty())
+        continue;
+      auto sim = _simulate(s, size);
+      double span = (double)(s.timestamps.back() - s.timestamps.front()) / ticks_per_second;
+      if (span > 0)
+        blocks_per_second += sim.n_blocks / span;
+      wasted += sim.wasted_bytes;
+      finalized += sim.finalized_bytes;
+      too_large += sim.n_too_large;
+      max_block_span = max(max_block_span, sim.max_block_span);
+      never_full = never_full || sim.n_finalized == 0;
+    }
+
+    // Every stream holds one open block; the rest cycle.
+    double cycling = (double)n_blocks - (double)streams.size();
+    double retention = (cycling <= 0) ? -1.0
+                       : (blocks_per_second > 0) ? cycling / blocks_per_second
+                                                 : numeric_limits<double>::infinity();
+
+    string wasted_text = (finalized > 0) ? format_s("%.1f%%", 100.0 * wasted / finalized) : string("-");
+    if (too_large > 0)
+      wasted_text = format_s("%" PRIu64 " too big", too_large);
+
+    printf("%-12s %8" PRIu64 " %12.1f %8s %16s %12s %12s%s\n", _format_bytes((double)size).c_str(), n_blocks,
+           blocks_per_second * 3600, wasted_text.c_str(),
+           ((never_full) ? ">" + _format_seconds(max_block_span / ticks_per_second)
+                         : _format_seconds(max_block_span / ticks_per_second)).c_str(),
+           _format_bytes((double)size * streams.size()).c_str(),
+           (retention < 0) ? "too few" : std::isinf(retention) ? "-" : _format_seconds(retention).c_str(),
+           (size == block_size) ? "  (current)" : "");
+  }
+
+  return 0;
+}
+
+int main(int argc, char* argv[]) {
+  if (argc < 3) {
+    _usage();
+    return 1;
+  }
+
+  string command = argv[1];
+  string file_name = argv[2];
+
+  try {
+    if (command == "info" && argc == 3)
+      return _info(file_name);
+
+    if (command == "fsck") {
+      size_t n_threads = 0;
+      for (int i = 3; i < argc; i++) {
+        if (string(argv[i]) == "--threads" && i + 1 < argc)
+          n_threads = (size_t)stoul(argv[++i]);
+        else {
+          _usage();
+          return 1;
+        }
+      }
+      return _fsck(file_name, n_threads);
+    }
+
+    if (command == "advise") {
+      double ticks_per_second = 1000000;
+      vector<uint64_t> block_sizes;
+      uint64_t capacity = 0;
+      for (int i = 3; i < argc; i++) {
+        string arg = argv[i];
+        if (i + 1 >= argc) {
+          _usage();
+          return 1;
+        }
+        string value = argv[++i];
+        if (arg == "--ticks-per-second")
+          ticks_per_second = stod(value);
+        else if (arg == "--capacity")
+          capacity = _parse_bytes(value);
+        else if (arg == "--block-sizes") {
+          for (size_t start = 0, comma; start <= value.size(); start = comma + 1) {
+            comma = value.find(',', start);
+            if (comma == string::npos)
+              comma = value.size();
+            block_sizes.push_back(_parse_bytes(value.substr(start, comma - start)));
+          }
+        } else {
+          _usage();
+          return 1;
+        }
+      }
+      if (ticks_per_second <= 0)
+        throw runtime_error("--ticks-per-second must be positive.");
+      return _advise(file_name, ticks_per_second, block_sizes, capacity);
+    }
+  } catch (const exception& e) {
+    fprintf(stderr, "nanots_inspect: %s\n", e.what());
+    return 1;
+  }
+
+  _usage();
+  return 1;
+}
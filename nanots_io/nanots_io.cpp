@@ -0,0 +1,364 @@
+// nanots_io - bulk import and export of nanots streams.
+//
+//   nanots_io allocate <file.nts> <block_size> <n_blocks>
+//   nanots_io import <file.nts> <stream_tag>=<input> [...] [options]
+//   nanots_io export <file.nts> <stream_tag>=<output> [...] [options]
+//   nanots_io merge <file.nts> <source.nts> [...]
+//
+// Options:
+//   --format csv|bin   csv (default): one "timestamp,payload" line per frame,
+//                      the payload being the rest of the line, verbatim.
+//                      bin: little endian records of int64 timestamp, uint8
+//                      flags, uint32 size and size payload bytes.
+//   --metadata <text>  segment metadata for imported streams.
+//   --start <ts>       first timestamp to export (default: everything).
+//   --end <ts>         last timestamp to export.
+//   --threads <n>      streams processed in parallel (default: one per core).
+//
+// Imports go through nanots_writer::bulk_load(), so input must be sorted by
+// timestamp and no writer may be using the file.
+
+#include "nanots.h"
+
+#include <cinttypes>
+#include <cstdio>
+#include <cstdlib>
+
+using namespace std;
+
+static const size_t IO_BUFFER_SIZE = 16 * 1024 * 1024;
+
+enum class io_format { CSV, BIN };
+
+struct io_options {
+  io_format format{io_format::CSV};
+  string metadata;
+  int64_t start_timestamp{INT64_MIN};
+  int64_t end_timestamp{INT64_MAX};
+  size_t n_threads{0};
+  // stream_tag, path
+  vector<pair<string, string>> streams;
+};
+
+static void _usage() {
+  fprintf(stderr,
+          "usage: nanots_io allocate <file.nts> <block_size> <n_blocks>\n"
+          "       nanots_io import <file.nts> <stream_tag>=<input> [...] [options]\n"
+          "       nanots_io export <file.nts> <stream_tag>=<output> [...] [options]\n"
+          "       nanots_io merge <file.nts> <source.nts> [...]\n"
+          "options: --format csv|bin, --metadata <text>, --start <ts>, --end <ts>, --threads <n>\n");
+}
+
+static io_options _parse_options(int argc, char* argv[], int first) {
+  io_options options;
+
+  for (int i = first; i < argc; i++) {
+    string arg = argv[i];
+
+    if (arg.compare(0, 2, "--") == 0) {
+      if (i + 1 >= argc)
+        throw runtime_error("Missing value for " + arg);
+      string value = argv[++i];
+
+      if (arg == "--format") {
+        if (value == "csv")
+          options.format = io_format::CSV;
+        else if (value == "bin")
+          options.format = io_format::BIN;
+        else
+          throw runtime_error("Unknown format: " + value);
+      } else if (arg == "--metadata")
+        options.metadata = value;
+      else if (arg == "--start")
+        options.start_timestamp = stoll(value);
+      else if (arg == "--end")
+        options.end_timestamp = stoll(value);
+      else if (arg == "--threads")
+        options.n_threads = (size_t)stoul(value);
+      else
+        throw runtime_error("Unknown option: " + arg);
+    } else {
+      auto eq = arg.find('=');
+      if (eq == string::npos || eq == 0 || eq + 1 == arg.size())
+        throw runtime_error("Expected <stream_tag>=<path>, got: " + arg);
+      options.streams.emplace_back(arg.substr(0, eq), arg.substr(eq + 1));
+    }
+  }
+
+  if (options.streams.empty())
+    throw runtime_error("No streams given.");
+
+  return options;
+}
+
+// Reads an input file in large chunks and hands out lines or fixed size
+// records from the buffer.
+class input_reader final {
+ public:
+  explicit input_reader(const string& path)
+      : _f(nts_file::open(path, "rb")), _buffer(IO_BUFFER_SIZE), _pos(0), _len(0) {}
+
+  // The returned line excludes the line ending and is valid until the next call.
+  bool next_line(const char*& line, size_t& len) {
+    while (true) {
+      auto start = _buffer.data() + _pos;
+      auto nl = (const char*)memchr(start, '\n', _len - _pos);
+      if (nl) {
+        line = start;
+        len = nl - start;
+        _pos += len + 1;
+        if (len > 0 && line[len - 1] == '\r')
+          len--;
+        return true;
+      }
+      if (!_fill(_len - _pos + 1)) {
+        // Last line without a newline.
+        if (_pos == _len)
+          return false;
+        line = _buffer.data() + _pos;
+        len = _len - _pos;
+        _pos = _len;
+        return true;
+      }
+    }
+  }
+
+  // Returns nullptr at end of input; throws on a truncated record.
+  const uint8_t* next_bytes(size_t n) {
+    if (_len - _pos < n && !_fill(n) && _pos == _len)
+      return nullptr;
+    if (_len - _pos < n)
+      throw runtime_error("Truncated record in binary input.");
+    auto p = (const uint8_t*)_buffer.data() + _pos;
+    _pos += n;
+    return p;
+  }
+
+ private:
+  // Makes room for at least min_available unread bytes and reads more input.
+  // Returns false at end of file.
+  bool _fill(size_t min_available) {
+    size_t unread = _len - _pos;
+    memmove(_buffer.data(), _buffer.data() + _pos, unread);
+    _pos = 0;
+    _len = unread;
+    if (_buffer.size() < min_available)
+      _buffer.resize(min_available * 2);
+
+    size_t n = fread(_buffer.data() + _len, 1, _buffer.size() - _len, _f);
+    _len += n;
+    return n > 0;
+  }
+
+  nts_file _f;
+  vector<char> _buffer;
+  size_t _pos;
+  size_t _len;
+};
+
+static bulk_stream _import_stream(const string& stream_tag,
+                                  const string& path,
+                                  const io_options& options) {
+  auto reader = make_shared<input_reader>(path);
+  auto line_number = make_shared<uint64_t>(0);
+  auto format = options.format;
+
+  bulk_stream stream;
+  stream.stream_tag = stream_tag;
+  stream.metadata = options.metadata;
+  stream.next = [reader, line_number, format, path](bulk_frame& frame) {
+    if (format == io_format::BIN) {
+      auto header = reader->next_bytes(sizeof(int64_t) + sizeof(uint8_t) + sizeof(uint32_t));
+      if (!header)
+        return false;
+      uint32_t size;
+      memcpy(&frame.timestamp, header, sizeof(int64_t));
+      frame.flags = header[sizeof(int64_t)];
+      memcpy(&size, header + sizeof(int64_t) + sizeof(uint8_t), sizeof(uint32_t));
+      frame.data = reader->next_bytes(size);
+      if (!frame.data && size > 0)
+        throw runtime_error(path + ": truncated record.");
+      frame.size = size;
+      return true;
+    }
+
+    const char* line;
+    size_t len;
+    while (reader->next_line(line, len)) {
+      (*line_number)++;
+      if (len == 0)
+        continue;
+
+      auto comma = (const char*)memchr(line, ',', len);
+      string ts_text(line, (comma) ? comma - line : len);
+      char* end = nullptr;
+      int64_t timestamp = strtoll(ts_text.c_str(), &end, 10);
+      if (ts_text.empty() || *end != '\0') {
+        // Tolerate a header row.
+        if (*line_number == 1)
+          continue;
+        throw runtime_error(path + ":" + to_string(*line_number) + ": bad timestamp.");
+      }
+
+      frame.timestamp = timestamp;
+      frame.flags = 0;
+      frame.data = (comma) ? (const uint8_t*)comma + 1 : (const uint8_t*)line + len;
+      frame.size = (comma) ? len - (comma + 1 - line) : 0;
+      return true;
+    }
+    return false;
+  };
+
+  return stream;
+}
+
+static int _import(const string& file_name, const io_options& options) {
+  vector<bulk_stream> streams;
+  for (auto& s : options.streams)
+    streams.push_back(_import_stream(s.first, s.second, options));
+
+  auto start = chrono::steady_clock::now();
+  auto stats = nanots_writer::bulk_load(file_name, move(streams), options.n_threads);
+  auto secs = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+  fprintf(stderr, "imported %" PRIu64 " frames into %" PRIu64 " blocks in %.2fs\n",
+          stats.n_frames, stats.n_blocks, secs);
+  return 0;
+}
+
+static uint64_t _export_stream(const string& file_name,
+                               const string& stream_tag,
+                               const string& path,
+                               const io_options& options) {
+  auto out = nts_file::open(path, "wb");
+  setvbuf(out, nullptr, _IOFBF, IO_BUFFER_SIZE);
+
+  uint64_t n_frames = 0;
+  bool failed = false;
+
+  nanots_reader reader(file_name);
+  reader.read(stream_tag, options.start_timestamp, options.end_timestamp,
+              [&](const uint8_t* data, size_t size, uint8_t flags, int64_t timestamp, int64_t,
+                  const string&) {
+                if (failed)
+                  return;
+
+                if (options.format == io_format::BIN) {
+                  uint32_t size32 = (uint32_t)size;
+                  fwrite(&timestamp, sizeof(timestamp), 1, out);
+                  fwrite(&flags, sizeof(flags), 1, out);
+                  fwrite(&size32, sizeof(size32), 1, out);
+                } else {
+                  if (memchr(data, '\n', size) || memchr(data, '\r', size)) {
+                    fprintf(stderr, "%s: frame at %" PRId64 " has a line break; use --format bin\n",
+                            stream_tag.c_str(), timestamp);
+                    failed = true;
+                    return;
+                  }
+                  fprintf(out, "%" PRId64 ",", timestamp);
+                }
+
+                fwrite(data, 1, size, out);
+                if (options.format == io_format::CSV)
+                  fputc('\n', out);
+                n_frames++;
+              });
+
+  if (fflush(out) != 0 || ferror(out))
+    throw runtime_error("Unable to write: " + path);
+  if (failed)
+    throw runtime_error("Unable to export " + stream_tag + " as csv.");
+
+  return n_frames;
+}
+
+static int _export(const string& file_name, const io_options& options) {
+  size_t n_threads = options.n_threads;
+  if (n_threads == 0)
+    n_threads = max<size_t>(thread::hardware_concurrency(), 1);
+  n_threads = min(n_threads, options.streams.size());
+
+  atomic<size_t> next_stream{0};
+  atomic<uint64_t> n_frames{0};
+  atomic<bool> failed{false};
+
+  auto start = chrono::steady_clock::now();
+
+  vector<thread> workers;
+  for (size_t i = 0; i < n_threads; i++) {
+    workers.emplace_back([&]() {
+      for (size_t s; (s = next_stream++) < options.streams.size();) {
+        auto& stream = options.streams[s];
+        try {
+          n_frames += _export_stream(file_name, stream.first, stream.second, options);
+        } catch (const exception& e) {
+          fprintf(stderr, "%s: %s\n", stream.first.c_str(), e.what());
+          failed = true;
+        }
+      }
+    });
+  }
+
+  for (auto& worker : workers)
+    worker.join();
+
+  auto secs = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+  fprintf(stderr, "exported %" PRIu64 " frames in %.2fs\n", n_frames.load(), secs);
+
+  return (failed) ? 1 : 0;
+}
+
+static int _merge(const string& file_name, int argc, char* argv[], int first) {
+  if (first >= argc)
+    throw runtime_error("No source files given.");
+
+  for (int i = first; i < argc; i++) {
+    auto start = chrono::steady_clock::now();
+    auto stats = nanots_writer::merge(argv[i], file_name);
+    auto secs = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+    fprintf(stderr, "%s: merged %" PRIu64 " frames in %" PRIu64 " blocks in %.2fs", argv[i],
+            stats.n_frames, stats.n_blocks, secs);
+    if (stats.n_blocks_skipped > 0)
+      fprintf(stderr, ", skipped %" PRIu64 " recycled blocks", stats.n_blocks_skipped);
+    fprintf(stderr, "\n");
+  }
+
+  return 0;
+}
+
+int main(int argc, char* argv[]) {
+  if (argc < 3) {
+    _usage();
+    return 1;
+  }
+
+  string command = argv[1];
+  string file_name = argv[2];
+
+  try {
+    if (command == "allocate") {
+      if (argc != 5) {
+        _usage();
+        return 1;
+      }
+      nanots_writer::allocate(file_name, (uint32_t)stoul(argv[3]), (uint32_t)stoul(argv[4]));
+      return 0;
+    }
+
+    if (command == "import")
+      return _import(file_name, _parse_options(argc, argv, 3));
+
+    if (command == "export")
+      return _export(file_name, _parse_options(argc, argv, 3));
+
+    if (command == "merge")
+      return _merge(file_name, argc, argv, 3);
+  } catch (const exception& e) {
+    fprintf(stderr, "nanots_io: %s\n", e.what());
+    return 1;
+  }
+
+  _usage();
+  return 1;
+}
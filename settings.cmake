@@ -33,6 +33,11 @@ endif()
 if(CMAKE_SYSTEM_NAME MATCHES "Linux")
     add_compile_options(-Wall -Wextra -Wno-unused-parameter)
 
+    # Without it SQLite's busy handler sleeps in whole seconds, so a writer
+    # waiting out another's transaction gets only a couple of tries before
+    # the busy timeout.
+    add_compile_definitions(HAVE_USLEEP=1)
+
     if(CMAKE_BUILD_TYPE STREQUAL "Debug")
         message(STATUS "Applying debug build flags for Linux")
 
@@ -34,6 +34,27 @@ class test_nanots : public test_fixture {
   TEST(test_nanots::test_nanots_progressive_block_deletion);
   TEST(test_nanots::test_nanots_iterator_block_transition_flag_search);
   TEST(test_nanots::test_nanots_iterator_performance_benchmark);
+  TEST(test_nanots::test_nanots_shared_database);
+  TEST(test_nanots::test_nanots_iterator_clone);
+  TEST(test_nanots::test_nanots_cursor_token_resume);
+  TEST(test_nanots::test_nanots_seek_ordinal);
+  TEST(test_nanots::test_nanots_read_ranges);
+  TEST(test_nanots::test_nanots_find_gaps);
+  TEST(test_nanots::test_nanots_size_histogram);
+  TEST(test_nanots::test_nanots_find_secondary);
+  TEST(test_nanots::test_nanots_read_key);
+  TEST(test_nanots::test_nanots_read_where);
+  TEST(test_nanots::test_nanots_continuous_queries);
+  TEST(test_nanots::test_nanots_live_fanout);
+  TEST(test_nanots::test_nanots_seal);
+  TEST(test_nanots::test_nanots_backup);
+  TEST(test_nanots::test_nanots_mirror);
+  TEST(test_nanots::test_nanots_bulk_load);
+  TEST(test_nanots::test_nanots_merge);
+  TEST(test_nanots::test_nanots_write_async);
+  TEST(test_nanots::test_nanots_async_pool);
+  TEST(test_nanots::test_nanots_batched_write_contexts);
+  TEST(test_nanots::test_nanots_write_group);
   RTF_FIXTURE_END();
 
   virtual ~test_nanots() throw() {}
@@ -72,4 +93,25 @@ class test_nanots : public test_fixture {
   void test_nanots_progressive_block_deletion();
   void test_nanots_iterator_block_transition_flag_search();
   void test_nanots_iterator_performance_benchmark();
+  void test_nanots_shared_database();
+  void test_nanots_iterator_clone();
+  void test_nanots_cursor_token_resume();
+  void test_nanots_seek_ordinal();
+  void test_nanots_read_ranges();
+  void test_nanots_find_gaps();
+  void test_nanots_size_histogram();
+  void test_nanots_find_secondary();
+  void test_nanots_read_key();
+  void test_nanots_read_where();
+  void test_nanots_continuous_queries();
+  void test_nanots_live_fanout();
+  void test_nanots_seal();
+  void test_nanots_backup();
+  void test_nanots_mirror();
+  void test_nanots_bulk_load();
+  void test_nanots_merge();
+  void test_nanots_write_async();
+  void test_nanots_async_pool();
+  void test_nanots_batched_write_contexts();
+  void test_nanots_write_group();
 };
@@ -4,11 +4,6 @@
 #include <inttypes.h>
 #include "nanots.h"
 
-// Forward declaration from nanots.cpp
-static std::string _database_name(const std::string& file_name) {
-  return file_name.substr(0, file_name.find(".nts")) + ".db";
-}
-
 using namespace std;
 using namespace std::chrono;
 
@@ -23,15 +18,28 @@ static void _whack_files() {
     rtf_remove_file("nanots_test_2048_4k_blocks.nts");
 }
 
+// Set NANOTS_UT_IN_MEMORY=1 to run the suite against in-memory databases.
+// Tests that exercise the on-disk files themselves still use real files.
+static std::vector<std::shared_ptr<nanots_database>> _memory_databases;
+
+static void _allocate(const std::string& file_name, uint32_t block_size, uint32_t n_blocks) {
+  const char* in_memory = getenv("NANOTS_UT_IN_MEMORY");
+  if (in_memory && std::string(in_memory) == "1")
+    _memory_databases.push_back(nanots_database::create_in_memory(file_name, block_size, n_blocks));
+  else
+    nanots_writer::allocate(file_name, block_size, n_blocks);
+}
+
 void test_nanots::setup() {
   _whack_files();
 
-  nanots_writer::allocate("nanots_test_16mb.nts", 1024 * 1024, 16);
-  nanots_writer::allocate("nanots_test_4mb.nts", 1024 * 1024, 4);
-  nanots_writer::allocate("nanots_test_2048_4k_blocks.nts", 4096, 2048);
+  _allocate("nanots_test_16mb.nts", 1024 * 1024, 16);
+  _allocate("nanots_test_4mb.nts", 1024 * 1024, 4);
+  _allocate("nanots_test_2048_4k_blocks.nts", 4096, 2048);
 }
 
 void test_nanots::teardown() {
+  _memory_databases.clear();
   _whack_files();
 }
 
@@ -254,6 +262,25 @@ void test_nanots::test_nanots_reader_time_range() {
   RTF_ASSERT(frames_read.size() == 3);  // frames 0-2
   RTF_ASSERT(frames_read[0].first == 1000);
   RTF_ASSERT(frames_read[2].first == 1200);
+
+  // A stream recorded over several writer sessions reads back in order
+  // (block sequences restart in every segment).
+  nanots_writer sessions("nanots_test_2048_4k_blocks.nts", false);
+  std::vector<uint8_t> frame(10000);
+  for (int session = 0; session < 2; session++) {
+    auto wctx = sessions.create_write_context("sessions_stream", "time range test");
+    for (int i = 1; i <= 20; i++)
+      sessions.write(wctx, frame.data(), frame.size(), ((session * 20) + i) * 10, 0);
+  }
+
+  std::vector<int64_t> timestamps;
+  nanots_reader sessions_reader("nanots_test_2048_4k_blocks.nts");
+  sessions_reader.read("sessions_stream", 0, INT64_MAX,
+                       [&](const uint8_t*, size_t, uint8_t, int64_t timestamp, int64_t,
+                           const std::string&) { timestamps.push_back(timestamp); });
+  RTF_ASSERT(timestamps.size() == 40);
+  for (size_t i = 0; i < timestamps.size(); i++)
+    RTF_ASSERT(timestamps[i] == (int64_t)(i + 1) * 10);
 }
 
 void test_nanots::test_nanots_iterator_bidirectional() {
@@ -1405,7 +1432,7 @@ void test_nanots::test_nanots_free_blocks() {
   printf("Initially found %d frames\n", initial_count);
 
   // Debug: Check what blocks exist in database
-  auto db_name = _database_name("nanots_test_2048_4k_blocks.nts");
+  auto db_name = nanots_database::open("nanots_test_2048_4k_blocks.nts")->database_name();
   nts_sqlite_conn debug_conn(db_name, false, true);
   auto debug_result = debug_conn.exec(
       "SELECT sb.start_timestamp, sb.end_timestamp, sb.block_idx, s.stream_tag "
@@ -1948,3 +1975,1511 @@ void test_nanots::test_nanots_iterator_performance_benchmark() {
   // Verify at least most finds were successful
   RTF_ASSERT(successful_finds >= num_iterations * 0.9);  // At least 90% success rate
 }
+
+void test_nanots::test_nanots_shared_database() {
+  auto db = nanots_database::open("nanots_test_4mb.nts");
+
+  // Everything opened on the same file shares a single handle
+  RTF_ASSERT(nanots_database::open("nanots_test_4mb.nts") == db);
+
+  // ...however the path to it is spelled
+  if (!db->in_memory()) {
+    RTF_ASSERT(nanots_database::open("./nanots_test_4mb.nts") == db);
+
+    if (rtf_file_exists("nanots_test_4mb_link.nts"))
+      rtf_remove_file("nanots_test_4mb_link.nts");
+#ifndef _WIN32
+    RTF_ASSERT(symlink("nanots_test_4mb.nts", "nanots_test_4mb_link.nts") == 0);
+    RTF_ASSERT(nanots_database::open("nanots_test_4mb_link.nts") == db);
+    rtf_remove_file("nanots_test_4mb_link.nts");
+#endif
+  }
+
+  RTF_ASSERT(db->writable());
+  RTF_ASSERT(db->block_size() == 1024 * 1024);
+  RTF_ASSERT(db->n_blocks() == 4);
+
+  {
+    nanots_writer writer(db, false);
+    auto wctx = writer.create_write_context("shared_stream", "shared metadata");
+    RTF_ASSERT(wctx.db == db);
+
+    for (int i = 0; i < 10; i++) {
+      std::string data = "shared_" + std::to_string(i);
+      writer.write(wctx, (uint8_t*)data.c_str(), data.size(), 1000 + i, 0);
+    }
+  }
+
+  // Iterators opened from the handle or by file name see the same data
+  nanots_iterator iter_a(db, "shared_stream");
+  nanots_iterator iter_b("nanots_test_4mb.nts", "shared_stream");
+
+  int count = 0;
+  while (iter_a.valid() && iter_b.valid()) {
+    RTF_ASSERT(iter_a->timestamp == iter_b->timestamp);
+    // Both iterators read through the same block mapping
+    RTF_ASSERT(iter_a->data == iter_b->data);
+    ++iter_a;
+    ++iter_b;
+    count++;
+  }
+  RTF_ASSERT(count == 10);
+
+  nanots_reader reader(db);
+  int read_count = 0;
+  reader.read("shared_stream", 0, 2000,
+              [&](const uint8_t* data, size_t size, uint8_t flags, int64_t timestamp,
+                  int64_t block_sequence, const std::string& metadata) {
+                RTF_ASSERT(metadata == "shared metadata");
+                read_count++;
+              });
+  RTF_ASSERT(read_count == 10);
+
+  // Opening many iterators should not reopen the file or the catalog
+  auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < 100; i++) {
+    nanots_iterator iter(db, "shared_stream");
+    RTF_ASSERT(iter.valid());
+  }
+  auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(
+      std::chrono::steady_clock::now() - start);
+  printf("Average iterator open time: %d us\n", (int)elapsed.count() / 100);
+
+  // A memory database shadows a file of the same name while it is alive,
+  // without disturbing the file's own handle.
+  const std::string shadowed_name = "nanots_test_shadowed.nts";
+  if (rtf_file_exists(shadowed_name))
+    rtf_remove_file(shadowed_name);
+  nanots_writer::allocate(shadowed_name, 65536, 4);
+  {
+    auto disk = nanots_database::open(shadowed_name);
+    {
+      auto memory = nanots_database::create_in_memory(shadowed_name, 65536, 4);
+      RTF_ASSERT(memory->in_memory());
+      RTF_ASSERT(nanots_database::open(shadowed_name) == memory);
+      RTF_ASSERT_THROWS(nanots_database::create_in_memory(shadowed_name, 65536, 4), nanots_exception);
+    }
+    RTF_ASSERT(nanots_database::open(shadowed_name) == disk);
+    RTF_ASSERT(nanots_database::open("./" + shadowed_name) == disk);
+  }
+  rtf_remove_file(shadowed_name);
+}
+
+void test_nanots::test_nanots_iterator_clone() {
+  nanots_writer db("nanots_test_2048_4k_blocks.nts", false);
+
+  {
+    auto wctx = db.create_write_context("clone_stream", "clone test");
+
+    // Blocks are rounded up to 64k, so 10k frames give us 6 frames per block
+    std::vector<uint8_t> frame(10000);
+    for (int i = 1; i <= 60; i++) {
+      frame[0] = (uint8_t)i;
+      db.write(wctx, frame.data(), frame.size(), i * 10, (uint8_t)i);
+    }
+  }
+
+  nanots_iterator main_iter("nanots_test_2048_4k_blocks.nts", "clone_stream");
+  RTF_ASSERT(main_iter.find(300));
+  RTF_ASSERT(main_iter->timestamp == 300);
+
+  // Fork a cursor positioned where the original is
+  nanots_iterator preview = main_iter;
+  RTF_ASSERT(preview.valid());
+  RTF_ASSERT(preview->timestamp == 300);
+  RTF_ASSERT(preview->data == main_iter->data);
+  RTF_ASSERT(preview.current_metadata() == "clone test");
+
+  // Move them in opposite directions, both cross block boundaries
+  for (int i = 0; i < 20; i++) {
+    ++main_iter;
+    --preview;
+  }
+  RTF_ASSERT(main_iter.valid() && main_iter->timestamp == 500);
+  RTF_ASSERT(preview.valid() && preview->timestamp == 100);
+  RTF_ASSERT(main_iter->data[0] == 50);
+  RTF_ASSERT(preview->data[0] == 10);
+
+  // Reverse scan from the current point down to the start
+  nanots_iterator reverse = preview;
+  int remaining = 0;
+  while (reverse.valid()) {
+    remaining++;
+    --reverse;
+  }
+  RTF_ASSERT(remaining == 10);
+
+  // Neither the preview nor the main cursor moved
+  RTF_ASSERT(preview->timestamp == 100);
+  RTF_ASSERT(main_iter->timestamp == 500);
+
+  // Assigning over an existing iterator repositions it
+  preview = main_iter;
+  ++preview;
+  RTF_ASSERT(preview->timestamp == 510);
+  RTF_ASSERT(main_iter->timestamp == 500);
+}
+
+void test_nanots::test_nanots_cursor_token_resume() {
+  nanots_writer db("nanots_test_2048_4k_blocks.nts", false);
+
+  {
+    auto wctx = db.create_write_context("token_stream", "token test");
+
+    // 6 frames per (64k) block
+    std::vector<uint8_t> frame(10000);
+    for (int i = 1; i <= 60; i++) {
+      frame[0] = (uint8_t)i;
+      db.write(wctx, frame.data(), frame.size(), i * 10, 0);
+    }
+  }
+
+  cursor_token token;
+  {
+    nanots_iterator iter("nanots_test_2048_4k_blocks.nts", "token_stream");
+    // Process the first 25 frames and remember where we stopped
+    for (int i = 1; i < 25; i++)
+      ++iter;
+    RTF_ASSERT(iter->timestamp == 250);
+    token = iter.current_token();
+    RTF_ASSERT(token.timestamp == 250);
+  }
+
+  // A fresh iterator (e.g. after a restart) resumes exactly on that frame
+  {
+    nanots_iterator iter("nanots_test_2048_4k_blocks.nts", "token_stream");
+    RTF_ASSERT(iter.seek_token(token));
+    RTF_ASSERT(iter.valid());
+    RTF_ASSERT(iter->timestamp == 250);
+    RTF_ASSERT(iter->data[0] == 25);
+    ++iter;
+    RTF_ASSERT(iter->timestamp == 260);
+
+    // Round trip through the token is stable
+    cursor_token again = iter.current_token();
+    RTF_ASSERT(iter.seek_token(again));
+    RTF_ASSERT(iter->timestamp == 260);
+  }
+
+  // A token whose uuid doesn't match is rejected and falls back to a timestamp
+  // search
+  {
+    cursor_token bad = token;
+    bad.block_uuid[0] ^= 0xff;
+    nanots_iterator iter("nanots_test_2048_4k_blocks.nts", "token_stream");
+    RTF_ASSERT(!iter.seek_token(bad));
+    RTF_ASSERT(iter.valid());
+    RTF_ASSERT(iter->timestamp == 250);
+  }
+
+  // Once the block is reclaimed the token falls back to the next surviving frame
+  nanots_writer::free_blocks("nanots_test_2048_4k_blocks.nts", "token_stream", 0, 300);
+  {
+    nanots_iterator iter("nanots_test_2048_4k_blocks.nts", "token_stream");
+    RTF_ASSERT(!iter.seek_token(token));
+    RTF_ASSERT(iter.valid());
+    RTF_ASSERT(iter->timestamp > 250);
+  }
+}
+
+void test_nanots::test_nanots_seek_ordinal() {
+  nanots_writer db("nanots_test_2048_4k_blocks.nts", false);
+
+  // Two recordings of the same stream; ordinals continue across segments
+  for (int segment = 0; segment < 2; segment++) {
+    auto wctx = db.create_write_context("ordinal_stream", "ordinal test");
+
+    // 6 frames per (64k) block
+    std::vector<uint8_t> frame(10000);
+    for (int i = 0; i < 40; i++) {
+      int n = (segment * 40) + i;
+      frame[0] = (uint8_t)n;
+      db.write(wctx, frame.data(), frame.size(), 1000 + (n * 10), 0);
+    }
+  }
+
+  nanots_iterator iter("nanots_test_2048_4k_blocks.nts", "ordinal_stream");
+  RTF_ASSERT(iter.ordinal() == 0);
+
+  // Ordinals track plain iteration
+  for (int i = 0; i < 15; i++)
+    ++iter;
+  RTF_ASSERT(iter.ordinal() == 15);
+
+  for (int64_t n : {0, 5, 6, 17, 39, 40, 41, 66, 79}) {
+    RTF_ASSERT(iter.seek_ordinal(n));
+    RTF_ASSERT(iter.ordinal() == n);
+    RTF_ASSERT(iter->timestamp == 1000 + (n * 10));
+    RTF_ASSERT(iter->data[0] == (uint8_t)n);
+  }
+
+  // Past the end
+  RTF_ASSERT(!iter.seek_ordinal(80));
+  RTF_ASSERT(!iter.valid());
+  RTF_ASSERT(!iter.seek_ordinal(-1));
+
+  // Navigation continues normally from an ordinal seek
+  RTF_ASSERT(iter.seek_ordinal(35));
+  --iter;
+  RTF_ASSERT(iter.ordinal() == 34);
+  for (int i = 0; i < 10; i++)
+    ++iter;
+  RTF_ASSERT(iter.ordinal() == 44);
+  RTF_ASSERT(iter->timestamp == 1440);
+
+  // Ordinals are stable when older blocks are freed
+  nanots_writer::free_blocks("nanots_test_2048_4k_blocks.nts", "ordinal_stream", 0, 1200);
+  nanots_iterator after_free("nanots_test_2048_4k_blocks.nts", "ordinal_stream");
+  RTF_ASSERT(!after_free.seek_ordinal(3));
+  RTF_ASSERT(after_free.seek_ordinal(50));
+  RTF_ASSERT(after_free->timestamp == 1500);
+
+  // ...even once every block of the stream is gone
+  nanots_writer::free_blocks("nanots_test_2048_4k_blocks.nts", "ordinal_stream", 0, INT64_MAX);
+  {
+    auto wctx = db.create_write_context("ordinal_stream", "ordinal test");
+    std::vector<uint8_t> frame(10000);
+    db.write(wctx, frame.data(), frame.size(), 5000, 0);
+  }
+  nanots_iterator after_free_all("nanots_test_2048_4k_blocks.nts", "ordinal_stream");
+  RTF_ASSERT(after_free_all.valid() && after_free_all.ordinal() == 80);
+  RTF_ASSERT(!after_free_all.seek_ordinal(0));
+  RTF_ASSERT(after_free_all.seek_ordinal(80) && after_free_all->timestamp == 5000);
+}
+
+void test_nanots::test_nanots_read_ranges() {
+  nanots_writer db("nanots_test_2048_4k_blocks.nts", false);
+
+  {
+    auto wctx = db.create_write_context("ranges_stream", "ranges test");
+
+    // 6 frames per (64k) block
+    std::vector<uint8_t> frame(10000);
+    for (int i = 1; i <= 100; i++) {
+      frame[0] = (uint8_t)i;
+      db.write(wctx, frame.data(), frame.size(), i * 10, 0);
+    }
+  }
+
+  nanots_reader reader("nanots_test_2048_4k_blocks.nts");
+
+  // Unsorted, overlapping, touching, inverted and out of data ranges
+  std::vector<std::pair<int64_t, int64_t>> ranges = {
+      {500, 530}, {100, 120}, {115, 150}, {151, 160}, {900, 800}, {2000, 3000}, {995, 5000}};
+
+  std::vector<int64_t> got;
+  reader.read_ranges("ranges_stream", ranges,
+                     [&](const uint8_t* data, size_t size, uint8_t flags, int64_t timestamp,
+                         int64_t block_sequence, const std::string& metadata) {
+                       RTF_ASSERT(data[0] == timestamp / 10);
+                       RTF_ASSERT(metadata == "ranges test");
+                       got.push_back(timestamp);
+                     });
+
+  std::vector<int64_t> expected;
+  for (int64_t ts = 100; ts <= 160; ts += 10)
+    expected.push_back(ts);
+  for (int64_t ts = 500; ts <= 530; ts += 10)
+    expected.push_back(ts);
+  expected.push_back(1000);
+
+  RTF_ASSERT(got == expected);
+
+  // Matches what individual reads return
+  std::vector<int64_t> individual;
+  for (auto& r : std::vector<std::pair<int64_t, int64_t>>{{100, 160}, {500, 530}, {995, 5000}}) {
+    reader.read("ranges_stream", r.first, r.second,
+                [&](const uint8_t* data, size_t size, uint8_t flags, int64_t timestamp,
+                    int64_t block_sequence, const std::string& metadata) {
+                  individual.push_back(timestamp);
+                });
+  }
+  RTF_ASSERT(got == individual);
+
+  // No ranges, no callbacks
+  int calls = 0;
+  reader.read_ranges("ranges_stream", {},
+                     [&](const uint8_t*, size_t, uint8_t, int64_t, int64_t, const std::string&) {
+                       calls++;
+                     });
+  RTF_ASSERT(calls == 0);
+
+  // A range running to INT64_MAX swallows everything after it
+  std::vector<int64_t> all;
+  reader.read_ranges("ranges_stream", {{0, INT64_MAX}, {100, 200}},
+                     [&](const uint8_t*, size_t, uint8_t, int64_t timestamp, int64_t,
+                         const std::string&) { all.push_back(timestamp); });
+  RTF_ASSERT(all.size() == 100);
+  for (size_t i = 0; i < all.size(); i++)
+    RTF_ASSERT(all[i] == (int64_t)(i + 1) * 10);
+
+  // More disjoint ranges than fit in one SQLite statement
+  std::vector<std::pair<int64_t, int64_t>> many;
+  for (int64_t k = 0; k < 20000; k++)
+    many.push_back({k * 5, (k * 5) + 1});
+  all.clear();
+  reader.read_ranges("ranges_stream", many,
+                     [&](const uint8_t*, size_t, uint8_t, int64_t timestamp, int64_t,
+                         const std::string&) { all.push_back(timestamp); });
+  RTF_ASSERT(all.size() == 100);
+  for (size_t i = 0; i < all.size(); i++)
+    RTF_ASSERT(all[i] == (int64_t)(i + 1) * 10);
+}
+
+void test_nanots::test_nanots_find_gaps() {
+  nanots_writer db("nanots_test_2048_4k_blocks.nts", false);
+
+  // 6 frames per (64k) block
+  std::vector<uint8_t> frame(10000);
+
+  {
+    auto wctx = db.create_write_context("gaps_stream", "gaps test");
+    int64_t ts = 0;
+    for (int i = 0; i < 100; i++) {
+      ts += 10;
+      if (i == 20)
+        ts += 500;  // gap inside a block
+      if (i == 36)
+        ts += 200;  // gap on a block boundary (6 frames per block)
+      db.write(wctx, frame.data(), frame.size(), ts, 0);
+    }
+  }
+
+  {
+    // A second recording that starts after an outage
+    auto wctx = db.create_write_context("gaps_stream", "gaps test");
+    for (int i = 0; i < 20; i++)
+      db.write(wctx, frame.data(), frame.size(), 5000 + (i * 10), 0);
+  }
+
+  // Brute force reference from every pair of consecutive frames
+  auto reference = [&](int64_t start, int64_t end, int64_t min_gap) {
+    std::vector<std::pair<int64_t, int64_t>> result;
+    nanots_iterator iter("nanots_test_2048_4k_blocks.nts", "gaps_stream");
+    int64_t previous = iter->timestamp;
+    ++iter;
+    while (iter.valid()) {
+      if (iter->timestamp - previous > min_gap && iter->timestamp > start && previous < end)
+        result.push_back({previous, iter->timestamp});
+      previous = iter->timestamp;
+      ++iter;
+    }
+    return result;
+  };
+
+  nanots_reader reader("nanots_test_2048_4k_blocks.nts");
+
+  auto check = [&](int64_t start, int64_t end, int64_t min_gap) {
+    auto gaps = reader.find_gaps("gaps_stream", start, end, min_gap);
+    std::vector<std::pair<int64_t, int64_t>> got;
+    for (auto& g : gaps)
+      got.push_back({g.start_timestamp, g.end_timestamp});
+    RTF_ASSERT(got == reference(start, end, min_gap));
+    return gaps.size();
+  };
+
+  RTF_ASSERT(check(0, 10000, 50) == 3);
+  RTF_ASSERT(check(0, 10000, 300) == 2);
+  RTF_ASSERT(check(0, 10000, 1000) == 1);
+  RTF_ASSERT(check(0, 10000, 10000) == 0);
+  // Windows that cut through, or sit entirely inside, a gap
+  RTF_ASSERT(check(400, 500, 50) == 1);
+  RTF_ASSERT(check(250, 300, 50) == 1);
+  RTF_ASSERT(check(1100, 1200, 50) == 0);
+  RTF_ASSERT(check(1500, 4000, 50) == 1);
+  RTF_ASSERT(check(0, 10000, 5) == reference(0, 10000, 5).size());
+}
+
+void test_nanots::test_nanots_size_histogram() {
+  nanots_writer db("nanots_test_2048_4k_blocks.nts", false);
+
+  std::map<int64_t, uint64_t> stored_sizes;
+
+  {
+    auto wctx = db.create_write_context("histogram_stream", "histogram test");
+    for (int i = 1; i <= 200; i++) {
+      size_t size = 1000 + ((i * 7919) % 9000);
+      std::vector<uint8_t> frame(size);
+      db.write(wctx, frame.data(), frame.size(), i * 10, 0);
+      // Frames are stored with a header and padded to 8 bytes
+      stored_sizes[i * 10] = (FRAME_HEADER_SIZE + size + 7) & ~7;
+    }
+  }
+
+  nanots_reader reader("nanots_test_2048_4k_blocks.nts");
+
+  for (int64_t bucket_size : {1, 25, 100, 700, 5000}) {
+    for (auto& range : std::vector<std::pair<int64_t, int64_t>>{{0, 2500}, {333, 1234}}) {
+      auto buckets = reader.size_histogram("histogram_stream", range.first, range.second, bucket_size);
+      RTF_ASSERT(buckets.size() == (size_t)((range.second - range.first) / bucket_size) + 1);
+
+      for (auto& bucket : buckets) {
+        uint64_t expected_frames = 0;
+        uint64_t expected_bytes = 0;
+        for (auto& s : stored_sizes) {
+          if (s.first >= bucket.start_timestamp && s.first < bucket.start_timestamp + bucket_size &&
+              s.first <= range.second) {
+            expected_frames++;
+            expected_bytes += s.second;
+          }
+        }
+        RTF_ASSERT(bucket.n_frames == expected_frames);
+        RTF_ASSERT(bucket.n_bytes == expected_bytes);
+      }
+    }
+  }
+
+  RTF_ASSERT_THROWS(reader.size_histogram("histogram_stream", 0, 100, 0), nanots_exception);
+
+  // The whole timestamp range spans more than INT64_MAX
+  auto buckets = reader.size_histogram("histogram_stream", INT64_MIN, INT64_MAX, INT64_MAX);
+  RTF_ASSERT(buckets.size() == 3);
+  RTF_ASSERT(buckets[0].start_timestamp == INT64_MIN);
+  RTF_ASSERT(buckets[1].n_frames == 200);
+  RTF_ASSERT(buckets[0].n_frames + buckets[2].n_frames == 0);
+
+  // Too many buckets
+  RTF_ASSERT_THROWS(reader.size_histogram("histogram_stream", INT64_MIN, INT64_MAX, 1), nanots_exception);
+  RTF_ASSERT_THROWS(reader.size_histogram("histogram_stream", 0, MAX_HISTOGRAM_BUCKETS, 1), nanots_exception);
+  RTF_ASSERT(reader.size_histogram("histogram_stream", 0, MAX_HISTOGRAM_BUCKETS - 1, 1).size() == MAX_HISTOGRAM_BUCKETS);
+}
+
+void test_nanots::test_nanots_find_secondary() {
+  nanots_writer db("nanots_test_2048_4k_blocks.nts", false);
+
+  // Secondary keys are not monotonic: odd frames run ahead of even ones.
+  auto key_of = [](int i) { return (i % 2 == 0) ? (int64_t)i * 100 - 50 : (int64_t)i * 100; };
+
+  {
+    auto wctx = db.create_write_context("secondary_stream", "secondary test");
+    std::vector<uint8_t> frame(10000);
+    for (int i = 1; i <= 40; i++) {
+      frame[0] = (uint8_t)i;
+      db.write(wctx, frame.data(), frame.size(), i * 10, 0, key_of(i));
+    }
+
+    // A context can't mix frames with and without secondary keys.
+    RTF_ASSERT_THROWS(db.write(wctx, frame.data(), frame.size(), 1000, 0), nanots_exception);
+  }
+
+  nanots_iterator iter("nanots_test_2048_4k_blocks.nts", "secondary_stream");
+
+  RTF_ASSERT(iter.valid());
+  RTF_ASSERT(iter.current_secondary_key().value() == key_of(1));
+
+  RTF_ASSERT(iter.find_secondary(1450));
+  RTF_ASSERT(iter->timestamp == 150);
+  RTF_ASSERT(iter->data[0] == 15);
+  RTF_ASSERT(iter.current_secondary_key().value() == 1500);
+
+  ++iter;
+  RTF_ASSERT(iter.valid());
+  RTF_ASSERT(iter.current_secondary_key().value() == key_of(16));
+
+  RTF_ASSERT(iter.find_secondary(3350));
+  RTF_ASSERT(iter->timestamp == 340);
+
+  RTF_ASSERT(iter.find_secondary(-100));
+  RTF_ASSERT(iter->timestamp == 10);
+
+  RTF_ASSERT(!iter.find_secondary(4001));
+  RTF_ASSERT(!iter.valid());
+
+  // Key slots are counted as frame storage.
+  nanots_reader reader("nanots_test_2048_4k_blocks.nts");
+  auto buckets = reader.size_histogram("secondary_stream", 0, 999, 1000);
+  RTF_ASSERT(buckets.size() == 1);
+  RTF_ASSERT(buckets[0].n_frames == 40);
+  RTF_ASSERT(buckets[0].n_bytes == 40 * (((FRAME_HEADER_SIZE + 10000 + 7) & ~7) + SECONDARY_KEY_SIZE));
+
+  // Frames written without keys have none.
+  {
+    auto wctx = db.create_write_context("plain_stream", "no keys");
+    std::vector<uint8_t> frame(100);
+    db.write(wctx, frame.data(), frame.size(), 10, 0);
+  }
+  nanots_iterator plain("nanots_test_2048_4k_blocks.nts", "plain_stream");
+  RTF_ASSERT(plain.valid());
+  RTF_ASSERT(!plain.current_secondary_key());
+  RTF_ASSERT(!plain.find_secondary(0));
+}
+
+void test_nanots::test_nanots_read_key() {
+  nanots_writer db("nanots_test_2048_4k_blocks.nts", false);
+
+  // The first 4 bytes of every frame hold the symbol it belongs to.
+  auto key_of = [](const uint8_t* data, size_t size) {
+    return (size >= 4) ? std::string((const char*)data, 4) : std::string();
+  };
+
+  {
+    auto wctx = db.create_write_context("key_stream", "bloom test");
+    wctx.key_extractor = key_of;
+    std::vector<uint8_t> frame(10000);
+    for (int i = 1; i <= 60; i++) {
+      const char* symbol = (i == 45) ? "CCC" : (i <= 30) ? "AAA" : "BBB";
+      memcpy(frame.data(), symbol, 4);
+      frame[4] = (uint8_t)i;
+      db.write(wctx, frame.data(), frame.size(), i * 10, 0);
+    }
+  }
+
+  nanots_reader reader("nanots_test_2048_4k_blocks.nts");
+
+  // Counts how many frames the reader had to look at.
+  int n_extracted = 0;
+  auto counting_key_of = [&](const uint8_t* data, size_t size) {
+    n_extracted++;
+    return key_of(data, size);
+  };
+
+  std::vector<int64_t> timestamps;
+  auto collect = [&](const uint8_t* data, size_t, uint8_t, int64_t timestamp, int64_t, const std::string&) {
+    RTF_ASSERT(data[4] == timestamp / 10);
+    timestamps.push_back(timestamp);
+  };
+
+  // 6 frames per block: only the 5 blocks holding AAA are scanned.
+  reader.read_key("key_stream", std::string("AAA", 4), counting_key_of, 0, 1000, collect);
+  RTF_ASSERT(timestamps.size() == 30);
+  RTF_ASSERT(timestamps.front() == 10 && timestamps.back() == 300);
+  RTF_ASSERT(n_extracted == 30);
+
+  timestamps.clear();
+  n_extracted = 0;
+  reader.read_key("key_stream", std::string("CCC", 4), counting_key_of, 0, 1000, collect);
+  RTF_ASSERT(timestamps.size() == 1 && timestamps[0] == 450);
+  RTF_ASSERT(n_extracted == 6);
+
+  timestamps.clear();
+  n_extracted = 0;
+  reader.read_key("key_stream", std::string("BBB", 4), counting_key_of, 400, 500, collect);
+  RTF_ASSERT(timestamps.size() == 10);
+
+  timestamps.clear();
+  n_extracted = 0;
+  reader.read_key("key_stream", std::string("ZZZ", 4), counting_key_of, 0, 1000, collect);
+  RTF_ASSERT(timestamps.empty());
+  RTF_ASSERT(n_extracted == 0);
+}
+
+void test_nanots::test_nanots_read_where() {
+  nanots_writer db("nanots_test_2048_4k_blocks.nts", false);
+
+  // The first 8 bytes of every frame hold a temperature reading.
+  auto temperature_of = [](const uint8_t* data, size_t size) -> std::optional<double> {
+    if (size < sizeof(double))
+      return std::nullopt;
+    double value;
+    memcpy(&value, data, sizeof(double));
+    return value;
+  };
+
+  {
+    auto wctx = db.create_write_context("temperature_stream", "summary test");
+    wctx.value_extractor = temperature_of;
+    std::vector<uint8_t> frame(10000);
+    for (int i = 1; i <= 60; i++) {
+      double temperature = (i == 40) ? 95.0 : (i == 41) ? 85.0 : 20.0 + (i % 7);
+      memcpy(frame.data(), &temperature, sizeof(double));
+      db.write(wctx, frame.data(), frame.size(), i * 10, 0);
+    }
+  }
+
+  nanots_reader reader("nanots_test_2048_4k_blocks.nts");
+
+  // Counts how many frames the reader had to look at.
+  int n_extracted = 0;
+  auto counting_temperature_of = [&](const uint8_t* data, size_t size) {
+    n_extracted++;
+    return temperature_of(data, size);
+  };
+
+  std::vector<int64_t> timestamps;
+  auto collect = [&](const uint8_t*, size_t, uint8_t, int64_t timestamp, int64_t, const std::string&) {
+    timestamps.push_back(timestamp);
+  };
+
+  // 6 frames per block: only the block holding the spike is scanned.
+  reader.read_where("temperature_stream", counting_temperature_of, 80.0,
+                    std::numeric_limits<double>::infinity(), 0, 1000, collect);
+  RTF_ASSERT(timestamps.size() == 2);
+  RTF_ASSERT(timestamps[0] == 400 && timestamps[1] == 410);
+  RTF_ASSERT(n_extracted == 6);
+
+  timestamps.clear();
+  n_extracted = 0;
+  reader.read_where("temperature_stream", counting_temperature_of, 26.0, 26.0, 0, 300, collect);
+  RTF_ASSERT(timestamps.size() == 4);
+  for (auto ts : timestamps)
+    RTF_ASSERT((ts / 10) % 7 == 6);
+
+  timestamps.clear();
+  n_extracted = 0;
+  reader.read_where("temperature_stream", counting_temperature_of, 100.0,
+                    std::numeric_limits<double>::infinity(), 0, 1000, collect);
+  RTF_ASSERT(timestamps.empty());
+  RTF_ASSERT(n_extracted == 0);
+}
+
+void test_nanots::test_nanots_continuous_queries() {
+  nanots_writer db("nanots_test_2048_4k_blocks.nts", false);
+
+  auto temperature_of = [](const uint8_t* data, size_t size) -> std::optional<double> {
+    double value;
+    memcpy(&value, data, sizeof(double));
+    return value;
+  };
+
+  std::vector<continuous_query_result> alerts, averages, counts;
+
+  continuous_query alert;
+  alert.stream_tag = "cq_source";
+  alert.value_extractor = temperature_of;
+  alert.aggregate = cq_aggregate::MAX;
+  alert.threshold = 80.0;
+  alert.callback = [&](const continuous_query_result& r) { alerts.push_back(r); };
+  auto alert_id = db.register_continuous_query(alert);
+
+  continuous_query average;
+  average.stream_tag = "cq_source";
+  average.value_extractor = temperature_of;
+  average.aggregate = cq_aggregate::AVG;
+  average.window = 100;
+  average.callback = [&](const continuous_query_result& r) { averages.push_back(r); };
+  average.derived_stream_tag = "cq_averages";
+  db.register_continuous_query(average);
+
+  continuous_query count;
+  count.stream_tag = "cq_source";
+  count.filter = [&](const uint8_t* data, size_t size) { return temperature_of(data, size).value() > 50.0; };
+  count.window = 100;
+  count.callback = [&](const continuous_query_result& r) { counts.push_back(r); };
+  db.register_continuous_query(count);
+
+  // Queries need a callback or a derived stream.
+  continuous_query invalid;
+  invalid.stream_tag = "cq_source";
+  RTF_ASSERT_THROWS(db.register_continuous_query(invalid), nanots_exception);
+
+  auto wctx = db.create_write_context("cq_source", "continuous query test");
+  std::vector<uint8_t> frame(256);
+  auto write = [&](int64_t timestamp, double temperature) {
+    memcpy(frame.data(), &temperature, sizeof(double));
+    db.write(wctx, frame.data(), frame.size(), timestamp, 0);
+  };
+
+  for (int i = 1; i <= 30; i++)
+    write(i * 10, (i == 15) ? 90.0 : 20.0 + i);
+
+  db.drain_continuous_queries();
+
+  RTF_ASSERT(alerts.size() == 1);
+  RTF_ASSERT(alerts[0].window_start == 150 && alerts[0].window_end == 150);
+  RTF_ASSERT(alerts[0].value == 90.0);
+
+  // The window holding ts 300 is still open.
+  RTF_ASSERT(averages.size() == 3);
+  RTF_ASSERT(averages[0].window_start == 0 && averages[0].window_end == 99);
+  RTF_ASSERT(averages[0].n_frames == 9 && averages[0].value == 25.0);
+  RTF_ASSERT(averages[1].n_frames == 10 && averages[1].value == 40.0);
+  RTF_ASSERT(averages[2].n_frames == 10 && averages[2].value == 44.5);
+
+  RTF_ASSERT(counts.size() == 1);
+  RTF_ASSERT(counts[0].window_start == 100 && counts[0].value == 1.0);
+
+  // Window results were also appended to the derived stream.
+  nanots_reader reader("nanots_test_2048_4k_blocks.nts");
+  std::vector<continuous_query_result> derived;
+  reader.read("cq_averages", 0, 1000,
+              [&](const uint8_t* data, size_t size, uint8_t, int64_t timestamp, int64_t, const std::string&) {
+                RTF_ASSERT(size == sizeof(continuous_query_result));
+                continuous_query_result r;
+                memcpy(&r, data, sizeof(r));
+                RTF_ASSERT(r.window_end == timestamp);
+                derived.push_back(r);
+              });
+  RTF_ASSERT(derived.size() == 3);
+  RTF_ASSERT(derived[1].value == 40.0);
+
+  // Nothing is delivered once a query is unregistered.
+  db.unregister_continuous_query(alert_id);
+  write(310, 95.0);
+  db.drain_continuous_queries();
+  RTF_ASSERT(alerts.size() == 1);
+  RTF_ASSERT(averages.size() == 3);
+}
+
+void test_nanots::test_nanots_live_fanout() {
+  nanots_writer::remove_live_ring("nanots_test_2048_4k_blocks.nts", "live_stream");
+
+  // Nothing to follow until the stream's writer enables fanout.
+  RTF_ASSERT_THROWS(nanots_live_subscriber("nanots_test_2048_4k_blocks.nts", "live_stream"),
+                    nanots_exception);
+
+  nanots_writer db("nanots_test_2048_4k_blocks.nts", false);
+  auto wctx = db.create_write_context("live_stream", "live test");
+  db.enable_live_fanout(wctx);
+
+  std::vector<uint8_t> frame(64);
+  auto write = [&](int64_t timestamp) {
+    memcpy(frame.data(), &timestamp, sizeof(timestamp));
+    db.write(wctx, frame.data(), frame.size(), timestamp, 0);
+  };
+
+  // Frames written before a subscriber exists are not delivered to it.
+  write(1);
+
+  nanots_live_subscriber subscriber("nanots_test_2048_4k_blocks.nts", "live_stream");
+
+  frame_info fi;
+  RTF_ASSERT(!subscriber.next(fi, 10));
+
+  // A waiting subscriber is woken by the write.
+  std::thread writer_thread([&]() {
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    write(2);
+  });
+  auto before = steady_clock::now();
+  RTF_ASSERT(subscriber.next(fi, 5000));
+  auto waited = duration_cast<milliseconds>(steady_clock::now() - before).count();
+  writer_thread.join();
+
+  RTF_ASSERT(fi.timestamp == 2);
+  RTF_ASSERT(fi.size == frame.size());
+  RTF_ASSERT(*(const int64_t*)fi.data == 2);
+  RTF_ASSERT(waited < 1000);
+
+  // A subscriber that falls more than a ring behind skips to the oldest frame
+  // still in the ring.
+  for (int64_t ts = 3; ts < 3 + LIVE_RING_ENTRIES + 100; ts++)
+    write(ts);
+
+  int64_t expected = 103;
+  while (subscriber.next(fi, 0)) {
+    RTF_ASSERT(fi.timestamp == expected);
+    RTF_ASSERT(*(const int64_t*)fi.data == expected);
+    expected++;
+  }
+  RTF_ASSERT(expected == 3 + LIVE_RING_ENTRIES + 100);
+  RTF_ASSERT(subscriber.n_dropped() == 100);
+
+  nanots_writer::remove_live_ring("nanots_test_2048_4k_blocks.nts", "live_stream");
+
+  // The ring goes away with the last writer publishing to it.
+  {
+    auto other = db.create_write_context("live_stream_2", "live test");
+    db.enable_live_fanout(other);
+
+    nanots_live_subscriber follower("nanots_test_2048_4k_blocks.nts", "live_stream_2");
+    db.write(other, frame.data(), frame.size(), 1, 0);
+    RTF_ASSERT(follower.next(fi, 1000));
+    RTF_ASSERT(fi.timestamp == 1);
+  }
+  RTF_ASSERT_THROWS(nanots_live_subscriber("nanots_test_2048_4k_blocks.nts", "live_stream_2"),
+                    nanots_exception);
+}
+
+void test_nanots::test_nanots_seal() {
+  // Sealing needs a real file, whatever the fixture is using.
+  const std::string file_name = "nanots_test_sealed.nts";
+  if (rtf_file_exists(file_name))
+    rtf_remove_file(file_name);
+
+  nanots_writer::allocate(file_name, 4096, 16);
+  auto db_name = nanots_database::open(file_name)->database_name();
+
+  auto value_of = [](const uint8_t* data, size_t) -> std::optional<double> {
+    return (double)data[0];
+  };
+
+  {
+    nanots_writer db(file_name, false);
+    auto wctx = db.create_write_context("sealed_stream", "seal test");
+    wctx.value_extractor = value_of;
+    std::vector<uint8_t> frame(10000);
+    for (int i = 1; i <= 20; i++) {
+      frame[0] = (uint8_t)i;
+      db.write(wctx, frame.data(), frame.size(), i * 10, 0);
+    }
+
+    // Not while a writer has the file open
+    bool rejected = false;
+    try {
+      nanots_writer::seal(file_name);
+    } catch (const nanots_exception& e) {
+      rejected = (e.get_ec() == NANOTS_EC_INVALID_ARGUMENT);
+    }
+    RTF_ASSERT(rejected);
+    RTF_ASSERT(rtf_file_exists(db_name));
+  }
+
+  // A second stream recorded over two sessions.
+  for (int session = 0; session < 2; session++) {
+    nanots_writer db(file_name, false);
+    auto wctx = db.create_write_context("sessions_stream", "seal test");
+    std::vector<uint8_t> frame(10000);
+    for (int i = 1; i <= 12; i++)
+      db.write(wctx, frame.data(), frame.size(), 2000 + (((session * 12) + i) * 10), 0);
+  }
+
+  nanots_writer::seal(file_name);
+  RTF_ASSERT(!rtf_file_exists(db_name));
+  RTF_ASSERT(nanots_database::open(file_name)->sealed());
+
+  bool threw = false;
+  try {
+    nanots_writer::seal(file_name);
+  } catch (const nanots_exception&) {
+    threw = true;
+  }
+  RTF_ASSERT(threw);
+
+  threw = false;
+  try {
+    nanots_writer db(file_name, false);
+  } catch (const nanots_exception& e) {
+    threw = (e.get_ec() == NANOTS_EC_CANT_OPEN);
+  }
+  RTF_ASSERT(threw);
+
+  {
+    nanots_reader reader(file_name);
+
+    std::vector<int64_t> timestamps;
+    reader.read("sealed_stream", 55, 145,
+                [&](const uint8_t* data, size_t, uint8_t, int64_t timestamp, int64_t,
+                    const std::string& metadata) {
+                  RTF_ASSERT(data[0] == timestamp / 10);
+                  RTF_ASSERT(metadata == "seal test");
+                  timestamps.push_back(timestamp);
+                });
+    RTF_ASSERT(timestamps.size() == 9);
+    RTF_ASSERT(timestamps.front() == 60 && timestamps.back() == 140);
+
+    timestamps.clear();
+    reader.read("sessions_stream", 0, INT64_MAX,
+                [&](const uint8_t*, size_t, uint8_t, int64_t timestamp, int64_t,
+                    const std::string&) { timestamps.push_back(timestamp); });
+    RTF_ASSERT(timestamps.size() == 24);
+    for (size_t i = 0; i < timestamps.size(); i++)
+      RTF_ASSERT(timestamps[i] == 2000 + (int64_t)(i + 1) * 10);
+
+    int n_groups = 0;
+    reader.read_group({"sessions_stream"}, 0, INT64_MAX,
+                      [&](int64_t timestamp, const std::vector<frame_info>&) {
+                        n_groups++;
+                        RTF_ASSERT(timestamp == 2000 + n_groups * 10);
+                      });
+    RTF_ASSERT(n_groups == 24);
+
+    // Queries beyond read() run against the directory loaded into memory.
+    timestamps.clear();
+    reader.read_where("sealed_stream", value_of, 17.0, 18.0, 0, 1000,
+                      [&](const uint8_t*, size_t, uint8_t, int64_t timestamp, int64_t,
+                          const std::string&) { timestamps.push_back(timestamp); });
+    RTF_ASSERT(timestamps.size() == 2);
+    RTF_ASSERT(reader.query_stream_tags(0, 1000).size() == 1);
+
+    nanots_iterator iter(file_name, "sealed_stream");
+    int n_frames = 0;
+    for (; iter.valid(); ++iter)
+      n_frames++;
+    RTF_ASSERT(n_frames == 20);
+    RTF_ASSERT(iter.find(100) && iter->timestamp == 100);
+  }
+
+  rtf_remove_file(file_name);
+}
+
+void test_nanots::test_nanots_backup() {
+  // Backups need real files, whatever the fixture is using.
+  const std::string file_name = "nanots_test_backup_src.nts";
+  const std::string backup_name = "nanots_test_backup_dst.nts";
+  for (auto& name : {file_name, backup_name}) {
+    if (rtf_file_exists(name))
+      rtf_remove_file(name);
+  }
+
+  nanots_writer::allocate(file_name, 4096, 32);
+
+  auto count_frames = [&](const std::string& stream_tag) {
+    int n = 0;
+    nanots_reader reader(backup_name);
+    reader.read(stream_tag, 0, 100000,
+                [&](const uint8_t* data, size_t, uint8_t, int64_t timestamp, int64_t,
+                    const std::string&) {
+                  RTF_ASSERT(data[0] == (uint8_t)(timestamp / 10));
+                  n++;
+                });
+    return n;
+  };
+
+  std::vector<uint8_t> frame(10000);
+
+  {
+    nanots_writer db(file_name, false);
+    auto wctx = db.create_write_context("backup_stream", "backup test");
+    for (int i = 1; i <= 20; i++) {
+      frame[0] = (uint8_t)i;
+      db.write(wctx, frame.data(), frame.size(), i * 10, 0);
+    }
+
+    // 6 frames per block, the 4th block is still being written.
+    auto info = nanots_writer::backup(file_name, backup_name);
+    RTF_ASSERT(info.n_blocks == 4 && info.n_blocks_copied == 4);
+    RTF_ASSERT(count_frames("backup_stream") == 20);
+
+    for (int i = 21; i <= 30; i++) {
+      frame[0] = (uint8_t)i;
+      db.write(wctx, frame.data(), frame.size(), i * 10, 0);
+    }
+  }
+
+  // Only the block that was open and the new ones are copied again.
+  auto info = nanots_writer::backup(file_name, backup_name);
+  RTF_ASSERT(info.n_blocks == 5 && info.n_blocks_copied == 2);
+  RTF_ASSERT(count_frames("backup_stream") == 30);
+
+  info = nanots_writer::backup(file_name, backup_name);
+  RTF_ASSERT(info.n_blocks == 5 && info.n_blocks_copied == 0);
+
+  // The backup is a working database.
+  {
+    nanots_writer db(backup_name, false);
+    auto wctx = db.create_write_context("restored_stream", "restored");
+    frame[0] = 1;
+    db.write(wctx, frame.data(), frame.size(), 10, 0);
+  }
+  RTF_ASSERT(count_frames("restored_stream") == 1);
+
+  for (auto& name : {file_name, backup_name})
+    rtf_remove_file(name);
+}
+
+void test_nanots::test_nanots_mirror() {
+  const std::string mirror_name = "nanots_test_mirror.nts";
+  const std::string promoted_name = "nanots_test_promoted.nts";
+  for (auto& name : {mirror_name, promoted_name}) {
+    if (rtf_file_exists(name))
+      rtf_remove_file(name);
+  }
+
+  nanots_writer::allocate(mirror_name, 4096, 16);
+
+  {
+    nanots_writer db("nanots_test_2048_4k_blocks.nts", false);
+    db.enable_mirror(mirror_name, 4);
+
+    std::vector<uint8_t> frame(10000);
+    for (int segment = 0; segment < 2; segment++) {
+      auto wctx = db.create_write_context("mirrored_stream", "mirror test");
+      for (int i = 1; i <= 15; i++) {
+        int64_t timestamp = (segment * 15 + i) * 10;
+        frame[0] = (uint8_t)(timestamp / 10);
+        db.write(wctx, frame.data(), frame.size(), timestamp, (uint8_t)segment, -timestamp);
+        RTF_ASSERT(db.get_mirror_stats().lag_frames <= 4);
+      }
+    }
+
+    db.drain_mirror();
+    auto stats = db.get_mirror_stats();
+    RTF_ASSERT(stats.n_frames_shipped == 30);
+    RTF_ASSERT(stats.n_frames_dropped == 0 && stats.lag_frames == 0);
+
+    // Frees on the primary reach the mirror: the first two blocks (6 frames each).
+    nanots_writer::free_blocks("nanots_test_2048_4k_blocks.nts", "mirrored_stream", 0, 120);
+    db.drain_mirror();
+  }
+
+  // The mirror survives the primary and can take its place.
+  nanots_writer::promote_mirror(mirror_name, promoted_name);
+  RTF_ASSERT(!rtf_file_exists(mirror_name));
+
+  {
+    nanots_iterator iter(promoted_name, "mirrored_stream");
+    int n_frames = 0;
+    for (; iter.valid(); ++iter) {
+      n_frames++;
+      RTF_ASSERT(iter->data[0] == (uint8_t)(iter->timestamp / 10));
+      RTF_ASSERT(iter->flags == ((iter->timestamp > 150) ? 1 : 0));
+      RTF_ASSERT(iter.current_secondary_key() == -iter->timestamp);
+      RTF_ASSERT(iter->timestamp > 120);
+    }
+    RTF_ASSERT(n_frames == 18);
+
+    nanots_writer db(promoted_name, false);
+    auto wctx = db.create_write_context("mirrored_stream", "after promotion");
+    uint8_t byte = 31;
+    db.write(wctx, &byte, 1, 310, 0, -310);
+  }
+
+  rtf_remove_file(promoted_name);
+}
+
+void test_nanots::test_nanots_bulk_load() {
+  // Bulk loads need a real file, whatever the fixture is using.
+  const std::string file_name = "nanots_test_bulk.nts";
+  if (rtf_file_exists(file_name))
+    rtf_remove_file(file_name);
+
+  nanots_writer::allocate(file_name, 65536, 64);
+
+  // Three streams of sorted frames with varying sizes; the first also carries
+  // secondary keys.
+  std::vector<bulk_stream> streams;
+  for (int s = 0; s < 3; s++) {
+    auto frame = std::make_shared<std::vector<uint8_t>>();
+    auto i = std::make_shared<int>(0);
+    bulk_stream stream;
+    stream.stream_tag = "bulk_" + std::to_string(s);
+    stream.metadata = "bulk test";
+    stream.next = [s, frame, i](bulk_frame& f) {
+      if (++*i > 1000)
+        return false;
+      frame->assign(100 + (*i * 37) % 900, (uint8_t)*i);
+      f.data = frame->data();
+      f.size = frame->size();
+      f.timestamp = *i * 10;
+      f.flags = (uint8_t)s;
+      if (s == 0)
+        f.secondary_key = *i * 3;
+      return true;
+    };
+    stream.value_extractor = [](const uint8_t* data, size_t) -> std::optional<double> {
+      return (double)data[0];
+    };
+    streams.push_back(std::move(stream));
+  }
+
+  auto stats = nanots_writer::bulk_load(file_name, std::move(streams), 3);
+  RTF_ASSERT(stats.n_frames == 3000);
+
+  {
+    for (int s = 0; s < 3; s++) {
+      nanots_iterator iter(file_name, "bulk_" + std::to_string(s));
+      int i = 0;
+      for (; iter.valid(); ++iter) {
+        i++;
+        RTF_ASSERT(iter->timestamp == i * 10);
+        RTF_ASSERT(iter->size == (size_t)(100 + (i * 37) % 900));
+        RTF_ASSERT(iter->data[0] == (uint8_t)i && iter->flags == s);
+        RTF_ASSERT(iter.ordinal() == i - 1);
+      }
+      RTF_ASSERT(i == 1000);
+    }
+
+    nanots_iterator iter(file_name, "bulk_0");
+    RTF_ASSERT(iter.find_secondary(1499) && iter->timestamp == 5000);
+
+    nanots_reader reader(file_name);
+    int n_read = 0;
+    reader.read_where("bulk_1", [](const uint8_t* data, size_t) -> std::optional<double> {
+      return (double)data[0];
+    }, 7.0, 7.0, 0, 100000, [&](const uint8_t*, size_t, uint8_t, int64_t, int64_t, const std::string&) {
+      n_read++;
+    });
+    RTF_ASSERT(n_read == 4);
+  }
+
+  // Writers carry on where the load ended.
+  {
+    nanots_writer db(file_name, false);
+    auto wctx = db.create_write_context("bulk_2", "appended");
+    uint8_t byte = 0;
+    db.write(wctx, &byte, 1, 100000, 0);
+  }
+
+  nanots_iterator iter(file_name, "bulk_2");
+  RTF_ASSERT(iter.find(100000) && iter.ordinal() == 1000);
+  RTF_ASSERT(stats.n_blocks < 64);
+
+  rtf_remove_file(file_name);
+}
+
+void test_nanots::test_nanots_merge() {
+  // Merges copy between real files, whatever the fixture is using.
+  const std::string source_name = "nanots_test_merge_src.nts";
+  const std::string file_name = "nanots_test_merge_dst.nts";
+  for (auto& name : {source_name, file_name}) {
+    if (rtf_file_exists(name))
+      rtf_remove_file(name);
+  }
+
+  nanots_writer::allocate(source_name, 4096, 32);
+  nanots_writer::allocate(file_name, 4096, 32);
+
+  std::vector<uint8_t> frame(10000);
+
+  // The destination already has the stream's first 5 frames.
+  {
+    nanots_writer db(file_name, false);
+    auto wctx = db.create_write_context("edge_stream", "central");
+    for (int i = 1; i <= 5; i++) {
+      frame[0] = (uint8_t)i;
+      db.write(wctx, frame.data(), frame.size(), i * 10, (uint8_t)(i % 2), i);
+    }
+  }
+
+  merge_stats stats;
+  {
+    nanots_writer db(source_name, false);
+    auto wctx = db.create_write_context("edge_stream", "edge device");
+    for (int i = 6; i <= 25; i++) {
+      frame[0] = (uint8_t)i;
+      db.write(wctx, frame.data(), frame.size(), i * 10, (uint8_t)(i % 2), i);
+    }
+
+    // 6 frames per block; the block still being written stays behind.
+    stats = nanots_writer::merge(source_name, file_name);
+    RTF_ASSERT(stats.n_segments == 1 && stats.n_blocks_skipped == 0);
+    RTF_ASSERT(stats.n_blocks == 3 && stats.n_frames == 18);
+  }
+
+  {
+    nanots_iterator iter(file_name, "edge_stream");
+    int i = 0;
+    for (; iter.valid(); ++iter) {
+      i++;
+      RTF_ASSERT(iter->timestamp == i * 10);
+      RTF_ASSERT(iter->data[0] == (uint8_t)i && iter->flags == i % 2);
+      RTF_ASSERT(iter.current_secondary_key() == i);
+      // Merged ordinals continue after the destination's own frames.
+      RTF_ASSERT(iter.ordinal() == i - 1);
+    }
+    RTF_ASSERT(i == 23);
+
+    // The source is untouched.
+    nanots_iterator source_iter(source_name, "edge_stream");
+    RTF_ASSERT(source_iter.valid() && source_iter->timestamp == 60 && source_iter.ordinal() == 0);
+  }
+
+  // Block sizes must match.
+  const std::string other_name = "nanots_test_merge_other.nts";
+  nanots_writer::allocate(other_name, 131072, 4);
+  bool threw = false;
+  try {
+    nanots_writer::merge(other_name, file_name);
+  } catch (const nanots_exception& e) {
+    threw = e.get_ec() == NANOTS_EC_INVALID_ARGUMENT;
+  }
+  RTF_ASSERT(threw);
+
+  // A later segment reusing a freed block sits earlier in the source file;
+  // the merged segments still come out in recording order.
+  const std::string recycled_name = "nanots_test_merge_recycled.nts";
+  const std::string into_name = "nanots_test_merge_into.nts";
+  for (auto& name : {recycled_name, into_name}) {
+    if (rtf_file_exists(name))
+      rtf_remove_file(name);
+    nanots_writer::allocate(name, 4096, 32);
+  }
+
+  {
+    nanots_writer db(recycled_name, false);
+    {
+      auto wctx = db.create_write_context("recycled_stream", "first");
+      for (int i = 1; i <= 18; i++)
+        db.write(wctx, frame.data(), frame.size(), i * 10, 0);
+    }
+    nanots_writer::free_blocks(recycled_name, "recycled_stream", 0, 60);
+    {
+      auto wctx = db.create_write_context("recycled_stream", "second");
+      for (int i = 101; i <= 106; i++)
+        db.write(wctx, frame.data(), frame.size(), i * 10, 0);
+    }
+  }
+
+  stats = nanots_writer::merge(recycled_name, into_name);
+  RTF_ASSERT(stats.n_segments == 2 && stats.n_blocks == 3);
+
+  {
+    nanots_iterator iter(into_name, "recycled_stream");
+    std::vector<int64_t> timestamps;
+    for (; iter.valid(); ++iter)
+      timestamps.push_back(iter->timestamp);
+    RTF_ASSERT(timestamps.size() == 18);
+    RTF_ASSERT(std::is_sorted(timestamps.begin(), timestamps.end()));
+    RTF_ASSERT(timestamps.front() == 70 && timestamps.back() == 1060);
+  }
+
+  for (auto& name : {source_name, file_name, other_name, recycled_name, into_name})
+    rtf_remove_file(name);
+}
+
+void test_nanots::test_nanots_write_async() {
+  nanots_writer db("nanots_test_2048_4k_blocks.nts", false);
+
+  std::vector<std::future<void>> futures;
+  std::atomic<int> n_callbacks{0};
+  std::atomic<int> n_errors{0};
+
+  {
+    auto wctx = db.create_write_context("async_stream", "async test");
+    std::vector<uint8_t> frame(1000);
+
+    // Enough frames to roll over several blocks on the async thread.
+    for (int i = 1; i <= 300; i++) {
+      frame[0] = (uint8_t)i;
+      if (i % 3 == 0)
+        db.write_async(wctx, frame.data(), frame.size(), i * 10, 0, i, false, [&](nanots_ec_t ec) {
+          if (ec == NANOTS_EC_OK)
+            n_callbacks++;
+        });
+      else
+        futures.push_back(db.write_async(wctx, frame.data(), frame.size(), i * 10, 0, i, i % 50 == 0));
+    }
+
+    // Errors come back through the completion, not from write_async().
+    auto late = db.write_async(wctx, frame.data(), frame.size(), 5, 0, 1);
+    db.write_async(wctx, frame.data(), frame.size(), 5, 0, 1, true, [&](nanots_ec_t ec) {
+      if (ec == NANOTS_EC_NON_MONOTONIC_TIMESTAMP)
+        n_errors++;
+    });
+
+    for (auto& f : futures)
+      f.get();
+
+    bool threw = false;
+    try {
+      late.get();
+    } catch (const nanots_exception& e) {
+      threw = e.get_ec() == NANOTS_EC_NON_MONOTONIC_TIMESTAMP;
+    }
+    RTF_ASSERT(threw);
+
+    db.drain_async(wctx);
+    RTF_ASSERT(n_callbacks == 100 && n_errors == 1);
+
+    // Synchronous writes carry on once the queue is drained.
+    db.write(wctx, frame.data(), frame.size(), 3010, 0, 301);
+  }
+
+  nanots_iterator iter("nanots_test_2048_4k_blocks.nts", "async_stream");
+  int i = 0;
+  for (; iter.valid(); ++iter) {
+    i++;
+    RTF_ASSERT(iter->timestamp == i * 10);
+    RTF_ASSERT(iter.current_secondary_key() == i);
+    if (i <= 300)
+      RTF_ASSERT(iter->data[0] == (uint8_t)i);
+  }
+  RTF_ASSERT(i == 301);
+}
+
+void test_nanots::test_nanots_async_pool() {
+  nanots_writer db("nanots_test_2048_4k_blocks.nts", false);
+  db.set_async_threads(4);
+
+  const int n_streams = 100;
+  std::vector<write_context> contexts;
+  for (int s = 0; s < n_streams; s++)
+    contexts.push_back(db.create_write_context("pool_stream_" + std::to_string(s), "pool test"));
+
+  // 10000 byte frames fill a block every 6 frames, so every stream rolls over
+  // a few times on whichever thread has it.
+  std::vector<uint8_t> frame(10000);
+  std::atomic<int> n_ok{0};
+  for (int i = 1; i <= 20; i++) {
+    for (int s = 0; s < n_streams; s++) {
+      frame[0] = (uint8_t)s;
+      frame[1] = (uint8_t)i;
+      db.write_async(contexts[s], frame.data(), frame.size(), i * 10, 0, std::nullopt, false,
+                     [&](nanots_ec_t ec) {
+                       if (ec == NANOTS_EC_OK)
+                         n_ok++;
+                     });
+    }
+
+    // Changing the pool size keeps the queued frames and their order.
+    if (i == 10)
+      db.set_async_threads(2);
+  }
+
+  for (auto& wctx : contexts)
+    db.drain_async(wctx);
+  RTF_ASSERT(n_ok == n_streams * 20);
+  contexts.clear();
+
+  nanots_reader reader("nanots_test_2048_4k_blocks.nts");
+  for (int s = 0; s < n_streams; s++) {
+    int i = 0;
+    bool ordered = true;
+    reader.read("pool_stream_" + std::to_string(s), 0, INT64_MAX,
+                [&](const uint8_t* data, size_t size, uint8_t, int64_t timestamp, int64_t, const std::string&) {
+                  i++;
+                  ordered = ordered && size == 10000 && timestamp == i * 10 && data[0] == (uint8_t)s &&
+                            data[1] == (uint8_t)i;
+                });
+    RTF_ASSERT(ordered && i == 20);
+  }
+
+  // Resizing the pool while other threads are writing loses no frames.
+  const int n_writers = 4;
+  std::vector<write_context> racing;
+  for (int s = 0; s < n_writers; s++)
+    racing.push_back(db.create_write_context("pool_race_" + std::to_string(s), "pool test"));
+
+  std::atomic<int> n_raced{0};
+  std::vector<std::thread> writers;
+  for (int s = 0; s < n_writers; s++) {
+    writers.emplace_back([&, s]() {
+      std::vector<uint8_t> f(1000, (uint8_t)s);
+      for (int i = 1; i <= 200; i++)
+        db.write_async(racing[s], f.data(), f.size(), i * 10, 0, std::nullopt, false, [&](nanots_ec_t ec) {
+          if (ec == NANOTS_EC_OK)
+            n_raced++;
+        });
+      db.drain_async(racing[s]);
+    });
+  }
+  for (int r = 0; r < 20; r++)
+    db.set_async_threads(1 + r % 3);
+  for (auto& t : writers)
+    t.join();
+  RTF_ASSERT(n_raced == n_writers * 200);
+}
+
+void test_nanots::test_nanots_batched_write_contexts() {
+  nanots_writer db("nanots_test_2048_4k_blocks.nts", false);
+
+  std::vector<std::pair<std::string, std::string>> streams;
+  for (int s = 0; s < 200; s++)
+    streams.emplace_back("batch_stream_" + std::to_string(s), "batch test");
+
+  // A duplicate fails the whole batch without claiming any stream tag.
+  auto dup = streams;
+  dup.push_back(streams.front());
+  bool threw = false;
+  try {
+    db.create_write_contexts(dup);
+  } catch (const nanots_exception& e) {
+    threw = e.get_ec() == NANOTS_EC_DUPLICATE_STREAM_TAG;
+  }
+  RTF_ASSERT(threw);
+
+  for (int round = 0; round < 2; round++) {
+    auto contexts = db.create_write_contexts(streams);
+    RTF_ASSERT(contexts.size() == streams.size());
+
+    threw = false;
+    try {
+      db.create_write_context(streams.back().first, "taken");
+    } catch (const nanots_exception& e) {
+      threw = e.get_ec() == NANOTS_EC_DUPLICATE_STREAM_TAG;
+    }
+    RTF_ASSERT(threw);
+
+    uint8_t frame[64] = {0};
+    for (int i = 1; i <= 3; i++) {
+      for (auto& wctx : contexts) {
+        frame[0] = (uint8_t)(round * 3 + i);
+        db.write(wctx, frame, sizeof(frame), (round * 3 + i) * 10, 0);
+      }
+    }
+
+    // Finalizes every open block at once and frees the stream tags again.
+    db.close_write_contexts(contexts);
+    RTF_ASSERT(contexts.empty());
+  }
+
+  nanots_reader reader("nanots_test_2048_4k_blocks.nts");
+  for (auto& stream : streams) {
+    int i = 0;
+    bool ordered = true;
+    reader.read(stream.first, 0, INT64_MAX,
+                [&](const uint8_t* data, size_t, uint8_t, int64_t timestamp, int64_t, const std::string&) {
+                  i++;
+                  ordered = ordered && timestamp == i * 10 && data[0] == (uint8_t)i;
+                });
+    RTF_ASSERT(ordered && i == 6);
+  }
+
+  auto open_blocks = nanots_database::open("nanots_test_2048_4k_blocks.nts")
+                         ->catalog()
+                         ->exec("SELECT COUNT(*) AS n FROM segment_blocks WHERE end_timestamp = 0;");
+  RTF_ASSERT(open_blocks.front()["n"].value() == "0");
+}
+
+void test_nanots::test_nanots_write_group() {
+  nanots_writer db("nanots_test_2048_4k_blocks.nts", false);
+
+  {
+    auto audio = db.create_write_context("group_audio", "group test");
+    auto video = db.create_write_context("group_video", "group test");
+    auto meta = db.create_write_context("group_meta", "group test");
+
+    // Video frames fill a block every 6 groups, so groups span rollovers.
+    std::vector<uint8_t> audio_frame(500), video_frame(10000), meta_frame(40);
+    for (int i = 1; i <= 40; i++) {
+      audio_frame[0] = video_frame[0] = meta_frame[0] = (uint8_t)i;
+      db.write_group({{&audio, audio_frame.data(), audio_frame.size(), 1},
+                      {&video, video_frame.data(), video_frame.size(), 2},
+                      {&meta, meta_frame.data(), meta_frame.size(), 3}},
+                     i * 10);
+
+      // A frame outside any group.
+      if (i == 20)
+        db.write(audio, audio_frame.data(), audio_frame.size(), i * 10 + 5, 0);
+    }
+
+    // A group that can't be written as a whole writes nothing.
+    bool threw = false;
+    try {
+      db.write_group({{&video, video_frame.data(), video_frame.size(), 0},
+                      {&audio, audio_frame.data(), audio_frame.size(), 0}},
+                     400);
+    } catch (const nanots_exception& e) {
+      threw = e.get_ec() == NANOTS_EC_NON_MONOTONIC_TIMESTAMP;
+    }
+    RTF_ASSERT(threw);
+  }
+
+  nanots_reader reader("nanots_test_2048_4k_blocks.nts");
+
+  int n_groups = 0;
+  bool complete = true;
+  reader.read_group({"group_video", "group_audio", "group_meta"}, 0, INT64_MAX,
+                    [&](int64_t timestamp, const std::vector<frame_info>& frames) {
+                      n_groups++;
+                      complete = complete && timestamp == n_groups * 10 && frames.size() == 3 &&
+                                 frames[0].size == 10000 && frames[0].flags == 2 &&
+                                 frames[1].size == 500 && frames[1].flags == 1 &&
+                                 frames[2].size == 40 && frames[2].flags == 3;
+                      for (auto& frame : frames)
+                        complete = complete && frame.timestamp == timestamp && frame.data[0] == (uint8_t)n_groups;
+                    });
+  RTF_ASSERT(complete && n_groups == 40);
+
+  // A time range picks out the groups inside it.
+  n_groups = 0;
+  reader.read_group({"group_audio", "group_meta"}, 195, 250,
+                    [&](int64_t, const std::vector<frame_info>&) { n_groups++; });
+  RTF_ASSERT(n_groups == 6);
+
+  int n_video = 0;
+  reader.read("group_video", 0, INT64_MAX,
+              [&](const uint8_t*, size_t, uint8_t, int64_t, int64_t, const std::string&) { n_video++; });
+  RTF_ASSERT(n_video == 40);
+
+  // Streams recorded over two sessions: block sequences restart in each
+  // session's segment.
+  for (int session = 0; session < 2; session++) {
+    nanots_writer sessions("nanots_test_2048_4k_blocks.nts", false);
+    auto a = sessions.create_write_context("group_sessions_a", "group test");
+    auto b = sessions.create_write_context("group_sessions_b", "group test");
+    std::vector<uint8_t> frame(10000);
+    for (int i = 1; i <= 30; i++)
+      sessions.write_group({{&a, frame.data(), frame.size(), 0}, {&b, frame.data(), frame.size(), 0}},
+                           ((session * 30) + i) * 10);
+  }
+
+  n_groups = 0;
+  bool ordered = true;
+  reader.read_group({"group_sessions_a", "group_sessions_b"}, 0, INT64_MAX,
+                    [&](int64_t timestamp, const std::vector<frame_info>&) {
+                      n_groups++;
+                      ordered = ordered && timestamp == n_groups * 10;
+                    });
+  RTF_ASSERT(ordered && n_groups == 60);
+}
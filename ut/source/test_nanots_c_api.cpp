@@ -209,6 +209,30 @@ void test_nanots_c_api::test_c_api_iterator_functionality() {
   RTF_ASSERT(result == NANOTS_EC_OK);
   RTF_ASSERT(frame_info.timestamp == 1000);
 
+  // Test clone
+  result = nanots_iterator_next(iterator);
+  RTF_ASSERT(result == NANOTS_EC_OK);
+
+  nanots_iterator_t clone = nanots_iterator_clone(iterator);
+  RTF_ASSERT(clone != nullptr);
+  RTF_ASSERT(nanots_iterator_valid(clone) == 1);
+
+  result = nanots_iterator_get_current_frame(clone, &frame_info);
+  RTF_ASSERT(result == NANOTS_EC_OK);
+  RTF_ASSERT(frame_info.timestamp == 1100);
+
+  result = nanots_iterator_next(clone);
+  RTF_ASSERT(result == NANOTS_EC_OK);
+  result = nanots_iterator_get_current_frame(clone, &frame_info);
+  RTF_ASSERT(result == NANOTS_EC_OK);
+  RTF_ASSERT(frame_info.timestamp == 1200);
+
+  // The original did not move
+  result = nanots_iterator_get_current_frame(iterator, &frame_info);
+  RTF_ASSERT(result == NANOTS_EC_OK);
+  RTF_ASSERT(frame_info.timestamp == 1100);
+
+  nanots_iterator_destroy(clone);
   nanots_iterator_destroy(iterator);
 }
 
@@ -227,6 +227,10 @@ nts_sqlite_conn::nts_sqlite_conn(const std::string& fileName, bool rw, bool wal)
       flags |= SQLITE_OPEN_READONLY;  // No CREATE for read-only
     }
 
+    // URI names select alternate VFSes, e.g. "file:/name?vfs=memdb".
+    if (fileName.compare(0, 5, "file:") == 0)
+      flags |= SQLITE_OPEN_URI;
+
     // ret = sqlite3_open_v2(fileName.c_str(), &_db, flags,
     // (embeddedvfs)?"embedded":nullptr);
     ret = sqlite3_open_v2(fileName.c_str(), &_db, flags, nullptr);
@@ -305,7 +309,7 @@ nts_sqlite_conn::exec(const std::string& query) const {
               val = std::to_string(sqlite3_column_int64(stmt, i));
               break;
             case SQLITE_FLOAT:
-              val = std::to_string(sqlite3_column_double(stmt, i));
+              val = format_s("%.17g", sqlite3_column_double(stmt, i));
               break;
             case SQLITE_NULL:
               break;
@@ -504,7 +508,8 @@ nts_sqlite_stmt::exec() {
             val = std::to_string(sqlite3_column_int64(_stmt, i));
             break;
           case SQLITE_FLOAT:
-            val = std::to_string(sqlite3_column_double(_stmt, i));
+            // 17 significant digits so std::stod() gets the exact value back.
+            val = format_s("%.17g", sqlite3_column_double(_stmt, i));
             break;
           case SQLITE_NULL:
             break;
@@ -565,6 +570,22 @@ bool file_exists(const std::string& path) {
 #endif
 }
 
+std::string canonical_path(const std::string& path) {
+#ifdef _WIN32
+  char resolved[_MAX_PATH];
+  if (_fullpath(resolved, path.c_str(), _MAX_PATH) == nullptr)
+    return path;
+  return resolved;
+#else
+  char* resolved = ::realpath(path.c_str(), nullptr);
+  if (resolved == nullptr)
+    return path;
+  std::string result(resolved);
+  free(resolved);
+  return result;
+#endif
+}
+
 int filenum(FILE* f) {
 #ifdef _WIN32
   return _fileno(f);
@@ -624,6 +645,119 @@ int fallocate(FILE* file, uint64_t size) {
 #endif
 }
 
+int truncate_file(FILE* file, uint64_t size) {
+#ifdef _WIN32
+  LARGE_INTEGER li;
+  li.QuadPart = size;
+  HANDLE h = (HANDLE)_get_osfhandle(filenum(file));
+  if (!SetFilePointerEx(h, li, nullptr, FILE_BEGIN) || !SetEndOfFile(h))
+    return -1;
+  return 0;
+#else
+  return ftruncate(filenum(file), (off_t)size);
+#endif
+}
+
+int copy_file_bytes(FILE* from, uint64_t from_offset, FILE* to, uint64_t to_offset, uint64_t len) {
+#ifdef __linux__
+  loff_t in_off = (loff_t)from_offset, out_off = (loff_t)to_offset;
+  uint64_t remaining = len;
+  while (remaining > 0) {
+    auto n = copy_file_range(filenum(from), &in_off, filenum(to), &out_off, remaining, 0);
+    if (n <= 0)
+      break;
+    remaining -= n;
+  }
+  if (remaining == 0)
+    return 0;
+
+  // Not supported between these files (e.g. across filesystems); finish with
+  // plain reads and writes.
+  from_offset = (uint64_t)in_off;
+  to_offset = (uint64_t)out_off;
+  len = remaining;
+#endif
+
+  std::vector<uint8_t> buffer((size_t)std::min<uint64_t>(len, 1024 * 1024));
+
+  while (len > 0) {
+    auto n = (size_t)std::min<uint64_t>(len, buffer.size());
+    if (read_file_at(from, from_offset, buffer.data(), n) < 0 ||
+        write_file_at(to, to_offset, buffer.data(), n) < 0)
+      return -1;
+    from_offset += n;
+    to_offset += n;
+    len -= n;
+  }
+
+  return 0;
+}
+
+int read_file_at(FILE* file, uint64_t offset, void* data, size_t len) {
+  auto p = (uint8_t*)data;
+  while (len > 0) {
+#ifdef _WIN32
+    OVERLAPPED ov = {};
+    ov.Offset = (DWORD)offset;
+    ov.OffsetHigh = (DWORD)(offset >> 32);
+    DWORD n = 0;
+    if (!ReadFile((HANDLE)_get_osfhandle(filenum(file)), p,
+                  (DWORD)std::min<size_t>(len, 1u << 30), &n, &ov) || n == 0)
+      return -1;
+#else
+    auto n = pread(filenum(file), p, len, (off_t)offset);
+    if (n <= 0)
+      return -1;
+#endif
+    p += n;
+    offset += n;
+    len -= n;
+  }
+  return 0;
+}
+
+int write_file_at(FILE* file, uint64_t offset, const void* data, size_t len) {
+  auto p = (const uint8_t*)data;
+  while (len > 0) {
+#ifdef _WIN32
+    OVERLAPPED ov = {};
+    ov.Offset = (DWORD)offset;
+    ov.OffsetHigh = (DWORD)(offset >> 32);
+    DWORD n = 0;
+    if (!WriteFile((HANDLE)_get_osfhandle(filenum(file)), p,
+                   (DWORD)std::min<size_t>(len, 1u << 30), &n, &ov) || n == 0)
+      return -1;
+#else
+    auto n = pwrite(filenum(file), p, len, (off_t)offset);
+    if (n <= 0)
+      return -1;
+#endif
+    p += n;
+    offset += n;
+    len -= n;
+  }
+  return 0;
+}
+
+int sync_file(FILE* file) {
+  fflush(file);
+#ifdef _WIN32
+  return FlushFileBuffers((HANDLE)_get_osfhandle(filenum(file))) ? 0 : -1;
+#else
+  return fsync(filenum(file));
+#endif
+}
+
+void rename_file(const std::string& from, const std::string& to) {
+#ifdef _WIN32
+  if (MoveFileExA(from.c_str(), to.c_str(), MOVEFILE_REPLACE_EXISTING) == 0)
+    throw std::runtime_error("Unable to rename file: " + from);
+#else
+  if (rename(from.c_str(), to.c_str()) != 0)
+    throw std::runtime_error("Unable to rename file: " + from);
+#endif
+}
+
 void remove_file(const std::string& path) {
 #ifdef _WIN32
   if (DeleteFileA(path.c_str()) == 0)
@@ -634,6 +768,135 @@ void remove_file(const std::string& path) {
 #endif
 }
 
+#ifdef _WIN32
+static std::string _shared_path(const std::string& name) {
+  char dir[MAX_PATH + 1];
+  DWORD len = GetTempPathA(MAX_PATH + 1, dir);
+  if (len == 0 || len > MAX_PATH)
+    throw std::runtime_error("Unable to find temporary directory.");
+  return std::string(dir) + name.substr(name.find_first_not_of('/'));
+}
+#endif
+
+void remove_shared(const std::string& name) {
+#ifdef _WIN32
+  auto path = _shared_path(name);
+  if (file_exists(path))
+    remove_file(path);
+#else
+  if (shm_unlink(name.c_str()) != 0 && errno != ENOENT)
+    throw std::runtime_error("Unable to remove shared memory: " + name);
+#endif
+}
+
+nts_file nts_file::open_shared(const std::string& name, uint64_t size, bool create, bool* created) {
+  *created = false;
+  nts_file obj;
+#ifdef _WIN32
+  auto path = _shared_path(name);
+  if (!file_exists(path)) {
+    if (!create)
+      throw std::runtime_error("Unable to open: " + path);
+    auto f = nts_file::open(path, "w+");
+    if (fallocate(f, size) < 0)
+      throw std::runtime_error("Unable to size: " + path);
+    *created = true;
+  }
+  obj = nts_file::open(path, "r+");
+#else
+  int fd = shm_open(name.c_str(), O_RDWR, 0666);
+  if (fd < 0 && errno == ENOENT && create) {
+    fd = shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0666);
+    if (fd >= 0)
+      *created = true;
+    else if (errno == EEXIST)
+      fd = shm_open(name.c_str(), O_RDWR, 0666);
+  }
+  if (fd < 0)
+    throw std::runtime_error("Unable to open shared memory: " + name);
+
+  if (*created) {
+    if (ftruncate(fd, (off_t)size) != 0) {
+      ::close(fd);
+      shm_unlink(name.c_str());
+      throw std::runtime_error("Unable to size shared memory: " + name);
+    }
+  } else {
+    // Its creator may not have sized it yet.
+    struct stat sfi;
+    if (fstat(fd, &sfi) != 0 || (uint64_t)sfi.st_size < size) {
+      ::close(fd);
+      throw std::runtime_error("Unable to open shared memory: " + name);
+    }
+  }
+
+  obj._f = fdopen(fd, "r+");
+  if (!obj._f) {
+    ::close(fd);
+    throw std::runtime_error("Unable to open shared memory: " + name);
+  }
+#endif
+  return obj;
+}
+
+nts_file nts_file::open_anonymous(const std::string& name, uint64_t size) {
+  nts_file obj;
+#ifdef __linux__
+  int fd = memfd_create(name.c_str(), MFD_CLOEXEC);
+  if (fd < 0)
+    throw std::runtime_error("Unable to create memfd: " + name);
+
+  // Pages are only committed as they are touched.
+  if (ftruncate(fd, (off_t)size) != 0) {
+    ::close(fd);
+    throw std::runtime_error("Unable to size memfd: " + name);
+  }
+
+  obj._f = fdopen(fd, "w+");
+  if (!obj._f) {
+    ::close(fd);
+    throw std::runtime_error("Unable to open memfd: " + name);
+  }
+#else
+  (void)name;
+#ifdef _WIN32
+#pragma warning(push)
+#pragma warning(disable : 4996)
+#endif
+  obj._f = tmpfile();
+#ifdef _WIN32
+#pragma warning(pop)
+#endif
+  if (!obj._f)
+    throw std::runtime_error("Unable to create temporary file.");
+
+  if (fallocate(obj._f, size) < 0)
+    throw std::runtime_error("Unable to size temporary file.");
+#endif
+  return obj;
+}
+
+void nts_futex_wait(uint32_t* addr, uint32_t expected, uint32_t timeout_ms) {
+#ifdef __linux__
+  struct timespec ts;
+  ts.tv_sec = timeout_ms / 1000;
+  ts.tv_nsec = (long)(timeout_ms % 1000) * 1000000;
+  // Not FUTEX_PRIVATE_FLAG: the word lives in a mapping shared between processes.
+  syscall(SYS_futex, addr, FUTEX_WAIT, expected, &ts, nullptr, 0);
+#else
+  if (*(volatile uint32_t*)addr == expected)
+    std::this_thread::sleep_for(std::chrono::milliseconds((timeout_ms < 1) ? timeout_ms : 1));
+#endif
+}
+
+void nts_futex_wake_all(uint32_t* addr) {
+#ifdef __linux__
+  syscall(SYS_futex, addr, FUTEX_WAKE, INT_MAX, nullptr, nullptr, 0);
+#else
+  (void)addr;
+#endif
+}
+
 static const uint32_t MAX_MAPPING_LEN = 1048576000;
 
 nts_memory_map::nts_memory_map()
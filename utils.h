@@ -2,14 +2,21 @@
 #ifndef UTILS_H
 #define UTILS_H
 
+#include <algorithm>
+#include <cerrno>
 #include <chrono>
+#include <cmath>
 #include <cstdarg>
 #include <cstdint>
 #include <cstring>
+#include <condition_variable>
+#include <deque>
 #include <functional>
+#include <future>
 #include <iomanip>
 #include <iostream>
 #include <map>
+#include <memory>
 #include <optional>
 #include <random>
 #include <sstream>
@@ -17,6 +24,7 @@
 #include <string>
 #include <thread>
 #include <unordered_map>
+#include <unordered_set>
 #include <vector>
 #include <atomic>
 #include <mutex>
@@ -35,6 +43,13 @@
   #include <unistd.h>
 #endif
 
+#ifdef __linux__
+  #include <climits>
+  #include <linux/futex.h>
+  #include <sys/syscall.h>
+  #include <time.h>
+#endif
+
 // String utilities...
 std::string format_s(const char* fmt, ...);
 std::string format_s(const char* fmt, va_list& args);
@@ -122,9 +137,11 @@ class nts_sqlite_stmt final {
   sqlite3* _db;
 };
 
+// Takes the write lock up front, so concurrent writers wait out the busy
+// timeout instead of failing to upgrade a read transaction.
 template <typename T>
 void nts_sqlite_transaction(const nts_sqlite_conn& db, T t) {
-  db.exec("BEGIN");
+  db.exec("BEGIN IMMEDIATE");
   try {
     t(db);
     db.exec("COMMIT");
@@ -175,6 +192,14 @@ class nts_file final {
     return obj;
 #endif
   }
+  // Unnamed scratch file of the given size: a memfd on Linux (never touches
+  // disk), elsewhere a temporary file that is removed when closed.
+  static nts_file open_anonymous(const std::string& name, uint64_t size);
+  // Shared memory that local processes open by name ("/name"): a POSIX shared
+  // memory object, elsewhere a file of that name in the temporary directory.
+  // Creates it at the given size if create is set, reporting so in *created.
+  // Throws if it doesn't exist (or isn't fully sized yet) otherwise.
+  static nts_file open_shared(const std::string& name, uint64_t size, bool create, bool* created);
   void close() {
     if (_f) {
       fclose(_f);
@@ -188,10 +213,36 @@ class nts_file final {
 
 // File utilities
 bool file_exists(const std::string& path);
+// Absolute path with symlinks, "." and ".." resolved. Returns path unchanged if
+// it can't be resolved (e.g. the file doesn't exist).
+std::string canonical_path(const std::string& path);
 int filenum(FILE* f);
 uint64_t file_size(const std::string& fileName);
 int fallocate(FILE* file, uint64_t size);
+// Sets the file's size without allocating; growing it leaves a sparse hole.
+int truncate_file(FILE* file, uint64_t size);
+// Copies len bytes between files. On Linux this is copy_file_range(), which
+// filesystems that support it turn into shared extents (reflinks). Returns 0 on
+// success and -1 on error.
+int copy_file_bytes(FILE* from, uint64_t from_offset, FILE* to, uint64_t to_offset, uint64_t len);
+// Positioned reads and writes that don't move the stream position. Return 0
+// once all len bytes are transferred and -1 on error.
+int read_file_at(FILE* file, uint64_t offset, void* data, size_t len);
+int write_file_at(FILE* file, uint64_t offset, const void* data, size_t len);
+// Flushes the file's data to stable storage.
+int sync_file(FILE* file);
 void remove_file(const std::string& path);
+// Removes the name of an nts_file::open_shared() object. Processes that have
+// it open keep it until they close it.
+void remove_shared(const std::string& name);
+// Replaces to with from.
+void rename_file(const std::string& from, const std::string& to);
+
+// Cross process wait/wake on a 32 bit word in shared memory. Linux uses
+// futexes; elsewhere waiting degrades to a short sleep. nts_futex_wait()
+// returns immediately if *addr != expected and may return spuriously.
+void nts_futex_wait(uint32_t* addr, uint32_t expected, uint32_t timeout_ms);
+void nts_futex_wake_all(uint32_t* addr);
 
 // returns pointer to first element between start and end which does not compare
 // less than target